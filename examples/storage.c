@@ -28,204 +28,155 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#define STORAGE_FILE "test-storage.variant"
+#define STORAGE_FILE "test-storage.fpstore"
+/* The GVariant dictionary used before, imported into a new store */
+#define OLD_STORAGE_FILE "test-storage.variant"
 
-static char *
-get_print_data_descriptor (FpPrint *print, FpDevice *dev, FpFinger finger)
+static void
+import_old_storage (FpPrintStore *store)
 {
-  const char *driver;
-  const char *dev_id;
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) dict_variant = NULL;
+  GVariantIter iter;
+  GVariant *value;
+  gchar *key;
 
-  if (print)
-    {
-      driver = fp_print_get_driver (print);
-      dev_id = fp_print_get_device_id (print);
-    }
-  else
-    {
-      driver = fp_device_get_driver (dev);
-      dev_id = fp_device_get_device_id (dev);
-    }
+  mapped = g_mapped_file_new (OLD_STORAGE_FILE, FALSE, NULL);
+  if (!mapped)
+    return;
 
-  return g_strdup_printf ("%s/%s/%x",
-                          driver,
-                          dev_id,
-                          finger);
-}
+  g_debug ("Importing prints from %s", OLD_STORAGE_FILE);
 
-static GVariantDict *
-load_data (void)
-{
-  GVariantDict *res;
-  GVariant *var;
-  gchar *contents = NULL;
-  gsize length = 0;
+  bytes = g_mapped_file_get_bytes (mapped);
+  dict_variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARDICT,
+                                                               bytes, FALSE));
 
-  if (!g_file_get_contents (STORAGE_FILE, &contents, &length, NULL))
+  /* Keys are driver/device-id/finger, the same the store uses without
+   * a username. */
+  g_variant_iter_init (&iter, dict_variant);
+  while (g_variant_iter_loop (&iter, "{sv}", &key, &value))
     {
-      g_warning ("Error loading storage, assuming it is empty");
-      return g_variant_dict_new (NULL);
-    }
+      g_autoptr(FpPrint) print = NULL;
+      g_autoptr(GError) error = NULL;
+      const guchar *stored_data;
+      const char *finger_str;
+      gsize stored_len;
 
-  var = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
-                                 contents,
-                                 length,
-                                 FALSE,
-                                 g_free,
-                                 contents);
+      finger_str = strrchr (key, '/');
+      if (!finger_str || !g_variant_is_of_type (value, G_VARIANT_TYPE_BYTESTRING))
+        continue;
 
-  res = g_variant_dict_new (var);
-  g_variant_unref (var);
-  return res;
+      stored_data = g_variant_get_fixed_array (value, &stored_len, 1);
+      print = fp_print_deserialize (stored_data, stored_len, &error);
+      if (!print ||
+          !fp_print_store_save (store, print,
+                                g_ascii_strtoull (finger_str + 1, NULL, 16),
+                                NULL, &error))
+        g_warning ("Error importing print %s: %s", key, error->message);
+    }
 }
 
-static int
-save_data (GVariant *data)
+static FpPrintStore *
+open_store (void)
 {
-  const gchar *contents = NULL;
-  gsize length;
-
-  length = g_variant_get_size (data);
-  contents = (gchar *) g_variant_get_data (data);
+  g_autoptr(GError) error = NULL;
+  gboolean exists;
+  FpPrintStore *store;
 
-  if (!g_file_set_contents (STORAGE_FILE, contents, length, NULL))
+  exists = g_file_test (STORAGE_FILE, G_FILE_TEST_EXISTS);
+  store = fp_print_store_new (STORAGE_FILE, &error);
+  if (!store)
     {
-      g_warning ("Error saving storage,!");
-      return -1;
+      g_warning ("Error opening storage: %s", error->message);
+      return NULL;
     }
 
-  g_variant_ref_sink (data);
-  g_variant_unref (data);
+  /* The old file is kept, it is only imported once */
+  if (!exists)
+    import_old_storage (store);
 
-  return 0;
-}
-
-static FpPrint *
-load_print_from_data (GVariant *data)
-{
-  const guchar *stored_data = NULL;
-  gsize stored_len;
-  FpPrint *print;
-
-  g_autoptr(GError) error = NULL;
-  stored_data = (const guchar *) g_variant_get_fixed_array (data, &stored_len, 1);
-  print = fp_print_deserialize (stored_data, stored_len, &error);
-  if (error)
-    g_warning ("Error deserializing data: %s", error->message);
-  return print;
+  return store;
 }
 
 int
 print_data_save (FpPrint *print, FpFinger finger, gboolean update_fingerprint)
 {
-  g_autofree gchar *descr = get_print_data_descriptor (print, NULL, finger);
-
+  g_autoptr(FpPrintStore) store = NULL;
   g_autoptr(GError) error = NULL;
-  g_autoptr(GVariantDict) dict = NULL;
-  g_autofree guchar *data = NULL;
-  GVariant *val;
-  gsize size;
-  int res;
 
-  dict = load_data ();
+  store = open_store ();
+  if (!store)
+    return -1;
 
-  fp_print_serialize (print, &data, &size, &error);
-  if (error)
+  /* Either way the print replaces the stored one, an updated print was
+   * loaded from the store by print_create_template() before. */
+  if (update_fingerprint &&
+      !fp_print_store_contains (store,
+                                fp_print_get_driver (print),
+                                fp_print_get_device_id (print),
+                                finger, NULL))
+    g_debug ("No stored print to update, saving a new one");
+
+  if (!fp_print_store_save (store, print, finger, NULL, &error))
     {
-      g_warning ("Error serializing data: %s", error->message);
+      g_warning ("Error saving print: %s", error->message);
       return -1;
     }
-  val = g_variant_new_fixed_array (G_VARIANT_TYPE ("y"), data, size, 1);
-  g_variant_dict_insert_value (dict, descr, val);
-
-  res = save_data (g_variant_dict_end (dict));
 
-  return res;
+  return 0;
 }
 
 FpPrint *
 print_data_load (FpDevice *dev, FpFinger finger)
 {
-  g_autofree gchar *descr = get_print_data_descriptor (NULL, dev, finger);
-
-  g_autoptr(GVariant) val = NULL;
-  g_autoptr(GVariantDict) dict = NULL;
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(GError) error = NULL;
+  FpPrint *print;
 
-  dict = load_data ();
-  val = g_variant_dict_lookup_value (dict, descr, G_VARIANT_TYPE ("ay"));
+  store = open_store ();
+  if (!store)
+    return NULL;
 
-  if (val)
-    return load_print_from_data (val);
+  print = fp_print_store_load (store,
+                               fp_device_get_driver (dev),
+                               fp_device_get_device_id (dev),
+                               finger,
+                               NULL,
+                               &error);
+  if (error)
+    g_warning ("Error loading print: %s", error->message);
 
-  return NULL;
+  return print;
 }
 
 GPtrArray *
 gallery_data_load (FpDevice *dev)
 {
-  g_autoptr(GVariantDict) dict = NULL;
-  g_autoptr(GVariant) dict_variant = NULL;
-  g_autofree char *dev_prefix = NULL;
-  GPtrArray *gallery;
-  const char *driver;
-  const char *dev_id;
-  GVariantIter iter;
-  GVariant *value;
-  gchar *key;
-
-  gallery = g_ptr_array_new_with_free_func (g_object_unref);
-  dict = load_data ();
-  dict_variant = g_variant_dict_end (dict);
-  driver = fp_device_get_driver (dev);
-  dev_id = fp_device_get_device_id (dev);
-  dev_prefix = g_strdup_printf ("%s/%s/", driver, dev_id);
+  g_autoptr(FpPrintStore) store = NULL;
 
-  g_variant_iter_init (&iter, dict_variant);
-  while (g_variant_iter_loop (&iter, "{sv}", &key, &value))
-    {
-      FpPrint *print;
-      const guchar *stored_data;
-      g_autoptr(GError) error = NULL;
-      gsize stored_len;
-
-      if (!g_str_has_prefix (key, dev_prefix))
-        continue;
+  store = open_store ();
+  if (!store)
+    return g_ptr_array_new_with_free_func (g_object_unref);
 
-      stored_data = (const guchar *) g_variant_get_fixed_array (value, &stored_len, 1);
-      print = fp_print_deserialize (stored_data, stored_len, &error);
-
-      if (error)
-        {
-          g_warning ("Error deserializing data: %s", error->message);
-          continue;
-        }
-
-      g_ptr_array_add (gallery, print);
-    }
-
-  return gallery;
+  return fp_print_store_list (store,
+                              fp_device_get_driver (dev),
+                              fp_device_get_device_id (dev));
 }
 
 FpPrint *
 print_create_template (FpDevice *dev, FpFinger finger, gboolean load_existing)
 {
-  g_autoptr(GVariantDict) dict = NULL;
   g_autoptr(GDateTime) datetime = NULL;
   g_autoptr(GDate) date = NULL;
-  g_autoptr(GVariant) existing_val = NULL;
-  g_autofree gchar *descr = get_print_data_descriptor (NULL, dev, finger);
   FpPrint *template = NULL;
   gint year, month, day;
 
   if (load_existing)
-    {
-      dict = load_data ();
-      existing_val = g_variant_dict_lookup_value (dict, descr, G_VARIANT_TYPE ("ay"));
-      if (existing_val != NULL)
-        template = load_print_from_data (existing_val);
-    }
+    template = print_data_load (dev, finger);
   if (template == NULL)
     {
       template = fp_print_new (dev);
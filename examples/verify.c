@@ -128,6 +128,17 @@ on_match_cb (FpDevice *dev, FpPrint *match, FpPrint *print,
       print_image_save (print, "verify.pgm"))
     g_print ("Print image saved as verify.pgm\n");
 
+  if (print && fp_print_get_match_info (print))
+    {
+      const FpMatchInfo *info = fp_print_get_match_info (print);
+
+      g_debug ("Match report: score %d/%d (sub-print %d), capture %.1f ms, "
+               "extraction %.1f ms, matching %.1f ms",
+               info->score, info->score_threshold, info->sub_print,
+               info->capture_time / 1000.0, info->extraction_time / 1000.0,
+               info->match_time / 1000.0);
+    }
+
   if (match)
     {
       const GDate *date = fp_print_get_enroll_date (match);
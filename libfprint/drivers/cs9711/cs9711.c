@@ -60,32 +60,53 @@ m_util_fail_if_error_or_next (FpiSsm *ssm, GError *error)
     fpi_ssm_next_state (ssm);
 }
 
-/** Synchroneous USB bulk write OUT helper*/
+/** Asynchroneous USB bulk write OUT helper */
 static void
-usb_send_out_sync (FpDevice *dev, guint8 type, GError **error)
+usb_send_out (FpDevice *dev,
+              FpiSsm *ssm,
+              guint8 type,
+              GCancellable *cancellable,
+              FpiUsbTransferCallback callback,
+              gpointer user_data)
 {
-  GError *err = NULL;
-
-  guint8 *data = g_malloc0(CS9711_FP_CMD_LEN_1);
+  FpiUsbTransfer *transfer = NULL;
+  guint8 *data = g_malloc0 (CS9711_FP_CMD_LEN_1);
 
   data[0] = data[CS9711_FP_CMD_LEN_1 - 1] = 0xEA;
   data[1] = data[CS9711_FP_CMD_LEN_1 - 2] = type;
 
-  g_autoptr(FpiUsbTransfer) transfer = NULL;
-
   transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
   transfer->short_is_error = FALSE;
-  fpi_usb_transfer_fill_bulk_full (transfer, CS9711_SEND_ENDPOINT, (guint8 *) data, CS9711_FP_CMD_LEN_1, g_free);
-  fpi_usb_transfer_submit_sync (transfer, CS9711_DEFAULT_WAIT_TIMEOUT, &err);
-  if (err)
-    {
-      g_warning ("Error while sending command 0x%X, continuing anyway: %s", type, err->message);
-      g_propagate_error (error, err);
-    }
+  transfer->ssm = ssm;
+  fpi_usb_transfer_fill_bulk_full (transfer, CS9711_SEND_ENDPOINT, data, CS9711_FP_CMD_LEN_1, g_free);
+  fpi_usb_transfer_submit (transfer, CS9711_DEFAULT_WAIT_TIMEOUT, cancellable, callback, user_data);
+}
+
+/** Log the result of a usb_send_out command */
+static void
+usb_send_out_log_result (FpiUsbTransfer *transfer, GError *error)
+{
+  guint8 type = transfer->buffer[1];
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    fp_dbg ("Sending command 0x%X was cancelled", type);
+  else if (error)
+    fp_warn ("Error while sending command 0x%X: %s", type, error->message);
   else
     fp_dbg("Sent command 0x%X", type);
 }
 
+/** usb_send_out callback failing the ssm or moving it to the next state */
+static void
+usb_send_out_cb_next (FpiUsbTransfer *transfer,
+                      FpDevice       *dev,
+                      gpointer        user_data,
+                      GError         *error)
+{
+  usb_send_out_log_result (transfer, error);
+  m_util_fail_if_error_or_next (transfer->ssm, error);
+}
+
 /** Asynchroneous USB bulk write IN helper */
 static void
 usb_read_in (FpDevice *dev,
@@ -93,6 +114,7 @@ usb_read_in (FpDevice *dev,
              gsize length,
              gboolean short_is_error,
              guint timeout_in_ms,
+             GCancellable *cancellable,
              FpiUsbTransferCallback callback,
              gpointer user_data)
 {
@@ -106,11 +128,11 @@ usb_read_in (FpDevice *dev,
   // facility
   length = CS9711_FP_RECV_LEN_MAX;
   short_is_error = FALSE;
-  transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
+  transfer = fpi_usb_transfer_pool_acquire_bulk (FPI_DEVICE_CS9711 (dev)->read_pool,
+                                                 CS9711_RECEIVE_ENDPOINT, length);
   transfer->short_is_error = short_is_error;
   transfer->ssm = ssm;
-  fpi_usb_transfer_fill_bulk (transfer, CS9711_RECEIVE_ENDPOINT, length);
-  fpi_usb_transfer_submit (transfer, timeout_in_ms, NULL, callback, user_data);
+  fpi_usb_transfer_submit (transfer, timeout_in_ms, cancellable, callback, user_data);
 }
 
 /************************** INIT SSM *************************************/
@@ -157,52 +179,62 @@ enum {
   M_INIT_STATE_COUNT,
 };
 
+static void
+m_init_send_query_cb (FpiUsbTransfer *transfer,
+                      FpDevice       *dev,
+                      gpointer        user_data,
+                      GError         *error)
+{
+  usb_send_out_log_result (transfer, error);
+
+  if (error)
+    {
+      fp_dbg("Error details: '%s', quark: %u code: %d", error->message, error->domain, error->code);
+      // if (g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT))
+      if (error->code == G_USB_DEVICE_ERROR_TIMED_OUT && error->domain == G_USB_DEVICE_ERROR)
+        {
+          g_error_free (error);
+          fpi_ssm_next_state (transfer->ssm);
+        }
+      else
+        fpi_ssm_mark_failed (transfer->ssm, error);
+    }
+  else
+    fpi_ssm_jump_to_state (transfer->ssm, M_INIT_STATE_RECEIVE_STATUS);
+}
+
 /* Exec init sequential state machine */
 static void
 m_init_state (FpiSsm *ssm, FpDevice *_dev)
 {
   FpDeviceCs9711 *self = FPI_DEVICE_CS9711 (_dev);
-  GError *error = NULL;
 
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case M_INIT_STATE_SEND_INI_QUERY:
-      usb_send_out_sync (_dev, CS9711_FP_CMD_TYPE_INIT, &error);
-      if (error)
-        {
-          fp_dbg("Error details: '%s', quark: %u code: %d", error->message, error->domain, error->code);
-          // if (g_error_matches (error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_TIMED_OUT))
-          if (error->code == G_USB_DEVICE_ERROR_TIMED_OUT && error->domain == G_USB_DEVICE_ERROR)
-            fpi_ssm_next_state (ssm);
-          else
-            fpi_ssm_mark_failed (ssm, error);
-        }
-      else
-        fpi_ssm_jump_to_state (ssm, M_INIT_STATE_RECEIVE_STATUS);
+      usb_send_out (_dev, ssm, CS9711_FP_CMD_TYPE_INIT, NULL, m_init_send_query_cb, NULL);
       break;
 
     case M_INIT_STATE_RECOVER_READ_IGNORED:
       fp_warn("Send operation had a timeout. Switching to reset procedure. Ignore next message about the result not matching the expected data.");
-      usb_read_in (_dev, ssm, CS9711_FP_CMD_LEN_1, FALSE, CS9711_DEFAULT_WAIT_TIMEOUT, m_init_read_cb_check_expected, NULL);
+      usb_read_in (_dev, ssm, CS9711_FP_CMD_LEN_1, FALSE, CS9711_DEFAULT_WAIT_TIMEOUT, NULL, m_init_read_cb_check_expected, NULL);
       break;
 
     case M_INIT_STATE_RECOVER_SEND_RESET:
-      usb_send_out_sync (_dev, CS9711_FP_CMD_TYPE_RESET, &error);
-      m_util_fail_if_error_or_next (ssm, error);
+      usb_send_out (_dev, ssm, CS9711_FP_CMD_TYPE_RESET, NULL, usb_send_out_cb_next, NULL);
       break;
 
     case M_INIT_STATE_RECOVER_READ_IGNORED_RESET:
       fp_warn("Send operation had a timeout. Switching to reset procedure.");
-      usb_read_in (_dev, ssm, CS9711_FP_CMD_LEN_1, FALSE, CS9711_DEFAULT_WAIT_TIMEOUT, m_init_read_cb_check_expected, self);
+      usb_read_in (_dev, ssm, CS9711_FP_CMD_LEN_1, FALSE, CS9711_DEFAULT_WAIT_TIMEOUT, NULL, m_init_read_cb_check_expected, self);
       break;
 
     case M_INIT_STATE_RECOVER_SEND_INIT:
-      usb_send_out_sync (_dev, CS9711_FP_CMD_TYPE_INIT, &error); // Do not reuse state to only try reset once
-      m_util_fail_if_error_or_next (ssm, error);
+      usb_send_out (_dev, ssm, CS9711_FP_CMD_TYPE_INIT, NULL, usb_send_out_cb_next, NULL); // Do not reuse state to only try reset once
       break;
 
     case M_INIT_STATE_RECEIVE_STATUS:
-      usb_read_in (_dev, ssm, CS9711_FP_CMD_LEN_1, TRUE, CS9711_DEFAULT_WAIT_TIMEOUT, m_init_read_cb_check_expected, NULL);
+      usb_read_in (_dev, ssm, CS9711_FP_CMD_LEN_1, TRUE, CS9711_DEFAULT_WAIT_TIMEOUT, NULL, m_init_read_cb_check_expected, NULL);
       break;
 
     default:
@@ -224,18 +256,96 @@ m_init_complete (FpiSsm *ssm, FpDevice *dev, GError *error) //TODO: done
 
 enum {
   M_SCAN_INIT_SLEEP = 0,
-  M_SCAN_INIT_READ,
-  M_SCAN_WAIT_FOR_READ_TO_COMPLETE,
-  M_SCAN_GET_IMAGE_TAIL,
+  M_SCAN_START,
+  M_SCAN_WAIT_FOR_TRANSFERS,
+  M_SCAN_SUBMIT_IMAGE,
   M_SCAN_SEND_POST_SCAN,
-  M_SCAN_IMAGE_COMPLETE,
+  M_SCAN_FINGER_OFF,
   M_SCAN_STATE_COUNT,
 };
 
 static const gpointer M_SCAN_READ_CB_BULK_UD_FIRST_BLOCK = (gpointer)1;
 static const gpointer M_SCAN_READ_CB_BULK_UD_SECOND_BLOCK = (gpointer)2;
 
-/* Read into FpDeviceCs9711->image_buffer if one of the two expected chunk sizes */
+/* Sensor rows are half as wide as the image: even sensor rows hold the even
+ * columns and odd sensor rows the odd columns of the same image row. Store
+ * len bytes of sensor data starting at offset directly into the image. */
+static void
+m_scan_deinterleave (FpImage *img, gsize offset, const guint8 *buf, gsize len)
+{
+  while (len > 0)
+    {
+      gsize y = offset / CS9711_SENSOR_WIDTH;
+      gsize x = offset % CS9711_SENSOR_WIDTH;
+      gsize n = MIN (len, CS9711_SENSOR_WIDTH - x);
+      guint8 *dst = img->data + (y / 2) * CS9711_WIDTH + y % 2 + x * 2;
+
+      for (gsize i = 0; i < n; i++)
+        dst[i * 2] = buf[i];
+
+      offset += n;
+      buf += n;
+      len -= n;
+    }
+}
+
+/* Called whenever one of the scan transfers is done. The first error is kept
+ * and cancels the remaining transfers; once all of them are done the ssm
+ * either fails or moves on. */
+static void
+m_scan_transfer_done (FpDeviceCs9711 *self, FpiSsm *ssm, GError *error)
+{
+  if (error && !self->scan_error)
+    {
+      self->scan_error = error;
+      g_cancellable_cancel (self->scan_cancellable);
+    }
+  else if (error)
+    {
+      g_error_free (error);
+    }
+
+  g_assert (self->scan_pending > 0);
+  if (--self->scan_pending > 0)
+    return;
+
+  g_clear_pointer (&self->tail_timeout, g_source_destroy);
+  g_clear_object (&self->scan_cancellable);
+
+  if (self->scan_error)
+    fpi_ssm_mark_failed (ssm, g_steal_pointer (&self->scan_error));
+  else
+    fpi_ssm_next_state (ssm);
+}
+
+static void
+m_scan_tail_timeout_cb (FpDevice *dev, gpointer user_data)
+{
+  FpDeviceCs9711 *self = FPI_DEVICE_CS9711 (dev);
+
+  self->tail_timeout = NULL;
+
+  /* The tail read returns as cancelled, report the timeout instead */
+  if (!self->scan_error)
+    {
+      self->scan_error = g_error_new_literal (G_USB_DEVICE_ERROR,
+                                              G_USB_DEVICE_ERROR_TIMED_OUT,
+                                              "Timed out waiting for the end of the image");
+      g_cancellable_cancel (self->scan_cancellable);
+    }
+}
+
+static void
+m_scan_send_cb (FpiUsbTransfer *transfer,
+                FpDevice       *dev,
+                gpointer        user_data,
+                GError         *error)
+{
+  usb_send_out_log_result (transfer, error);
+  m_scan_transfer_done (FPI_DEVICE_CS9711 (dev), transfer->ssm, error);
+}
+
+/* De-interleave into FpDeviceCs9711->image if one of the two expected chunk sizes */
 static void
 m_scan_read_cb_bulk (FpiUsbTransfer *transfer,
                      FpDevice       *dev,
@@ -247,7 +357,7 @@ m_scan_read_cb_bulk (FpiUsbTransfer *transfer,
   g_assert (transfer->ssm != NULL);
 
   gsize expected_size = 0;
-  gpointer offset = NULL;
+  gsize offset = 0;
 
   g_assert (FALSE
     || user_data == M_SCAN_READ_CB_BULK_UD_FIRST_BLOCK
@@ -257,20 +367,20 @@ m_scan_read_cb_bulk (FpiUsbTransfer *transfer,
   if (user_data == M_SCAN_READ_CB_BULK_UD_FIRST_BLOCK)
     {
       expected_size = CS9711_FP_RECV_LEN_1;
-      offset = self->image_buffer;
+      offset = 0;
     }
   else if (user_data == M_SCAN_READ_CB_BULK_UD_SECOND_BLOCK)
     {
       expected_size = CS9711_FP_RECV_LEN_2;
-      offset = self->image_buffer + CS9711_FP_RECV_LEN_1;
+      offset = CS9711_FP_RECV_LEN_1;
     }
   else
     g_assert_not_reached ();
 
   if (error)
     {
-      fp_err ("Read failed: %s, aborting", error->message);
-      fpi_ssm_mark_failed (transfer->ssm, error);
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        fp_err ("Read failed: %s, aborting", error->message);
     }
   else
     {
@@ -278,13 +388,22 @@ m_scan_read_cb_bulk (FpiUsbTransfer *transfer,
         {
           fp_dbg("\tSkipping buffer print - got %lu bytes, expected %lu", transfer->actual_length, expected_size);
           error = g_error_new (FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID, "expected %lu bytes but got %lu, can't continue", expected_size, transfer->actual_length);
-          fpi_ssm_mark_failed (transfer->ssm, error);
         }
       else {
-        memcpy (offset, transfer->buffer, expected_size);
-        fpi_ssm_next_state (transfer->ssm);
+        /* The tail follows right after the first block, so it gets the
+         * normal timeout from now on. Store the first block, which is most
+         * of the frame, while the tail is still being transferred. */
+        if (user_data == M_SCAN_READ_CB_BULK_UD_FIRST_BLOCK && !self->scan_error)
+          self->tail_timeout = fpi_device_add_timeout (dev, CS9711_DEFAULT_WAIT_TIMEOUT,
+                                                       m_scan_tail_timeout_cb,
+                                                       NULL, NULL);
+        else if (user_data == M_SCAN_READ_CB_BULK_UD_SECOND_BLOCK)
+          g_clear_pointer (&self->tail_timeout, g_source_destroy);
+        m_scan_deinterleave (self->image, offset, transfer->buffer, expected_size);
       }
     }
+
+  m_scan_transfer_done (self, transfer->ssm, error);
 }
 
 static int
@@ -292,19 +411,11 @@ m_scan_submit_image (FpiSsm        *ssm,
                      FpImageDevice *dev)
 {
   FpDeviceCs9711 *self = FPI_DEVICE_CS9711 (dev);
-  FpImage *img;
+  FpImage *img = g_steal_pointer (&self->image);
 
-  img = fp_image_new (CS9711_WIDTH, CS9711_HEIGHT);
   if (img == NULL)
     return 1;
 
-  for (gsize y = 0; y < CS9711_SENSOR_HEIGHT; y++)
-    for (gsize x = 0; x < CS9711_SENSOR_WIDTH; x++) {
-      gsize dy = y / 2;
-      gsize dx = x * 2 + y % 2;
-      img->data[dy * CS9711_WIDTH + dx] = self->image_buffer[y * CS9711_SENSOR_WIDTH + x];
-    }
-
   img->flags = FPI_IMAGE_PARTIAL;
 
   fpi_image_device_image_captured (dev, img);
@@ -316,37 +427,50 @@ m_scan_submit_image (FpiSsm        *ssm,
 static void
 m_scan_state (FpiSsm *ssm, FpDevice *_dev)
 {
+  FpDeviceCs9711 *self = FPI_DEVICE_CS9711 (_dev);
   FpImageDevice *image_device = FP_IMAGE_DEVICE (_dev);
-  GError *error = NULL;
 
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case M_SCAN_INIT_SLEEP:
+      /* The transfers are de-interleaved straight into this image */
+      g_clear_object (&self->image);
+      self->image = fp_image_new (CS9711_WIDTH, CS9711_HEIGHT);
       fpi_ssm_next_state_delayed (ssm, CS9711_DEFAULT_RESET_SLEEP);
       break;
 
-    case M_SCAN_INIT_READ:
-      usb_read_in (_dev, ssm, CS9711_FP_RECV_LEN_1, FALSE, 0, m_scan_read_cb_bulk, M_SCAN_READ_CB_BULK_UD_FIRST_BLOCK);
-      usb_send_out_sync (_dev, CS9711_FP_CMD_TYPE_SCAN, &error);
+    case M_SCAN_START:
+      /* Queue both reads before triggering the scan. The first block is a
+       * whole number of packets, so the tail lands in the second read
+       * right after it without another round trip. The tail read waits
+       * behind the one waiting for the finger, so its timeout is only
+       * started once the first block arrived. */
+      g_assert (self->scan_pending == 0);
+      self->scan_cancellable = g_cancellable_new ();
+      self->scan_pending = 3;
+      usb_read_in (_dev, ssm, CS9711_FP_RECV_LEN_1, FALSE, 0, self->scan_cancellable, m_scan_read_cb_bulk, M_SCAN_READ_CB_BULK_UD_FIRST_BLOCK);
+      usb_read_in (_dev, ssm, CS9711_FP_RECV_LEN_2, TRUE, 0, self->scan_cancellable, m_scan_read_cb_bulk, M_SCAN_READ_CB_BULK_UD_SECOND_BLOCK);
+      usb_send_out (_dev, ssm, CS9711_FP_CMD_TYPE_SCAN, self->scan_cancellable, m_scan_send_cb, NULL);
       fpi_image_device_report_finger_status (image_device, TRUE);
-      m_util_fail_if_error_or_next (ssm, error);
+      fpi_ssm_next_state (ssm);
       break;
 
-    case M_SCAN_WAIT_FOR_READ_TO_COMPLETE:
-      /* Wait for usb_read_in's callback m_scan_read_cb_bulk to advance the state */
+    case M_SCAN_WAIT_FOR_TRANSFERS:
+      /* Wait for m_scan_transfer_done to advance the state */
       break;
 
-    case M_SCAN_GET_IMAGE_TAIL:
-      usb_read_in (_dev, ssm, CS9711_FP_RECV_LEN_2, TRUE, CS9711_DEFAULT_WAIT_TIMEOUT, m_scan_read_cb_bulk, M_SCAN_READ_CB_BULK_UD_SECOND_BLOCK);
+    case M_SCAN_SUBMIT_IMAGE:
+      /* The image is processed while the sensor is reset */
+      m_scan_submit_image (ssm, image_device);
+      fpi_ssm_next_state (ssm);
       break;
 
     case M_SCAN_SEND_POST_SCAN:
-      usb_send_out_sync (_dev, CS9711_FP_CMD_TYPE_RESET, &error);
-      m_util_fail_if_error_or_next (ssm, error);
+      usb_send_out (_dev, ssm, CS9711_FP_CMD_TYPE_RESET, NULL, usb_send_out_cb_next, NULL);
       break;
 
-    case M_SCAN_IMAGE_COMPLETE:
-      m_scan_submit_image (ssm, image_device);
+    case M_SCAN_FINGER_OFF:
+      /* Only now the next capture may start */
       fpi_image_device_report_finger_status (image_device, FALSE);
       fpi_ssm_mark_completed (ssm);
       break;
@@ -399,7 +523,8 @@ dev_open (FpImageDevice *dev)
   g_usb_device_claim_interface (fpi_device_get_usb_device (FP_DEVICE (dev)), 0, 0, &error);
 
   /* Initialize private structure */
-  memset(self->image_buffer, 0, CS9711_FRAME_SIZE);
+  g_clear_object (&self->image);
+  self->read_pool = fpi_usb_transfer_pool_new (FP_DEVICE (dev), CS9711_FP_RECV_LEN_MAX, 2, FALSE);
 
   /* Notify open complete */
   fpi_image_device_open_complete (dev, error);
@@ -408,8 +533,16 @@ dev_open (FpImageDevice *dev)
 static void
 dev_close (FpImageDevice *dev)
 {
+  FpDeviceCs9711 *self = FPI_DEVICE_CS9711 (dev);
   GError *error = NULL;
 
+  g_clear_object (&self->image);
+  g_clear_pointer (&self->read_pool, fpi_usb_transfer_pool_unref);
+  g_clear_pointer (&self->tail_timeout, g_source_destroy);
+  g_clear_object (&self->scan_cancellable);
+  g_clear_error (&self->scan_error);
+  self->scan_pending = 0;
+
   /* Release usb interface */
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)),
                                   0, 0, &error);
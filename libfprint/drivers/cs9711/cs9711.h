@@ -34,7 +34,17 @@ struct _FpDeviceCs9711
 {
   FpImageDevice parent;
 
-  unsigned char image_buffer[CS9711_FRAME_SIZE];
+  FpImage      *image;
+
+  /* Reused for all reads */
+  FpiUsbTransferPool *read_pool;
+
+  /* Transfers queued in parallel during a scan */
+  GCancellable *scan_cancellable;
+  GError       *scan_error;
+  guint         scan_pending;
+  /* Limits the wait for the tail once the first block arrived */
+  GSource      *tail_timeout;
 };
 
 G_DECLARE_FINAL_TYPE (FpDeviceCs9711, fpi_device_cs9711, FPI, DEVICE_CS9711, FpImageDevice)
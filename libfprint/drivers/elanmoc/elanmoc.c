@@ -631,9 +631,6 @@ elanmoc_match_report_cb (FpiDeviceElanmoc *self,
   FpDevice *device = FP_DEVICE (self);
   FpPrint *print = NULL;
   FpPrint *verify_print = NULL;
-  GPtrArray *prints;
-  gboolean found = FALSE;
-  guint index;
 
   if (error)
     {
@@ -661,16 +658,9 @@ elanmoc_match_report_cb (FpiDeviceElanmoc *self,
 
   if (fpi_device_get_current_action (device) == FPI_DEVICE_ACTION_IDENTIFY)
     {
-      fpi_device_get_identify_data (device, &prints);
-      found = g_ptr_array_find_with_equal_func (prints,
-                                                print,
-                                                (GEqualFunc) fp_print_equal,
-                                                &index);
-
-      if (found)
-        fpi_device_identify_report (device, g_ptr_array_index (prints, index), print, NULL);
-      else
-        fpi_device_identify_report (device, NULL, print, NULL);
+      fpi_device_identify_report (device,
+                                  fpi_device_find_identify_print (device, print, NULL),
+                                  print, NULL);
 
       fpi_device_identify_complete (device, NULL);
     }
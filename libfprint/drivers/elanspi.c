@@ -22,6 +22,7 @@
 
 #include "drivers_api.h"
 #include "elanspi.h"
+#include "elanspi_level.h"
 
 #include <linux/hidraw.h>
 #include <sys/ioctl.h>
@@ -67,14 +68,18 @@ struct _FpiDeviceElanSpi
   };
 
   /* generic temp info for async reading */
-  guint8 sensor_status;
-  gint64 capture_timeout;
+  guint8  sensor_status;
+  gint64  capture_timeout;
+  GError *regtable_error;
 
   /* background / calibration parameters */
   guint16 *bg_image;
   guint16 *last_image;
   guint16 *prev_frame_image;
 
+  /* sensor offset of every pixel of a (rotated) frame */
+  guint32 *frame_index;
+
   gint     fp_empty_counter;
   GSList  *fp_frame_list;
 
@@ -216,7 +221,6 @@ enum elanspi_capture_hv_state {
 
 enum elanspi_write_regtable_state {
   ELANSPI_WRTABLE_WRITE,
-  ELANSPI_WRTABLE_ITERATE,
   ELANSPI_WRTABLE_NSTATES
 };
 
@@ -398,6 +402,7 @@ elanspi_determine_sensor (FpiDeviceElanSpi *self, GError **err)
     }
 
   /* setup frame size */
+  g_clear_pointer (&self->frame_index, g_free);
   if (fpi_device_get_driver_data (FP_DEVICE (self)) & ELANSPI_HV_FLIPPED)
     {
       self->frame_width = self->sensor_height;
@@ -506,6 +511,34 @@ elanspi_capture_old_handler (FpiSsm *ssm, FpDevice *dev)
     }
 }
 
+static void
+elanspi_regtable_write_cb (FpiSpiTransfer *transfer, FpDevice *dev, gpointer unused_data, GError *error)
+{
+  FpiDeviceElanSpi *self = FPI_DEVICE_ELANSPI (dev);
+
+  /* the write of the last entry reports the first error */
+  if (error && !self->regtable_error)
+    self->regtable_error = error;
+  else if (error)
+    g_error_free (error);
+}
+
+static void
+elanspi_regtable_last_write_cb (FpiSpiTransfer *transfer, FpDevice *dev, gpointer unused_data, GError *error)
+{
+  FpiDeviceElanSpi *self = FPI_DEVICE_ELANSPI (dev);
+
+  if (self->regtable_error)
+    {
+      if (error)
+        g_error_free (error);
+      fpi_ssm_mark_failed (transfer->ssm, g_steal_pointer (&self->regtable_error));
+      return;
+    }
+
+  fpi_ssm_spi_transfer_cb (transfer, dev, unused_data, error);
+}
+
 static void
 elanspi_send_regtable_handler (FpiSsm *ssm, FpDevice *dev)
 {
@@ -516,20 +549,22 @@ elanspi_send_regtable_handler (FpiSsm *ssm, FpDevice *dev)
   switch (fpi_ssm_get_cur_state (ssm))
     {
     case ELANSPI_WRTABLE_WRITE:
-      xfer = elanspi_write_register (self, entry->addr, entry->value);
-      xfer->ssm = ssm;
-      fpi_spi_transfer_submit (xfer, fpi_device_get_cancellable (dev), fpi_ssm_spi_transfer_cb, NULL);
-      return;
-
-    case ELANSPI_WRTABLE_ITERATE:
-      entry += 1;
-      if (entry->addr != 0xff)
+      /* queue all writes at once, so they can be merged into few ioctls */
+      do
         {
-          fpi_ssm_set_data (ssm, (gpointer) entry, NULL);
-          fpi_ssm_jump_to_state (ssm, ELANSPI_WRTABLE_WRITE);
-          return;
+          xfer = elanspi_write_register (self, entry->addr, entry->value);
+          entry += 1;
+
+          if (entry->addr != 0xff)
+            {
+              fpi_spi_transfer_submit (xfer, fpi_device_get_cancellable (dev), elanspi_regtable_write_cb, NULL);
+              continue;
+            }
+
+          xfer->ssm = ssm;
+          fpi_spi_transfer_submit (xfer, fpi_device_get_cancellable (dev), elanspi_regtable_last_write_cb, NULL);
         }
-      fpi_ssm_mark_completed (ssm);
+      while (entry->addr != 0xff);
       return;
     }
 }
@@ -563,11 +598,11 @@ elanspi_write_regtable (FpiDeviceElanSpi *self, const struct elanspi_regtable *
 static int
 elanspi_mean_image (FpiDeviceElanSpi *self, const guint16 *img)
 {
-  int total = 0;
+  FpiFrameStats stats = { 0 };
 
-  for (int i = 0; i < self->sensor_width * self->sensor_height; i += 1)
-    total += img[i];
-  return total / (self->sensor_width * self->sensor_height);
+  fpi_frame_stats_add_u16 (&stats, img, self->sensor_width, self->sensor_height,
+                           self->sensor_width, 1);
+  return fpi_frame_stats_get_mean (&stats);
 }
 
 static void
@@ -1153,26 +1188,12 @@ enum elanspi_guess_result {
 static gint
 elanspi_correct_with_bg (FpiDeviceElanSpi *self, guint16 *raw_image)
 {
-  gint count = 0;
-
-  for (int i = 0; i < self->sensor_width * self->sensor_height; i += 1)
-    {
-      if (raw_image[i] < self->bg_image[i])
-        {
-          count += 1;
-          raw_image[i] = 0;
-        }
-      else
-        {
-          raw_image[i] -= self->bg_image[i];
-        }
-    }
-
-  return count;
+  return fpi_frame_subtract_u16 (raw_image, self->bg_image,
+                                 self->sensor_width * self->sensor_height);
 }
 
-static guint16
-elanspi_lookup_pixel_with_rotation (FpiDeviceElanSpi *self, const guint16 *data_in, int y, int x)
+static guint32
+elanspi_pixel_offset_with_rotation (FpiDeviceElanSpi *self, int y, int x)
 {
   int rotation = fpi_device_get_driver_data (FP_DEVICE (self)) & 3;
   gint x1 = x, y1 = y;
@@ -1192,7 +1213,39 @@ elanspi_lookup_pixel_with_rotation (FpiDeviceElanSpi *self, const guint16 *data_
       x1 = (self->sensor_height - y - 1);
       y1 = x;
     }
-  return data_in[y1 * self->sensor_width + x1];
+  return y1 * self->sensor_width + x1;
+}
+
+/* The area of the sensor that elanspi_pixel_offset_with_rotation() maps
+ * for a frame, in sensor coordinates */
+static void
+elanspi_get_frame_window (FpiDeviceElanSpi *self, const guint16 *data_in,
+                          const guint16 **window, guint *width, guint *height)
+{
+  int rotation = fpi_device_get_driver_data (FP_DEVICE (self)) & 3;
+  gint x = 0, y = 0;
+
+  *width = self->frame_width;
+  *height = self->frame_height;
+
+  if (rotation == ELANSPI_180_ROTATE)
+    {
+      y = self->sensor_height - self->frame_height;
+    }
+  else if (rotation == ELANSPI_90LEFT_ROTATE)
+    {
+      *width = self->frame_height;
+      *height = self->frame_width;
+      y = self->sensor_width - self->frame_width;
+    }
+  else if (rotation == ELANSPI_90RIGHT_ROTATE)
+    {
+      *width = self->frame_height;
+      *height = self->frame_width;
+      x = self->sensor_height - self->frame_height;
+    }
+
+  *window = data_in + y * self->sensor_width + x;
 }
 
 static enum elanspi_guess_result
@@ -1211,23 +1264,17 @@ elanspi_guess_image (FpiDeviceElanSpi *self, guint16 *raw_image)
   gint invalid_percent = (100 * elanspi_correct_with_bg (self, image_copy)) / (self->sensor_height * self->sensor_width);
   gint is_fp = 0, is_empty = 0;
 
-  gint64 mean = 0;
-  gint64 sq_stddev = 0;
+  FpiFrameStats stats = { 0 };
+  const guint16 *window;
+  guint window_width, window_height;
+  guint64 sq_stddev;
 
-  for (int j = 0; j < frame_height; j += 1)
-    for (int i = 0; i < frame_width; i += 1)
-      mean += (gint64) elanspi_lookup_pixel_with_rotation (self, image_copy, j, i);
-
-  mean /= (frame_width * frame_height);
-
-  for (int j = 0; j < frame_height; j += 1)
-    for (int i = 0; i < frame_width; i += 1)
-      {
-        gint64 k = (gint64) elanspi_lookup_pixel_with_rotation (self, image_copy, j, i) - mean;
-        sq_stddev += k * k;
-      }
-
-  sq_stddev /= (frame_width * frame_height);
+  /* The statistics do not depend on the order of the pixels, so evaluate
+   * the area of the sensor that makes up the (rotated) frame directly. */
+  elanspi_get_frame_window (self, image_copy, &window, &window_width, &window_height);
+  fpi_frame_stats_add_u16 (&stats, window, window_width, window_height,
+                           self->sensor_width, 1);
+  sq_stddev = fpi_frame_stats_get_sq_dev (&stats);
 
   if (invalid_percent < ELANSPI_MAX_REAL_INVALID_PERCENT)
     is_fp += 1;
@@ -1269,58 +1316,20 @@ elanspi_check_waitupdown_done (FpiDeviceElanSpi *self, enum elanspi_guess_result
     }
 }
 
-static int
-cmp_u16 (const void *a, const void *b)
-{
-  return (int) (*(guint16 *) a - *(guint16 *) b);
-}
-
 static void
 elanspi_process_frame (FpiDeviceElanSpi *self, const guint16 *data_in, guint8 *data_out)
 {
   size_t frame_size = self->frame_width * self->frame_height;
-  guint16 data_in_sorted[frame_size];
-
-  for (int i = 0, offset = 0; i < self->frame_height; i += 1)
-    for (int j = 0; j < self->frame_width; j += 1)
-      data_in_sorted[offset++] = elanspi_lookup_pixel_with_rotation (self, data_in, i, j);
-
-  qsort (data_in_sorted, frame_size, 2, cmp_u16);
-  guint16 lvl0 = data_in_sorted[0];
-  guint16 lvl1 = data_in_sorted[frame_size * 3 / 10];
-  guint16 lvl2 = data_in_sorted[frame_size * 65 / 100];
-  guint16 lvl3 = data_in_sorted[frame_size - 1];
-
-  lvl1 = MAX (lvl1, lvl0 + 1);
-  lvl2 = MAX (lvl2, lvl1 + 1);
-  lvl3 = MAX (lvl3, lvl2 + 1);
 
-  for (int i = 0; i < self->frame_height; i += 1)
+  if (!self->frame_index)
     {
-      for (int j = 0; j < self->frame_width; j += 1)
-        {
-          guint16 px = elanspi_lookup_pixel_with_rotation (self, data_in, i, j);
-          if (px < lvl0)
-            {
-              px = 0;
-            }
-          else if (px > lvl3)
-            {
-              px = 255;
-            }
-          else
-            {
-              if (lvl0 <= px && px < lvl1)
-                px = (px - lvl0) * 99 / (lvl1 - lvl0);
-              else if (lvl1 <= px && px < lvl2)
-                px = 99 + ((px - lvl1) * 56 / (lvl2 - lvl1));
-              else /* (lvl2 <= px && px <= lvl3) */
-                px = 155 + ((px - lvl2) * 100 / (lvl3 - lvl2));
-            }
-          *data_out = px;
-          data_out += 1;
-        }
+      self->frame_index = g_new (guint32, frame_size);
+      for (int i = 0, offset = 0; i < self->frame_height; i += 1)
+        for (int j = 0; j < self->frame_width; j += 1)
+          self->frame_index[offset++] = elanspi_pixel_offset_with_rotation (self, i, j);
     }
+
+  elanspi_level_frame (data_in, self->frame_index, frame_size, data_out);
 }
 
 static unsigned char
@@ -1362,24 +1371,15 @@ elanspi_fp_frame_stitch_and_submit (FpiDeviceElanSpi *self)
 static gint64
 elanspi_get_frame_diff_stddev_sq (FpiDeviceElanSpi *self, guint16 *frame1, guint16 *frame2)
 {
-  gint64 mean = 0;
-  gint64 sq_stddev = 0;
-
-  for (int j = 0; j < (self->sensor_height * self->sensor_width); j += 1)
-    mean += abs ((int) frame1[j] - (int) frame2[j]);
+  FpiFrameStats stats = { 0 };
 
   g_assert (self->sensor_height && self->sensor_width); /* make clang happy about div0 */
-  mean /= (self->sensor_height * self->sensor_width);
-
-  for (int j = 0; j < (self->sensor_height * self->sensor_width); j += 1)
-    {
-      gint64 k = abs ((int) frame1[j] - (int) frame2[j]) - mean;
-      sq_stddev += k * k;
-    }
 
-  sq_stddev /= (self->sensor_height * self->sensor_width);
+  fpi_frame_stats_add_diff_u16 (&stats, frame1, frame2,
+                                self->sensor_width, self->sensor_height,
+                                self->sensor_width, 1);
 
-  return sq_stddev;
+  return fpi_frame_stats_get_sq_dev (&stats);
 }
 
 static void
@@ -1683,6 +1683,7 @@ fpi_device_elanspi_finalize (GObject *this)
   g_clear_pointer (&self->bg_image, g_free);
   g_clear_pointer (&self->last_image, g_free);
   g_clear_pointer (&self->prev_frame_image, g_free);
+  g_clear_pointer (&self->frame_index, g_free);
   g_slist_free_full (g_steal_pointer (&self->fp_frame_list), g_free);
 
   G_OBJECT_CLASS (fpi_device_elanspi_parent_class)->finalize (this);
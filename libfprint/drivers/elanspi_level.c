@@ -0,0 +1,148 @@
+/*
+ * Elan SPI frame leveling
+ *
+ * Copyright (C) 2021 Matthew Mirvish <matthew@mm12.xyz>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+
+#include "elanspi_level.h"
+
+/* Piecewise linear mapping of t = 0..count-1 to base + t * scale / div,
+ * without a division per entry */
+static void
+elanspi_fill_level_lut (guint8 *lut, guint count, guint base, guint scale, guint div)
+{
+  guint q = base, r = 0;
+
+  for (guint t = 0; t < count; t++)
+    {
+      lut[t] = q;
+      r += scale;
+      while (r >= div)
+        {
+          q += 1;
+          r -= div;
+        }
+    }
+}
+
+static guint8
+elanspi_level_pixel (guint16 px, guint16 lvl0, guint16 lvl1, guint16 lvl2, guint16 lvl3)
+{
+  if (px < lvl0)
+    px = 0;
+  else if (px > lvl3)
+    px = 255;
+  else if (lvl0 <= px && px < lvl1)
+    px = (px - lvl0) * 99 / (lvl1 - lvl0);
+  else if (lvl1 <= px && px < lvl2)
+    px = 99 + ((px - lvl1) * 56 / (lvl2 - lvl1));
+  else /* (lvl2 <= px && px <= lvl3) */
+    px = 155 + ((px - lvl2) * 100 / (lvl3 - lvl2));
+
+  return px;
+}
+
+/* Maps the frame pixels data_in[index[i]] to 8 bit, stretching the
+ * 0/30/65/100% percentiles of the frame to 0/99/155/255 */
+void
+elanspi_level_frame (const guint16 *data_in, const guint32 *index,
+                     size_t frame_size, guint8 *data_out)
+{
+  size_t rank1 = frame_size * 3 / 10;
+  size_t rank2 = frame_size * 65 / 100;
+  guint16 frame[frame_size];
+  guint hist_hi[256] = { 0 };
+  guint hist_lo1[256] = { 0 };
+  guint hist_lo2[256] = { 0 };
+  guint16 min = G_MAXUINT16, max = 0;
+  guint bucket1 = 0, bucket2 = 0;
+  size_t below1 = 0, below2 = 0, cum = 0;
+  guint lo1 = 0, lo2 = 0;
+
+  /* Find the 0/30/65/100% percentiles with a two level radix selection
+   * over the high and low byte rather than by sorting the frame. */
+  for (size_t i = 0; i < frame_size; i += 1)
+    {
+      guint16 px = data_in[index[i]];
+
+      frame[i] = px;
+      hist_hi[px >> 8] += 1;
+      min = MIN (min, px);
+      max = MAX (max, px);
+    }
+
+  for (guint b = 0; b < 256; b += 1)
+    {
+      if (cum <= rank1 && rank1 < cum + hist_hi[b])
+        {
+          bucket1 = b;
+          below1 = cum;
+        }
+      if (cum <= rank2 && rank2 < cum + hist_hi[b])
+        {
+          bucket2 = b;
+          below2 = cum;
+        }
+      cum += hist_hi[b];
+    }
+
+  for (size_t i = 0; i < frame_size; i += 1)
+    {
+      if ((frame[i] >> 8) == bucket1)
+        hist_lo1[frame[i] & 0xff] += 1;
+      if ((frame[i] >> 8) == bucket2)
+        hist_lo2[frame[i] & 0xff] += 1;
+    }
+
+  for (cum = below1; cum + hist_lo1[lo1] <= rank1; lo1 += 1)
+    cum += hist_lo1[lo1];
+  for (cum = below2; cum + hist_lo2[lo2] <= rank2; lo2 += 1)
+    cum += hist_lo2[lo2];
+
+  guint16 lvl0 = min;
+  guint16 lvl1 = (bucket1 << 8) | lo1;
+  guint16 lvl2 = (bucket2 << 8) | lo2;
+  guint16 lvl3 = max;
+
+  lvl1 = MAX (lvl1, lvl0 + 1);
+  lvl2 = MAX (lvl2, lvl1 + 1);
+  lvl3 = MAX (lvl3, lvl2 + 1);
+
+  if (!(lvl0 < lvl1 && lvl1 < lvl2 && lvl2 < lvl3))
+    {
+      /* The levels wrapped around at the top of the range */
+      for (size_t i = 0; i < frame_size; i += 1)
+        data_out[i] = elanspi_level_pixel (frame[i], lvl0, lvl1, lvl2, lvl3);
+      return;
+    }
+
+  /* All pixels are within lvl0..max, so map them through a lookup table
+   * of that range (which is small for the 12-14 bit sensor data). */
+  g_autofree guint8 *lut = g_malloc (max - lvl0 + 1);
+  guint n1 = MIN (lvl1, max + 1) - lvl0;
+  guint n2 = lvl1 <= max ? MIN (lvl2, max + 1) - lvl1 : 0;
+  guint n3 = lvl2 <= max ? max + 1 - lvl2 : 0;
+
+  elanspi_fill_level_lut (lut, n1, 0, 99, lvl1 - lvl0);
+  elanspi_fill_level_lut (lut + n1, n2, 99, 56, lvl2 - lvl1);
+  elanspi_fill_level_lut (lut + n1 + n2, n3, 155, 100, lvl3 - lvl2);
+
+  for (size_t i = 0; i < frame_size; i += 1)
+    data_out[i] = lut[frame[i] - lvl0];
+}
@@ -1177,7 +1177,6 @@ fpc_verify_cb (FpiDeviceFpcMoc *self,
                void            *data,
                GError          *error)
 {
-  g_autoptr(GPtrArray) templates = NULL;
   FpDevice *device = FP_DEVICE (self);
   gboolean found = FALSE;
   FpiDeviceAction current_action;
@@ -1202,7 +1201,6 @@ fpc_verify_cb (FpiDeviceFpcMoc *self,
     {
       FpPrint *match = NULL;
       FpPrint *print = NULL;
-      gint cnt = 0;
       fpc_fid_data_t fid_data = {0};
 
       fid_data.subfactor = presp->subfactor;
@@ -1215,25 +1213,13 @@ fpc_verify_cb (FpiDeviceFpcMoc *self,
 
       if (current_action == FPI_DEVICE_ACTION_VERIFY)
         {
-          templates = g_ptr_array_sized_new (1);
           fpi_device_get_verify_data (device, &print);
-          g_ptr_array_add (templates, print);
+          found = fp_print_equal (print, match);
         }
       else
         {
-          fpi_device_get_identify_data (device, &templates);
-          g_ptr_array_ref (templates);
-        }
-
-      for (cnt = 0; cnt < templates->len; cnt++)
-        {
-          print = g_ptr_array_index (templates, cnt);
-
-          if (fp_print_equal (print, match))
-            {
-              found = TRUE;
-              break;
-            }
+          print = fpi_device_find_identify_print (device, match, NULL);
+          found = print != NULL;
         }
 
       if (found)
@@ -441,17 +441,7 @@ fp_verify_cb (FpiDeviceGoodixMoc  *self,
         }
       else
         {
-          GPtrArray *templates = NULL;
-          fpi_device_get_identify_data (device, &templates);
-
-          for (gint i = 0; i < templates->len; i++)
-            {
-              if (fp_print_equal (g_ptr_array_index (templates, i), new_scan))
-                {
-                  matching = g_ptr_array_index (templates, i);
-                  break;
-                }
-            }
+          matching = fpi_device_find_identify_print (device, new_scan, NULL);
         }
     }
 
@@ -735,26 +735,15 @@ identify_msg_cb (FpiDeviceSynaptics *self,
     case BMKT_RSP_ID_OK:
       {
         FpPrint *print = NULL;
-        GPtrArray *prints = NULL;
         g_autoptr(GVariant) data = NULL;
-        gboolean found = FALSE;
-        guint index;
 
         print = create_print (self,
                               resp->response.id_resp.user_id,
                               resp->response.id_resp.finger_id);
 
-        fpi_device_get_identify_data (device, &prints);
-
-        found = g_ptr_array_find_with_equal_func (prints,
-                                                  print,
-                                                  (GEqualFunc) fp_print_equal,
-                                                  &index);
-
-        if (found)
-          fpi_device_identify_report (device, g_ptr_array_index (prints, index), print, NULL);
-        else
-          fpi_device_identify_report (device, NULL, print, NULL);
+        fpi_device_identify_report (device,
+                                    fpi_device_find_identify_print (device, print, NULL),
+                                    print, NULL);
 
         identify_complete_after_finger_removal (self, NULL);
       }
@@ -1507,6 +1496,7 @@ fpi_device_synaptics_class_init (FpiDeviceSynapticsClass *klass)
   dev_class->id_table = id_table;
   dev_class->nr_enroll_stages = ENROLL_SAMPLES;
   dev_class->temp_hot_seconds = -1;
+  dev_class->identify_max_prints = UINT8_MAX;
 
   dev_class->open = dev_init;
   dev_class->close = dev_exit;
@@ -29,7 +29,12 @@
 #include "upeksonly.h"
 
 #define CTRL_TIMEOUT 1000
+/* Register writes are control transfers, which the host controller runs one
+ * after the other on ep0. Each one is still acknowledged by the sensor
+ * before the next starts, queueing them only saves the round trips. */
+#define WRITE_REGS_IN_FLIGHT 4
 #define NUM_BULK_TRANSFERS 24
+#define IMG_READ_SIZE 4096
 #define MAX_ROWS 2048
 #define MIN_ROWS 64
 
@@ -73,10 +78,7 @@ struct _FpiDeviceUpeksonly
 
   FpiSsm       *loopsm;
 
-  /* Do we really need multiple concurrent transfers? */
-  GCancellable  *img_cancellable;
-  GPtrArray     *img_transfers;
-  int            num_flying;
+  FpiUsbStream  *img_stream;
 
   GSList        *rows;
   unsigned       num_rows;
@@ -154,9 +156,12 @@ upeksonly_get_pixel (struct fpi_line_asmbl_ctx *ctx,
 static void
 free_img_transfers (FpiDeviceUpeksonly *sdev)
 {
-  g_cancellable_cancel (sdev->img_cancellable);
-  g_clear_object (&sdev->img_cancellable);
-  g_clear_pointer (&sdev->img_transfers, g_ptr_array_unref);
+  /* Reads that are still in flight are dropped */
+  sdev->killing_transfers = NOT_KILLING;
+  g_clear_error (&sdev->kill_error);
+  if (sdev->img_stream)
+    fpi_usb_stream_stop (sdev->img_stream);
+  g_clear_pointer (&sdev->img_stream, fpi_usb_stream_unref);
 }
 
 static void
@@ -187,9 +192,10 @@ cancel_img_transfers (FpImageDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
 
-  g_cancellable_cancel (self->img_cancellable);
-
-  if (self->num_flying == 0)
+  /* The last callback of the stream finishes the kill */
+  if (self->img_stream && fpi_usb_stream_is_active (self->img_stream))
+    fpi_usb_stream_stop (self->img_stream);
+  else
     last_transfer_killed (dev);
 }
 
@@ -498,35 +504,43 @@ handle_packet (FpImageDevice *dev, unsigned char *data)
 }
 
 static void
-img_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
-             gpointer user_data, GError *error)
+img_stream_cb (FpiUsbStream *stream, FpDevice *device,
+               FpiUsbTransfer *transfer, gpointer user_data, GError *error)
 {
   FpImageDevice *dev = FP_IMAGE_DEVICE (device);
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   int i;
 
-  self->num_flying--;
-
-  if (self->killing_transfers)
+  /* The stream ended and all reads were returned */
+  if (!transfer)
     {
-      if (self->num_flying == 0)
-        last_transfer_killed (dev);
+      if (error && !self->killing_transfers)
+        {
+          fp_warn ("bad status %s, terminating session", error->message);
+          self->killing_transfers = IMG_SESSION_ERROR;
+          self->kill_error = error;
+        }
+      else
+        {
+          /* don't care about error or success if we're terminating */
+          g_clear_error (&error);
+        }
 
-      /* don't care about error or success if we're terminating */
-      g_clear_error (&error);
+      last_transfer_killed (dev);
       return;
     }
 
+  if (self->killing_transfers)
+    return;
+
   /* NOTE: The old code assume 4096 bytes are received each time
    * but there is no reason we need to enforce that. However, we
    * always need full lines. */
   if (transfer->actual_length % 64 != 0)
-    error = fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
-                                      "Data packets need to be multiple of 64 bytes, got %zi bytes",
-                                      transfer->actual_length);
-
-  if (error)
     {
+      error = fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                        "Data packets need to be multiple of 64 bytes, got %zi bytes",
+                                        transfer->actual_length);
       fp_warn ("bad status %s, terminating session", error->message);
       self->killing_transfers = IMG_SESSION_ERROR;
 
@@ -548,91 +562,26 @@ img_data_cb (FpiUsbTransfer *transfer, FpDevice *device,
   for (i = 0; i + 64 <= transfer->actual_length; i += 64)
     {
       if (!is_capturing (self))
-        return;
+        break;
       handle_packet (dev, transfer->buffer + i);
     }
 
-  if (is_capturing (self))
-    {
-      fpi_usb_transfer_submit (fpi_usb_transfer_ref (transfer),
-                               0,
-                               self->img_cancellable,
-                               img_data_cb,
-                               user_data);
-      self->num_flying++;
-    }
+  /* Stop polling once the capture is over */
+  if (!is_capturing (self))
+    fpi_usb_stream_stop (stream);
 }
 
 /***** STATE MACHINE HELPERS *****/
 
-struct write_regs_data
-{
-  FpDevice                    *dev;
-  FpiSsm                      *ssm;
-  FpiUsbTransfer              *transfer;
-  const struct sonly_regwrite *regs;
-  size_t                       num_regs;
-  size_t                       regs_written;
-};
-
 static void
-write_regs_finished (struct write_regs_data *wrdata, GError *error)
+write_regs_cb (FpDevice *dev, gpointer user_data, GError *error)
 {
+  FpiSsm *ssm = user_data;
+
   if (!error)
-    fpi_ssm_next_state (wrdata->ssm);
+    fpi_ssm_next_state (ssm);
   else
-    fpi_ssm_mark_failed (wrdata->ssm, error);
-
-  g_free (wrdata);
-}
-
-static void write_regs_iterate (struct write_regs_data *wrdata);
-
-static void
-write_regs_cb (FpiUsbTransfer *transfer, FpDevice *device,
-               gpointer user_data, GError *error)
-{
-  struct write_regs_data *wrdata = user_data;
-
-  if (error)
-    {
-      write_regs_finished (wrdata, error);
-      return;
-    }
-
-  wrdata->regs_written++;
-  write_regs_iterate (wrdata);
-}
-
-static void
-write_regs_iterate (struct write_regs_data *wrdata)
-{
-  FpiUsbTransfer *transfer;
-  const struct sonly_regwrite *regwrite;
-
-  if (wrdata->regs_written >= wrdata->num_regs)
-    {
-      write_regs_finished (wrdata, NULL);
-      return;
-    }
-
-  regwrite = &wrdata->regs[wrdata->regs_written];
-  fp_dbg ("set %02x=%02x", regwrite->reg, regwrite->value);
-
-  transfer = fpi_usb_transfer_new (wrdata->dev);
-  fpi_usb_transfer_fill_control (transfer,
-                                 G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
-                                 G_USB_DEVICE_REQUEST_TYPE_VENDOR,
-                                 G_USB_DEVICE_RECIPIENT_DEVICE,
-                                 0x0c,
-                                 0,
-                                 regwrite->reg,
-                                 1);
-  transfer->short_is_error = TRUE;
-  transfer->ssm = wrdata->ssm;
-  transfer->buffer[0] = regwrite->value;
-
-  fpi_usb_transfer_submit (transfer, CTRL_TIMEOUT, NULL, write_regs_cb, wrdata);
+    fpi_ssm_mark_failed (ssm, error);
 }
 
 static void
@@ -641,15 +590,33 @@ sm_write_regs (FpiSsm                      *ssm,
                const struct sonly_regwrite *regs,
                size_t                       num_regs)
 {
-  struct write_regs_data *wrdata = g_malloc (sizeof (*wrdata));
+  FpiUsbTransferBatch *batch;
+  size_t i;
+
+  batch = fpi_usb_transfer_batch_new (dev, WRITE_REGS_IN_FLIGHT);
+
+  for (i = 0; i < num_regs; i++)
+    {
+      FpiUsbTransfer *transfer;
 
-  wrdata->ssm = ssm;
-  wrdata->regs = regs;
-  wrdata->num_regs = num_regs;
-  wrdata->regs_written = 0;
-  wrdata->dev = dev;
+      fp_dbg ("set %02x=%02x", regs[i].reg, regs[i].value);
+
+      transfer = fpi_usb_transfer_new (dev);
+      fpi_usb_transfer_fill_control (transfer,
+                                     G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
+                                     G_USB_DEVICE_REQUEST_TYPE_VENDOR,
+                                     G_USB_DEVICE_RECIPIENT_DEVICE,
+                                     0x0c,
+                                     0,
+                                     regs[i].reg,
+                                     1);
+      transfer->short_is_error = TRUE;
+      transfer->buffer[0] = regs[i].value;
+
+      fpi_usb_transfer_batch_add (batch, transfer);
+    }
 
-  write_regs_iterate (wrdata);
+  fpi_usb_transfer_batch_submit (batch, CTRL_TIMEOUT, NULL, write_regs_cb, ssm);
 }
 
 static void
@@ -892,21 +859,10 @@ capsm_fire_bulk (FpiSsm   *ssm,
                  FpDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
-  int i;
 
   g_assert (self->capturing == FALSE);
 
-  g_clear_object (&self->img_cancellable);
-  self->img_cancellable = g_cancellable_new ();
-  for (i = 0; i < self->img_transfers->len; i++)
-    {
-      fpi_usb_transfer_submit (fpi_usb_transfer_ref (g_ptr_array_index (self->img_transfers, i)),
-                               0,
-                               self->img_cancellable,
-                               img_data_cb,
-                               NULL);
-      self->num_flying++;
-    }
+  fpi_usb_stream_start (self->img_stream, NULL, img_stream_cb, NULL);
   self->capturing = TRUE;
   fpi_ssm_next_state (ssm);
 }
@@ -1392,26 +1348,15 @@ dev_activate (FpImageDevice *dev)
 {
   FpiDeviceUpeksonly *self = FPI_DEVICE_UPEKSONLY (dev);
   FpiSsm *ssm = NULL;
-  int i;
 
   self->deactivating = FALSE;
   self->capturing = FALSE;
 
-  self->num_flying = 0;
-  self->img_transfers = g_ptr_array_new_with_free_func ((GFreeFunc) fpi_usb_transfer_unref);
-
   /* This might seem odd, but we do need multiple in-flight URBs so that
    * we never stop polling the device for more data.
    */
-  for (i = 0; i < NUM_BULK_TRANSFERS; i++)
-    {
-      FpiUsbTransfer *transfer;
-
-      transfer = fpi_usb_transfer_new (FP_DEVICE (dev));
-      fpi_usb_transfer_fill_bulk (transfer, 0x81, 4096);
-
-      g_ptr_array_add (self->img_transfers, transfer);
-    }
+  self->img_stream = fpi_usb_stream_new (FP_DEVICE (dev), 0x81, IMG_READ_SIZE,
+                                         NUM_BULK_TRANSFERS, 0);
 
   switch (self->dev_model)
     {
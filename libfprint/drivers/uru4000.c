@@ -24,6 +24,7 @@
 #include <pk11pub.h>
 
 #include "drivers_api.h"
+#include "uru4000_decode.h"
 
 #define EP_INTR (1 | FPI_USB_ENDPOINT_IN)
 #define EP_DATA (2 | FPI_USB_ENDPOINT_IN)
@@ -565,49 +566,6 @@ enum {
   BLOCKF_NOT_PRESENT      = 0x01,
 };
 
-static uint32_t
-update_key (uint32_t key)
-{
-  /* linear feedback shift register
-   * taps at bit positions 1 3 4 7 11 13 20 23 26 29 32 */
-  uint32_t bit = key & 0x9248144d;
-
-  bit ^= bit << 16;
-  bit ^= bit << 8;
-  bit ^= bit << 4;
-  bit ^= bit << 2;
-  bit ^= bit << 1;
-  return (bit & 0x80000000) | (key >> 1);
-}
-
-static uint32_t
-do_decode (uint8_t *data, int num_bytes, uint32_t key)
-{
-  uint8_t xorbyte;
-  int i;
-
-  for (i = 0; i < num_bytes - 1; i++)
-    {
-      /* calculate xor byte and update key */
-      xorbyte  = ((key >>  4) & 1) << 0;
-      xorbyte |= ((key >>  8) & 1) << 1;
-      xorbyte |= ((key >> 11) & 1) << 2;
-      xorbyte |= ((key >> 14) & 1) << 3;
-      xorbyte |= ((key >> 18) & 1) << 4;
-      xorbyte |= ((key >> 21) & 1) << 5;
-      xorbyte |= ((key >> 24) & 1) << 6;
-      xorbyte |= ((key >> 29) & 1) << 7;
-      key = update_key (key);
-
-      /* decrypt data */
-      data[i] = data[i + 1] ^ xorbyte;
-    }
-
-  /* the final byte is implicitly zero */
-  data[i] = 0;
-  return update_key (key);
-}
-
 static int
 calc_dev2 (struct uru4k_image *img)
 {
@@ -733,14 +691,13 @@ imaging_run_state (FpiSsm *ssm, FpDevice *_dev)
             {
             case BLOCKF_ENCRYPTED:
               fp_dbg ("decoding %d lines", num_lines);
-              key = do_decode (&img->data[self->img_lines_done][0],
-                               IMAGE_WIDTH * num_lines, key);
+              key = uru4000_decode (&img->data[self->img_lines_done][0],
+                                    IMAGE_WIDTH * num_lines, key);
               break;
 
             case 0:
               fp_dbg ("skipping %d lines", num_lines);
-              for (r = 0; r < IMAGE_WIDTH * num_lines; r++)
-                key = update_key (key);
+              key = uru4000_skip_key (key, IMAGE_WIDTH * num_lines);
               break;
             }
           if ((flags & BLOCKF_NOT_PRESENT) == 0)
@@ -0,0 +1,175 @@
+/*
+ * Digital Persona U.are.U 4000/4000B/4500 image decryption
+ * Copyright (C) 2007-2008 Daniel Drake <dsd@gentoo.org>
+ * Copyright (C) 2012 Timo Teräs <timo.teras@iki.fi>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "uru4000_decode.h"
+
+/*
+ * The image data is XORed with a keystream generated by a 32 bit linear
+ * feedback shift register. As both the register update and the derivation
+ * of the XOR byte are linear, the keystream for a whole chunk of bytes and
+ * the key at the end of the chunk are just the XOR of the contributions of
+ * every byte of the initial key. These contributions are precomputed, so a
+ * chunk is decoded with a handful of table lookups instead of stepping the
+ * register for every byte.
+ */
+#define CHUNK_SIZE 32
+#define CHUNK_WORDS (CHUNK_SIZE / 8)
+
+typedef struct
+{
+  /* key after CHUNK_SIZE updates */
+  uint32_t advance[4][256];
+  /* keystream for the next CHUNK_SIZE bytes, in memory order */
+  uint64_t keystream[4][256][CHUNK_WORDS];
+} DecodeTables;
+
+static DecodeTables tables;
+
+uint32_t
+uru4000_update_key (uint32_t key)
+{
+  /* linear feedback shift register
+   * taps at bit positions 1 3 4 7 11 13 20 23 26 29 32 */
+  uint32_t bit = key & 0x9248144d;
+
+  bit ^= bit << 16;
+  bit ^= bit << 8;
+  bit ^= bit << 4;
+  bit ^= bit << 2;
+  bit ^= bit << 1;
+  return (bit & 0x80000000) | (key >> 1);
+}
+
+static uint8_t
+key_xor_byte (uint32_t key)
+{
+  uint8_t xorbyte;
+
+  xorbyte  = ((key >>  4) & 1) << 0;
+  xorbyte |= ((key >>  8) & 1) << 1;
+  xorbyte |= ((key >> 11) & 1) << 2;
+  xorbyte |= ((key >> 14) & 1) << 3;
+  xorbyte |= ((key >> 18) & 1) << 4;
+  xorbyte |= ((key >> 21) & 1) << 5;
+  xorbyte |= ((key >> 24) & 1) << 6;
+  xorbyte |= ((key >> 29) & 1) << 7;
+
+  return xorbyte;
+}
+
+static const DecodeTables *
+get_tables (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      int i, v, j;
+
+      for (i = 0; i < 4; i++)
+        {
+          for (v = 0; v < 256; v++)
+            {
+              uint8_t stream[CHUNK_SIZE];
+              uint32_t key = (uint32_t) v << (i * 8);
+
+              for (j = 0; j < CHUNK_SIZE; j++)
+                {
+                  stream[j] = key_xor_byte (key);
+                  key = uru4000_update_key (key);
+                }
+
+              tables.advance[i][v] = key;
+              memcpy (tables.keystream[i][v], stream, CHUNK_SIZE);
+            }
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return &tables;
+}
+
+static inline uint32_t
+advance_chunk (const DecodeTables *t, uint32_t key)
+{
+  return t->advance[0][key & 0xff] ^
+         t->advance[1][(key >> 8) & 0xff] ^
+         t->advance[2][(key >> 16) & 0xff] ^
+         t->advance[3][key >> 24];
+}
+
+/* Returns the key after num_bytes updates */
+uint32_t
+uru4000_skip_key (uint32_t key, int num_bytes)
+{
+  const DecodeTables *t = get_tables ();
+
+  for (; num_bytes >= CHUNK_SIZE; num_bytes -= CHUNK_SIZE)
+    key = advance_chunk (t, key);
+
+  for (; num_bytes > 0; num_bytes--)
+    key = uru4000_update_key (key);
+
+  return key;
+}
+
+/* Decrypts num_bytes of data in place, returns the key for the next block */
+uint32_t
+uru4000_decode (uint8_t *data, int num_bytes, uint32_t key)
+{
+  const DecodeTables *t = get_tables ();
+  int i = 0;
+
+  /* Every decrypted byte is taken from the following encrypted one, so the
+   * last byte of the chunk must not be the last byte of the block. */
+  for (; i + CHUNK_SIZE < num_bytes; i += CHUNK_SIZE)
+    {
+      const uint64_t *k0 = t->keystream[0][key & 0xff];
+      const uint64_t *k1 = t->keystream[1][(key >> 8) & 0xff];
+      const uint64_t *k2 = t->keystream[2][(key >> 16) & 0xff];
+      const uint64_t *k3 = t->keystream[3][key >> 24];
+      int w;
+
+      for (w = 0; w < CHUNK_WORDS; w++)
+        {
+          uint64_t word;
+
+          memcpy (&word, data + i + w * sizeof (uint64_t) + 1, sizeof (uint64_t));
+          word ^= k0[w] ^ k1[w] ^ k2[w] ^ k3[w];
+          memcpy (data + i + w * sizeof (uint64_t), &word, sizeof (uint64_t));
+        }
+
+      key = advance_chunk (t, key);
+    }
+
+  for (; i < num_bytes - 1; i++)
+    {
+      data[i] = data[i + 1] ^ key_xor_byte (key);
+      key = uru4000_update_key (key);
+    }
+
+  /* the final byte is implicitly zero */
+  data[i] = 0;
+  return uru4000_update_key (key);
+}
@@ -321,4 +321,7 @@ fpi_device_virtual_image_class_init (FpDeviceVirtualImageClass *klass)
 
   img_class->activate = dev_activate;
   img_class->deactivate = dev_deactivate;
+
+  /* Capture the next enroll stage while the previous image is processed */
+  img_class->enroll_pipeline_depth = 2;
 }
@@ -29,5 +29,7 @@
 #include "fpi-log.h"
 #include "fpi-print.h"
 #include "fpi-usb-transfer.h"
+#include "fpi-usb-stream.h"
 #include "fpi-spi-transfer.h"
 #include "fpi-ssm.h"
+#include "fpi-trace.h"
@@ -22,6 +22,7 @@
 
 #include "fpi-context.h"
 #include "fpi-device.h"
+#include "fpi-worker.h"
 #include <gusb.h>
 #include <stdio.h>
 
@@ -55,10 +56,21 @@ typedef struct
 
   GArray       *drivers;
   GPtrArray    *devices;
+
+  FpiWorker    *worker;
 } FpContextPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (FpContext, fp_context, G_TYPE_OBJECT)
 
+enum {
+  PROP_0,
+  PROP_PROCESSING_THREADS,
+  PROP_PROCESSING_QUEUE_DEPTH,
+  N_PROPS
+};
+
+static GParamSpec *properties[N_PROPS];
+
 enum {
   DEVICE_ADDED_SIGNAL,
   DEVICE_REMOVED_SIGNAL,
@@ -66,6 +78,9 @@ enum {
 };
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* Number of contexts sharing the default worker */
+static gint n_contexts = 0;
+
 static const char *
 get_drivers_whitelist_env (void)
 {
@@ -298,6 +313,12 @@ fp_context_finalize (GObject *object)
 
   g_slist_free_full (g_steal_pointer (&priv->sources), (GDestroyNotify) g_source_destroy);
 
+  /* The worker is shared by all contexts, drop it with the last one.
+   * Queued jobs keep it alive until they have finished. */
+  g_clear_pointer (&priv->worker, fpi_worker_unref);
+  if (g_atomic_int_dec_and_test (&n_contexts))
+    fpi_worker_set_default (NULL);
+
   if (priv->usb_ctx)
     g_object_run_dispose (G_OBJECT (priv->usb_ctx));
   g_clear_object (&priv->usb_ctx);
@@ -305,12 +326,98 @@ fp_context_finalize (GObject *object)
   G_OBJECT_CLASS (fp_context_parent_class)->finalize (object);
 }
 
+static void
+fp_context_get_property (GObject    *object,
+                         guint       prop_id,
+                         GValue     *value,
+                         GParamSpec *pspec)
+{
+  FpContext *self = FP_CONTEXT (object);
+  FpContextPrivate *priv = fp_context_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_PROCESSING_THREADS:
+      g_value_set_uint (value, fpi_worker_get_max_threads (priv->worker));
+      break;
+
+    case PROP_PROCESSING_QUEUE_DEPTH:
+      g_value_set_uint (value, fpi_worker_get_queue_depth (priv->worker));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+fp_context_set_property (GObject      *object,
+                         guint         prop_id,
+                         const GValue *value,
+                         GParamSpec   *pspec)
+{
+  FpContext *self = FP_CONTEXT (object);
+  FpContextPrivate *priv = fp_context_get_instance_private (self);
+
+  switch (prop_id)
+    {
+    case PROP_PROCESSING_THREADS:
+      fpi_worker_set_max_threads (priv->worker, g_value_get_uint (value));
+      break;
+
+    case PROP_PROCESSING_QUEUE_DEPTH:
+      fpi_worker_set_queue_depth (priv->worker, g_value_get_uint (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
 static void
 fp_context_class_init (FpContextClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->finalize = fp_context_finalize;
+  object_class->get_property = fp_context_get_property;
+  object_class->set_property = fp_context_set_property;
+
+  /**
+   * FpContext:processing-threads:
+   *
+   * The maximum number of threads used for image processing (e.g.
+   * minutiae detection), shared between all devices. The default
+   * depends on the number of processors.
+   *
+   * The threads are shared by all contexts of the process, so changing
+   * this also affects other contexts.
+   */
+  properties[PROP_PROCESSING_THREADS] =
+    g_param_spec_uint ("processing-threads",
+                       "Processing threads",
+                       "The maximum number of image processing threads",
+                       1, G_MAXINT, fpi_worker_get_default_max_threads (),
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * FpContext:processing-queue-depth:
+   *
+   * The maximum number of image processing jobs of a single device that
+   * are queued at the same time. Further jobs are held back, so that one
+   * device cannot starve all others. At most #FPI_WORKER_MAX_HELD_BACK
+   * jobs are held back, further ones fail.
+   *
+   * Like #FpContext:processing-threads, this is shared by all contexts.
+   */
+  properties[PROP_PROCESSING_QUEUE_DEPTH] =
+    g_param_spec_uint ("processing-queue-depth",
+                       "Processing queue depth",
+                       "The maximum number of queued image processing jobs per device",
+                       1, G_MAXINT, FPI_WORKER_DEFAULT_QUEUE_DEPTH,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
 
   /**
    * FpContext::device-added:
@@ -380,6 +487,10 @@ fp_context_init (FpContext *self)
 
   priv->devices = g_ptr_array_new_with_free_func (g_object_unref);
 
+  /* Image processing of all devices is done by the default worker */
+  g_atomic_int_inc (&n_contexts);
+  priv->worker = fpi_worker_get_default ();
+
   priv->cancellable = g_cancellable_new ();
   priv->usb_ctx = g_usb_context_new (&error);
   if (!priv->usb_ctx)
@@ -600,3 +711,171 @@ fp_context_get_devices (FpContext *context)
 
   return priv->devices;
 }
+
+typedef struct
+{
+  guint   pending;
+  gint64  start_time;
+  GError *error;
+} OpenAllData;
+
+static void
+open_all_data_free (OpenAllData *data)
+{
+  g_clear_error (&data->error);
+  g_free (data);
+}
+
+static void
+open_all_device_done (GTask *task)
+{
+  OpenAllData *data = g_task_get_task_data (task);
+
+  if (--data->pending > 0)
+    return;
+
+  g_debug ("Opening all devices took %.1f ms",
+           (g_get_monotonic_time () - data->start_time) / 1000.0);
+
+  if (data->error)
+    g_task_return_error (task, g_steal_pointer (&data->error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+open_all_device_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GError) error = NULL;
+  OpenAllData *data = g_task_get_task_data (task);
+  FpDevice *device = FP_DEVICE (source_object);
+  gdouble duration;
+
+  duration = (g_get_monotonic_time () - data->start_time) / 1000.0;
+
+  if (fp_device_open_finish (device, res, &error))
+    {
+      g_debug ("Opened device %s (%s) in %.1f ms",
+               fp_device_get_name (device), fp_device_get_driver (device), duration);
+    }
+  else
+    {
+      g_message ("Could not open device %s (%s) after %.1f ms: %s",
+                 fp_device_get_name (device), fp_device_get_driver (device),
+                 duration, error->message);
+      if (!data->error)
+        data->error = g_steal_pointer (&error);
+    }
+
+  open_all_device_done (task);
+}
+
+/**
+ * fp_context_open_all:
+ * @context: a #FpContext
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Start an asynchronous operation to open all devices that are not open
+ * yet, fp_context_enumerate() will be called as needed. The devices are
+ * opened concurrently, so the initialization of one reader does not wait
+ * for the others. The callback will be called once all of them have
+ * finished. Retrieve the result with fp_context_open_all_finish().
+ */
+void
+fp_context_open_all (FpContext          *context,
+                     GCancellable       *cancellable,
+                     GAsyncReadyCallback callback,
+                     gpointer            user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  OpenAllData *data;
+  GPtrArray *devices;
+  guint i;
+
+  g_return_if_fail (FP_IS_CONTEXT (context));
+
+  task = g_task_new (context, cancellable, callback, user_data);
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  devices = fp_context_get_devices (context);
+
+  data = g_new0 (OpenAllData, 1);
+  data->start_time = g_get_monotonic_time ();
+  g_task_set_task_data (task, data, (GDestroyNotify) open_all_data_free);
+
+  /* Held until all devices were started, so that we never return early */
+  data->pending = 1;
+
+  for (i = 0; i < devices->len; i++)
+    {
+      FpDevice *device = g_ptr_array_index (devices, i);
+
+      if (fp_device_is_open (device))
+        continue;
+
+      data->pending++;
+      fp_device_open (device, cancellable, open_all_device_cb, g_object_ref (task));
+    }
+
+  open_all_device_done (task);
+}
+
+/**
+ * fp_context_open_all_finish:
+ * @context: a #FpContext
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an asynchronous operation to open all devices. See
+ * fp_context_open_all(). If opening any of the devices failed, the first
+ * error is returned. The devices that were opened successfully stay open.
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_context_open_all_finish (FpContext    *context,
+                            GAsyncResult *result,
+                            GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, context), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+async_result_ready (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GTask **task = user_data;
+
+  *task = g_object_ref (G_TASK (res));
+}
+
+/**
+ * fp_context_open_all_sync:
+ * @context: a #FpContext
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Open all devices synchronously, see fp_context_open_all().
+ *
+ * Returns: (type void): %FALSE on error, %TRUE otherwise
+ */
+gboolean
+fp_context_open_all_sync (FpContext    *context,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GAsyncResult) task = NULL;
+
+  g_return_val_if_fail (FP_IS_CONTEXT (context), FALSE);
+
+  fp_context_open_all (context, cancellable, async_result_ready, &task);
+  while (!task)
+    g_main_context_iteration (NULL, TRUE);
+
+  return fp_context_open_all_finish (context, task, error);
+}
@@ -49,4 +49,17 @@ void fp_context_enumerate (FpContext *context);
 
 GPtrArray *fp_context_get_devices (FpContext *context);
 
+void fp_context_open_all (FpContext          *context,
+                          GCancellable       *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer            user_data);
+
+gboolean fp_context_open_all_finish (FpContext    *context,
+                                     GAsyncResult *result,
+                                     GError      **error);
+
+gboolean fp_context_open_all_sync (FpContext    *context,
+                                   GCancellable *cancellable,
+                                   GError      **error);
+
 G_END_DECLS
@@ -76,6 +76,9 @@ typedef struct
   GSource            *current_idle_cancel_source;
   GSource            *current_task_idle_return_source;
 
+  /* Monotonic time at which the current open action was started */
+  gint64              open_start_time;
+
   /* State for tasks */
   gboolean            wait_for_finger;
   FpFingerStatusFlags finger_status;
@@ -115,6 +118,13 @@ typedef struct
 {
   FpPrint       *enrolled_print;   /* verify */
   GPtrArray     *gallery;   /* identify */
+  GHashTable    *gallery_index; /* FpPrint -> index + 1, created on demand */
+
+  /* Set if the identify gallery is split into chunks, see
+   * FpDeviceClass::identify_max_prints. gallery is the current chunk. */
+  GPtrArray     *full_gallery;
+  guint          chunk_end;
+  gboolean       chunk_missed;
 
   gboolean       result_reported;
   FpPrint       *match;
@@ -127,6 +137,9 @@ typedef struct
 } FpMatchData;
 
 
+gboolean fpi_match_data_next_chunk (FpMatchData *data,
+                                    guint        chunk_size);
+
 void fpi_device_suspend (FpDevice *device);
 void fpi_device_resume (FpDevice *device);
 
@@ -22,6 +22,7 @@
 #include "fpi-log.h"
 
 #include "fp-device-private.h"
+#include "fpi-trace.h"
 
 /**
  * SECTION: fp-device
@@ -860,6 +861,8 @@ fp_device_open (FpDevice           *device,
 
   priv->current_action = FPI_DEVICE_ACTION_OPEN;
   priv->current_task = g_steal_pointer (&task);
+  priv->open_start_time = g_get_monotonic_time ();
+  fpi_trace_async_begin ("device", "open", device);
   setup_task_cancellable (device);
   fpi_device_report_finger_status (device, FP_FINGER_STATUS_NONE);
 
@@ -1238,7 +1241,9 @@ match_data_free (FpMatchData *data)
   data->match_data = NULL;
 
   g_clear_object (&data->enrolled_print);
+  g_clear_pointer (&data->gallery_index, g_hash_table_unref);
   g_clear_pointer (&data->gallery, g_ptr_array_unref);
+  g_clear_pointer (&data->full_gallery, g_ptr_array_unref);
 
   g_free (data);
 }
@@ -1383,6 +1388,11 @@ fp_device_verify_finish (FpDevice     *device,
  * Start an asynchronous operation to identify prints. The callback will
  * be called once the operation has finished. Retrieve the result with
  * fp_device_identify_finish().
+ *
+ * Some devices can only identify against a limited number of prints at a
+ * time. Larger galleries are searched in parts, and the user may need to
+ * present the finger again for each part. #FpDevice:finger-status changes
+ * to %FP_FINGER_STATUS_NEEDED when that is the case.
  */
 void
 fp_device_identify (FpDevice           *device,
@@ -1458,6 +1468,14 @@ fp_device_identify (FpDevice           *device,
   data->match_data = match_data;
   data->match_destroy = match_destroy;
 
+  if (cls->identify_max_prints && data->gallery->len > cls->identify_max_prints)
+    {
+      g_debug ("Splitting gallery of %u prints into chunks of %u",
+               data->gallery->len, cls->identify_max_prints);
+      data->full_gallery = g_steal_pointer (&data->gallery);
+      fpi_match_data_next_chunk (data, cls->identify_max_prints);
+    }
+
   // Attach the match data as task data so that it is destroyed
   g_task_set_task_data (priv->current_task, data, (GDestroyNotify) match_data_free);
 
@@ -29,13 +29,20 @@ typedef struct
   gboolean            active;
 
   gboolean            finger_present;
+  gint64              capture_started_at;
 
   gint                enroll_stage;
 
-  gboolean            minutiae_scan_active;
+  /* Captured images in the order they were taken, see FpiPendingScan */
+  GQueue              pending_scans;
+  guint               enroll_pipeline_depth;
   GError             *action_error;
   FpImage            *capture_image;
 
+  /* The SIGFM enroll print is fused in a worker thread before completing */
+  gboolean            fusing;
+  gboolean            enroll_fused;
+
   gint                score_threshold;
   FpiPrintType        algorithm;
 } FpImageDevicePrivate;
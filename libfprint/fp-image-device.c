@@ -134,7 +134,7 @@ fp_image_device_start_capture_action (FpDevice *device)
   priv->enroll_stage = 0;
   /* The internal state machine guarantees both of these. */
   g_assert (!priv->finger_present);
-  g_assert (!priv->minutiae_scan_active);
+  g_assert (g_queue_is_empty (&priv->pending_scans));
 
   /* And activate the device; we rely on fpi_image_device_activate_complete()
    * to be called when done (or immediately). */
@@ -201,6 +201,7 @@ fp_image_device_constructed (GObject *obj)
   priv->algorithm = FPI_PRINT_NBIS;
   if (cls->algorithm > 0)
     priv->algorithm = (FpiPrintType) cls->algorithm;
+  priv->enroll_pipeline_depth = MAX (cls->enroll_pipeline_depth, 1);
 
   G_OBJECT_CLASS (fp_image_device_parent_class)->constructed (obj);
 }
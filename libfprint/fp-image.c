@@ -22,8 +22,11 @@
 #define FP_COMPONENT "image"
 
 #include "fpi-compat.h"
+#include "fpi-device.h"
 #include "fpi-image.h"
 #include "fpi-log.h"
+#include "fpi-trace.h"
+#include "fpi-worker.h"
 
 #include <config.h>
 #include <nbis.h>
@@ -177,6 +180,7 @@ typedef struct
   guchar            * image;
   gint                width;
   gint                height;
+  FpiImageFlags       flags;
   GAsyncReadyCallback user_cb;
 } ExtractSigfmData;
 
@@ -209,6 +213,8 @@ fp_image_sigfm_extract_cb (GObject * source_object, GAsyncResult * res,
     {
       image = FP_IMAGE (source_object);
 
+      image->flags = data->flags;
+
       g_clear_pointer (&image->data, g_free);
       image->data = g_steal_pointer (&data->image);
       image->sigfm_info = g_steal_pointer (&data->sigfm_info);
@@ -255,55 +261,6 @@ fp_image_detect_minutiae_cb (GObject      *source_object,
     data->user_cb (source_object, res, user_data);
 }
 
-static void
-vflip (guint8 *data, gint width, gint height)
-{
-  int data_len = width * height;
-  unsigned char rowbuf[width];
-  int i;
-
-  for (i = 0; i < height / 2; i++)
-    {
-      int offset = i * width;
-      int swap_offset = data_len - (width * (i + 1));
-
-      /* copy top row into buffer */
-      memcpy (rowbuf, data + offset, width);
-
-      /* copy lower row over upper row */
-      memcpy (data + offset, data + swap_offset, width);
-
-      /* copy buffer over lower row */
-      memcpy (data + swap_offset, rowbuf, width);
-    }
-}
-
-static void
-hflip (guint8 *data, gint width, gint height)
-{
-  unsigned char rowbuf[width];
-  int i, j;
-
-  for (i = 0; i < height; i++)
-    {
-      int offset = i * width;
-
-      memcpy (rowbuf, data + offset, width);
-      for (j = 0; j < width; j++)
-        data[offset + j] = rowbuf[width - j - 1];
-    }
-}
-
-static void
-invert_colors (guint8 *data, gint width, gint height)
-{
-  int data_len = width * height;
-  int i;
-
-  for (i = 0; i < data_len; i++)
-    data[i] = 0xff - data[i];
-}
-
 static void
 fp_image_sigfm_extract_thread_func (GTask * task, void * src_obj,
                                     void * task_data,
@@ -311,8 +268,10 @@ fp_image_sigfm_extract_thread_func (GTask * task, void * src_obj,
 {
   ExtractSigfmData * data = task_data;
   GTimer * timer = g_timer_new ();
+  gint64 trace_start = fpi_trace_begin ();
 
   data->sigfm_info = sigfm_extract (data->image, data->width, data->height);
+  fpi_trace_end ("image", "sigfm extraction", trace_start);
   g_timer_stop (timer);
   fp_dbg ("sigfm extract completed in %f secs", g_timer_elapsed (timer, NULL));
   g_timer_destroy (timer);
@@ -321,7 +280,6 @@ fp_image_sigfm_extract_thread_func (GTask * task, void * src_obj,
     {
       fp_err ("extract sigfm info failed");
       g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "SIGFM scan failed");
-      g_object_unref (task);
       return;
     }
 
@@ -329,11 +287,9 @@ fp_image_sigfm_extract_thread_func (GTask * task, void * src_obj,
     {
       g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
                                "No enough keypoints found");
-      g_object_unref (task);
       return;
     }
   g_task_return_boolean (task, TRUE);
-  g_object_unref (task);
 }
 
 static void
@@ -355,28 +311,19 @@ fp_image_detect_minutiae_thread_func (GTask        *task,
   gint bw, bh, bd;
   gint r;
   g_autofree LFSPARMS *lfsparms = NULL;
-
-  /* Normalize the image first */
-  if (data->flags & FPI_IMAGE_H_FLIPPED)
-    hflip (data->image, data->width, data->height);
-
-  if (data->flags & FPI_IMAGE_V_FLIPPED)
-    vflip (data->image, data->width, data->height);
-
-  if (data->flags & FPI_IMAGE_COLORS_INVERTED)
-    invert_colors (data->image, data->width, data->height);
-
-  data->flags &= ~(FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED | FPI_IMAGE_COLORS_INVERTED);
+  gint64 trace_start;
 
   lfsparms = g_memdup2 (&g_lfsparms_V2, sizeof (LFSPARMS));
   lfsparms->remove_perimeter_pts = data->flags & FPI_IMAGE_PARTIAL ? TRUE : FALSE;
 
   timer = g_timer_new ();
+  trace_start = fpi_trace_begin ();
   r = get_minutiae (&minutiae, &quality_map, &direction_map,
                     &low_contrast_map, &low_flow_map, &high_curve_map,
                     &map_w, &map_h, &bdata, &bw, &bh, &bd,
                     data->image, data->width, data->height, 8,
                     data->ppmm, lfsparms);
+  fpi_trace_end ("image", "minutiae detection", trace_start);
   g_timer_stop (timer);
   fp_dbg ("Minutiae scan completed in %f secs", g_timer_elapsed (timer, NULL));
 
@@ -387,7 +334,6 @@ fp_image_detect_minutiae_thread_func (GTask        *task,
     {
       fp_err ("get minutiae failed, code %d", r);
       g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Minutiae scan failed with code %d", r);
-      g_object_unref (task);
       return;
     }
 
@@ -395,12 +341,10 @@ fp_image_detect_minutiae_thread_func (GTask        *task,
     {
       g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
                                "No minutiae found");
-      g_object_unref (task);
       return;
     }
 
   g_task_return_boolean (task, TRUE);
-  g_object_unref (task);
 }
 
 /**
@@ -517,6 +461,60 @@ fp_image_get_sigfm_info (FpImage * self)
   return self->sigfm_info;
 }
 
+static void
+extract_sigfm_info (FpImage            *self,
+                    FpiWorkerPriority   priority,
+                    gconstpointer       owner,
+                    GCancellable       *cancellable,
+                    GAsyncReadyCallback callback,
+                    gpointer            user_data)
+{
+  g_autoptr(FpiWorker) worker = fpi_worker_get_default ();
+  g_autoptr(GTask) task = NULL;
+  ExtractSigfmData * data = g_new0 (ExtractSigfmData, 1);
+
+  task = g_task_new (self, cancellable, fp_image_sigfm_extract_cb, user_data);
+
+  /* The thread works on a normalized copy of the image */
+  data->image = fpi_image_dup_normalized_data (self);
+  data->flags = self->flags & ~FPI_IMAGE_NORMALIZATION_FLAGS;
+  data->width = self->width;
+  data->height = self->height;
+  data->user_cb = callback;
+
+  g_task_set_task_data (task, data,
+                        (GDestroyNotify) fp_image_sigfm_extract_free);
+  fpi_worker_run_task (worker, task, fp_image_sigfm_extract_thread_func,
+                       priority, owner);
+}
+
+static void
+detect_minutiae (FpImage            *self,
+                 FpiWorkerPriority   priority,
+                 gconstpointer       owner,
+                 GCancellable       *cancellable,
+                 GAsyncReadyCallback callback,
+                 gpointer            user_data)
+{
+  g_autoptr(FpiWorker) worker = fpi_worker_get_default ();
+  g_autoptr(GTask) task = NULL;
+  DetectMinutiaeData *data = g_new0 (DetectMinutiaeData, 1);
+
+  task = g_task_new (self, cancellable, fp_image_detect_minutiae_cb, user_data);
+
+  /* The thread works on a normalized copy of the image */
+  data->image = fpi_image_dup_normalized_data (self);
+  data->flags = self->flags & ~FPI_IMAGE_NORMALIZATION_FLAGS;
+  data->width = self->width;
+  data->height = self->height;
+  data->ppmm = self->ppmm;
+  data->user_cb = callback;
+
+  g_task_set_task_data (task, data, (GDestroyNotify) fp_image_detect_minutiae_free);
+  fpi_worker_run_task (worker, task, fp_image_detect_minutiae_thread_func,
+                       priority, owner);
+}
+
 /**
  * fp_image_extract_sigfm_info:
  * @self: A #FpImage
@@ -530,20 +528,8 @@ void
 fp_image_extract_sigfm_info (FpImage * self, GCancellable * cancellable,
                              GAsyncReadyCallback callback, gpointer user_data)
 {
-  GTask * task;
-  ExtractSigfmData * data = g_new0 (ExtractSigfmData, 1);
-
-  task = g_task_new (self, cancellable, fp_image_sigfm_extract_cb, user_data);
-
-  data->image = g_malloc (self->width * self->height);
-  memcpy (data->image, self->data, self->width * self->height);
-  data->width = self->width;
-  data->height = self->height;
-  data->user_cb = callback;
-
-  g_task_set_task_data (task, data,
-                        (GDestroyNotify) fp_image_sigfm_extract_free);
-  g_task_run_in_thread (task, fp_image_sigfm_extract_thread_func);
+  extract_sigfm_info (self, FPI_WORKER_PRIORITY_DEFAULT, NULL,
+                      cancellable, callback, user_data);
 }
 
 /**
@@ -561,21 +547,68 @@ fp_image_detect_minutiae (FpImage            *self,
                           GAsyncReadyCallback callback,
                           gpointer            user_data)
 {
-  GTask *task;
-  DetectMinutiaeData *data = g_new0 (DetectMinutiaeData, 1);
+  detect_minutiae (self, FPI_WORKER_PRIORITY_DEFAULT, NULL,
+                   cancellable, callback, user_data);
+}
 
-  task = g_task_new (self, cancellable, fp_image_detect_minutiae_cb, user_data);
+static FpiWorkerPriority
+device_worker_priority (FpDevice *device)
+{
+  switch (fpi_device_get_current_action (device))
+    {
+    case FPI_DEVICE_ACTION_VERIFY:
+    case FPI_DEVICE_ACTION_IDENTIFY:
+      return FPI_WORKER_PRIORITY_HIGH;
 
-  data->image = g_malloc (self->width * self->height);
-  memcpy (data->image, self->data, self->width * self->height);
-  data->flags = self->flags;
-  data->width = self->width;
-  data->height = self->height;
-  data->ppmm = self->ppmm;
-  data->user_cb = callback;
+    case FPI_DEVICE_ACTION_ENROLL:
+      return FPI_WORKER_PRIORITY_LOW;
 
-  g_task_set_task_data (task, data, (GDestroyNotify) fp_image_detect_minutiae_free);
-  g_task_run_in_thread (task, fp_image_detect_minutiae_thread_func);
+    default:
+      return FPI_WORKER_PRIORITY_DEFAULT;
+    }
+}
+
+/**
+ * fpi_image_detect_minutiae:
+ * @self: A #FpImage
+ * @device: The #FpDevice that captured @self
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Like fp_image_detect_minutiae(), but the job is prioritized depending
+ * on the current action of @device (verify and identify before enroll),
+ * counted against the processing queue depth of @device and cancelled
+ * together with the current action. Finish it using
+ * fp_image_detect_minutiae_finish().
+ */
+void
+fpi_image_detect_minutiae (FpImage            *self,
+                           FpDevice           *device,
+                           GAsyncReadyCallback callback,
+                           gpointer            user_data)
+{
+  detect_minutiae (self, device_worker_priority (device), device,
+                   fpi_device_get_cancellable (device), callback, user_data);
+}
+
+/**
+ * fpi_image_extract_sigfm_info:
+ * @self: A #FpImage
+ * @device: The #FpDevice that captured @self
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Like fpi_image_detect_minutiae() but extracting the SIGFM keypoints and
+ * descriptors, see fp_image_extract_sigfm_info().
+ */
+void
+fpi_image_extract_sigfm_info (FpImage            *self,
+                              FpDevice           *device,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data)
+{
+  extract_sigfm_info (self, device_worker_priority (device), device,
+                      fpi_device_get_cancellable (device), callback, user_data);
 }
 
 /**
@@ -43,4 +43,34 @@ struct _FpPrint
 
   GVariant  *data;
   GPtrArray *prints;
+
+  /* Match statistics, not serialized. Contains the number of successful
+   * matches of each entry in prints, see fpi_print_bz3_match(). */
+  guint *sub_print_hits;
+  guint  n_sub_print_hits;
+
+  /* Only set on scanned prints */
+  FpMatchInfo *match_info;
+
+  /* Cached by fpi_print_hash(), 0 if it needs to be computed */
+  guint identity_hash;
 };
+
+/* Compact NBIS template as stored in FpPrint::prints. Unlike struct
+ * xyt_struct, which always has room for MAX_BOZORTH_MINUTIAE rows, only
+ * nrows entries are allocated for each of the x, y and theta columns.
+ * The columns are stored one after the other in @cols. */
+typedef struct
+{
+  guint16 nrows;
+  gint16  cols[];
+} FpiXyt;
+
+#define FPI_XYT_X(xyt) ((xyt)->cols)
+#define FPI_XYT_Y(xyt) ((xyt)->cols + (xyt)->nrows)
+#define FPI_XYT_THETA(xyt) ((xyt)->cols + 2 * (xyt)->nrows)
+
+FpiXyt *fpi_xyt_new (guint nrows);
+gsize   fpi_xyt_size (const FpiXyt *xyt);
+void    fpi_xyt_to_struct (const FpiXyt      *xyt,
+                           struct xyt_struct *out);
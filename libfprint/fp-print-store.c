@@ -0,0 +1,782 @@
+/*
+ * FpPrintStore - Indexed on-disk print storage
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The store is an append-only log of records, each one replacing (or, if
+ * it has no data, deleting) the print stored under its key. Every record
+ * is synced to disk before the operation returns, so after a crash only
+ * the last record can be incomplete; it is detected using its checksum
+ * and dropped when the store is opened again.
+ *
+ * The index of the live records is built when opening by walking the
+ * record headers of the mapped file, the print data itself is only read
+ * when a print is loaded. Compaction rewrites the live records into a new
+ * file which atomically replaces the old one.
+ *
+ * Record layout, all integers are little endian:
+ *   guint32 magic, key length, data length and checksum
+ *   key, padded so that the print data following the 3 byte header of
+ *   fp_print_serialize() is 8 byte aligned
+ *   data, padded to 8 bytes
+ */
+
+#define FP_COMPONENT "print-store"
+
+#include "fp-print-store.h"
+#include "fpi-compat.h"
+#include "fpi-log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_MAGIC 0x52535046 /* "FPSR" */
+#define RECORD_ALIGN 8
+#define PRINT_HEADER_LEN 3
+
+/* Compact once more than half of the file is stale */
+#define COMPACT_MIN_DEAD_BYTES (64 * 1024)
+
+typedef struct
+{
+  guint32 magic;
+  guint32 key_len;
+  guint32 data_len;
+  guint32 checksum;
+} RecordHeader;
+
+typedef struct
+{
+  goffset offset;
+  gsize   size;
+  goffset data_offset;
+  guint32 data_len;
+  guint32 checksum;
+} RecordEntry;
+
+struct _FpPrintStore
+{
+  GObject      parent_instance;
+
+  char        *path;
+  int          fd;
+  goffset      size;
+  GMappedFile *mapped;
+
+  /* key -> RecordEntry */
+  GHashTable *index;
+  gsize       dead_bytes;
+};
+
+/**
+ * SECTION: fp-print-store
+ * @title: FpPrintStore
+ * @short_description: On-disk storage for prints
+ *
+ * Devices without their own storage need the application to keep the
+ * enrolled prints. #FpPrintStore keeps them in a single file, indexed by
+ * driver, device ID, finger and (optionally) username. Every change is
+ * synced to disk before the call returns, and only the data of the prints
+ * that are loaded is read.
+ *
+ * The store is not thread safe and a file must only be opened by one
+ * #FpPrintStore at a time.
+ */
+
+G_DEFINE_TYPE (FpPrintStore, fp_print_store, G_TYPE_OBJECT)
+
+static gsize
+align_up (gsize value, gsize align)
+{
+  return (value + align - 1) & ~(align - 1);
+}
+
+static goffset
+record_data_offset (goffset offset, guint32 key_len)
+{
+  return align_up (offset + sizeof (RecordHeader) + key_len + PRINT_HEADER_LEN,
+                   RECORD_ALIGN) - PRINT_HEADER_LEN;
+}
+
+static gsize
+record_size (goffset offset, guint32 key_len, guint32 data_len)
+{
+  return align_up (record_data_offset (offset, key_len) + data_len,
+                   RECORD_ALIGN) - offset;
+}
+
+/* FNV-1a, this only needs to detect torn writes */
+static guint32
+record_checksum (const char *key, guint32 key_len,
+                 const guint8 *data, guint32 data_len)
+{
+  guint32 hash = 2166136261u;
+  guint32 i;
+
+  for (i = 0; i < key_len; i++)
+    hash = (hash ^ (guint8) key[i]) * 16777619u;
+  for (i = 0; i < data_len; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+
+  return hash;
+}
+
+/* Without a username, these are the keys the example storage used */
+static char *
+print_key (const char *driver,
+           const char *device_id,
+           FpFinger    finger,
+           const char *username)
+{
+  if (!username)
+    return g_strdup_printf ("%s/%s/%x", driver, device_id, finger);
+
+  return g_strdup_printf ("%s/%s/%x/%s", driver, device_id, finger, username);
+}
+
+static gboolean
+set_error_from_errno (GError    **error,
+                      int         errsv,
+                      const char *msg,
+                      const char *path)
+{
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+               "%s %s: %s", msg, path, g_strerror (errsv));
+  return FALSE;
+}
+
+static gboolean
+write_all (int           fd,
+           const guint8 *data,
+           gsize         len,
+           goffset       offset)
+{
+  while (len > 0)
+    {
+      gssize r = pwrite (fd, data, len, offset);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r < 0)
+        return FALSE;
+
+      data += r;
+      len -= r;
+      offset += r;
+    }
+
+  return TRUE;
+}
+
+/* Returns the mapping, making sure it covers the whole file */
+static const guint8 *
+store_map (FpPrintStore *store,
+           GError      **error)
+{
+  if (store->size == 0)
+    return NULL;
+
+  if (store->mapped &&
+      g_mapped_file_get_length (store->mapped) >= (gsize) store->size)
+    return (const guint8 *) g_mapped_file_get_contents (store->mapped);
+
+  g_clear_pointer (&store->mapped, g_mapped_file_unref);
+  store->mapped = g_mapped_file_new_from_fd (store->fd, FALSE, error);
+  if (!store->mapped)
+    return NULL;
+
+  return (const guint8 *) g_mapped_file_get_contents (store->mapped);
+}
+
+static void
+index_update (FpPrintStore      *store,
+              char              *key,
+              const RecordEntry *entry)
+{
+  RecordEntry *old = g_hash_table_lookup (store->index, key);
+
+  if (old)
+    store->dead_bytes += old->size;
+
+  if (entry->data_len > 0)
+    {
+      g_hash_table_insert (store->index, key, g_memdup2 (entry, sizeof (*entry)));
+    }
+  else
+    {
+      /* The deletion record itself is stale right away */
+      g_hash_table_remove (store->index, key);
+      store->dead_bytes += entry->size;
+      g_free (key);
+    }
+}
+
+static gboolean
+store_load_index (FpPrintStore *store,
+                  GError      **error)
+{
+  const guint8 *contents;
+  goffset offset = 0;
+
+  contents = store_map (store, error);
+  if (store->size > 0 && !contents)
+    return FALSE;
+
+  while (offset + (goffset) sizeof (RecordHeader) <= store->size)
+    {
+      RecordHeader header;
+      RecordEntry entry;
+      const char *key;
+
+      memcpy (&header, contents + offset, sizeof (header));
+      header.magic = GUINT32_FROM_LE (header.magic);
+      header.key_len = GUINT32_FROM_LE (header.key_len);
+      header.data_len = GUINT32_FROM_LE (header.data_len);
+      header.checksum = GUINT32_FROM_LE (header.checksum);
+
+      if (header.magic != RECORD_MAGIC || header.key_len == 0)
+        break;
+
+      entry.offset = offset;
+      entry.size = record_size (offset, header.key_len, header.data_len);
+      entry.data_offset = record_data_offset (offset, header.key_len);
+      entry.data_len = header.data_len;
+      entry.checksum = header.checksum;
+
+      if (offset + (goffset) entry.size > store->size)
+        break;
+
+      key = (const char *) contents + offset + sizeof (RecordHeader);
+
+      /* Earlier records were synced before the next one was written, only
+       * the last one may have been torn by a crash. */
+      if (offset + (goffset) entry.size == store->size &&
+          record_checksum (key, header.key_len,
+                           contents + entry.data_offset,
+                           header.data_len) != header.checksum)
+        break;
+
+      index_update (store, g_strndup (key, header.key_len), &entry);
+      offset += entry.size;
+    }
+
+  if (offset != store->size)
+    {
+      fp_warn ("Dropping %" G_GOFFSET_FORMAT " bytes of incomplete data "
+                 "at the end of %s", store->size - offset, store->path);
+
+      /* Accessing truncated pages of a mapping raises SIGBUS */
+      g_clear_pointer (&store->mapped, g_mapped_file_unref);
+
+      if (ftruncate (store->fd, offset) < 0)
+        return set_error_from_errno (error, errno, "Could not truncate", store->path);
+
+      store->size = offset;
+    }
+
+  return TRUE;
+}
+
+/**
+ * fp_print_store_new:
+ * @path: The file to store the prints in
+ * @error: Return location for error
+ *
+ * Opens the store at @path, creating it if it does not exist yet. An
+ * incomplete record at the end of the file, e.g. after a crash, is dropped.
+ *
+ * Returns: (transfer full): A new #FpPrintStore, or %NULL on error
+ */
+FpPrintStore *
+fp_print_store_new (const gchar *path,
+                    GError     **error)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  struct stat st;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  store = g_object_new (FP_TYPE_PRINT_STORE, NULL);
+  store->path = g_strdup (path);
+  store->fd = g_open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (store->fd < 0)
+    {
+      set_error_from_errno (error, errno, "Could not open", path);
+      return NULL;
+    }
+
+  if (fstat (store->fd, &st) < 0)
+    {
+      set_error_from_errno (error, errno, "Could not stat", path);
+      return NULL;
+    }
+  store->size = st.st_size;
+
+  if (!store_load_index (store, error))
+    return NULL;
+
+  return g_steal_pointer (&store);
+}
+
+static void
+fp_print_store_finalize (GObject *object)
+{
+  FpPrintStore *store = (FpPrintStore *) object;
+
+  /* Prints loaded from the store keep their own reference to the mapping */
+  if (store->fd >= 0)
+    close (store->fd);
+  g_clear_pointer (&store->mapped, g_mapped_file_unref);
+  g_clear_pointer (&store->index, g_hash_table_unref);
+  g_clear_pointer (&store->path, g_free);
+
+  G_OBJECT_CLASS (fp_print_store_parent_class)->finalize (object);
+}
+
+static void
+fp_print_store_class_init (FpPrintStoreClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = fp_print_store_finalize;
+}
+
+static void
+fp_print_store_init (FpPrintStore *store)
+{
+  store->fd = -1;
+  store->index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static gboolean
+store_append (FpPrintStore *store,
+              const char   *key,
+              const guint8 *data,
+              guint32       data_len,
+              GError      **error)
+{
+  g_autofree guint8 *record = NULL;
+  RecordHeader header;
+  RecordEntry entry;
+  guint32 key_len = strlen (key);
+
+  entry.offset = store->size;
+  entry.size = record_size (entry.offset, key_len, data_len);
+  entry.data_offset = record_data_offset (entry.offset, key_len);
+  entry.data_len = data_len;
+  entry.checksum = record_checksum (key, key_len, data, data_len);
+
+  header.magic = GUINT32_TO_LE (RECORD_MAGIC);
+  header.key_len = GUINT32_TO_LE (key_len);
+  header.data_len = GUINT32_TO_LE (data_len);
+  header.checksum = GUINT32_TO_LE (entry.checksum);
+
+  record = g_malloc0 (entry.size);
+  memcpy (record, &header, sizeof (header));
+  memcpy (record + sizeof (header), key, key_len);
+  if (data_len > 0)
+    memcpy (record + (entry.data_offset - entry.offset), data, data_len);
+
+  if (!write_all (store->fd, record, entry.size, entry.offset) ||
+      fdatasync (store->fd) < 0)
+    {
+      int errsv = errno;
+
+      /* Do not leave a partial record behind for the next append. This
+       * only cuts beyond the mapped part of the file. */
+      if (ftruncate (store->fd, store->size) < 0)
+        fp_warn ("Could not truncate %s: %s", store->path, g_strerror (errno));
+
+      return set_error_from_errno (error, errsv, "Could not write to", store->path);
+    }
+
+  store->size += entry.size;
+  index_update (store, g_strdup (key), &entry);
+
+  if (store->dead_bytes > COMPACT_MIN_DEAD_BYTES &&
+      store->dead_bytes > (gsize) store->size / 2)
+    {
+      g_autoptr(GError) compact_error = NULL;
+
+      /* The record was written, failing to compact is not fatal */
+      if (!fp_print_store_compact (store, &compact_error))
+        fp_warn ("Could not compact %s: %s", store->path, compact_error->message);
+    }
+
+  return TRUE;
+}
+
+/**
+ * fp_print_store_save:
+ * @store: A #FpPrintStore
+ * @print: The #FpPrint to store
+ * @finger: The finger to store @print for
+ * @username: (nullable): The username to store @print for
+ * @error: Return location for error
+ *
+ * Stores @print, replacing any print for the same driver, device, finger
+ * and username.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_store_save (FpPrintStore *store,
+                     FpPrint      *print,
+                     FpFinger      finger,
+                     const gchar  *username,
+                     GError      **error)
+{
+  g_autofree char *key = NULL;
+  g_autofree guchar *data = NULL;
+  gsize length;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+  g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+
+  if (!fp_print_serialize (print, &data, &length, error))
+    return FALSE;
+
+  if (length > G_MAXUINT32)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Print is too large to be stored");
+      return FALSE;
+    }
+
+  key = print_key (fp_print_get_driver (print),
+                   fp_print_get_device_id (print),
+                   finger,
+                   username);
+
+  return store_append (store, key, data, length, error);
+}
+
+static FpPrint *
+store_load_entry (FpPrintStore      *store,
+                  const char        *key,
+                  const RecordEntry *entry,
+                  GError           **error)
+{
+  g_autoptr(GBytes) file_bytes = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  const guint8 *contents;
+
+  contents = store_map (store, error);
+  if (!contents)
+    return NULL;
+
+  if (record_checksum (key, strlen (key), contents + entry->data_offset,
+                       entry->data_len) != entry->checksum)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Print %s in %s is corrupted", key, store->path);
+      return NULL;
+    }
+
+  /* The print may reference the mapped data directly */
+  file_bytes = g_mapped_file_get_bytes (store->mapped);
+  bytes = g_bytes_new_from_bytes (file_bytes, entry->data_offset, entry->data_len);
+
+  return fp_print_deserialize_bytes (bytes, FALSE, error);
+}
+
+/**
+ * fp_print_store_contains:
+ * @store: A #FpPrintStore
+ * @driver: The driver of the print
+ * @device_id: The device ID of the print
+ * @finger: The finger of the print
+ * @username: (nullable): The username of the print
+ *
+ * Returns: %TRUE if a print is stored for the given key
+ */
+gboolean
+fp_print_store_contains (FpPrintStore *store,
+                         const gchar  *driver,
+                         const gchar  *device_id,
+                         FpFinger      finger,
+                         const gchar  *username)
+{
+  g_autofree char *key = NULL;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+
+  key = print_key (driver, device_id, finger, username);
+
+  return g_hash_table_contains (store->index, key);
+}
+
+/**
+ * fp_print_store_load:
+ * @store: A #FpPrintStore
+ * @driver: The driver of the print
+ * @device_id: The device ID of the print
+ * @finger: The finger of the print
+ * @username: (nullable): The username of the print
+ * @error: Return location for error
+ *
+ * Returns: (transfer full): The stored print, or %NULL if there is none
+ *   (in which case @error is not set) or it could not be loaded
+ */
+FpPrint *
+fp_print_store_load (FpPrintStore *store,
+                     const gchar  *driver,
+                     const gchar  *device_id,
+                     FpFinger      finger,
+                     const gchar  *username,
+                     GError      **error)
+{
+  g_autofree char *key = NULL;
+  RecordEntry *entry;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), NULL);
+
+  key = print_key (driver, device_id, finger, username);
+
+  entry = g_hash_table_lookup (store->index, key);
+  if (!entry)
+    return NULL;
+
+  return store_load_entry (store, key, entry, error);
+}
+
+/**
+ * fp_print_store_delete:
+ * @store: A #FpPrintStore
+ * @driver: The driver of the print
+ * @device_id: The device ID of the print
+ * @finger: The finger of the print
+ * @username: (nullable): The username of the print
+ * @error: Return location for error
+ *
+ * Removes the print from the store, if there is one.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_store_delete (FpPrintStore *store,
+                       const gchar  *driver,
+                       const gchar  *device_id,
+                       FpFinger      finger,
+                       const gchar  *username,
+                       GError      **error)
+{
+  g_autofree char *key = NULL;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+
+  key = print_key (driver, device_id, finger, username);
+
+  if (!g_hash_table_contains (store->index, key))
+    return TRUE;
+
+  return store_append (store, key, NULL, 0, error);
+}
+
+typedef struct
+{
+  const char        *key;
+  const RecordEntry *entry;
+} ListItem;
+
+static gint
+list_item_cmp (gconstpointer a, gconstpointer b)
+{
+  const ListItem *item_a = a;
+  const ListItem *item_b = b;
+
+  return (item_a->entry->offset > item_b->entry->offset) -
+         (item_a->entry->offset < item_b->entry->offset);
+}
+
+/**
+ * fp_print_store_list:
+ * @store: A #FpPrintStore
+ * @driver: The driver of the prints
+ * @device_id: The device ID of the prints
+ *
+ * Loads all prints stored for the given device, e.g. to identify against
+ * them. Prints that cannot be loaded are skipped.
+ *
+ * Returns: (transfer full) (element-type FpPrint): The prints
+ */
+GPtrArray *
+fp_print_store_list (FpPrintStore *store,
+                     const gchar  *driver,
+                     const gchar  *device_id)
+{
+  g_autofree char *prefix = NULL;
+  g_autoptr(GArray) items = NULL;
+  GPtrArray *prints;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), NULL);
+
+  prefix = g_strdup_printf ("%s/%s/", driver, device_id);
+  items = g_array_new (FALSE, FALSE, sizeof (ListItem));
+
+  g_hash_table_iter_init (&iter, store->index);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      ListItem item = { key, value };
+
+      if (g_str_has_prefix (key, prefix))
+        g_array_append_val (items, item);
+    }
+
+  /* Read the file sequentially */
+  g_array_sort (items, list_item_cmp);
+
+  prints = g_ptr_array_new_full (items->len, g_object_unref);
+  for (i = 0; i < items->len; i++)
+    {
+      ListItem *item = &g_array_index (items, ListItem, i);
+      g_autoptr(GError) error = NULL;
+      FpPrint *print;
+
+      print = store_load_entry (store, item->key, item->entry, &error);
+      if (!print)
+        {
+          fp_warn ("Error loading print %s: %s", item->key, error->message);
+          continue;
+        }
+
+      g_ptr_array_add (prints, print);
+    }
+
+  return prints;
+}
+
+static gboolean
+sync_directory (const char *path,
+                GError    **error)
+{
+  g_autofree char *dir = g_path_get_dirname (path);
+  int fd = g_open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+  int r;
+
+  if (fd < 0)
+    return set_error_from_errno (error, errno, "Could not open", dir);
+
+  r = fsync (fd);
+  close (fd);
+
+  if (r < 0)
+    return set_error_from_errno (error, errno, "Could not sync", dir);
+
+  return TRUE;
+}
+
+/**
+ * fp_print_store_compact:
+ * @store: A #FpPrintStore
+ * @error: Return location for error
+ *
+ * Drops stale records by writing the live ones into a new file, which
+ * then atomically replaces the store. This also happens automatically
+ * once enough of the file is stale.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_store_compact (FpPrintStore *store,
+                        GError      **error)
+{
+  g_autofree char *tmp_path = NULL;
+  g_autoptr(GHashTable) index = NULL;
+  g_autoptr(GArray) items = NULL;
+  const guint8 *contents;
+  GHashTableIter iter;
+  gpointer key, value;
+  goffset offset = 0;
+  int fd;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_PRINT_STORE (store), FALSE);
+
+  tmp_path = g_strconcat (store->path, ".tmp", NULL);
+  items = g_array_new (FALSE, FALSE, sizeof (ListItem));
+
+  contents = store_map (store, error);
+  if (store->size > 0 && !contents)
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, store->index);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      ListItem item = { key, value };
+      g_array_append_val (items, item);
+    }
+  g_array_sort (items, list_item_cmp);
+
+  fd = g_open (tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return set_error_from_errno (error, errno, "Could not open", tmp_path);
+
+  index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  for (i = 0; i < items->len; i++)
+    {
+      ListItem *item = &g_array_index (items, ListItem, i);
+      guint32 key_len = strlen (item->key);
+      RecordEntry entry = *item->entry;
+
+      /* Records keep their alignment if the offset is a multiple of 8, so
+       * the data can simply be copied. */
+      entry.offset = offset;
+      entry.data_offset = record_data_offset (offset, key_len);
+
+      if (!write_all (fd, contents + item->entry->offset, entry.size, offset))
+        {
+          int errsv = errno;
+
+          close (fd);
+          g_unlink (tmp_path);
+          return set_error_from_errno (error, errsv, "Could not write to", tmp_path);
+        }
+
+      g_hash_table_insert (index, g_strdup (item->key),
+                           g_memdup2 (&entry, sizeof (entry)));
+      offset += entry.size;
+    }
+
+  if (fdatasync (fd) < 0 || g_rename (tmp_path, store->path) < 0)
+    {
+      int errsv = errno;
+
+      close (fd);
+      g_unlink (tmp_path);
+      return set_error_from_errno (error, errsv, "Could not replace", store->path);
+    }
+
+  /* The old file may still be mapped by prints that were loaded from it */
+  close (store->fd);
+  g_clear_pointer (&store->mapped, g_mapped_file_unref);
+  store->fd = fd;
+  store->size = offset;
+  store->dead_bytes = 0;
+  g_clear_pointer (&store->index, g_hash_table_unref);
+  store->index = g_steal_pointer (&index);
+
+  return sync_directory (store->path, error);
+}
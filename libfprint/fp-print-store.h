@@ -0,0 +1,59 @@
+/*
+ * FpPrintStore - Indexed on-disk print storage
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include "fp-print.h"
+
+G_BEGIN_DECLS
+
+#define FP_TYPE_PRINT_STORE (fp_print_store_get_type ())
+G_DECLARE_FINAL_TYPE (FpPrintStore, fp_print_store, FP, PRINT_STORE, GObject)
+
+FpPrintStore *fp_print_store_new (const gchar *path,
+                                  GError     **error);
+
+gboolean      fp_print_store_save (FpPrintStore *store,
+                                   FpPrint      *print,
+                                   FpFinger      finger,
+                                   const gchar  *username,
+                                   GError      **error);
+gboolean      fp_print_store_contains (FpPrintStore *store,
+                                       const gchar  *driver,
+                                       const gchar  *device_id,
+                                       FpFinger      finger,
+                                       const gchar  *username);
+FpPrint      *fp_print_store_load (FpPrintStore *store,
+                                   const gchar  *driver,
+                                   const gchar  *device_id,
+                                   FpFinger      finger,
+                                   const gchar  *username,
+                                   GError      **error);
+gboolean      fp_print_store_delete (FpPrintStore *store,
+                                     const gchar  *driver,
+                                     const gchar  *device_id,
+                                     FpFinger      finger,
+                                     const gchar  *username,
+                                     GError      **error);
+GPtrArray    *fp_print_store_list (FpPrintStore *store,
+                                   const gchar  *driver,
+                                   const gchar  *device_id);
+gboolean      fp_print_store_compact (FpPrintStore *store,
+                                      GError      **error);
+
+G_END_DECLS
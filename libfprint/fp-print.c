@@ -24,6 +24,7 @@
 #include "fp-print-private.h"
 #include "fpi-compat.h"
 #include "fpi-log.h"
+#include "fpi-worker.h"
 
 /**
  * SECTION: fp-print
@@ -43,6 +44,7 @@
  */
 
 G_DEFINE_TYPE (FpPrint, fp_print, G_TYPE_INITIALLY_UNOWNED)
+G_DEFINE_BOXED_TYPE (FpMatchInfo, fp_match_info, fp_match_info_copy, fp_match_info_free)
 
 enum {
   PROP_0,
@@ -58,6 +60,7 @@ enum {
   PROP_USERNAME,
   PROP_DESCRIPTION,
   PROP_ENROLL_DATE,
+  PROP_MATCH_INFO,
 
   /* Private property*/
   PROP_FPI_TYPE,
@@ -81,6 +84,8 @@ fp_print_finalize (GObject *object)
   g_clear_pointer (&self->enroll_date, g_date_free);
   g_clear_pointer (&self->data, g_variant_unref);
   g_clear_pointer (&self->prints, g_ptr_array_unref);
+  g_clear_pointer (&self->sub_print_hits, g_free);
+  g_clear_pointer (&self->match_info, fp_match_info_free);
 
   G_OBJECT_CLASS (fp_print_parent_class)->finalize (object);
 }
@@ -127,6 +132,10 @@ fp_print_get_property (GObject    *object,
       g_value_set_boxed (value, self->enroll_date);
       break;
 
+    case PROP_MATCH_INFO:
+      g_value_set_boxed (value, self->match_info);
+      break;
+
     case PROP_FPI_TYPE:
       g_value_set_enum (value, self->type);
       break;
@@ -160,10 +169,12 @@ fp_print_set_property (GObject      *object,
 
     case PROP_DRIVER:
       self->driver = g_value_dup_string (value);
+      self->identity_hash = 0;
       break;
 
     case PROP_DEVICE_ID:
       self->device_id = g_value_dup_string (value);
+      self->identity_hash = 0;
       break;
 
     case PROP_DEVICE_STORED:
@@ -192,11 +203,13 @@ fp_print_set_property (GObject      *object,
     case PROP_FPI_DATA:
       g_clear_pointer (&self->data, g_variant_unref);
       self->data = g_value_dup_variant (value);
+      self->identity_hash = 0;
       break;
 
     case PROP_FPI_PRINTS:
       g_clear_pointer (&self->prints, g_ptr_array_unref);
       self->prints = g_value_get_pointer (value);
+      self->identity_hash = 0;
       break;
 
     default:
@@ -280,6 +293,13 @@ fp_print_class_init (FpPrintClass *klass)
                         G_TYPE_DATE,
                         G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
 
+  properties[PROP_MATCH_INFO] =
+    g_param_spec_boxed ("match-info",
+                        "Match Info",
+                        "Scores and timings of matching a scanned print, only valid for prints reported by verify or identify operations",
+                        FP_TYPE_MATCH_INFO,
+                        G_PARAM_STATIC_STRINGS | G_PARAM_READABLE);
+
   /**
    * FpPrint::fpi-type: (skip)
    *
@@ -402,6 +422,53 @@ fp_print_get_device_stored (FpPrint *print)
   return print->device_stored;
 }
 
+/**
+ * fp_print_get_match_info:
+ * @print: A #FpPrint
+ *
+ * Returns the scores and timings of matching a scanned print. This is
+ * only available for prints reported by a verify or identify operation
+ * of a device that matches on the host. It can e.g. be used to tune the
+ * score threshold or to monitor latencies.
+ *
+ * When identifying, the scores are those of the matching template. If no
+ * template matched, they are those of the closest template, i.e. the one
+ * with the highest score.
+ *
+ * Returns: (transfer none) (nullable): The #FpMatchInfo, or %NULL
+ */
+const FpMatchInfo *
+fp_print_get_match_info (FpPrint *print)
+{
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+
+  return print->match_info;
+}
+
+/**
+ * fp_match_info_copy:
+ * @info: A #FpMatchInfo
+ *
+ * Returns: (transfer full): A copy of @info
+ */
+FpMatchInfo *
+fp_match_info_copy (const FpMatchInfo *info)
+{
+  return g_memdup2 (info, sizeof (FpMatchInfo));
+}
+
+/**
+ * fp_match_info_free:
+ * @info: A #FpMatchInfo
+ *
+ * Frees a #FpMatchInfo.
+ */
+void
+fp_match_info_free (FpMatchInfo *info)
+{
+  g_free (info);
+}
+
 /**
  * fp_print_get_image:
  * @print: A #FpPrint
@@ -606,6 +673,10 @@ fp_print_equal (FpPrint *self, FpPrint *other)
   if (g_strcmp0 (self->device_id, other->device_id))
     return FALSE;
 
+  /* Cheap for repeated comparisons, e.g. when searching a gallery */
+  if (fpi_print_hash (self) != fpi_print_hash (other))
+    return FALSE;
+
   if (self->type == FPI_PRINT_RAW)
     {
       return g_variant_equal (self->data, other->data);
@@ -619,10 +690,34 @@ fp_print_equal (FpPrint *self, FpPrint *other)
 
       for (i = 0; i < self->prints->len; i++)
         {
-          struct xyt_struct *a = g_ptr_array_index (self->prints, i);
-          struct xyt_struct *b = g_ptr_array_index (other->prints, i);
+          FpiXyt *a = g_ptr_array_index (self->prints, i);
+          FpiXyt *b = g_ptr_array_index (other->prints, i);
+
+          if (a->nrows != b->nrows ||
+              memcmp (a, b, fpi_xyt_size (a)) != 0)
+            return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (self->type == FPI_PRINT_SIGFM)
+    {
+      guint i;
+
+      if (self->prints->len != other->prints->len)
+        return FALSE;
+
+      for (i = 0; i < self->prints->len; i++)
+        {
+          int len_a, len_b;
+          unsigned char *a = sigfm_serialize_binary (g_ptr_array_index (self->prints, i), &len_a);
+          unsigned char *b = sigfm_serialize_binary (g_ptr_array_index (other->prints, i), &len_b);
+          gboolean equal = len_a == len_b && memcmp (a, b, len_a) == 0;
 
-          if (memcmp (a, b, sizeof (struct xyt_struct)) != 0)
+          free (a);
+          free (b);
+
+          if (!equal)
             return FALSE;
         }
 
@@ -636,32 +731,59 @@ fp_print_equal (FpPrint *self, FpPrint *other)
 
 #define FPI_PRINT_VARIANT_TYPE G_VARIANT_TYPE ("(issbymsmsia{sv}v)")
 
-G_STATIC_ASSERT (sizeof (((struct xyt_struct *) NULL)->xcol[0]) == 4);
+static GVariant *
+xyt_column_to_variant (const gint16 *col,
+                       guint         nrows)
+{
+  gint32 values[MAX_BOZORTH_MINUTIAE];
+  guint i;
+
+  g_assert (nrows <= G_N_ELEMENTS (values));
 
-/**
- * fp_print_serialize:
- * @print: A #FpPrint
- * @data: (array length=length) (transfer full) (out): Return location for data pointer
- * @length: (transfer full) (out): Length of @data
- * @error: Return location for error
- *
- * Serialize a print definition for permanent storage. Note that this is
- * lossy in the sense that e.g. the image data is discarded.
- *
- * Returns: (type void): %TRUE on success
- */
-gboolean
-fp_print_serialize (FpPrint *print,
-                    guchar **data,
-                    gsize   *length,
-                    GError **error)
+  for (i = 0; i < nrows; i++)
+    values[i] = col[i];
+
+  return g_variant_new_fixed_array (G_VARIANT_TYPE_INT32, values, nrows,
+                                    sizeof (values[0]));
+}
+
+static gboolean
+xyt_column_from_variant (GVariant *value,
+                         gint16   *col,
+                         guint     nrows)
 {
-  g_autoptr(GVariant) result = NULL;
-  GVariantBuilder builder = G_VARIANT_BUILDER_INIT (FPI_PRINT_VARIANT_TYPE);
+  const gint32 *values;
   gsize len;
+  guint i;
 
-  g_assert (data);
-  g_assert (length);
+  values = g_variant_get_fixed_array (value, &len, sizeof (gint32));
+  if (len != nrows)
+    return FALSE;
+
+  for (i = 0; i < nrows; i++)
+    {
+      if (values[i] < G_MININT16 || values[i] > G_MAXINT16)
+        return FALSE;
+      col[i] = values[i];
+    }
+
+  return TRUE;
+}
+
+/* Header prepended to a single serialized print */
+#define FPI_PRINT_HEADER "FP3"
+#define FPI_PRINT_HEADER_LEN 3
+
+/* Header prepended to a serialized gallery; it is padded to 8 bytes so that
+ * the variant data stays aligned if the buffer itself is (e.g. mmap'ed). */
+#define FPI_PRINT_GALLERY_HEADER "FP3G\0\0\0\0"
+#define FPI_PRINT_GALLERY_HEADER_LEN 8
+#define FPI_PRINT_GALLERY_VARIANT_TYPE G_VARIANT_TYPE ("a(issbymsmsia{sv}v)")
+
+static GVariant *
+fp_print_to_variant (FpPrint *print)
+{
+  GVariantBuilder builder = G_VARIANT_BUILDER_INIT (FPI_PRINT_VARIANT_TYPE);
 
   g_variant_builder_add (&builder, "i", print->type);
   g_variant_builder_add (&builder, "s", print->driver);
@@ -681,8 +803,6 @@ fp_print_serialize (FpPrint *print,
   g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
   g_variant_builder_close (&builder);
 
-  GPtrArray * to_free = NULL;
-
   /* Insert NBIS print data for type NBIS, otherwise the GVariant directly */
   if (print->type == FPI_PRINT_NBIS)
     {
@@ -692,25 +812,16 @@ fp_print_serialize (FpPrint *print,
       g_variant_builder_open (&nested, G_VARIANT_TYPE ("a(aiaiai)"));
       for (i = 0; i < print->prints->len; i++)
         {
-          struct xyt_struct *xyt = g_ptr_array_index (print->prints, i);
+          FpiXyt *xyt = g_ptr_array_index (print->prints, i);
 
+          /* The storage format uses 32bit columns */
           g_variant_builder_open (&nested, G_VARIANT_TYPE ("(aiaiai)"));
-
           g_variant_builder_add_value (&nested,
-                                       g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                  xyt->xcol,
-                                                                  xyt->nrows,
-                                                                  sizeof (xyt->xcol[0])));
+                                       xyt_column_to_variant (FPI_XYT_X (xyt), xyt->nrows));
           g_variant_builder_add_value (&nested,
-                                       g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                  xyt->ycol,
-                                                                  xyt->nrows,
-                                                                  sizeof (xyt->ycol[0])));
+                                       xyt_column_to_variant (FPI_XYT_Y (xyt), xyt->nrows));
           g_variant_builder_add_value (&nested,
-                                       g_variant_new_fixed_array (G_VARIANT_TYPE_INT32,
-                                                                  xyt->thetacol,
-                                                                  xyt->nrows,
-                                                                  sizeof (xyt->thetacol[0])));
+                                       xyt_column_to_variant (FPI_XYT_THETA (xyt), xyt->nrows));
           g_variant_builder_close (&nested);
         }
 
@@ -719,8 +830,6 @@ fp_print_serialize (FpPrint *print,
     }
   else if (print->type == FPI_PRINT_SIGFM)
     {
-      to_free = g_ptr_array_new ();
-      g_ptr_array_set_free_func (to_free, free);
       GVariantBuilder nested =
         G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("(a(ay))"));
       g_variant_builder_open (&nested, G_VARIANT_TYPE ("a(ay)"));
@@ -730,10 +839,11 @@ fp_print_serialize (FpPrint *print,
           SigfmImgInfo * info = g_ptr_array_index (print->prints, i);
           int slen;
           unsigned char * serialized = sigfm_serialize_binary (info, &slen);
+          /* g_variant_new_fixed_array copies the data */
           g_variant_builder_add_value (
             &nested, g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
                                                 serialized, slen, 1));
-          g_ptr_array_add (to_free, serialized);
+          free (serialized);
           g_variant_builder_close (&nested);
         }
       g_variant_builder_close (&nested);
@@ -744,7 +854,18 @@ fp_print_serialize (FpPrint *print,
       g_variant_builder_add (&builder, "v", g_variant_new_variant (print->data));
     }
 
-  result = g_variant_builder_end (&builder);
+  return g_variant_builder_end (&builder);
+}
+
+static void
+fp_print_store_variant (GVariant    *value,
+                        const gchar *header,
+                        gsize        header_len,
+                        guchar     **data,
+                        gsize       *length)
+{
+  g_autoptr(GVariant) result = g_variant_ref_sink (value);
+  gsize len;
 
   if (G_BYTE_ORDER == G_BIG_ENDIAN)
     {
@@ -754,46 +875,92 @@ fp_print_serialize (FpPrint *print,
       result = tmp;
     }
 
-  len = g_variant_get_size (result);
-  /* Add 3 bytes of header */
-  len += 3;
+  len = g_variant_get_size (result) + header_len;
 
   *data = g_malloc (len);
   *length = len;
 
-  (*data)[0] = (guchar) 'F';
-  (*data)[1] = (guchar) 'P';
-  (*data)[2] = (guchar) '3';
+  memcpy (*data, header, header_len);
+  g_variant_store (result, (*data) + header_len);
+}
 
-  g_variant_get_data (result);
-  g_variant_store (result, (*data) + 3);
-  if (to_free != NULL)
-    g_ptr_array_free (to_free, TRUE);
+/**
+ * fp_print_serialize:
+ * @print: A #FpPrint
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for error
+ *
+ * Serialize a print definition for permanent storage. Note that this is
+ * lossy in the sense that e.g. the image data is discarded.
+ *
+ * Returns: (type void): %TRUE on success
+ */
+gboolean
+fp_print_serialize (FpPrint *print,
+                    guchar **data,
+                    gsize   *length,
+                    GError **error)
+{
+  g_assert (data);
+  g_assert (length);
+
+  fp_print_store_variant (fp_print_to_variant (print),
+                          FPI_PRINT_HEADER, FPI_PRINT_HEADER_LEN,
+                          data, length);
 
   return TRUE;
 }
 
 /**
- * fp_print_deserialize:
- * @data: (array length=length): The binary data
- * @length: Length of the data
+ * fp_print_serialize_many:
+ * @prints: (element-type FpPrint): The prints to serialize
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
  * @error: Return location for error
  *
- * Deserialize a print definition from permanent storage.
+ * Serialize a whole gallery of prints into a single blob that can be
+ * loaded again in one pass using fp_print_deserialize_many(). The same
+ * restrictions as for fp_print_serialize() apply.
  *
- * Returns: (transfer full): A newly created #FpPrint on success
+ * Returns: (type void): %TRUE on success
  */
-FpPrint *
-fp_print_deserialize (const guchar *data,
-                      gsize         length,
-                      GError      **error)
+gboolean
+fp_print_serialize_many (GPtrArray *prints,
+                         guchar   **data,
+                         gsize     *length,
+                         GError   **error)
+{
+  GVariantBuilder builder = G_VARIANT_BUILDER_INIT (FPI_PRINT_GALLERY_VARIANT_TYPE);
+  guint i;
+
+  g_assert (prints);
+  g_assert (data);
+  g_assert (length);
+
+  for (i = 0; i < prints->len; i++)
+    {
+      FpPrint *print = g_ptr_array_index (prints, i);
+
+      g_return_val_if_fail (FP_IS_PRINT (print), FALSE);
+
+      g_variant_builder_add_value (&builder, fp_print_to_variant (print));
+    }
+
+  fp_print_store_variant (g_variant_builder_end (&builder),
+                          FPI_PRINT_GALLERY_HEADER, FPI_PRINT_GALLERY_HEADER_LEN,
+                          data, length);
+
+  return TRUE;
+}
+
+static FpPrint *
+fp_print_from_variant (GVariant *value,
+                       GError  **error)
 {
   g_autoptr(FpPrint) result = NULL;
-  g_autoptr(GVariant) raw_value = NULL;
-  g_autoptr(GVariant) value = NULL;
   g_autoptr(GVariant) print_data = NULL;
   g_autoptr(GDate) date = NULL;
-  guchar *aligned_data = NULL;
   guint8 finger_int8;
   FpFinger finger;
   g_autofree gchar *username = NULL;
@@ -804,34 +971,6 @@ fp_print_deserialize (const guchar *data,
   const gchar *device_id;
   gboolean device_stored;
 
-  g_assert (data);
-  g_assert (length > 3);
-
-  if (memcmp (data, "FP3", 3) != 0)
-    goto invalid_format;
-
-  /* NOTE:
-   * We make sure that we have no variant left over from the parsing at the end
-   * of this function (meaning we don't need to keep the data around.
-   */
-
-  /* To support GLIB < 2.60 we need to make sure that the memory is aligned correctly.
-   * We also need to copy the backing store for the raw data that we may keep for
-   * longer. */
-  aligned_data = g_malloc (length - 3);
-  memcpy (aligned_data, data + 3, length - 3);
-  raw_value = g_variant_new_from_data (FPI_PRINT_VARIANT_TYPE,
-                                       aligned_data, length - 3,
-                                       FALSE, g_free, aligned_data);
-
-  if (!raw_value)
-    goto invalid_format;
-
-  if (G_BYTE_ORDER == G_BIG_ENDIAN)
-    value = g_variant_byteswap (raw_value);
-  else
-    value = g_variant_get_normal_form (raw_value);
-
   g_variant_get (value,
                  "(i&s&sbymsmsi@a{sv}v)",
                  &type,
@@ -862,38 +1001,28 @@ fp_print_deserialize (const guchar *data,
       fpi_print_set_type (result, FPI_PRINT_NBIS);
       for (i = 0; i < g_variant_n_children (prints); i++)
         {
-          g_autofree struct xyt_struct *xyt = NULL;
-          const gint32 *xcol, *ycol, *thetacol;
-          gsize xlen, ylen, thetalen;
+          g_autofree FpiXyt *xyt = NULL;
           g_autoptr(GVariant) xyt_data = NULL;
-          GVariant *child;
+          g_autoptr(GVariant) xcol = NULL;
+          g_autoptr(GVariant) ycol = NULL;
+          g_autoptr(GVariant) thetacol = NULL;
+          gsize nrows;
 
           xyt_data = g_variant_get_child_value (prints, i);
+          xcol = g_variant_get_child_value (xyt_data, 0);
+          ycol = g_variant_get_child_value (xyt_data, 1);
+          thetacol = g_variant_get_child_value (xyt_data, 2);
 
-          child = g_variant_get_child_value (xyt_data, 0);
-          xcol = g_variant_get_fixed_array (child, &xlen, sizeof (gint32));
-          g_variant_unref (child);
-
-          child = g_variant_get_child_value (xyt_data, 1);
-          ycol = g_variant_get_fixed_array (child, &ylen, sizeof (gint32));
-          g_variant_unref (child);
-
-          child = g_variant_get_child_value (xyt_data, 2);
-          thetacol = g_variant_get_fixed_array (child, &thetalen, sizeof (gint32));
-          g_variant_unref (child);
-
-          if (xlen != ylen || xlen != thetalen)
+          nrows = g_variant_n_children (xcol);
+          if (nrows > MAX_BOZORTH_MINUTIAE)
             goto invalid_format;
 
-          if (xlen > G_N_ELEMENTS (xyt->xcol))
+          xyt = fpi_xyt_new (nrows);
+          if (!xyt_column_from_variant (xcol, FPI_XYT_X (xyt), nrows) ||
+              !xyt_column_from_variant (ycol, FPI_XYT_Y (xyt), nrows) ||
+              !xyt_column_from_variant (thetacol, FPI_XYT_THETA (xyt), nrows))
             goto invalid_format;
 
-          xyt = g_new0 (struct xyt_struct, 1);
-          xyt->nrows = xlen;
-          memcpy (xyt->xcol, xcol, sizeof (xcol[0]) * xlen);
-          memcpy (xyt->ycol, ycol, sizeof (xcol[0]) * xlen);
-          memcpy (xyt->thetacol, thetacol, sizeof (xcol[0]) * xlen);
-
           g_ptr_array_add (result->prints, g_steal_pointer (&xyt));
         }
     }
@@ -960,3 +1089,514 @@ invalid_format:
                "Data could not be parsed");
   return NULL;
 }
+
+/* Wraps @bytes, skipping the first @offset bytes, as a variant of @type in
+ * little endian normal form. The data is only copied if it is not aligned,
+ * needs to be byteswapped or (unless @trusted) is not in normal form. */
+static GVariant *
+fp_print_variant_from_bytes (const GVariantType *type,
+                             GBytes             *bytes,
+                             gsize               offset,
+                             gboolean            trusted)
+{
+  g_autoptr(GBytes) payload = NULL;
+  g_autoptr(GVariant) raw_value = NULL;
+  const guchar *data;
+  gsize length;
+
+  data = g_bytes_get_data (bytes, &length);
+  g_assert (length >= offset);
+
+  /* GLib < 2.60 does not cope with unaligned data, and we never want to
+   * hit the slow unaligned paths. g_malloc'ed memory is always aligned. */
+  if (GPOINTER_TO_SIZE (data + offset) % 8 == 0)
+    payload = g_bytes_new_from_bytes (bytes, offset, length - offset);
+  else
+    payload = g_bytes_new (data + offset, length - offset);
+
+  raw_value = g_variant_ref_sink (g_variant_new_from_bytes (type, payload, trusted));
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    return g_variant_byteswap (raw_value);
+
+  if (trusted || g_variant_is_normal_form (raw_value))
+    return g_steal_pointer (&raw_value);
+
+  return g_variant_get_normal_form (raw_value);
+}
+
+/**
+ * fp_print_deserialize:
+ * @data: (array length=length): The binary data
+ * @length: Length of the data
+ * @error: Return location for error
+ *
+ * Deserialize a print definition from permanent storage.
+ *
+ * Returns: (transfer full): A newly created #FpPrint on success
+ */
+FpPrint *
+fp_print_deserialize (const guchar *data,
+                      gsize         length,
+                      GError      **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) value = NULL;
+
+  g_assert (data);
+  g_assert (length > FPI_PRINT_HEADER_LEN);
+
+  if (memcmp (data, FPI_PRINT_HEADER, FPI_PRINT_HEADER_LEN) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Data could not be parsed");
+      return NULL;
+    }
+
+  /* We need to copy the backing store for the raw data that we may keep for
+   * longer, this also takes care of the alignment. */
+  bytes = g_bytes_new (data + FPI_PRINT_HEADER_LEN, length - FPI_PRINT_HEADER_LEN);
+  value = fp_print_variant_from_bytes (FPI_PRINT_VARIANT_TYPE, bytes, 0, FALSE);
+
+  return fp_print_from_variant (value, error);
+}
+
+/**
+ * fp_print_deserialize_bytes:
+ * @bytes: The data created by fp_print_serialize()
+ * @trusted: Whether @bytes is known to be well formed
+ * @error: Return location for error
+ *
+ * Deserialize a print definition from a #GBytes. Unlike
+ * fp_print_deserialize(), the data is used without copying it if the
+ * print data following the header happens to be 8 byte aligned; the
+ * returned print may then keep a reference to @bytes.
+ *
+ * If @trusted is %TRUE, the data is assumed to be in normal form (e.g.
+ * because it was written by fp_print_serialize() and stored in a safe
+ * location) and it is not validated. Never pass %TRUE for data that could
+ * have been modified by someone else.
+ *
+ * Returns: (transfer full): A newly created #FpPrint on success
+ */
+FpPrint *
+fp_print_deserialize_bytes (GBytes   *bytes,
+                            gboolean  trusted,
+                            GError  **error)
+{
+  g_autoptr(GVariant) value = NULL;
+  const guchar *data;
+  gsize length;
+
+  g_return_val_if_fail (bytes != NULL, NULL);
+
+  data = g_bytes_get_data (bytes, &length);
+  if (length <= FPI_PRINT_HEADER_LEN ||
+      memcmp (data, FPI_PRINT_HEADER, FPI_PRINT_HEADER_LEN) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Data could not be parsed");
+      return NULL;
+    }
+
+  value = fp_print_variant_from_bytes (FPI_PRINT_VARIANT_TYPE, bytes,
+                                       FPI_PRINT_HEADER_LEN, trusted);
+
+  return fp_print_from_variant (value, error);
+}
+
+static GPtrArray *
+deserialize_many (GBytes       *bytes,
+                  gboolean      trusted,
+                  GCancellable *cancellable,
+                  GError      **error)
+{
+  g_autoptr(GPtrArray) prints = NULL;
+  g_autoptr(GVariant) value = NULL;
+  GVariantIter iter;
+  GVariant *child;
+  const guchar *data;
+  gsize length;
+
+  data = g_bytes_get_data (bytes, &length);
+  if (length < FPI_PRINT_GALLERY_HEADER_LEN ||
+      memcmp (data, FPI_PRINT_GALLERY_HEADER, FPI_PRINT_GALLERY_HEADER_LEN) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Data could not be parsed");
+      return NULL;
+    }
+
+  value = fp_print_variant_from_bytes (FPI_PRINT_GALLERY_VARIANT_TYPE, bytes,
+                                       FPI_PRINT_GALLERY_HEADER_LEN, trusted);
+
+  prints = g_ptr_array_new_full (g_variant_n_children (value), g_object_unref);
+
+  g_variant_iter_init (&iter, value);
+  while ((child = g_variant_iter_next_value (&iter)))
+    {
+      FpPrint *print;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          g_variant_unref (child);
+          return NULL;
+        }
+
+      print = fp_print_from_variant (child, error);
+
+      g_variant_unref (child);
+      if (!print)
+        return NULL;
+
+      g_ptr_array_add (prints, print);
+    }
+
+  return g_steal_pointer (&prints);
+}
+
+/**
+ * fp_print_deserialize_many:
+ * @bytes: The data created by fp_print_serialize_many()
+ * @trusted: Whether @bytes is known to be in normal form
+ * @error: Return location for error
+ *
+ * Deserialize a whole gallery of prints in one pass. See
+ * fp_print_deserialize_bytes() for the meaning of @trusted. The header is
+ * padded so that the data is used without copying it if @bytes itself is
+ * 8 byte aligned, which is the case when mapping a file using
+ * g_mapped_file_get_bytes().
+ *
+ * Returns: (transfer full) (element-type FpPrint): The deserialized prints,
+ *   or %NULL if any of them could not be parsed
+ */
+GPtrArray *
+fp_print_deserialize_many (GBytes   *bytes,
+                           gboolean  trusted,
+                           GError  **error)
+{
+  g_return_val_if_fail (bytes != NULL, NULL);
+
+  return deserialize_many (bytes, trusted, NULL, error);
+}
+
+static void
+serialize_thread_func (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  GError *error = NULL;
+  guchar *data;
+  gsize length;
+  gboolean res;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  if (task_data)
+    res = fp_print_serialize_many (task_data, &data, &length, &error);
+  else
+    res = fp_print_serialize (source_object, &data, &length, &error);
+
+  if (!res)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_task_return_pointer (task, g_bytes_new_take (data, length),
+                         (GDestroyNotify) g_bytes_unref);
+}
+
+static gboolean
+serialize_finish (GAsyncResult *result,
+                  guchar      **data,
+                  gsize        *length,
+                  GError      **error)
+{
+  GBytes *bytes;
+
+  bytes = g_task_propagate_pointer (G_TASK (result), error);
+  if (!bytes)
+    return FALSE;
+
+  *data = g_bytes_unref_to_data (bytes, length);
+
+  return TRUE;
+}
+
+/**
+ * fp_print_serialize_async:
+ * @print: A #FpPrint
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Serializes @print like fp_print_serialize() but in a worker thread, so
+ * that the main loop is not blocked. @print must not be modified until
+ * the operation has finished.
+ */
+void
+fp_print_serialize_async (FpPrint            *print,
+                          GCancellable       *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer            user_data)
+{
+  g_autoptr(FpiWorker) worker = fpi_worker_get_default ();
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (FP_IS_PRINT (print));
+
+  task = g_task_new (print, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fp_print_serialize_async);
+  fpi_worker_run_task (worker, task, serialize_thread_func,
+                       FPI_WORKER_PRIORITY_LOW, NULL);
+}
+
+/**
+ * fp_print_serialize_finish:
+ * @print: A #FpPrint
+ * @result: A #GAsyncResult
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finishes an operation started with fp_print_serialize_async().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_serialize_finish (FpPrint      *print,
+                           GAsyncResult *result,
+                           guchar      **data,
+                           gsize        *length,
+                           GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, print), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        fp_print_serialize_async, FALSE);
+  g_return_val_if_fail (data != NULL && length != NULL, FALSE);
+
+  return serialize_finish (result, data, length, error);
+}
+
+/**
+ * fp_print_serialize_many_async:
+ * @prints: (element-type FpPrint): The prints to serialize
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Serializes a gallery like fp_print_serialize_many() but in a worker
+ * thread. The prints must not be modified until the operation has
+ * finished; @prints itself may be changed.
+ */
+void
+fp_print_serialize_many_async (GPtrArray          *prints,
+                               GCancellable       *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer            user_data)
+{
+  g_autoptr(FpiWorker) worker = fpi_worker_get_default ();
+  g_autoptr(GTask) task = NULL;
+  GPtrArray *copy;
+  guint i;
+
+  g_return_if_fail (prints != NULL);
+
+  copy = g_ptr_array_new_full (prints->len, g_object_unref);
+  for (i = 0; i < prints->len; i++)
+    g_ptr_array_add (copy, g_object_ref (g_ptr_array_index (prints, i)));
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fp_print_serialize_many_async);
+  g_task_set_task_data (task, copy, (GDestroyNotify) g_ptr_array_unref);
+  fpi_worker_run_task (worker, task, serialize_thread_func,
+                       FPI_WORKER_PRIORITY_LOW, NULL);
+}
+
+/**
+ * fp_print_serialize_many_finish:
+ * @result: A #GAsyncResult
+ * @data: (array length=length) (transfer full) (out): Return location for data pointer
+ * @length: (transfer full) (out): Length of @data
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finishes an operation started with fp_print_serialize_many_async().
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+fp_print_serialize_many_finish (GAsyncResult *result,
+                                guchar      **data,
+                                gsize        *length,
+                                GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        fp_print_serialize_many_async, FALSE);
+  g_return_val_if_fail (data != NULL && length != NULL, FALSE);
+
+  return serialize_finish (result, data, length, error);
+}
+
+typedef struct
+{
+  GBytes  *bytes;
+  gboolean trusted;
+  gboolean many;
+} DeserializeData;
+
+static void
+deserialize_data_free (DeserializeData *data)
+{
+  g_bytes_unref (data->bytes);
+  g_free (data);
+}
+
+static void
+deserialize_thread_func (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  DeserializeData *data = task_data;
+  GError *error = NULL;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  if (data->many)
+    {
+      GPtrArray *prints;
+
+      prints = deserialize_many (data->bytes, data->trusted, cancellable, &error);
+      if (prints)
+        g_task_return_pointer (task, prints, (GDestroyNotify) g_ptr_array_unref);
+      else
+        g_task_return_error (task, error);
+    }
+  else
+    {
+      FpPrint *print;
+
+      print = fp_print_deserialize_bytes (data->bytes, data->trusted, &error);
+      if (print)
+        g_task_return_pointer (task, print, g_object_unref);
+      else
+        g_task_return_error (task, error);
+    }
+}
+
+static void
+deserialize_async (GBytes             *bytes,
+                   gboolean            trusted,
+                   gboolean            many,
+                   gpointer            source_tag,
+                   GCancellable       *cancellable,
+                   GAsyncReadyCallback callback,
+                   gpointer            user_data)
+{
+  g_autoptr(FpiWorker) worker = fpi_worker_get_default ();
+  g_autoptr(GTask) task = NULL;
+  DeserializeData *data = g_new0 (DeserializeData, 1);
+
+  data->bytes = g_bytes_ref (bytes);
+  data->trusted = trusted;
+  data->many = many;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+  g_task_set_task_data (task, data, (GDestroyNotify) deserialize_data_free);
+  fpi_worker_run_task (worker, task, deserialize_thread_func,
+                       FPI_WORKER_PRIORITY_LOW, NULL);
+}
+
+/**
+ * fp_print_deserialize_async:
+ * @bytes: The data created by fp_print_serialize()
+ * @trusted: Whether @bytes is known to be well formed
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Deserializes a print like fp_print_deserialize_bytes() but in a worker
+ * thread, so that the main loop is not blocked.
+ */
+void
+fp_print_deserialize_async (GBytes             *bytes,
+                            gboolean            trusted,
+                            GCancellable       *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer            user_data)
+{
+  g_return_if_fail (bytes != NULL);
+
+  deserialize_async (bytes, trusted, FALSE, fp_print_deserialize_async,
+                     cancellable, callback, user_data);
+}
+
+/**
+ * fp_print_deserialize_finish:
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finishes an operation started with fp_print_deserialize_async().
+ *
+ * Returns: (transfer full): A newly created #FpPrint on success
+ */
+FpPrint *
+fp_print_deserialize_finish (GAsyncResult *result,
+                             GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        fp_print_deserialize_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * fp_print_deserialize_many_async:
+ * @bytes: The data created by fp_print_serialize_many()
+ * @trusted: Whether @bytes is known to be well formed
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Deserializes a gallery like fp_print_deserialize_many() but in a worker
+ * thread, so that the main loop is not blocked while loading it.
+ */
+void
+fp_print_deserialize_many_async (GBytes             *bytes,
+                                 gboolean            trusted,
+                                 GCancellable       *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer            user_data)
+{
+  g_return_if_fail (bytes != NULL);
+
+  deserialize_async (bytes, trusted, TRUE, fp_print_deserialize_many_async,
+                     cancellable, callback, user_data);
+}
+
+/**
+ * fp_print_deserialize_many_finish:
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finishes an operation started with fp_print_deserialize_many_async().
+ *
+ * Returns: (transfer full) (element-type FpPrint): The deserialized prints
+ */
+GPtrArray *
+fp_print_deserialize_many_finish (GAsyncResult *result,
+                                  GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        fp_print_deserialize_many_async, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -33,6 +33,43 @@ G_DECLARE_FINAL_TYPE (FpPrint, fp_print, FP, PRINT, GInitiallyUnowned)
 
 #include "fp-device.h"
 
+#define FP_TYPE_MATCH_INFO (fp_match_info_get_type ())
+
+/**
+ * FpMatchInfo:
+ * @score: The best score the matching algorithm reported, for identify
+ *   that of the matching or otherwise the closest template
+ * @score_threshold: The score that is needed for a match
+ * @sub_print: The index of the sub-print of the (matching or closest)
+ *   enrolled print that gave @score, or -1 if unknown
+ * @capture_time: Time in microseconds from detecting the finger until the
+ *   image was captured
+ * @extraction_time: Time in microseconds from capturing the image until its
+ *   features were extracted, including the time waiting for a thread
+ * @match_time: Time in microseconds spent matching against the enrolled
+ *   print(s)
+ *
+ * Details on how a scanned print was matched, see fp_print_get_match_info().
+ * The scores are only comparable between devices using the same matching
+ * algorithm.
+ */
+typedef struct
+{
+  gint   score;
+  gint   score_threshold;
+  gint   sub_print;
+
+  gint64 capture_time;
+  gint64 extraction_time;
+  gint64 match_time;
+} FpMatchInfo;
+
+GType        fp_match_info_get_type (void) G_GNUC_CONST;
+FpMatchInfo *fp_match_info_copy (const FpMatchInfo *info);
+void         fp_match_info_free (FpMatchInfo *info);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpMatchInfo, fp_match_info_free)
+
 /**
  * FpFinger:
  * @FP_FINGER_UNKNOWN: The finger is unknown
@@ -89,6 +126,7 @@ const gchar *fp_print_get_username (FpPrint *print);
 const gchar *fp_print_get_description (FpPrint *print);
 const GDate *fp_print_get_enroll_date (FpPrint *print);
 gboolean     fp_print_get_device_stored (FpPrint *print);
+const FpMatchInfo *fp_print_get_match_info (FpPrint *print);
 
 void         fp_print_set_finger (FpPrint *print,
                                   FpFinger finger);
@@ -113,4 +151,52 @@ FpPrint *fp_print_deserialize (const guchar *data,
                                gsize         length,
                                GError      **error);
 
+FpPrint *fp_print_deserialize_bytes (GBytes   *bytes,
+                                     gboolean  trusted,
+                                     GError  **error);
+
+gboolean fp_print_serialize_many (GPtrArray *prints,
+                                  guchar   **data,
+                                  gsize     *length,
+                                  GError   **error);
+
+GPtrArray *fp_print_deserialize_many (GBytes   *bytes,
+                                      gboolean  trusted,
+                                      GError  **error);
+
+void     fp_print_serialize_async (FpPrint            *print,
+                                   GCancellable       *cancellable,
+                                   GAsyncReadyCallback callback,
+                                   gpointer            user_data);
+gboolean fp_print_serialize_finish (FpPrint      *print,
+                                    GAsyncResult *result,
+                                    guchar      **data,
+                                    gsize        *length,
+                                    GError      **error);
+
+void     fp_print_serialize_many_async (GPtrArray          *prints,
+                                        GCancellable       *cancellable,
+                                        GAsyncReadyCallback callback,
+                                        gpointer            user_data);
+gboolean fp_print_serialize_many_finish (GAsyncResult *result,
+                                         guchar      **data,
+                                         gsize        *length,
+                                         GError      **error);
+
+void     fp_print_deserialize_async (GBytes             *bytes,
+                                     gboolean            trusted,
+                                     GCancellable       *cancellable,
+                                     GAsyncReadyCallback callback,
+                                     gpointer            user_data);
+FpPrint *fp_print_deserialize_finish (GAsyncResult *result,
+                                      GError      **error);
+
+void       fp_print_deserialize_many_async (GBytes             *bytes,
+                                            gboolean            trusted,
+                                            GCancellable       *cancellable,
+                                            GAsyncReadyCallback callback,
+                                            gpointer            user_data);
+GPtrArray *fp_print_deserialize_many_finish (GAsyncResult *result,
+                                             GError      **error);
+
 G_END_DECLS
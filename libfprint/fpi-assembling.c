@@ -23,6 +23,7 @@
 
 #include "fpi-log.h"
 #include "fpi-image.h"
+#include "fpi-trace.h"
 
 #include <string.h>
 
@@ -135,6 +136,7 @@ do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
 {
   GSList *l;
   GTimer *timer;
+  gint64 trace_start;
   guint num_frames = 1;
   struct fpi_frame *prev_stripe;
   unsigned int min_error;
@@ -145,6 +147,7 @@ do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
   unsigned long long total_error = 0;
 
   timer = g_timer_new ();
+  trace_start = fpi_trace_begin ();
 
   /* Skip the first frame */
   prev_stripe = stripes->data;
@@ -172,6 +175,7 @@ do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
       prev_stripe = cur_stripe;
     }
 
+  fpi_trace_end ("image", "movement estimation", trace_start);
   g_timer_stop (timer);
   fp_dbg ("calc delta completed in %f secs", g_timer_elapsed (timer, NULL));
   g_timer_destroy (timer);
@@ -26,6 +26,7 @@
 #include "fpi-log.h"
 
 #include "fp-device-private.h"
+#include "fpi-trace.h"
 
 /**
  * SECTION: fpi-device
@@ -315,6 +316,7 @@ typedef struct
 {
   GSource   source;
   FpDevice *device;
+  gboolean  persistent;
 } FpDeviceTimeoutSource;
 
 static void
@@ -323,6 +325,10 @@ timeout_finalize (GSource *source)
   FpDeviceTimeoutSource *timeout_source = (FpDeviceTimeoutSource *) source;
   FpDevicePrivate *priv;
 
+  /* Timers are owned by the caller and not tracked by the device */
+  if (timeout_source->persistent)
+    return;
+
   priv = fp_device_get_instance_private (timeout_source->device);
   priv->sources = g_slist_remove (priv->sources, source);
 }
@@ -333,9 +339,17 @@ timeout_dispatch (GSource *source, GSourceFunc gsource_func, gpointer user_data)
   FpDeviceTimeoutSource *timeout_source = (FpDeviceTimeoutSource *) source;
   FpTimeoutFunc callback = (FpTimeoutFunc) gsource_func;
 
+  if (!timeout_source->persistent)
+    {
+      callback (timeout_source->device, user_data);
+      return G_SOURCE_REMOVE;
+    }
+
+  /* Disarm first, the callback may re-arm the timer */
+  g_source_set_ready_time (source, -1);
   callback (timeout_source->device, user_data);
 
-  return G_SOURCE_REMOVE;
+  return G_SOURCE_CONTINUE;
 }
 
 static GSourceFuncs timeout_funcs = {
@@ -346,6 +360,39 @@ static GSourceFuncs timeout_funcs = {
   NULL, NULL
 };
 
+static FpDeviceTimeoutSource *
+device_timeout_source_new (FpDevice      *device,
+                           gboolean       persistent,
+                           FpTimeoutFunc  func,
+                           gpointer       user_data,
+                           GDestroyNotify destroy_notify)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeviceTimeoutSource *source;
+  GMainContext *context;
+
+  source = (FpDeviceTimeoutSource *) g_source_new (&timeout_funcs,
+                                                   sizeof (FpDeviceTimeoutSource));
+  source->device = device;
+  source->persistent = persistent;
+
+  if (priv->current_task)
+    context = g_task_get_context (priv->current_task);
+  else
+    context = g_main_context_get_thread_default ();
+
+  g_source_attach (&source->source, context);
+  g_source_set_callback (&source->source, (GSourceFunc) func, user_data, destroy_notify);
+
+  if (!persistent)
+    {
+      priv->sources = g_slist_prepend (priv->sources, source);
+      g_source_unref (&source->source);
+    }
+
+  return source;
+}
+
 /**
  * fpi_device_add_timeout:
  * @device: The #FpDevice
@@ -366,29 +413,66 @@ fpi_device_add_timeout (FpDevice      *device,
                         gpointer       user_data,
                         GDestroyNotify destroy_notify)
 {
-  FpDevicePrivate *priv = fp_device_get_instance_private (device);
   FpDeviceTimeoutSource *source;
-  GMainContext *context;
-
-  source = (FpDeviceTimeoutSource *) g_source_new (&timeout_funcs,
-                                                   sizeof (FpDeviceTimeoutSource));
-  source->device = device;
 
-  if (priv->current_task)
-    context = g_task_get_context (priv->current_task);
-  else
-    context = g_main_context_get_thread_default ();
-
-  g_source_attach (&source->source, context);
-  g_source_set_callback (&source->source, (GSourceFunc) func, user_data, destroy_notify);
+  source = device_timeout_source_new (device, FALSE, func, user_data, destroy_notify);
   g_source_set_ready_time (&source->source,
                            g_source_get_time (&source->source) + interval * (guint64) 1000);
-  priv->sources = g_slist_prepend (priv->sources, source);
-  g_source_unref (&source->source);
 
   return &source->source;
 }
 
+/**
+ * fpi_device_add_timer:
+ * @device: The #FpDevice
+ * @func: The #FpTimeoutFunc to call on timeout
+ * @user_data: (nullable): User data to pass to the callback
+ * @destroy_notify: (nullable): #GDestroyNotify for @user_data
+ *
+ * Register a timer that can be armed repeatedly. Unlike with
+ * fpi_device_add_timeout(), the returned source is initially disarmed and
+ * it is not destroyed after @func has been called. Use
+ * fpi_device_timer_arm() to schedule a call.
+ *
+ * The timer is not destroyed together with the device. Call
+ * g_source_destroy() and g_source_unref() once it is not needed anymore.
+ *
+ * Returns: (transfer full): A newly created and attached #GSource
+ */
+GSource *
+fpi_device_add_timer (FpDevice      *device,
+                      FpTimeoutFunc  func,
+                      gpointer       user_data,
+                      GDestroyNotify destroy_notify)
+{
+  FpDeviceTimeoutSource *source;
+
+  source = device_timeout_source_new (device, TRUE, func, user_data, destroy_notify);
+  g_source_set_ready_time (&source->source, -1);
+
+  return &source->source;
+}
+
+/**
+ * fpi_device_timer_arm:
+ * @timer: A #GSource returned by fpi_device_add_timer()
+ * @interval: The interval in milliseconds, or a negative value to disarm
+ *
+ * (Re-)schedules the call of the timer, replacing any pending one.
+ */
+void
+fpi_device_timer_arm (GSource *timer,
+                      gint     interval)
+{
+  g_return_if_fail (timer);
+
+  if (interval < 0)
+    g_source_set_ready_time (timer, -1);
+  else
+    g_source_set_ready_time (timer,
+                             g_source_get_time (timer) + interval * (guint64) 1000);
+}
+
 /**
  * fpi_device_get_usb_device:
  * @device: The #FpDevice
@@ -603,6 +687,9 @@ fpi_device_get_verify_data (FpDevice *device,
  * Note that @prints can be an empty array, in such case the device is expected
  * to report the scanned print matching the one in its internal storage, if any.
  *
+ * If the gallery is larger than #FpDeviceClass.identify_max_prints, then
+ * @prints only contains the chunk of the gallery that is currently tried.
+ *
  */
 void
 fpi_device_get_identify_data (FpDevice   *device,
@@ -621,6 +708,89 @@ fpi_device_get_identify_data (FpDevice   *device,
     *prints = data->gallery;
 }
 
+/* Replaces the gallery with the next chunk of the full gallery */
+gboolean
+fpi_match_data_next_chunk (FpMatchData *data, guint chunk_size)
+{
+  guint start = data->chunk_end;
+  guint i;
+
+  g_assert (data->full_gallery);
+
+  if (start >= data->full_gallery->len)
+    return FALSE;
+
+  data->chunk_end = MIN (start + chunk_size, data->full_gallery->len);
+
+  g_clear_pointer (&data->gallery_index, g_hash_table_unref);
+  g_clear_pointer (&data->gallery, g_ptr_array_unref);
+  data->gallery = g_ptr_array_new_full (data->chunk_end - start, g_object_unref);
+  for (i = start; i < data->chunk_end; i++)
+    g_ptr_array_add (data->gallery, g_object_ref (g_ptr_array_index (data->full_gallery, i)));
+
+  return TRUE;
+}
+
+/**
+ * fpi_device_find_identify_print:
+ * @device: The #FpDevice
+ * @print: The #FpPrint to look for, e.g. created from the device response
+ * @index: (out) (optional): Return location for the index in the gallery
+ *
+ * Looks up the print in the identify gallery that is equal to @print
+ * (see fp_print_equal()). The gallery is indexed by the print hashes on
+ * the first call, so further lookups take constant time.
+ *
+ * Returns: (transfer none) (nullable): The #FpPrint from the gallery, or
+ *   %NULL if there is none
+ */
+FpPrint *
+fpi_device_find_identify_print (FpDevice *device,
+                                FpPrint  *print,
+                                guint    *index)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpMatchData *data;
+  gpointer found;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+  g_return_val_if_fail (FP_IS_PRINT (print), NULL);
+  g_return_val_if_fail (priv->current_action == FPI_DEVICE_ACTION_IDENTIFY, NULL);
+
+  data = g_task_get_task_data (priv->current_task);
+  g_assert (data);
+
+  if (!data->gallery_index)
+    {
+      guint i;
+
+      data->gallery_index = g_hash_table_new ((GHashFunc) fpi_print_hash,
+                                              (GEqualFunc) fp_print_equal);
+
+      for (i = 0; i < data->gallery->len; i++)
+        {
+          FpPrint *p = g_ptr_array_index (data->gallery, i);
+          FpiPrintType type;
+
+          g_object_get (p, "fpi-type", &type, NULL);
+          if (type == FPI_PRINT_UNDEFINED)
+            continue;
+
+          /* Keep the first one if there are duplicates */
+          if (!g_hash_table_contains (data->gallery_index, p))
+            g_hash_table_insert (data->gallery_index, p, GUINT_TO_POINTER (i + 1));
+        }
+    }
+
+  if (!g_hash_table_lookup_extended (data->gallery_index, print, NULL, &found))
+    return NULL;
+
+  if (index)
+    *index = GPOINTER_TO_UINT (found) - 1;
+
+  return g_ptr_array_index (data->gallery, GPOINTER_TO_UINT (found) - 1);
+}
+
 /**
  * fpi_device_get_delete_data:
  * @device: The #FpDevice
@@ -1159,7 +1329,9 @@ fpi_device_open_complete (FpDevice *device, GError *error)
   g_return_if_fail (FP_IS_DEVICE (device));
   g_return_if_fail (priv->current_action == FPI_DEVICE_ACTION_OPEN);
 
-  g_debug ("Device reported open completion");
+  g_debug ("Device reported open completion after %.1f ms",
+           (g_get_monotonic_time () - priv->open_start_time) / 1000.0);
+  fpi_trace_async_end ("device", "open", device);
 
   clear_device_cancel_action (device);
   fpi_device_report_finger_status (device, FP_FINGER_STATUS_NONE);
@@ -1352,6 +1524,24 @@ fpi_device_verify_complete (FpDevice *device,
     }
 }
 
+static void
+identify_next_chunk_cb (FpDevice *device, gpointer user_data)
+{
+  FpDevicePrivate *priv = fp_device_get_instance_private (device);
+  FpDeviceClass *cls = FP_DEVICE_GET_CLASS (device);
+  FpMatchData *data = g_task_get_task_data (priv->current_task);
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (priv->current_cancellable, &error))
+    {
+      fpi_device_identify_complete (device, error);
+      return;
+    }
+
+  fpi_match_data_next_chunk (data, cls->identify_max_prints);
+  cls->identify (device);
+}
+
 /**
  * fpi_device_identify_complete:
  * @device: The #FpDevice
@@ -1380,6 +1570,19 @@ fpi_device_identify_complete (FpDevice *device,
 
   data = g_task_get_task_data (priv->current_task);
 
+  if (!error && data->chunk_missed)
+    {
+      data->chunk_missed = FALSE;
+      data->result_reported = FALSE;
+
+      /* Most drivers capture a new sample for the next chunk */
+      fpi_device_report_finger_status (device, FP_FINGER_STATUS_NEEDED);
+
+      /* Do not re-enter the driver */
+      fpi_device_add_timeout (device, 0, identify_next_chunk_cb, NULL, NULL);
+      return;
+    }
+
   clear_device_cancel_action (device);
   fpi_device_report_finger_status (device, FP_FINGER_STATUS_NONE);
 
@@ -2056,6 +2259,17 @@ fpi_device_identify_report (FpDevice *device,
 
   g_debug ("Device reported identify result");
 
+  /* Nothing to report yet if there are more chunks of the gallery */
+  if (!match && !error &&
+      data->full_gallery && data->chunk_end < data->full_gallery->len)
+    {
+      g_debug ("No match in prints %u to %u of the gallery",
+               data->chunk_end - data->gallery->len, data->chunk_end - 1);
+      g_clear_object (&print);
+      data->chunk_missed = TRUE;
+      return;
+    }
+
   if (error)
     {
       if (match != NULL)
@@ -86,6 +86,14 @@ struct _FpIdEntry
  *   after being mostly cold. Set to -1 if the device can be always-on.
  * @temp_cold_seconds: Assumed time in seconds for the device to be mostly cold
  *   after having been too hot to operate.
+ * @identify_max_prints: The maximum number of prints the device can identify
+ *   against in one operation, or 0 if there is no limit. Larger galleries are
+ *   split into chunks that are passed to @identify one after another until
+ *   one of them matches. Every chunk is a separate @identify call, so a
+ *   driver that captures a new sample for each call makes the user touch
+ *   the sensor once per chunk (e.g. twice for 300 prints on synaptics,
+ *   which is limited to 255). Between chunks the finger status is
+ *   reported as %FP_FINGER_STATUS_NEEDED.
  * @usb_discover: Class method to check whether a USB device is supported by
  *  the driver. Should return 0 if the device is unsupported and a positive
  *  score otherwise. The default score is 50 and the driver with the highest
@@ -157,6 +165,9 @@ struct _FpDeviceClass
   gint32 temp_hot_seconds;
   gint32 temp_cold_seconds;
 
+  /* Device limits */
+  guint identify_max_prints;
+
   /* Callbacks */
   gint (*usb_discover) (GUsbDevice *usb_device);
   void (*probe)    (FpDevice *device);
@@ -248,6 +259,9 @@ void fpi_device_get_verify_data (FpDevice *device,
                                  FpPrint **print);
 void fpi_device_get_identify_data (FpDevice   *device,
                                    GPtrArray **prints);
+FpPrint *fpi_device_find_identify_print (FpDevice *device,
+                                         FpPrint  *print,
+                                         guint    *index);
 void fpi_device_get_delete_data (FpDevice *device,
                                  FpPrint **print);
 GCancellable *fpi_device_get_cancellable (FpDevice *device);
@@ -259,6 +273,12 @@ GSource * fpi_device_add_timeout (FpDevice      *device,
                                   FpTimeoutFunc  func,
                                   gpointer       user_data,
                                   GDestroyNotify destroy_notify);
+GSource * fpi_device_add_timer (FpDevice      *device,
+                                FpTimeoutFunc  func,
+                                gpointer       user_data,
+                                GDestroyNotify destroy_notify);
+void fpi_device_timer_arm (GSource *timer,
+                           gint     interval);
 
 void fpi_device_set_nr_enroll_stages (FpDevice *device,
                                       gint      enroll_stages);
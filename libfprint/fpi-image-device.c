@@ -20,6 +20,8 @@
 #include "fpi-print.h"
 #define FP_COMPONENT "image_device"
 #include "fpi-log.h"
+#include "fpi-trace.h"
+#include "fpi-worker.h"
 
 #include "fp-image-device-private.h"
 #include "fp-image-device.h"
@@ -45,6 +47,29 @@ fp_image_device_get_instance_private (FpImageDevice *self)
 static void fp_image_device_change_state (FpImageDevice      *self,
                                           FpiImageDeviceState state);
 
+/* An image that was captured and is still being processed. Results are
+ * handled in capture order, even if the processing of a later image
+ * finishes first. */
+typedef struct
+{
+  FpImageDevice *device;
+  FpImage       *image;
+  GAsyncResult  *result;
+
+  /* Timings in µs, see FpMatchInfo */
+  gint64 captured_at;
+  gint64 capture_time;
+  gint64 extraction_time;
+} FpiPendingScan;
+
+static void
+fpi_pending_scan_free (FpiPendingScan *scan)
+{
+  g_clear_object (&scan->image);
+  g_clear_object (&scan->result);
+  g_free (scan);
+}
+
 /* Private shared functions */
 
 void
@@ -139,6 +164,9 @@ fp_image_device_change_state (FpImageDevice *self, FpiImageDeviceState state)
                prev_state_str, state_str);
 
   priv->state = state;
+  fpi_trace_counter ("image-device", "image device state", state);
+  if (state == FPI_IMAGE_DEVICE_STATE_CAPTURE)
+    priv->capture_started_at = g_get_monotonic_time ();
   g_object_notify (G_OBJECT (self), "fpi-image-device-state");
   g_signal_emit_by_name (self, "fpi-image-device-state-changed", priv->state);
 
@@ -160,15 +188,76 @@ static void
 fp_image_device_enroll_maybe_await_finger_on (FpImageDevice *self)
 {
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  guint pending = g_queue_get_length (&priv->pending_scans);
+
+  /* We wait for the finger to be removed before we switch to
+   * AWAIT_FINGER_ON. Unless the driver allows pipelining, we also wait
+   * for the minutiae scan to complete. */
+  if (priv->finger_present || pending >= priv->enroll_pipeline_depth)
+    return;
+
+  /* A pipelined capture might already be running */
+  if (priv->state == FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON ||
+      priv->state == FPI_IMAGE_DEVICE_STATE_CAPTURE)
+    return;
 
-  /* We wait for both the minutiae scan to complete and the finger to
-   * be removed before we switch to AWAIT_FINGER_ON. */
-  if (priv->minutiae_scan_active || priv->finger_present)
+  /* Do not capture more images than there are stages left */
+  if (priv->enroll_stage + pending >= fp_device_get_nr_enroll_stages (FP_DEVICE (self)))
     return;
 
   fp_image_device_change_state (self, FPI_IMAGE_DEVICE_STATE_AWAIT_FINGER_ON);
 }
 
+static void fp_image_device_maybe_complete_action (FpImageDevice *self,
+                                                   GError        *error);
+
+static void
+fp_image_device_fuse_thread_func (GTask        *task,
+                                  gpointer      source_object,
+                                  gpointer      task_data,
+                                  GCancellable *cancellable)
+{
+  FpPrint *enroll_print = task_data;
+  gint64 trace_start = fpi_trace_begin ();
+
+  fpi_print_sigfm_fuse (enroll_print);
+  fpi_trace_end ("image", "sigfm fusion", trace_start);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+fp_image_device_fuse_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  FpImageDevice *self = FP_IMAGE_DEVICE (source_object);
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  GError *error = NULL;
+
+  priv->fusing = FALSE;
+  priv->enroll_fused = TRUE;
+
+  g_task_propagate_boolean (G_TASK (res), &error);
+  fp_image_device_maybe_complete_action (self, error);
+}
+
+/* Fusing registers all enrolled sub-prints against each other, which is
+ * far too slow for the main loop. */
+static void
+fp_image_device_fuse_enroll_print (FpImageDevice *self, FpPrint *enroll_print)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  g_autoptr(FpiWorker) worker = fpi_worker_get_default ();
+  g_autoptr(GTask) task = NULL;
+
+  priv->fusing = TRUE;
+
+  task = g_task_new (self, fpi_device_get_cancellable (FP_DEVICE (self)),
+                     fp_image_device_fuse_cb, NULL);
+  g_task_set_task_data (task, g_object_ref (enroll_print), g_object_unref);
+  fpi_worker_run_task (worker, task, fp_image_device_fuse_thread_func,
+                       FPI_WORKER_PRIORITY_LOW, self);
+}
+
 static void
 fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
 {
@@ -191,8 +280,9 @@ fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
         }
     }
 
-  /* Do not complete if the device is still active or a minutiae scan is pending. */
-  if (priv->active || priv->minutiae_scan_active)
+  /* Do not complete if the device is still active, a minutiae scan is
+   * pending or the enrolled print is being fused. */
+  if (priv->active || priv->fusing || !g_queue_is_empty (&priv->pending_scans))
     return;
 
   if (!priv->action_error)
@@ -200,6 +290,7 @@ fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
 
   if (priv->action_error)
     {
+      priv->enroll_fused = FALSE;
       fpi_device_action_error (device, g_steal_pointer (&priv->action_error));
       g_clear_object (&priv->capture_image);
       return;
@@ -213,6 +304,13 @@ fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
       FpPrint *enroll_print;
       fpi_device_get_enroll_data (device, &enroll_print);
 
+      if (priv->algorithm == FPI_PRINT_SIGFM && !priv->enroll_fused)
+        {
+          fp_image_device_fuse_enroll_print (self, enroll_print);
+          return;
+        }
+      priv->enroll_fused = FALSE;
+
       fpi_device_enroll_complete (device, g_object_ref (enroll_print), NULL);
     }
   else if (action == FPI_DEVICE_ACTION_VERIFY)
@@ -234,25 +332,32 @@ fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
 }
 
 static void
-fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, gpointer user_data)
+fp_image_device_process_scan (FpImageDevice *self, FpiPendingScan *scan)
 {
-  g_autoptr(FpImage) image = FP_IMAGE (source_object);
+  g_autoptr(FpImage) image = g_steal_pointer (&scan->image);
   g_autoptr(FpPrint) print = NULL;
+  GAsyncResult *res = scan->result;
+  FpMatchInfo match_info = { 0, };
+  gint64 match_start;
   GError *error = NULL;
-  FpImageDevice *self = FP_IMAGE_DEVICE (user_data);
   FpDevice *device = FP_DEVICE (self);
-  FpImageDevicePrivate *priv;
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
   FpiDeviceAction action;
 
-  /* Note: We rely on the device to not disappear during an operation. */
-  priv = fp_image_device_get_instance_private (FP_IMAGE_DEVICE (device));
-  priv->minutiae_scan_active = FALSE;
+  match_info.score_threshold = priv->score_threshold;
+  match_info.sub_print = -1;
+  match_info.capture_time = scan->capture_time;
+  match_info.extraction_time = scan->extraction_time;
 
   if (!fp_image_detect_minutiae_finish (image, res, &error))
     {
       /* Cancel operation . */
       if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
         {
+          /* Only the first of several pending scans reports the error */
+          if (priv->action_error && priv->action_error->domain != FP_DEVICE_RETRY)
+            g_clear_error (&error);
+
           fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
           fpi_image_device_deactivate (self, TRUE);
           return;
@@ -267,6 +372,15 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
 
   action = fpi_device_get_current_action (device);
 
+  /* An earlier scan of a pipelined enrollment failed the action already */
+  if (action == FPI_DEVICE_ACTION_ENROLL &&
+      priv->action_error && priv->action_error->domain != FP_DEVICE_RETRY)
+    {
+      g_clear_error (&error);
+      fp_image_device_maybe_complete_action (self, NULL);
+      return;
+    }
+
   if (action == FPI_DEVICE_ACTION_CAPTURE)
     {
       priv->capture_image = g_steal_pointer (&image);
@@ -325,12 +439,17 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
       fpi_device_get_verify_data (device, &template);
       if (print)
         {
+          match_start = g_get_monotonic_time ();
           if (priv->algorithm == FPI_PRINT_NBIS)
             result = fpi_print_bz3_match (template, print, priv->score_threshold,
+                                          &match_info.score, &match_info.sub_print,
                                           &error);
           else if (priv->algorithm == FPI_PRINT_SIGFM)
             result = fpi_print_sigfm_match (template, print, priv->score_threshold,
+                                            &match_info.score, &match_info.sub_print,
                                             &error);
+          match_info.match_time = g_get_monotonic_time () - match_start;
+          fpi_print_set_match_info (print, &match_info);
         }
       else
         {
@@ -349,17 +468,29 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
       FpPrint *result = NULL;
 
       fpi_device_get_identify_data (device, &templates);
+      match_start = g_get_monotonic_time ();
       for (i = 0; !error && i < templates->len; i++)
         {
           FpPrint *template = g_ptr_array_index (templates, i);
+          gint score = 0, sub_print = -1;
 
           int match_result = FPI_MATCH_ERROR;
           if (priv->algorithm == FPI_PRINT_NBIS)
             match_result = fpi_print_bz3_match (template, print,
-                                                priv->score_threshold, &error);
+                                                priv->score_threshold,
+                                                &score, &sub_print, &error);
           else if (priv->algorithm == FPI_PRINT_SIGFM)
             match_result = fpi_print_sigfm_match (template, print,
-                                                  priv->score_threshold, &error);
+                                                  priv->score_threshold,
+                                                  &score, &sub_print, &error);
+
+          /* Report the matching template, otherwise the closest one */
+          if (match_result == FPI_MATCH_SUCCESS ||
+              (sub_print >= 0 && (match_info.sub_print < 0 || score > match_info.score)))
+            {
+              match_info.score = score;
+              match_info.sub_print = sub_print;
+            }
 
           if (match_result == FPI_MATCH_SUCCESS)
             {
@@ -367,6 +498,9 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
               break;
             }
         }
+      match_info.match_time = g_get_monotonic_time () - match_start;
+      if (print)
+        fpi_print_set_match_info (print, &match_info);
 
       if (!error || error->domain == FP_DEVICE_RETRY)
         fpi_device_identify_report (device, result, g_steal_pointer (&print), g_steal_pointer (&error));
@@ -375,16 +509,32 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
     }
   else
     {
-      /* XXX: This can be hit currently due to a race condition in the enroll code!
-       *      In that case we scan a further image even though the minutiae for the previous
-       *      one have not yet been detected.
-       *      We need to keep track on the pending minutiae detection and the fact that
-       *      it will finish eventually (or we may need to retry on error and activate the
-       *      device again). */
       g_assert_not_reached ();
     }
 }
 
+static void
+fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  FpiPendingScan *scan = user_data;
+  FpImageDevice *self = scan->device;
+  FpImageDevicePrivate *priv;
+
+  /* Note: We rely on the device to not disappear during an operation. */
+  priv = fp_image_device_get_instance_private (self);
+  scan->result = g_object_ref (res);
+  scan->extraction_time = g_get_monotonic_time () - scan->captured_at;
+
+  /* Deliver the results in capture order. The scan is removed from the
+   * queue first, so that the action can complete with the last one. */
+  while ((scan = g_queue_peek_head (&priv->pending_scans)) && scan->result)
+    {
+      g_queue_pop_head (&priv->pending_scans);
+      fp_image_device_process_scan (self, scan);
+      fpi_pending_scan_free (scan);
+    }
+}
+
 /*********************************************************/
 /* Private API */
 
@@ -497,6 +647,7 @@ void
 fpi_image_device_image_captured (FpImageDevice *self, FpImage *image)
 {
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+  FpiPendingScan *scan;
   FpiDeviceAction action;
 
   action = fpi_device_get_current_action (FP_DEVICE (self));
@@ -510,21 +661,24 @@ fpi_image_device_image_captured (FpImageDevice *self, FpImage *image)
 
   g_debug ("Image device captured an image");
 
-  priv->minutiae_scan_active = TRUE;
+  scan = g_new0 (FpiPendingScan, 1);
+  scan->device = self;
+  scan->image = image;
+  scan->captured_at = g_get_monotonic_time ();
+  scan->capture_time = scan->captured_at - priv->capture_started_at;
+  g_queue_push_tail (&priv->pending_scans, scan);
 
   if (priv->algorithm != FPI_PRINT_SIGFM)
     {
       /* XXX: We also detect minutiae in capture mode, we solely do this
        *      to normalize the image which will happen as a by-product. */
-      fp_image_detect_minutiae (image,
-                                fpi_device_get_cancellable (FP_DEVICE (self)),
-                                fpi_image_device_minutiae_detected, self);
+      fpi_image_detect_minutiae (image, FP_DEVICE (self),
+                                 fpi_image_device_minutiae_detected, scan);
     }
   else
     {
-      fp_image_extract_sigfm_info (image,
-                                   fpi_device_get_cancellable (FP_DEVICE (self)),
-                                   fpi_image_device_minutiae_detected, self);
+      fpi_image_extract_sigfm_info (image, FP_DEVICE (self),
+                                    fpi_image_device_minutiae_detected, scan);
     }
 
   /* XXX: This is wrong if we add support for raw capture mode. */
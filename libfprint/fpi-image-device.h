@@ -81,6 +81,12 @@ typedef enum {
  * @score_threshold: Threshold to consider bozorth3 score a match, default: 40
  * @img_width: Width of the image, only provide if constant
  * @img_height: Height of the image, only provide if constant
+ * @algorithm: The matching algorithm to use, default: NBIS
+ * @enroll_pipeline_depth: Number of images that may be processed while
+ *   capturing the next one during enrollment, default: 1. Setting this
+ *   higher allows capturing the next enroll stage without waiting for
+ *   the minutiae detection of the previous one, which makes sense for
+ *   fast press type sensors.
  * @img_open: Open the device and do basic initialization
  *   (use this instead of the #FpDeviceClass open vfunc)
  * @img_close: Close the device
@@ -114,6 +120,7 @@ struct _FpImageDeviceClass
   gint                    img_width;
   gint                    img_height;
   FpiImageDeviceAlgorithm algorithm;
+  guint                   enroll_pipeline_depth;
 
   void                    (*img_open)     (FpImageDevice *dev);
   void                    (*img_close)    (FpImageDevice *dev);
@@ -30,6 +30,10 @@
 #include <pixman.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /**
  * SECTION: fpi-image
  * @title: Internal FpImage
@@ -58,21 +62,11 @@ gint
 fpi_std_sq_dev (const guint8 *buf,
                 gint          size)
 {
-  guint64 res = 0, mean = 0;
-  gint i;
-
-  for (i = 0; i < size; i++)
-    mean += buf[i];
+  FpiFrameStats stats = { 0 };
 
-  mean /= size;
-
-  for (i = 0; i < size; i++)
-    {
-      int dev = (int) buf[i] - mean;
-      res += dev * dev;
-    }
+  fpi_frame_stats_add_u8 (&stats, buf, size, 1, size, 1);
 
-  return res / size;
+  return fpi_frame_stats_get_sq_dev (&stats);
 }
 
 /**
@@ -108,20 +102,685 @@ fpi_mean_sq_diff_norm (const guint8 *buf1,
   return res / size;
 }
 
-FpImage *
-fpi_image_resize (FpImage *orig_img,
-                  guint    w_factor,
-                  guint    h_factor)
+/* Number of SIMD iterations after which the 32 bit partial sums are
+ * folded into the 64 bit ones, before they can overflow. */
+#define STATS_FOLD_INTERVAL 4096
+
+static void
+stats_add_row_u8 (FpiFrameStats *stats,
+                  const guint8  *row,
+                  guint          width)
 {
+  guint64 sum = 0, sum_sq = 0;
+  guint i = 0;
+
+#ifdef __SSE2__
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    __m128i vsum = zero;
+    __m128i vsum_sq = zero;
+    guint64 lanes[2];
+
+    while (i + 16 <= width)
+      {
+        guint end = i + 16 * MIN ((width - i) / 16, STATS_FOLD_INTERVAL);
+        __m128i vsq32 = zero;
+
+        for (; i < end; i += 16)
+          {
+            __m128i v = _mm_loadu_si128 ((const __m128i *) (row + i));
+            __m128i lo = _mm_unpacklo_epi8 (v, zero);
+            __m128i hi = _mm_unpackhi_epi8 (v, zero);
+
+            vsum = _mm_add_epi64 (vsum, _mm_sad_epu8 (v, zero));
+            vsq32 = _mm_add_epi32 (vsq32, _mm_madd_epi16 (lo, lo));
+            vsq32 = _mm_add_epi32 (vsq32, _mm_madd_epi16 (hi, hi));
+          }
+
+        vsum_sq = _mm_add_epi64 (vsum_sq, _mm_unpacklo_epi32 (vsq32, zero));
+        vsum_sq = _mm_add_epi64 (vsum_sq, _mm_unpackhi_epi32 (vsq32, zero));
+      }
+
+    _mm_storeu_si128 ((__m128i *) lanes, vsum);
+    sum = lanes[0] + lanes[1];
+    _mm_storeu_si128 ((__m128i *) lanes, vsum_sq);
+    sum_sq = lanes[0] + lanes[1];
+  }
+#endif
+
+  for (; i < width; i++)
+    {
+      sum += row[i];
+      sum_sq += (guint) row[i] * row[i];
+    }
+
+  stats->count += width;
+  stats->sum += sum;
+  stats->sum_sq += sum_sq;
+}
+
+/* Adds the values of @row, or the absolute difference to @ref if given */
+static void
+stats_add_row_u16 (FpiFrameStats  *stats,
+                   const guint16  *row,
+                   const guint16  *ref,
+                   guint           width)
+{
+  guint64 sum = 0, sum_sq = 0;
+  guint i = 0;
+
+#ifdef __SSE2__
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    __m128i vsum = zero;
+    __m128i vsum_sq = zero;
+    guint64 lanes[2];
+
+    while (i + 8 <= width)
+      {
+        guint end = i + 8 * MIN ((width - i) / 8, STATS_FOLD_INTERVAL);
+        __m128i vsum32 = zero;
+
+        for (; i < end; i += 8)
+          {
+            __m128i v = _mm_loadu_si128 ((const __m128i *) (row + i));
+            __m128i sq_lo, sq_hi, lo, hi;
+
+            if (ref)
+              {
+                __m128i r = _mm_loadu_si128 ((const __m128i *) (ref + i));
+
+                v = _mm_or_si128 (_mm_subs_epu16 (v, r), _mm_subs_epu16 (r, v));
+              }
+
+            vsum32 = _mm_add_epi32 (vsum32, _mm_unpacklo_epi16 (v, zero));
+            vsum32 = _mm_add_epi32 (vsum32, _mm_unpackhi_epi16 (v, zero));
+
+            /* Full 32 bit squares from the low and high halves */
+            lo = _mm_mullo_epi16 (v, v);
+            hi = _mm_mulhi_epu16 (v, v);
+            sq_lo = _mm_unpacklo_epi16 (lo, hi);
+            sq_hi = _mm_unpackhi_epi16 (lo, hi);
+
+            vsum_sq = _mm_add_epi64 (vsum_sq, _mm_unpacklo_epi32 (sq_lo, zero));
+            vsum_sq = _mm_add_epi64 (vsum_sq, _mm_unpackhi_epi32 (sq_lo, zero));
+            vsum_sq = _mm_add_epi64 (vsum_sq, _mm_unpacklo_epi32 (sq_hi, zero));
+            vsum_sq = _mm_add_epi64 (vsum_sq, _mm_unpackhi_epi32 (sq_hi, zero));
+          }
+
+        vsum = _mm_add_epi64 (vsum, _mm_unpacklo_epi32 (vsum32, zero));
+        vsum = _mm_add_epi64 (vsum, _mm_unpackhi_epi32 (vsum32, zero));
+      }
+
+    _mm_storeu_si128 ((__m128i *) lanes, vsum);
+    sum = lanes[0] + lanes[1];
+    _mm_storeu_si128 ((__m128i *) lanes, vsum_sq);
+    sum_sq = lanes[0] + lanes[1];
+  }
+#endif
+
+  for (; i < width; i++)
+    {
+      guint64 v = ref ? ABS ((gint) row[i] - (gint) ref[i]) : row[i];
+
+      sum += v;
+      sum_sq += v * v;
+    }
+
+  stats->count += width;
+  stats->sum += sum;
+  stats->sum_sq += sum_sq;
+}
+
+/**
+ * FpiFrameStats:
+ * @count: The number of samples
+ * @sum: The sum of all samples
+ * @sum_sq: The sum of the squares of all samples
+ *
+ * Accumulated statistics of (a part of) a frame, usually used to detect
+ * whether a finger is present. Initialize it to zero and add samples
+ * using e.g. fpi_frame_stats_add_u8(). As only sums are stored, all
+ * statistics are computed in a single pass over the data.
+ */
+
+/**
+ * fpi_frame_stats_add_u8:
+ * @stats: A #FpiFrameStats
+ * @buf: The first pixel of the area, one byte per pixel
+ * @width: The width of the area
+ * @height: The height of the area
+ * @stride: The distance between the start of two rows in pixels
+ * @step: Only sample every @step-th pixel of every @step-th row
+ *
+ * Adds the pixels of an area of a frame to @stats. Using a @step larger
+ * than one evaluates a subsampled frame, which is usually good enough to
+ * detect a finger while touching only a fraction of the data.
+ */
+void
+fpi_frame_stats_add_u8 (FpiFrameStats *stats,
+                        const guint8  *buf,
+                        guint          width,
+                        guint          height,
+                        gsize          stride,
+                        guint          step)
+{
+  guint x, y;
+
+  g_return_if_fail (stats);
+  g_return_if_fail (step > 0);
+
+  if (step == 1 && stride == width)
+    {
+      /* Contiguous, handle it as a single row */
+      stats_add_row_u8 (stats, buf, width * height);
+      return;
+    }
+
+  for (y = 0; y < height; y += step)
+    {
+      const guint8 *row = buf + y * stride;
+
+      if (step == 1)
+        {
+          stats_add_row_u8 (stats, row, width);
+          continue;
+        }
+
+      for (x = 0; x < width; x += step)
+        {
+          stats->count++;
+          stats->sum += row[x];
+          stats->sum_sq += (guint) row[x] * row[x];
+        }
+    }
+}
+
+static void
+stats_add_u16 (FpiFrameStats *stats,
+               const guint16 *buf,
+               const guint16 *ref,
+               guint          width,
+               guint          height,
+               gsize          stride,
+               guint          step)
+{
+  guint x, y;
+
+  if (step == 1 && stride == width)
+    {
+      stats_add_row_u16 (stats, buf, ref, width * height);
+      return;
+    }
+
+  for (y = 0; y < height; y += step)
+    {
+      const guint16 *row = buf + y * stride;
+      const guint16 *ref_row = ref ? ref + y * stride : NULL;
+
+      if (step == 1)
+        {
+          stats_add_row_u16 (stats, row, ref_row, width);
+          continue;
+        }
+
+      for (x = 0; x < width; x += step)
+        {
+          guint64 v = ref_row ? ABS ((gint) row[x] - (gint) ref_row[x]) : row[x];
+
+          stats->count++;
+          stats->sum += v;
+          stats->sum_sq += v * v;
+        }
+    }
+}
+
+/**
+ * fpi_frame_stats_add_u16:
+ * @stats: A #FpiFrameStats
+ * @buf: The first pixel of the area, 16 bit per pixel
+ * @width: The width of the area
+ * @height: The height of the area
+ * @stride: The distance between the start of two rows in pixels
+ * @step: Only sample every @step-th pixel of every @step-th row
+ *
+ * Like fpi_frame_stats_add_u8(), but for frames with 16 bit pixels.
+ */
+void
+fpi_frame_stats_add_u16 (FpiFrameStats *stats,
+                         const guint16 *buf,
+                         guint          width,
+                         guint          height,
+                         gsize          stride,
+                         guint          step)
+{
+  g_return_if_fail (stats);
+  g_return_if_fail (step > 0);
+
+  stats_add_u16 (stats, buf, NULL, width, height, stride, step);
+}
+
+/**
+ * fpi_frame_stats_add_diff_u16:
+ * @stats: A #FpiFrameStats
+ * @buf1: The first pixel of the area in the first frame
+ * @buf2: The first pixel of the area in the second frame
+ * @width: The width of the area
+ * @height: The height of the area
+ * @stride: The distance between the start of two rows in pixels
+ * @step: Only sample every @step-th pixel of every @step-th row
+ *
+ * Adds the absolute differences between the pixels of two 16 bit frames
+ * to @stats, e.g. to detect movement between two frames.
+ */
+void
+fpi_frame_stats_add_diff_u16 (FpiFrameStats *stats,
+                              const guint16 *buf1,
+                              const guint16 *buf2,
+                              guint          width,
+                              guint          height,
+                              gsize          stride,
+                              guint          step)
+{
+  g_return_if_fail (stats);
+  g_return_if_fail (buf2);
+  g_return_if_fail (step > 0);
+
+  stats_add_u16 (stats, buf1, buf2, width, height, stride, step);
+}
+
+/**
+ * fpi_frame_stats_get_mean:
+ * @stats: A #FpiFrameStats
+ *
+ * Returns: The mean of the samples, rounded down
+ */
+guint64
+fpi_frame_stats_get_mean (const FpiFrameStats *stats)
+{
+  g_return_val_if_fail (stats, 0);
+
+  if (stats->count == 0)
+    return 0;
+
+  return stats->sum / stats->count;
+}
+
+/**
+ * fpi_frame_stats_get_sq_dev:
+ * @stats: A #FpiFrameStats
+ *
+ * Calculates the squared standard deviation of the samples. To match the
+ * two pass implementations drivers used before, the deviation is taken
+ * from the mean as returned by fpi_frame_stats_get_mean() and the result
+ * is rounded down:
+ * |[<!-- -->
+ *    mean = sum (samples) / count
+ *    sq_dev = sum ((samples - mean) ^ 2) / count
+ * ]|
+ *
+ * Returns: The squared standard deviation of the samples
+ */
+guint64
+fpi_frame_stats_get_sq_dev (const FpiFrameStats *stats)
+{
+  guint64 mean;
+
+  g_return_val_if_fail (stats, 0);
+
+  if (stats->count == 0)
+    return 0;
+
+  /* sum ((x - m) ^ 2) = sum (x ^ 2) - 2 * m * sum (x) + count * m ^ 2 */
+  mean = stats->sum / stats->count;
+
+  return (stats->sum_sq + stats->count * mean * mean - 2 * mean * stats->sum) / stats->count;
+}
+
+/**
+ * fpi_frame_subtract_u16:
+ * @frame: A frame with 16 bit pixels, modified in place
+ * @bg: The background frame
+ * @len: The number of pixels in @frame and @bg
+ *
+ * Subtracts the background from @frame, pixels that are below the
+ * background are clamped to zero.
+ *
+ * Returns: The number of pixels that were below the background
+ */
+gsize
+fpi_frame_subtract_u16 (guint16       *frame,
+                        const guint16 *bg,
+                        gsize          len)
+{
+  gsize count = 0;
+  gsize i = 0;
+
+#ifdef __SSE2__
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i ones = _mm_set1_epi16 (1);
+
+    while (i + 8 <= len)
+      {
+        /* Count the valid pixels per lane, before the 16 bit counters
+         * could overflow */
+        gsize end = i + 8 * MIN ((len - i) / 8, G_MAXINT16);
+        gsize start = i;
+        __m128i vvalid = zero;
+        gint32 lanes[4];
+
+        for (; i < end; i += 8)
+          {
+            __m128i v = _mm_loadu_si128 ((const __m128i *) (frame + i));
+            __m128i b = _mm_loadu_si128 ((const __m128i *) (bg + i));
+            __m128i valid = _mm_cmpeq_epi16 (_mm_subs_epu16 (b, v), zero);
+
+            vvalid = _mm_sub_epi16 (vvalid, valid);
+            _mm_storeu_si128 ((__m128i *) (frame + i), _mm_subs_epu16 (v, b));
+          }
+
+        _mm_storeu_si128 ((__m128i *) lanes, _mm_madd_epi16 (vvalid, ones));
+        count += (i - start) - (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+      }
+  }
+#endif
+
+  for (; i < len; i++)
+    {
+      if (frame[i] < bg[i])
+        {
+          count += 1;
+          frame[i] = 0;
+        }
+      else
+        {
+          frame[i] -= bg[i];
+        }
+    }
+
+  return count;
+}
+
+/**
+ * FpiFingerDetector:
+ *
+ * Hysteresis and debouncing for a finger presence metric, e.g. the value
+ * returned by fpi_frame_stats_get_sq_dev(). A finger is reported once the
+ * metric exceeded the on threshold for a number of consecutive frames, and
+ * reported as removed once it stayed below the off threshold for as long.
+ * Values between the thresholds keep the current state.
+ */
+
+/**
+ * fpi_finger_detector_init:
+ * @detector: A #FpiFingerDetector
+ * @on_threshold: A finger is present if the metric is above this value
+ * @off_threshold: A finger is absent if the metric is below this value
+ * @debounce: The number of consecutive frames needed to switch the state
+ *
+ * Initializes @detector, the finger is initially considered absent.
+ */
+void
+fpi_finger_detector_init (FpiFingerDetector *detector,
+                          guint64            on_threshold,
+                          guint64            off_threshold,
+                          guint              debounce)
+{
+  g_return_if_fail (detector);
+  g_return_if_fail (off_threshold <= on_threshold);
+
+  detector->on_threshold = on_threshold;
+  detector->off_threshold = off_threshold;
+  detector->debounce = MAX (debounce, 1);
+  detector->present = FALSE;
+  detector->pending = 0;
+}
+
+/**
+ * fpi_finger_detector_update:
+ * @detector: A #FpiFingerDetector
+ * @value: The metric of the latest frame
+ *
+ * Feeds the metric of a new frame into @detector.
+ *
+ * Returns: %TRUE if a finger is considered present
+ */
+gboolean
+fpi_finger_detector_update (FpiFingerDetector *detector,
+                            guint64            value)
+{
+  gboolean flip;
+
+  g_return_val_if_fail (detector, FALSE);
+
+  if (detector->present)
+    flip = value < detector->off_threshold;
+  else
+    flip = value > detector->on_threshold;
+
+  if (!flip)
+    {
+      detector->pending = 0;
+      return detector->present;
+    }
+
+  if (++detector->pending >= detector->debounce)
+    {
+      detector->present = !detector->present;
+      detector->pending = 0;
+    }
+
+  return detector->present;
+}
+
+static inline void
+normalize_row (const guint8 *src,
+               guint8       *dst,
+               guint         width,
+               gboolean      hflip,
+               gboolean      invert)
+{
+  guint8 mask = invert ? 0xff : 0x00;
+  guint i = 0;
+
+  if (!hflip && !invert)
+    {
+      memcpy (dst, src, width);
+      return;
+    }
+
+#ifdef __SSE2__
+  {
+    __m128i vmask = _mm_set1_epi8 ((gchar) mask);
+
+    for (; i + 16 <= width; i += 16)
+      {
+        __m128i v;
+
+        if (hflip)
+          {
+            /* Reverse the 16 bytes: dwords, then words, then bytes */
+            v = _mm_loadu_si128 ((const __m128i *) (src + width - i - 16));
+            v = _mm_shuffle_epi32 (v, _MM_SHUFFLE (0, 1, 2, 3));
+            v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+            v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+            v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+          }
+        else
+          {
+            v = _mm_loadu_si128 ((const __m128i *) (src + i));
+          }
+
+        _mm_storeu_si128 ((__m128i *) (dst + i), _mm_xor_si128 (v, vmask));
+      }
+  }
+#endif
+
+  if (hflip)
+    for (; i < width; i++)
+      dst[i] = src[width - i - 1] ^ mask;
+  else
+    for (; i < width; i++)
+      dst[i] = src[i] ^ mask;
+}
+
+/**
+ * fpi_image_dup_normalized_data:
+ * @self: A #FpImage
+ *
+ * Creates a copy of the image data with the flips and colour inversion
+ * requested through the #FpiImageFlags applied. All of the normalization
+ * happens in a single pass while copying the data.
+ *
+ * Returns: (transfer full): The normalized image data, free with g_free()
+ */
+guint8 *
+fpi_image_dup_normalized_data (FpImage *self)
+{
+  gboolean hflip = !!(self->flags & FPI_IMAGE_H_FLIPPED);
+  gboolean vflip = !!(self->flags & FPI_IMAGE_V_FLIPPED);
+  gboolean invert = !!(self->flags & FPI_IMAGE_COLORS_INVERTED);
+  guint8 *data = g_malloc (self->width * self->height);
+  guint y;
+
+  for (y = 0; y < self->height; y++)
+    {
+      guint src_y = vflip ? self->height - y - 1 : y;
+
+      normalize_row (self->data + (gsize) src_y * self->width,
+                     data + (gsize) y * self->width,
+                     self->width, hflip, invert);
+    }
+
+  return data;
+}
+
+/* The built-in resize samples exactly like pixman's bilinear filter does:
+ * pixel centres sit at .5, weights have 7 bits of precision, pixels outside
+ * of the image are transparent (i.e. 0) and the result is truncated. */
+#define RESIZE_WEIGHT_BITS 7
+#define RESIZE_WEIGHT_ONE (1 << RESIZE_WEIGHT_BITS)
+
+static void
+resize_sample_positions (guint   factor,
+                         guint   len,
+                         gint   *index,
+                         gint16 *weight)
+{
+  /* 16.16 fixed point, rounded the same way as the pixman transform */
+  gint32 step = (1 << 16) / factor;
+  gint32 pos = ((gint64) step * (1 << 15) + (1 << 15)) >> 16;
+  guint i;
+
+  for (i = 0; i < len; i++, pos += step)
+    {
+      gint32 p = pos - (1 << 15);
+
+      /* Sample from pixel index[i] and the one following it; index is -1
+       * for the left/top border, the padding in the buffers handles that. */
+      index[i] = p >> 16;
+      weight[i] = (p >> (16 - RESIZE_WEIGHT_BITS)) & (RESIZE_WEIGHT_ONE - 1);
+    }
+}
+
+static void
+resize_blend_rows (const gint16 *top,
+                   const gint16 *bottom,
+                   gint16        weight,
+                   guint8       *out,
+                   guint         len)
+{
+  gint16 iweight = RESIZE_WEIGHT_ONE - weight;
+  guint i = 0;
+
+#ifdef __SSE2__
+  /* Interleave both rows so that a single madd does the weighting */
+  __m128i w = _mm_set1_epi32 (((guint32) weight << 16) | (guint16) iweight);
+
+  for (; i + 8 <= len; i += 8)
+    {
+      __m128i t = _mm_loadu_si128 ((const __m128i *) (top + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (bottom + i));
+      __m128i lo = _mm_madd_epi16 (_mm_unpacklo_epi16 (t, b), w);
+      __m128i hi = _mm_madd_epi16 (_mm_unpackhi_epi16 (t, b), w);
+      __m128i res;
+
+      lo = _mm_srai_epi32 (lo, 2 * RESIZE_WEIGHT_BITS);
+      hi = _mm_srai_epi32 (hi, 2 * RESIZE_WEIGHT_BITS);
+      res = _mm_packs_epi32 (lo, hi);
+      _mm_storel_epi64 ((__m128i *) (out + i), _mm_packus_epi16 (res, res));
+    }
+#endif
+
+  for (; i < len; i++)
+    out[i] = (top[i] * iweight + bottom[i] * weight) >> (2 * RESIZE_WEIGHT_BITS);
+}
+
+static void
+resize_bilinear (FpImage *orig_img,
+                 FpImage *newimg,
+                 guint    w_factor,
+                 guint    h_factor)
+{
+  guint src_w = orig_img->width;
+  guint src_h = orig_img->height;
+  guint dst_w = newimg->width;
+  guint dst_h = newimg->height;
+  g_autofree gint *x_index = g_new (gint, dst_w);
+  g_autofree gint16 *x_weight = g_new (gint16, dst_w);
+  g_autofree gint *y_index = g_new (gint, dst_h);
+  g_autofree gint16 *y_weight = g_new (gint16, dst_h);
+  g_autofree guint8 *src_row = g_malloc0 (src_w + 2);
+  g_autofree gint16 *rows = NULL;
+  guint x, y;
+
+  resize_sample_positions (w_factor, dst_w, x_index, x_weight);
+  resize_sample_positions (h_factor, dst_h, y_index, y_weight);
+
+  /* Horizontally scaled source rows, with an empty row above and below the
+   * image. The values stay below 2^15 as they only carry 7 bits of weight. */
+  rows = g_new0 (gint16, (gsize) (src_h + 2) * dst_w);
+
+  for (y = 0; y < src_h; y++)
+    {
+      gint16 *row = rows + (gsize) (y + 1) * dst_w;
+
+      memcpy (src_row + 1, orig_img->data + (gsize) y * src_w, src_w);
+
+      for (x = 0; x < dst_w; x++)
+        {
+          const guint8 *p = src_row + x_index[x] + 1;
+
+          row[x] = p[0] * (RESIZE_WEIGHT_ONE - x_weight[x]) + p[1] * x_weight[x];
+        }
+    }
+
+  for (y = 0; y < dst_h; y++)
+    {
+      const gint16 *top = rows + (gsize) (y_index[y] + 1) * dst_w;
+
+      resize_blend_rows (top, top + dst_w, y_weight[y],
+                         newimg->data + (gsize) y * dst_w, dst_w);
+    }
+}
+
 #ifdef HAVE_PIXMAN
-  int new_width = orig_img->width * w_factor;
-  int new_height = orig_img->height * h_factor;
+static gboolean
+resize_pixman (FpImage *orig_img,
+               FpImage *newimg,
+               guint    w_factor,
+               guint    h_factor)
+{
   pixman_image_t *orig, *resized;
   pixman_transform_t transform;
-  FpImage *newimg;
+
+  /* pixman can only wrap buffers with 32bit aligned row strides */
+  if (orig_img->width % 4 != 0 || newimg->width % 4 != 0)
+    return FALSE;
 
   orig = pixman_image_create_bits (PIXMAN_a8, orig_img->width, orig_img->height, (uint32_t *) orig_img->data, orig_img->width);
-  resized = pixman_image_create_bits (PIXMAN_a8, new_width, new_height, NULL, new_width);
+  resized = pixman_image_create_bits (PIXMAN_a8, newimg->width, newimg->height, (uint32_t *) newimg->data, newimg->width);
 
   pixman_transform_init_identity (&transform);
   pixman_transform_scale (NULL, &transform, pixman_int_to_fixed (w_factor), pixman_int_to_fixed (h_factor));
@@ -134,21 +793,46 @@ fpi_image_resize (FpImage *orig_img,
                             0, 0, /* src x y */
                             0, 0, /* mask x y */
                             0, 0, /* dst x y */
-                            new_width, new_height /* width height */
+                            newimg->width, newimg->height /* width height */
                            );
 
-  newimg = fp_image_new (new_width, new_height);
-  newimg->flags = orig_img->flags;
-
-  memcpy (newimg->data, pixman_image_get_data (resized), new_width * new_height);
-
   pixman_image_unref (orig);
   pixman_image_unref (resized);
 
-  return newimg;
-#else
-  fp_err ("Libfprint compiled without pixman support, impossible to resize");
+  return TRUE;
+}
+#endif
+
+/**
+ * fpi_image_resize:
+ * @orig_img: The #FpImage to resize
+ * @w_factor: Horizontal scaling factor
+ * @h_factor: Vertical scaling factor
+ *
+ * Scales up an image by integer factors using bilinear filtering. pixman is
+ * used if libfprint was built with it, otherwise a built-in implementation
+ * producing the same result is used.
+ *
+ * Returns: (transfer full): the resized #FpImage
+ */
+FpImage *
+fpi_image_resize (FpImage *orig_img,
+                  guint    w_factor,
+                  guint    h_factor)
+{
+  FpImage *newimg;
 
-  return g_object_ref (orig_img);
+  g_return_val_if_fail (w_factor > 0 && h_factor > 0, NULL);
+
+  newimg = fp_image_new (orig_img->width * w_factor, orig_img->height * h_factor);
+  newimg->flags = orig_img->flags;
+
+#ifdef HAVE_PIXMAN
+  if (resize_pixman (orig_img, newimg, w_factor, h_factor))
+    return newimg;
 #endif
+
+  resize_bilinear (orig_img, newimg, w_factor, h_factor);
+
+  return newimg;
 }
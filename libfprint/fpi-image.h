@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include "fp-device.h"
 #include "fp-image.h"
 #include "sigfm/sigfm.h"
 #include <config.h>
@@ -41,6 +42,10 @@ typedef enum {
   FPI_IMAGE_PARTIAL         = 1 << 3,
 } FpiImageFlags;
 
+/* Flags that are handled by fpi_image_dup_normalized_data() */
+#define FPI_IMAGE_NORMALIZATION_FLAGS \
+  (FPI_IMAGE_V_FLIPPED | FPI_IMAGE_H_FLIPPED | FPI_IMAGE_COLORS_INVERTED)
+
 /**
  * FpImage:
  * @width: Width of the image
@@ -73,12 +78,72 @@ struct _FpImage
   guint          ref_count;
 };
 
+typedef struct
+{
+  guint64 count;
+  guint64 sum;
+  guint64 sum_sq;
+} FpiFrameStats;
+
+typedef struct
+{
+  /*< private >*/
+  guint64  on_threshold;
+  guint64  off_threshold;
+  guint    debounce;
+  gboolean present;
+  guint    pending;
+} FpiFingerDetector;
+
 gint fpi_std_sq_dev (const guint8 *buf,
                      gint          size);
 gint fpi_mean_sq_diff_norm (const guint8 *buf1,
                             const guint8 *buf2,
                             gint          size);
 
+void fpi_frame_stats_add_u8 (FpiFrameStats *stats,
+                             const guint8  *buf,
+                             guint          width,
+                             guint          height,
+                             gsize          stride,
+                             guint          step);
+void fpi_frame_stats_add_u16 (FpiFrameStats *stats,
+                              const guint16 *buf,
+                              guint          width,
+                              guint          height,
+                              gsize          stride,
+                              guint          step);
+void fpi_frame_stats_add_diff_u16 (FpiFrameStats *stats,
+                                   const guint16 *buf1,
+                                   const guint16 *buf2,
+                                   guint          width,
+                                   guint          height,
+                                   gsize          stride,
+                                   guint          step);
+gsize fpi_frame_subtract_u16 (guint16       *frame,
+                              const guint16 *bg,
+                              gsize          len);
+guint64 fpi_frame_stats_get_mean (const FpiFrameStats *stats);
+guint64 fpi_frame_stats_get_sq_dev (const FpiFrameStats *stats);
+
+void fpi_finger_detector_init (FpiFingerDetector *detector,
+                               guint64            on_threshold,
+                               guint64            off_threshold,
+                               guint              debounce);
+gboolean fpi_finger_detector_update (FpiFingerDetector *detector,
+                                     guint64            value);
+
+guint8 *fpi_image_dup_normalized_data (FpImage *self);
+
+void fpi_image_detect_minutiae (FpImage            *self,
+                                FpDevice           *device,
+                                GAsyncReadyCallback callback,
+                                gpointer            user_data);
+void fpi_image_extract_sigfm_info (FpImage            *self,
+                                   FpDevice           *device,
+                                   GAsyncReadyCallback callback,
+                                   gpointer            user_data);
+
 FpImage *fpi_image_resize (FpImage *orig,
                            guint    w_factor,
                            guint    h_factor);
@@ -26,6 +26,7 @@
 #include "fp-print-private.h"
 #include "fpi-device.h"
 #include "fpi-compat.h"
+#include "fpi-trace.h"
 
 /**
  * SECTION: fpi-print
@@ -58,9 +59,10 @@ fpi_print_add_print (FpPrint *print, FpPrint *add)
   g_assert (add->prints->len == 1);
   void * to_add =
     print->type == FPI_PRINT_NBIS ?
-    g_memdup2 (add->prints->pdata[0], sizeof (struct xyt_struct)) :
+    g_memdup2 (add->prints->pdata[0], fpi_xyt_size (add->prints->pdata[0])) :
     (void *) sigfm_copy_info (add->prints->pdata[0]);
   g_ptr_array_add (print->prints, to_add);
+  print->identity_hash = 0;
 }
 
 /**
@@ -81,6 +83,7 @@ fpi_print_set_type (FpPrint     *print,
   g_return_if_fail (print->type == FPI_PRINT_UNDEFINED);
 
   print->type = type;
+  print->identity_hash = 0;
   if (print->type == FPI_PRINT_NBIS || print->type == FPI_PRINT_SIGFM)
     {
       g_assert_null (print->prints);
@@ -109,20 +112,101 @@ fpi_print_set_device_stored (FpPrint *print,
   g_object_notify (G_OBJECT (print), "device-stored");
 }
 
+/**
+ * fpi_print_set_match_info:
+ * @print: A scanned #FpPrint
+ * @info: The #FpMatchInfo of matching @print
+ *
+ * Drivers that match on the host should set this on the scanned print
+ * before reporting it with fpi_device_verify_report() or
+ * fpi_device_identify_report().
+ */
+void
+fpi_print_set_match_info (FpPrint           *print,
+                          const FpMatchInfo *info)
+{
+  g_return_if_fail (FP_IS_PRINT (print));
+  g_return_if_fail (info != NULL);
+
+  g_clear_pointer (&print->match_info, fp_match_info_free);
+  print->match_info = fp_match_info_copy (info);
+  g_object_notify (G_OBJECT (print), "match-info");
+}
+
+/**
+ * fpi_xyt_new:
+ * @nrows: The number of minutiae
+ *
+ * Allocates a zero initialized #FpiXyt with room for @nrows minutiae,
+ * free it using g_free().
+ *
+ * Returns: (transfer full): A new #FpiXyt
+ */
+FpiXyt *
+fpi_xyt_new (guint nrows)
+{
+  FpiXyt *xyt;
+
+  g_return_val_if_fail (nrows <= MAX_BOZORTH_MINUTIAE, NULL);
+
+  xyt = g_malloc0 (sizeof (FpiXyt) + 3 * nrows * sizeof (xyt->cols[0]));
+  xyt->nrows = nrows;
+
+  return xyt;
+}
+
+/**
+ * fpi_xyt_size:
+ * @xyt: A #FpiXyt
+ *
+ * Returns: The size of @xyt in bytes, e.g. to copy or compare it
+ */
+gsize
+fpi_xyt_size (const FpiXyt *xyt)
+{
+  return sizeof (FpiXyt) + 3 * xyt->nrows * sizeof (xyt->cols[0]);
+}
+
+/**
+ * fpi_xyt_to_struct:
+ * @xyt: A #FpiXyt
+ * @out: The bozorth struct to fill in
+ *
+ * Expands @xyt into the fixed size representation used by the bozorth3
+ * matcher. Only the first @xyt->nrows entries of the columns are written.
+ */
+void
+fpi_xyt_to_struct (const FpiXyt      *xyt,
+                   struct xyt_struct *out)
+{
+  const gint16 *x = FPI_XYT_X (xyt);
+  const gint16 *y = FPI_XYT_Y (xyt);
+  const gint16 *theta = FPI_XYT_THETA (xyt);
+  guint i;
+
+  out->nrows = xyt->nrows;
+  for (i = 0; i < xyt->nrows; i++)
+    {
+      out->xcol[i] = x[i];
+      out->ycol[i] = y[i];
+      out->thetacol[i] = theta[i];
+    }
+}
+
 /* XXX: This is the old version, but wouldn't it be smarter to instead
  * use the highest quality mintutiae? Possibly just using bz_prune from
  * upstream? */
-static void
+static FpiXyt *
 minutiae_to_xyt (struct fp_minutiae *minutiae,
                  int                 bwidth,
-                 int                 bheight,
-                 struct xyt_struct  *xyt)
+                 int                 bheight)
 {
   int i;
   struct fp_minutia *minutia;
   struct minutiae_struct c[MAX_FILE_MINUTIAE];
+  FpiXyt *xyt;
 
-  /* struct xyt_struct uses arrays of MAX_BOZORTH_MINUTIAE (200) */
+  /* Bozorth only looks at up to MAX_BOZORTH_MINUTIAE (200) minutiae */
   int nmin = min (minutiae->num, MAX_BOZORTH_MINUTIAE);
 
   for (i = 0; i < nmin; i++)
@@ -140,13 +224,15 @@ minutiae_to_xyt (struct fp_minutiae *minutiae,
   qsort ((void *) &c, (size_t) nmin, sizeof (struct minutiae_struct),
          sort_x_y);
 
+  xyt = fpi_xyt_new (nmin);
   for (i = 0; i < nmin; i++)
     {
-      xyt->xcol[i]     = c[i].col[0];
-      xyt->ycol[i]     = c[i].col[1];
-      xyt->thetacol[i] = c[i].col[2];
+      FPI_XYT_X (xyt)[i]     = c[i].col[0];
+      FPI_XYT_Y (xyt)[i]     = c[i].col[1];
+      FPI_XYT_THETA (xyt)[i] = c[i].col[2];
     }
-  xyt->nrows = nmin;
+
+  return xyt;
 }
 
 /**
@@ -170,7 +256,6 @@ fpi_print_add_from_image (FpPrint *print,
 {
   GPtrArray *minutiae;
   struct fp_minutiae _minutiae;
-  struct xyt_struct *xyt;
 
   if ((print->type != FPI_PRINT_NBIS && print->type != FPI_PRINT_SIGFM) ||
       !image)
@@ -195,15 +280,15 @@ fpi_print_add_from_image (FpPrint *print,
       _minutiae.list = (struct fp_minutia **) minutiae->pdata;
       _minutiae.alloc = minutiae->len;
 
-      xyt = g_new0 (struct xyt_struct, 1);
-      minutiae_to_xyt (&_minutiae, image->width, image->height, xyt);
-      g_ptr_array_add (print->prints, xyt);
+      g_ptr_array_add (print->prints,
+                       minutiae_to_xyt (&_minutiae, image->width, image->height));
     }
   else if (print->type == FPI_PRINT_SIGFM)
     {
       SigfmImgInfo * info = fp_image_get_sigfm_info (image);
       g_ptr_array_add (print->prints, info);
     }
+  print->identity_hash = 0;
 
   g_clear_object (&print->image);
   print->image = g_object_ref (image);
@@ -212,15 +297,75 @@ fpi_print_add_from_image (FpPrint *print,
   return TRUE;
 }
 
+/* Halve all hit counts once one of them gets here, so that the order
+ * adapts if e.g. the user starts placing the finger differently. */
+#define SUB_PRINT_HITS_MAX 64
+
+static gint
+sub_print_order_cmp (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const guint *hits = user_data;
+  guint idx_a = *(const guint *) a;
+  guint idx_b = *(const guint *) b;
+
+  if (hits[idx_a] != hits[idx_b])
+    return hits[idx_a] > hits[idx_b] ? -1 : 1;
+
+  return idx_a < idx_b ? -1 : idx_a > idx_b;
+}
+
+/* Returns the order in which the sub-prints of @template should be tried,
+ * those that matched most often first. */
+static guint *
+sub_print_order_new (FpPrint *template)
+{
+  guint *order = g_new (guint, template->prints->len);
+  guint i;
+
+  for (i = 0; i < template->prints->len; i++)
+    order[i] = i;
+
+  if (template->n_sub_print_hits == template->prints->len)
+    g_qsort_with_data (order, template->prints->len, sizeof (guint),
+                       sub_print_order_cmp, template->sub_print_hits);
+
+  return order;
+}
+
+static void
+sub_print_record_hit (FpPrint *template, guint idx)
+{
+  guint i;
+
+  /* The sub-prints changed (e.g. during enrollment), start over */
+  if (template->n_sub_print_hits != template->prints->len)
+    {
+      g_free (template->sub_print_hits);
+      template->sub_print_hits = g_new0 (guint, template->prints->len);
+      template->n_sub_print_hits = template->prints->len;
+    }
+
+  if (++template->sub_print_hits[idx] < SUB_PRINT_HITS_MAX)
+    return;
+
+  for (i = 0; i < template->n_sub_print_hits; i++)
+    template->sub_print_hits[i] /= 2;
+}
+
 /**
  * fpi_print_bz3_match:
  * @template: A #FpPrint containing one or more prints
  * @print: A newly scanned #FpPrint to test
  * @score_threshold: The BZ3 match threshold
+ * @score: (out) (optional): Return location for the best score
+ * @sub_print: (out) (optional): Return location for the index of the
+ *   sub-print in @template with the best score, or -1
  * @error: Return location for error
  *
  * Match the newly scanned @print (containing exactly one print) against the
  * prints contained in @template which will have been stored during enrollment.
+ * Matching stops at the first sub-print that reaches @score_threshold. The
+ * sub-prints that matched most often before are tried first.
  *
  * Both @template and @print need to be of type #FPI_PRINT_NBIS for this to
  * work.
@@ -228,12 +373,24 @@ fpi_print_add_from_image (FpPrint *print,
  * Returns: Whether the prints match, @error will be set if #FPI_MATCH_ERROR is returned
  */
 FpiMatchResult
-fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint score_threshold, GError **error)
+fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint score_threshold,
+                     gint *score, gint *sub_print, GError **error)
 {
-  struct xyt_struct *pstruct;
+  g_autofree struct xyt_struct *pstruct = NULL;
+  g_autofree struct xyt_struct *gstruct = NULL;
+  g_autofree guint *order = NULL;
+  FpiMatchResult result = FPI_MATCH_FAIL;
+  gint best_score = 0;
+  gint best_idx = -1;
+  gint64 trace_start;
   gint probe_len;
   gint i;
 
+  if (score)
+    *score = 0;
+  if (sub_print)
+    *sub_print = -1;
+
   /* XXX: Use a different error type? */
   if (template->type != FPI_PRINT_NBIS)
     {
@@ -249,22 +406,42 @@ fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint score_threshold, GE
       return FPI_MATCH_ERROR;
     }
 
-  pstruct = g_ptr_array_index (print->prints, 0);
+  /* The prints are stored compactly, expand them for bozorth */
+  pstruct = g_new (struct xyt_struct, 1);
+  gstruct = g_new (struct xyt_struct, 1);
+  fpi_xyt_to_struct (g_ptr_array_index (print->prints, 0), pstruct);
+  trace_start = fpi_trace_begin ();
   probe_len = bozorth_probe_init (pstruct);
+  order = sub_print_order_new (template);
 
   for (i = 0; i < template->prints->len; i++)
     {
-      struct xyt_struct *gstruct;
-      gint score;
-      gstruct = g_ptr_array_index (template->prints, i);
-      score = bozorth_to_gallery (probe_len, pstruct, gstruct);
-      fp_dbg ("score %d/%d", score, score_threshold);
-
-      if (score >= score_threshold)
-        return FPI_MATCH_SUCCESS;
+      gint cur_score;
+      fpi_xyt_to_struct (g_ptr_array_index (template->prints, order[i]), gstruct);
+      cur_score = bozorth_to_gallery (probe_len, pstruct, gstruct);
+      fp_dbg ("score %d/%d (sub-print %u)", cur_score, score_threshold, order[i]);
+
+      if (best_idx < 0 || cur_score > best_score)
+        {
+          best_score = cur_score;
+          best_idx = order[i];
+        }
+
+      if (cur_score >= score_threshold)
+        {
+          sub_print_record_hit (template, order[i]);
+          result = FPI_MATCH_SUCCESS;
+          break;
+        }
     }
+  fpi_trace_end ("match", "bozorth3 match", trace_start);
+
+  if (score)
+    *score = best_score;
+  if (sub_print)
+    *sub_print = best_idx;
 
-  return FPI_MATCH_FAIL;
+  return result;
 }
 
 /**
@@ -272,10 +449,14 @@ fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint score_threshold, GE
  * @template: A #FpPrint containing one or more prints
  * @print: A newly scanned #FpPrint to test
  * @score_threshold: The BZ3 match threshold
+ * @score: (out) (optional): Return location for the best score
+ * @sub_print: (out) (optional): Return location for the index of the
+ *   sub-print in @template with the best score, or -1
  * @error: Return location for error
  *
  * Match the newly scanned @print (containing exactly one print) against the
  * prints contained in @template which will have been stored during enrollment.
+ * The sub-prints are tried in the same order as in fpi_print_bz3_match().
  *
  * Both @template and @print need to be of type #FPI_PRINT_SIGFM for this to
  * work.
@@ -284,8 +465,20 @@ fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint score_threshold, GE
  */
 FpiMatchResult
 fpi_print_sigfm_match (FpPrint * template, FpPrint * print,
-                       gint score_threshold, GError ** error)
+                       gint score_threshold, gint * score, gint * sub_print,
+                       GError ** error)
 {
+  g_autofree guint *order = NULL;
+  FpiMatchResult result = FPI_MATCH_FAIL;
+  gint best_score = 0;
+  gint best_idx = -1;
+  gint64 trace_start;
+
+  if (score)
+    *score = 0;
+  if (sub_print)
+    *sub_print = -1;
+
   if (template->type != FPI_PRINT_SIGFM)
     {
       *error = fpi_device_error_new_msg (
@@ -295,21 +488,172 @@ fpi_print_sigfm_match (FpPrint * template, FpPrint * print,
       return FPI_MATCH_ERROR;
     }
   SigfmImgInfo * against = g_ptr_array_index (print->prints, 0);
+  trace_start = fpi_trace_begin ();
+  order = sub_print_order_new (template);
   for (int i = 0; i != template->prints->len; ++i)
     {
-      SigfmImgInfo * pinfo = g_ptr_array_index (template->prints, i);
-      int score = sigfm_match_score (pinfo, against);
-      if (score < 0)
+      SigfmImgInfo * pinfo = g_ptr_array_index (template->prints, order[i]);
+      int cur_score = sigfm_match_score (pinfo, against);
+      if (cur_score < 0)
         {
           *error = fpi_device_error_new_msg (FP_DEVICE_ERROR_DATA_INVALID,
                                              "error in sigfm_match_score");
           return FPI_MATCH_ERROR;
         }
-      fp_dbg ("sigfm score %d/%d", score, score_threshold);
-      if (score >= score_threshold)
-        return FPI_MATCH_SUCCESS;
+      fp_dbg ("sigfm score %d/%d (sub-print %u)", cur_score, score_threshold, order[i]);
+      if (best_idx < 0 || cur_score > best_score)
+        {
+          best_score = cur_score;
+          best_idx = order[i];
+        }
+      if (cur_score >= score_threshold)
+        {
+          sub_print_record_hit (template, order[i]);
+          result = FPI_MATCH_SUCCESS;
+          break;
+        }
     }
-  return FPI_MATCH_FAIL;
+  fpi_trace_end ("match", "sigfm match", trace_start);
+
+  if (score)
+    *score = best_score;
+  if (sub_print)
+    *sub_print = best_idx;
+
+  return result;
+}
+
+/**
+ * fpi_print_sigfm_fuse:
+ * @print: A #FpPrint of type #FPI_PRINT_SIGFM
+ *
+ * Registers the prints that were added during enrollment against each
+ * other and merges them into a single template without duplicate
+ * keypoints. Verification then only needs to match against one print.
+ * Prints that do not overlap with any of the others are kept as is.
+ */
+void
+fpi_print_sigfm_fuse (FpPrint *print)
+{
+  g_autoptr(GPtrArray) prints = NULL;
+  g_autofree int *merged = NULL;
+  SigfmImgInfo *fused;
+  guint i;
+
+  g_return_if_fail (print->type == FPI_PRINT_SIGFM);
+
+  if (print->prints->len < 2)
+    return;
+
+  merged = g_new0 (int, print->prints->len);
+  fused = sigfm_fuse_info ((SigfmImgInfo **) print->prints->pdata,
+                           print->prints->len, merged);
+  if (!fused)
+    {
+      fp_warn ("Could not fuse SIGFM prints, keeping them separately");
+      return;
+    }
+
+  prints = g_steal_pointer (&print->prints);
+  print->prints = g_ptr_array_new_with_free_func ((GDestroyNotify) sigfm_free_info);
+  g_ptr_array_add (print->prints, fused);
+
+  for (i = 0; i < prints->len; i++)
+    if (!merged[i])
+      g_ptr_array_add (print->prints, g_steal_pointer (&prints->pdata[i]));
+  print->identity_hash = 0;
+
+  fp_dbg ("Fused %u SIGFM prints into %u with %d keypoints", prints->len,
+          print->prints->len, sigfm_keypoints_count (fused));
+}
+
+static guint
+hash_bytes (guint hash, gconstpointer data, gsize len)
+{
+  const guint8 *bytes = data;
+  gsize i;
+
+  /* FNV-1a */
+  for (i = 0; i < len; i++)
+    {
+      hash ^= bytes[i];
+      hash *= 16777619;
+    }
+
+  return hash;
+}
+
+static guint
+hash_string (guint hash, const gchar *str)
+{
+  /* Include the terminating NUL so that NULL and "" differ */
+  if (!str)
+    return hash * 31;
+
+  return hash_bytes (hash, str, strlen (str) + 1);
+}
+
+/**
+ * fpi_print_hash:
+ * @print: A #FpPrint
+ *
+ * Computes a hash of the information that fp_print_equal() compares, so
+ * that equal prints have the same hash. Together with fp_print_equal()
+ * it can be used for a #GHashTable of prints.
+ *
+ * The hash is cached, so calling this repeatedly is cheap. It is updated
+ * when the print data is modified using the fpi_print functions.
+ *
+ * Returns: The hash of @print
+ */
+guint
+fpi_print_hash (FpPrint *print)
+{
+  guint hash = 2166136261u;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_PRINT (print), 0);
+
+  if (print->identity_hash)
+    return print->identity_hash;
+
+  hash = hash_bytes (hash, &print->type, sizeof (print->type));
+  hash = hash_string (hash, print->driver);
+  hash = hash_string (hash, print->device_id);
+
+  if (print->type == FPI_PRINT_RAW && print->data)
+    {
+      g_autoptr(GVariant) normal = g_variant_get_normal_form (print->data);
+
+      hash = hash_string (hash, g_variant_get_type_string (normal));
+      hash = hash_bytes (hash, g_variant_get_data (normal), g_variant_get_size (normal));
+    }
+  else if (print->type == FPI_PRINT_NBIS)
+    {
+      for (i = 0; i < print->prints->len; i++)
+        {
+          FpiXyt *xyt = g_ptr_array_index (print->prints, i);
+
+          hash = hash_bytes (hash, xyt, fpi_xyt_size (xyt));
+        }
+    }
+  else if (print->type == FPI_PRINT_SIGFM)
+    {
+      for (i = 0; i < print->prints->len; i++)
+        {
+          int len;
+          unsigned char *serialized =
+            sigfm_serialize_binary (g_ptr_array_index (print->prints, i), &len);
+
+          hash = hash_bytes (hash, serialized, len);
+          free (serialized);
+        }
+    }
+
+  /* 0 means that the hash was not computed yet */
+  print->identity_hash = hash ? hash : 1;
+
+  return print->identity_hash;
 }
 
 /**
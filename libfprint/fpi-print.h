@@ -47,10 +47,20 @@ gboolean fpi_print_add_from_image (FpPrint *print,
 FpiMatchResult fpi_print_bz3_match (FpPrint *temp,
                                     FpPrint *print,
                                     gint     score_threshold,
+                                    gint    *score,
+                                    gint    *sub_print,
                                     GError **error);
 
 FpiMatchResult fpi_print_sigfm_match (FpPrint * template, FpPrint * print,
-                                      gint score_threshold, GError * *error);
+                                      gint score_threshold, gint * score,
+                                      gint * sub_print, GError * *error);
+
+void fpi_print_sigfm_fuse (FpPrint *print);
+
+void fpi_print_set_match_info (FpPrint           *print,
+                               const FpMatchInfo *info);
+
+guint fpi_print_hash (FpPrint *print);
 
 /* Helpers to encode metadata into user ID strings. */
 gchar * fpi_print_generate_user_id (FpPrint * print);
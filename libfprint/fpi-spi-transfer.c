@@ -27,6 +27,26 @@
 #define SPIDEV_BLOCK_SIZE_FALLBACK 4096
 static gsize block_size = 0;
 
+static int spi_ioctl_default (int                      spidev_fd,
+                              struct spi_ioc_transfer *xfer,
+                              guint                    n_xfer);
+static FpiSpiTransferIoctlFunc spi_ioctl = spi_ioctl_default;
+/* The I/O thread of a spidev quits after being idle for this long */
+#define SPI_IO_IDLE_TIMEOUT_US (5 * G_USEC_PER_SEC)
+/* Limit for the transfers merged into one ioctl, SPI_IOC_MESSAGE() can
+ * describe at most 511 segments. */
+#define SPI_IO_MAX_MERGE 32
+
+typedef struct
+{
+  int          spidev_fd;
+  GAsyncQueue *queue;
+} SpiIoThread;
+
+/* spidev fd -> SpiIoThread */
+G_LOCK_DEFINE_STATIC (spi_io_threads);
+static GHashTable *spi_io_threads = NULL;
+
 /**
  * SECTION:fpi-spi-transfer
  * @title: SPI transfer helpers
@@ -41,6 +61,13 @@ static gsize block_size = 0;
  * Drivers should always use this API rather than calling read/write/ioctl on
  * the spidev device.
  *
+ * Asynchronous transfers are run in order by an I/O thread that exists for
+ * each spidev device while it is in use. Transfers that are queued at the
+ * same time are merged into a single ioctl if they fit into the spidev
+ * buffer together. The chip is deselected between them, so the bus sees the
+ * same messages as with separate ioctls. Each transfer still completes on
+ * its own, but if the merged ioctl fails, all of its transfers fail.
+ *
  * Setting G_MESSAGES_DEBUG and FP_DEBUG_TRANSFER will result in the message
  * content to be dumped.
  */
@@ -103,23 +130,13 @@ log_transfer (FpiSpiTransfer *transfer, gboolean submit, GError *error)
     }
 }
 
-/**
- * fpi_spi_transfer_new:
- * @device: The #FpDevice the transfer is for
- * @spidev_fd: The file descriptor for the spidev device
- *
- * Creates a new #FpiSpiTransfer.
- *
- * Returns: (transfer full): A newly created #FpiSpiTransfer
- */
-FpiSpiTransfer *
-fpi_spi_transfer_new (FpDevice * device, int spidev_fd)
+/* Read once, the I/O threads only use it after a transfer was created */
+static void
+spi_init_block_size (void)
 {
-  FpiSpiTransfer *self;
+  static gsize initialized = 0;
 
-  g_assert (FP_IS_DEVICE (device));
-
-  if (G_UNLIKELY (block_size == 0))
+  if (g_once_init_enter (&initialized))
     {
       g_autoptr(GError) error = NULL;
       g_autofree char *contents = NULL;
@@ -139,7 +156,28 @@ fpi_spi_transfer_new (FpDevice * device, int spidev_fd)
         {
           g_message ("Failed to read spidev block size, using %" G_GSIZE_FORMAT, block_size);
         }
+
+      g_once_init_leave (&initialized, 1);
     }
+}
+
+/**
+ * fpi_spi_transfer_new:
+ * @device: The #FpDevice the transfer is for
+ * @spidev_fd: The file descriptor for the spidev device
+ *
+ * Creates a new #FpiSpiTransfer.
+ *
+ * Returns: (transfer full): A newly created #FpiSpiTransfer
+ */
+FpiSpiTransfer *
+fpi_spi_transfer_new (FpDevice * device, int spidev_fd)
+{
+  FpiSpiTransfer *self;
+
+  g_assert (FP_IS_DEVICE (device));
+
+  spi_init_block_size ();
 
   self = g_slice_new0 (FpiSpiTransfer);
   self->ref_count = 1;
@@ -310,6 +348,20 @@ transfer_finish_cb (GObject *source_object, GAsyncResult *res, gpointer user_dat
   callback (transfer, transfer->device, transfer->user_data, error);
 }
 
+static int
+spi_ioctl_default (int spidev_fd, struct spi_ioc_transfer *xfer, guint n_xfer)
+{
+  /* This ioctl cannot be interrupted. */
+  return ioctl (spidev_fd, SPI_IOC_MESSAGE (n_xfer), xfer);
+}
+
+/* Replaces the spidev ioctl for the unit tests */
+void
+fpi_spi_transfer_set_ioctl_func (FpiSpiTransferIoctlFunc func)
+{
+  spi_ioctl = func ? func : spi_ioctl_default;
+}
+
 static int
 transfer_chunk (FpiSpiTransfer *transfer, gsize full_length, gsize *transferred)
 {
@@ -373,8 +425,7 @@ transfer_chunk (FpiSpiTransfer *transfer, gsize full_length, gsize *transferred)
       xfer[transfers - 1].cs_change = TRUE;
     }
 
-  /* This ioctl cannot be interrupted. */
-  status = ioctl (transfer->spidev_fd, SPI_IOC_MESSAGE (transfers), xfer);
+  status = spi_ioctl (transfer->spidev_fd, xfer, transfers);
 
   if (status >= 0)
     *transferred += len;
@@ -382,47 +433,254 @@ transfer_chunk (FpiSpiTransfer *transfer, gsize full_length, gsize *transferred)
   return status;
 }
 
-static void
-transfer_thread_func (GTask        *task,
-                      gpointer      source_object,
-                      gpointer      task_data,
-                      GCancellable *cancellable)
+static gsize
+transfer_full_length (FpiSpiTransfer *transfer)
+{
+  gsize full_length = 0;
+
+  if (transfer->buffer_wr)
+    full_length += transfer->length_wr;
+  if (transfer->buffer_rd)
+    full_length += transfer->length_rd;
+
+  return full_length;
+}
+
+static gboolean
+transfer_run (FpiSpiTransfer *transfer, GError **error)
 {
-  FpiSpiTransfer *transfer = (FpiSpiTransfer *) task_data;
   gsize full_length;
   gsize transferred = 0;
   int status = 0;
 
   if (transfer->buffer_wr == NULL && transfer->buffer_rd == NULL)
     {
-      g_task_return_new_error (task,
-                               G_IO_ERROR,
-                               G_IO_ERROR_INVALID_ARGUMENT,
-                               "Transfer with neither write or read!");
-      return;
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_ARGUMENT,
+                   "Transfer with neither write or read!");
+      return FALSE;
     }
 
-  full_length = 0;
-  if (transfer->buffer_wr)
-    full_length += transfer->length_wr;
-  if (transfer->buffer_rd)
-    full_length += transfer->length_rd;
+  full_length = transfer_full_length (transfer);
 
   while (transferred < full_length && status >= 0)
     status = transfer_chunk (transfer, full_length, &transferred);
 
   if (status < 0)
     {
-      g_task_return_new_error (task,
-                               G_IO_ERROR,
-                               g_io_error_from_errno (errno),
-                               "Error invoking ioctl for SPI transfer (%d)",
-                               errno);
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errno),
+                   "Error invoking ioctl for SPI transfer (%d)",
+                   errno);
+      return FALSE;
     }
+
+  return TRUE;
+}
+
+static void
+transfer_thread_func (GTask        *task,
+                      gpointer      source_object,
+                      gpointer      task_data,
+                      GCancellable *cancellable)
+{
+  FpiSpiTransfer *transfer = (FpiSpiTransfer *) task_data;
+  GError *error = NULL;
+
+  if (!transfer_run (transfer, &error))
+    g_task_return_error (task, error);
   else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+spi_io_run_task (GTask *task)
+{
+  transfer_thread_func (task, NULL, g_task_get_task_data (task), NULL);
+  g_object_unref (task);
+}
+
+/* Transfers that need to be split are never merged */
+static gboolean
+spi_io_can_merge (GTask *task)
+{
+  FpiSpiTransfer *transfer = g_task_get_task_data (task);
+
+  if (transfer->buffer_wr == NULL && transfer->buffer_rd == NULL)
+    return FALSE;
+
+  return transfer_full_length (transfer) <= block_size;
+}
+
+static void
+spi_io_run_merged (GPtrArray *tasks)
+{
+  g_autofree struct spi_ioc_transfer *xfer = NULL;
+  FpiSpiTransfer *transfer = NULL;
+  guint n_xfer = 0;
+  int status;
+  int errsv;
+  guint i;
+
+  xfer = g_new0 (struct spi_ioc_transfer, tasks->len * 2);
+
+  for (i = 0; i < tasks->len; i++)
+    {
+      transfer = g_task_get_task_data (g_ptr_array_index (tasks, i));
+
+      if (transfer->buffer_wr)
+        {
+          xfer[n_xfer].tx_buf = (gsize) transfer->buffer_wr;
+          xfer[n_xfer].len = transfer->length_wr;
+          n_xfer += 1;
+        }
+
+      if (transfer->buffer_rd)
+        {
+          xfer[n_xfer].rx_buf = (gsize) transfer->buffer_rd;
+          xfer[n_xfer].len = transfer->length_rd;
+          n_xfer += 1;
+        }
+
+      /* Deselect the chip between transfers, as separate ioctls would. On the
+       * last segment cs_change would keep the chip selected instead. */
+      if (i + 1 < tasks->len)
+        xfer[n_xfer - 1].cs_change = TRUE;
+    }
+
+  status = spi_ioctl (transfer->spidev_fd, xfer, n_xfer);
+  errsv = errno;
+
+  for (i = 0; i < tasks->len; i++)
+    {
+      GTask *task = g_ptr_array_index (tasks, i);
+
+      if (status < 0)
+        g_task_return_new_error (task,
+                                 G_IO_ERROR,
+                                 g_io_error_from_errno (errsv),
+                                 "Error invoking ioctl for SPI transfer (%d)",
+                                 errsv);
+      else
+        g_task_return_boolean (task, TRUE);
+
+      g_object_unref (task);
+    }
+}
+
+static gpointer
+spi_io_thread_func (gpointer user_data)
+{
+  SpiIoThread *io = user_data;
+  g_autoptr(GPtrArray) merged = g_ptr_array_new ();
+  GTask *next = NULL;
+
+  while (TRUE)
+    {
+      GTask *task;
+      gsize merged_length;
+
+      /* A transfer that could not be merged into the previous ioctl */
+      if (next)
+        task = g_steal_pointer (&next);
+      else
+        task = g_async_queue_timeout_pop (io->queue, SPI_IO_IDLE_TIMEOUT_US);
+
+      if (!task)
+        {
+          gboolean idle;
+
+          /* New transfers are queued with the lock held */
+          G_LOCK (spi_io_threads);
+          idle = g_async_queue_length (io->queue) == 0;
+          if (idle)
+            g_hash_table_remove (spi_io_threads, GINT_TO_POINTER (io->spidev_fd));
+          G_UNLOCK (spi_io_threads);
+
+          if (idle)
+            break;
+          continue;
+        }
+
+      /* The result would be an error anyway, so skip the transfer */
+      if (g_task_return_error_if_cancelled (task))
+        {
+          g_object_unref (task);
+          continue;
+        }
+
+      if (!spi_io_can_merge (task))
+        {
+          spi_io_run_task (task);
+          continue;
+        }
+
+      /* Take the transfers that are already waiting, as long as they fit
+       * into the spidev buffer together. */
+      g_ptr_array_set_size (merged, 0);
+      g_ptr_array_add (merged, task);
+      merged_length = transfer_full_length (g_task_get_task_data (task));
+
+      while (merged->len < SPI_IO_MAX_MERGE &&
+             (next = g_async_queue_try_pop (io->queue)))
+        {
+          gsize length;
+
+          if (g_task_return_error_if_cancelled (next))
+            {
+              g_clear_object (&next);
+              continue;
+            }
+
+          if (!spi_io_can_merge (next))
+            break;
+
+          length = transfer_full_length (g_task_get_task_data (next));
+          if (merged_length + length > block_size)
+            break;
+
+          merged_length += length;
+          g_ptr_array_add (merged, g_steal_pointer (&next));
+        }
+
+      if (merged->len == 1)
+        spi_io_run_task (task);
+      else
+        spi_io_run_merged (merged);
+    }
+
+  g_async_queue_unref (io->queue);
+  g_free (io);
+
+  return NULL;
+}
+
+static void
+spi_io_queue_task (int spidev_fd, GTask *task)
+{
+  SpiIoThread *io;
+
+  G_LOCK (spi_io_threads);
+
+  if (!spi_io_threads)
+    spi_io_threads = g_hash_table_new (NULL, NULL);
+
+  io = g_hash_table_lookup (spi_io_threads, GINT_TO_POINTER (spidev_fd));
+  if (!io)
     {
-      g_task_return_boolean (task, TRUE);
+      io = g_new0 (SpiIoThread, 1);
+      io->spidev_fd = spidev_fd;
+      io->queue = g_async_queue_new ();
+      g_hash_table_insert (spi_io_threads, GINT_TO_POINTER (spidev_fd), io);
+
+      g_thread_unref (g_thread_new ("fpi-spi-io", spi_io_thread_func, io));
     }
+
+  g_async_queue_push (io->queue, task);
+
+  G_UNLOCK (spi_io_threads);
 }
 
 /**
@@ -434,8 +692,9 @@ transfer_thread_func (GTask        *task,
  *
  * Submit an SPI transfer with a specific timeout and callback functions.
  *
- * The underlying transfer cannot be cancelled. The current implementation
- * will only call @callback after the transfer has been completed.
+ * The underlying transfer cannot be cancelled once it was started. The
+ * current implementation will only call @callback after the transfer has
+ * been completed or was dropped from the queue because of the cancellation.
  *
  * Note that #FpiSpiTransfer will be stolen when this function is called.
  * So that all associated data will be free'ed automatically, after the
@@ -465,10 +724,10 @@ fpi_spi_transfer_submit (FpiSpiTransfer        *transfer,
                      transfer_finish_cb,
                      NULL);
   g_task_set_task_data (task,
-                        g_steal_pointer (&transfer),
+                        transfer,
                         (GDestroyNotify) fpi_spi_transfer_unref);
 
-  g_task_run_in_thread (task, transfer_thread_func);
+  spi_io_queue_task (transfer->spidev_fd, g_steal_pointer (&task));
 }
 
 /**
@@ -110,4 +110,14 @@ gboolean           fpi_spi_transfer_submit_sync (FpiSpiTransfer *transfer,
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiSpiTransfer, fpi_spi_transfer_unref)
 
+#ifndef __GTK_DOC_IGNORE__
+/* Internal, lets the unit tests replace the spidev ioctl */
+struct spi_ioc_transfer;
+typedef int (*FpiSpiTransferIoctlFunc)(int                      spidev_fd,
+                                       struct spi_ioc_transfer *xfer,
+                                       guint                    n_xfer);
+
+void fpi_spi_transfer_set_ioctl_func (FpiSpiTransferIoctlFunc func);
+#endif
+
 G_END_DECLS
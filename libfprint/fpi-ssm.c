@@ -23,6 +23,7 @@
 
 #include "drivers_api.h"
 #include "fpi-ssm.h"
+#include "fpi-trace.h"
 
 
 /**
@@ -68,8 +69,28 @@
  * communication with the device (such as a USB transfer), and the
  * callback function iterates the machine to the next state
  * upon success (or fails).
+ *
+ * Transitions using fpi_ssm_next_state() and fpi_ssm_jump_to_state() call
+ * the handler of the new state synchronously, so that chains of states
+ * which do not need to wait for the device run without returning to the
+ * main loop. To bound the stack usage, once #FPI_SSM_MAX_INLINE_DEPTH
+ * handlers are nested the next handler is deferred to the main loop.
+ * A deferred handler is dropped if the machine is moved on externally before
+ * it runs.
+ * Delayed transitions of a state machine all share a single timer source.
+ *
+ * For profiling, the number of times each state was entered and the time
+ * spent in it is recorded, see fpi_ssm_get_state_stats().
  */
 
+typedef enum {
+  FPI_SSM_TIMEOUT_NONE,
+  FPI_SSM_TIMEOUT_NEXT_STATE,
+  FPI_SSM_TIMEOUT_JUMP_TO_STATE,
+  FPI_SSM_TIMEOUT_COMPLETE,
+  FPI_SSM_TIMEOUT_CALL_HANDLER,
+} FpiSsmTimeoutAction;
+
 struct _FpiSsm
 {
   FpDevice               *dev;
@@ -82,12 +103,19 @@ struct _FpiSsm
   int                     cur_state;
   gboolean                completed;
   gboolean                silence;
-  GSource                *timeout;
+  GSource                *timer;
+  FpiSsmTimeoutAction     timeout_action;
+  int                     timeout_state;
+  gint64                  state_entered;
+  FpiSsmStateStats       *stats;
   GError                 *error;
   FpiSsmCompletedCallback callback;
   FpiSsmHandlerCallback   handler;
 };
 
+/* Number of state handlers currently running in this thread */
+static GPrivate ssm_handler_depth = G_PRIVATE_INIT (NULL);
+
 /**
  * fpi_ssm_new:
  * @dev: a #fp_dev fingerprint device
@@ -138,6 +166,7 @@ fpi_ssm_new_full (FpDevice             *dev,
   machine->dev = dev;
   machine->name = g_strdup (machine_name);
   machine->completed = TRUE;
+  machine->stats = g_new0 (FpiSsmStateStats, nr_states);
   return machine;
 }
 
@@ -195,30 +224,72 @@ fpi_ssm_get_device (FpiSsm *machine)
   return machine->dev;
 }
 
+/* A handler deferred to unwind the stack is not a pending transition, it
+ * is dropped if the machine moves on before it runs. */
+static gboolean
+fpi_ssm_has_delayed_transition (FpiSsm *machine)
+{
+  return machine->timeout_action != FPI_SSM_TIMEOUT_NONE &&
+         machine->timeout_action != FPI_SSM_TIMEOUT_CALL_HANDLER;
+}
+
 static void
 fpi_ssm_clear_delayed_action (FpiSsm *machine)
 {
   g_return_if_fail (machine);
 
-  g_clear_pointer (&machine->timeout, g_source_destroy);
+  machine->timeout_action = FPI_SSM_TIMEOUT_NONE;
+  if (machine->timer)
+    fpi_device_timer_arm (machine->timer, -1);
 }
 
+static void on_device_timeout (FpDevice *dev,
+                               gpointer  user_data);
+
 static void
-fpi_ssm_set_delayed_action_timeout (FpiSsm        *machine,
-                                    int            delay,
-                                    FpTimeoutFunc  callback,
-                                    gpointer       user_data,
-                                    GDestroyNotify destroy_func)
+fpi_ssm_set_delayed_action_timeout (FpiSsm             *machine,
+                                    int                 delay,
+                                    FpiSsmTimeoutAction action,
+                                    int                 state)
 {
   g_return_if_fail (machine);
 
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_ssm_has_delayed_transition (machine));
 
-  fpi_ssm_clear_delayed_action (machine);
+  if (!machine->timer)
+    {
+      g_autofree char *source_name = NULL;
+
+      /* The timer belongs to the machine, it may outlive the device */
+      machine->timer = fpi_device_add_timer (machine->dev, on_device_timeout,
+                                             machine, NULL);
+      source_name = g_strdup_printf ("[%s] ssm %s timer",
+                                     fp_device_get_device_id (machine->dev),
+                                     machine->name);
+      g_source_set_name (machine->timer, source_name);
+    }
+
+  machine->timeout_action = action;
+  machine->timeout_state = state;
+  fpi_device_timer_arm (machine->timer, delay);
+}
+
+/* Accounts the time spent in the current state */
+static void
+fpi_ssm_leave_state (FpiSsm *machine)
+{
+  FpiSsmStateStats *stats;
+  gint64 elapsed;
+
+  if (machine->state_entered == 0)
+    return;
 
-  machine->timeout = fpi_device_add_timeout (machine->dev, delay, callback,
-                                             user_data, destroy_func);
+  stats = &machine->stats[machine->cur_state];
+  elapsed = g_get_monotonic_time () - machine->state_entered;
+  stats->total_time += elapsed;
+  stats->max_time = MAX (stats->max_time, elapsed);
+  machine->state_entered = 0;
 }
 
 /**
@@ -234,13 +305,16 @@ fpi_ssm_free (FpiSsm *machine)
   if (!machine)
     return;
 
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_ssm_has_delayed_transition (machine));
 
   if (machine->ssm_data_destroy)
     g_clear_pointer (&machine->ssm_data, machine->ssm_data_destroy);
   g_clear_pointer (&machine->error, g_error_free);
   g_clear_pointer (&machine->name, g_free);
-  fpi_ssm_clear_delayed_action (machine);
+  if (machine->timer)
+    g_source_destroy (machine->timer);
+  g_clear_pointer (&machine->timer, g_source_unref);
+  g_clear_pointer (&machine->stats, g_free);
   g_free (machine);
 }
 
@@ -248,10 +322,32 @@ fpi_ssm_free (FpiSsm *machine)
 static void
 __ssm_call_handler (FpiSsm *machine, gboolean force_msg)
 {
+  gint depth = GPOINTER_TO_INT (g_private_get (&ssm_handler_depth));
+
+  if (depth >= FPI_SSM_MAX_INLINE_DEPTH)
+    {
+      /* Unwind the stack before entering the state */
+      fpi_ssm_set_delayed_action_timeout (machine, 0,
+                                          FPI_SSM_TIMEOUT_CALL_HANDLER,
+                                          machine->cur_state);
+      return;
+    }
+
   if (force_msg || !machine->silence)
     fp_dbg ("[%s] %s entering state %d", fp_device_get_driver (machine->dev),
             machine->name, machine->cur_state);
+  fpi_trace_counter ("ssm", machine->name, machine->cur_state);
+
+  if (machine->cur_state >= 0 && machine->cur_state < machine->nr_states)
+    {
+      machine->stats[machine->cur_state].entries++;
+      machine->state_entered = g_get_monotonic_time ();
+    }
+
+  /* The machine may be gone once the handler returns */
+  g_private_set (&ssm_handler_depth, GINT_TO_POINTER (depth + 1));
   machine->handler (machine, machine->dev);
+  g_private_set (&ssm_handler_depth, GINT_TO_POINTER (depth));
 }
 
 /**
@@ -274,6 +370,7 @@ fpi_ssm_start (FpiSsm *ssm, FpiSsmCompletedCallback callback)
 
   BUG_ON (!ssm->completed);
   ssm->callback = callback;
+  ssm->state_entered = 0;
   ssm->cur_state = 0;
   ssm->completed = FALSE;
   ssm->error = NULL;
@@ -309,7 +406,7 @@ fpi_ssm_start_subsm (FpiSsm *parent, FpiSsm *child)
   g_return_if_fail (parent != NULL);
   g_return_if_fail (child != NULL);
 
-  BUG_ON (parent->timeout);
+  BUG_ON (fpi_ssm_has_delayed_transition (parent));
   child->parentsm = parent;
 
   fpi_ssm_clear_delayed_action (parent);
@@ -318,6 +415,29 @@ fpi_ssm_start_subsm (FpiSsm *parent, FpiSsm *child)
   fpi_ssm_start (child, __subsm_complete);
 }
 
+static void
+fpi_ssm_log_state_stats (FpiSsm *machine)
+{
+  g_autoptr(GString) line = NULL;
+  int i;
+
+  line = g_string_new (NULL);
+  for (i = 0; i < machine->nr_states; i++)
+    {
+      FpiSsmStateStats *stats = &machine->stats[i];
+
+      if (stats->entries == 0)
+        continue;
+
+      g_string_append_printf (line, " %d: %ux %.3fms (max %.3fms)", i,
+                              stats->entries, stats->total_time / 1000.0,
+                              stats->max_time / 1000.0);
+    }
+
+  fp_dbg ("[%s] %s state timings:%s", fp_device_get_driver (machine->dev),
+          machine->name, line->str);
+}
+
 /**
  * fpi_ssm_mark_completed:
  * @machine: an #FpiSsm state machine
@@ -335,9 +455,10 @@ fpi_ssm_mark_completed (FpiSsm *machine)
   g_return_if_fail (machine != NULL);
 
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_ssm_has_delayed_transition (machine));
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_leave_state (machine);
 
   /* complete in a cleanup state just moves forward one step */
   if (machine->cur_state < machine->start_cleanup)
@@ -360,6 +481,7 @@ fpi_ssm_mark_completed (FpiSsm *machine)
   else
     fp_dbg ("[%s] %s completed successfully", fp_device_get_driver (machine->dev),
             machine->name);
+  fpi_ssm_log_state_stats (machine);
   if (machine->callback)
     {
       GError *error = machine->error ? g_error_copy (machine->error) : NULL;
@@ -369,16 +491,6 @@ fpi_ssm_mark_completed (FpiSsm *machine)
   fpi_ssm_free (machine);
 }
 
-static void
-on_device_timeout_complete (FpDevice *dev,
-                            gpointer  user_data)
-{
-  FpiSsm *machine = user_data;
-
-  machine->timeout = NULL;
-  fpi_ssm_mark_completed (machine);
-}
-
 /**
  * fpi_ssm_mark_completed_delayed:
  * @machine: an #FpiSsm state machine
@@ -392,18 +504,10 @@ void
 fpi_ssm_mark_completed_delayed (FpiSsm *machine,
                                 int     delay)
 {
-  g_autofree char *source_name = NULL;
-
   g_return_if_fail (machine != NULL);
 
   fpi_ssm_set_delayed_action_timeout (machine, delay,
-                                      on_device_timeout_complete,
-                                      machine, NULL);
-
-  source_name = g_strdup_printf ("[%s] ssm %s complete %d",
-                                 fp_device_get_device_id (machine->dev),
-                                 machine->name, machine->cur_state + 1);
-  g_source_set_name (machine->timeout, source_name);
+                                      FPI_SSM_TIMEOUT_COMPLETE, 0);
 }
 
 /**
@@ -454,9 +558,10 @@ fpi_ssm_next_state (FpiSsm *machine)
   g_return_if_fail (machine != NULL);
 
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_ssm_has_delayed_transition (machine));
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_leave_state (machine);
 
   machine->cur_state++;
   if (machine->cur_state == machine->nr_states)
@@ -470,7 +575,7 @@ fpi_ssm_cancel_delayed_state_change (FpiSsm *machine)
 {
   g_return_if_fail (machine);
   BUG_ON (machine->completed);
-  BUG_ON (machine->timeout == NULL);
+  BUG_ON (machine->timeout_action == FPI_SSM_TIMEOUT_NONE);
 
   fp_dbg ("[%s] %s cancelled delayed state change",
           fp_device_get_driver (machine->dev), machine->name);
@@ -478,16 +583,6 @@ fpi_ssm_cancel_delayed_state_change (FpiSsm *machine)
   fpi_ssm_clear_delayed_action (machine);
 }
 
-static void
-on_device_timeout_next_state (FpDevice *dev,
-                              gpointer  user_data)
-{
-  FpiSsm *machine = user_data;
-
-  machine->timeout = NULL;
-  fpi_ssm_next_state (machine);
-}
-
 /**
  * fpi_ssm_next_state_delayed:
  * @machine: an #FpiSsm state machine
@@ -501,18 +596,10 @@ void
 fpi_ssm_next_state_delayed (FpiSsm *machine,
                             int     delay)
 {
-  g_autofree char *source_name = NULL;
-
   g_return_if_fail (machine != NULL);
 
   fpi_ssm_set_delayed_action_timeout (machine, delay,
-                                      on_device_timeout_next_state,
-                                      machine, NULL);
-
-  source_name = g_strdup_printf ("[%s] ssm %s jump to next state %d",
-                                 fp_device_get_device_id (machine->dev),
-                                 machine->name, machine->cur_state + 1);
-  g_source_set_name (machine->timeout, source_name);
+                                      FPI_SSM_TIMEOUT_NEXT_STATE, 0);
 }
 
 /**
@@ -531,9 +618,10 @@ fpi_ssm_jump_to_state (FpiSsm *machine, int state)
 
   BUG_ON (machine->completed);
   BUG_ON (state < 0 || state > machine->nr_states);
-  BUG_ON (machine->timeout != NULL);
+  BUG_ON (fpi_ssm_has_delayed_transition (machine));
 
   fpi_ssm_clear_delayed_action (machine);
+  fpi_ssm_leave_state (machine);
 
   machine->cur_state = state;
   if (machine->cur_state == machine->nr_states)
@@ -542,22 +630,6 @@ fpi_ssm_jump_to_state (FpiSsm *machine, int state)
     __ssm_call_handler (machine, FALSE);
 }
 
-typedef struct
-{
-  FpiSsm *machine;
-  int     next_state;
-} FpiSsmJumpToStateDelayedData;
-
-static void
-on_device_timeout_jump_to_state (FpDevice *dev,
-                                 gpointer  user_data)
-{
-  FpiSsmJumpToStateDelayedData *data = user_data;
-
-  data->machine->timeout = NULL;
-  fpi_ssm_jump_to_state (data->machine, data->next_state);
-}
-
 /**
  * fpi_ssm_jump_to_state_delayed:
  * @machine: an #FpiSsm state machine
@@ -572,24 +644,43 @@ fpi_ssm_jump_to_state_delayed (FpiSsm *machine,
                                int     state,
                                int     delay)
 {
-  FpiSsmJumpToStateDelayedData *data;
-  g_autofree char *source_name = NULL;
-
   g_return_if_fail (machine != NULL);
   BUG_ON (state < 0 || state > machine->nr_states);
 
-  data = g_new0 (FpiSsmJumpToStateDelayedData, 1);
-  data->machine = machine;
-  data->next_state = state;
-
   fpi_ssm_set_delayed_action_timeout (machine, delay,
-                                      on_device_timeout_jump_to_state,
-                                      data, g_free);
+                                      FPI_SSM_TIMEOUT_JUMP_TO_STATE, state);
+}
 
-  source_name = g_strdup_printf ("[%s] ssm %s jump to state %d",
-                                 fp_device_get_device_id (machine->dev),
-                                 machine->name, state);
-  g_source_set_name (machine->timeout, source_name);
+static void
+on_device_timeout (FpDevice *dev,
+                   gpointer  user_data)
+{
+  FpiSsm *machine = user_data;
+  FpiSsmTimeoutAction action = machine->timeout_action;
+
+  machine->timeout_action = FPI_SSM_TIMEOUT_NONE;
+
+  switch (action)
+    {
+    case FPI_SSM_TIMEOUT_NEXT_STATE:
+      fpi_ssm_next_state (machine);
+      break;
+
+    case FPI_SSM_TIMEOUT_JUMP_TO_STATE:
+      fpi_ssm_jump_to_state (machine, machine->timeout_state);
+      break;
+
+    case FPI_SSM_TIMEOUT_COMPLETE:
+      fpi_ssm_mark_completed (machine);
+      break;
+
+    case FPI_SSM_TIMEOUT_CALL_HANDLER:
+      __ssm_call_handler (machine, FALSE);
+      break;
+
+    case FPI_SSM_TIMEOUT_NONE:
+      g_assert_not_reached ();
+    }
 }
 
 /**
@@ -644,6 +735,27 @@ fpi_ssm_dup_error (FpiSsm *machine)
   return NULL;
 }
 
+/**
+ * fpi_ssm_get_state_stats:
+ * @machine: an #FpiSsm state machine
+ * @state: the state to query
+ *
+ * Returns how often @state was entered and how much time was spent in it
+ * (from calling its handler until the next transition). The time spent
+ * in the current state is only accounted once the machine leaves it.
+ *
+ * Returns: (transfer none): the #FpiSsmStateStats of @state
+ */
+const FpiSsmStateStats *
+fpi_ssm_get_state_stats (FpiSsm *machine,
+                         int     state)
+{
+  g_return_val_if_fail (machine != NULL, NULL);
+  g_return_val_if_fail (state >= 0 && state < machine->nr_states, NULL);
+
+  return &machine->stats[state];
+}
+
 /**
  * fpi_ssm_silence_debug:
  * @machine: an #FpiSsm state machine
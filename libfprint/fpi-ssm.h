@@ -58,6 +58,29 @@ typedef void (*FpiSsmCompletedCallback)(FpiSsm   *ssm,
 typedef void (*FpiSsmHandlerCallback)(FpiSsm   *ssm,
                                       FpDevice *dev);
 
+/**
+ * FpiSsmStateStats:
+ * @entries: How often the state was entered
+ * @total_time: The total time spent in the state in µs
+ * @max_time: The longest time spent in the state at once in µs
+ *
+ * Profiling counters of a single state, see fpi_ssm_get_state_stats().
+ */
+typedef struct
+{
+  guint  entries;
+  gint64 total_time;
+  gint64 max_time;
+} FpiSsmStateStats;
+
+/**
+ * FPI_SSM_MAX_INLINE_DEPTH:
+ *
+ * The number of nested state handlers after which a transition is not run
+ * synchronously anymore but from the main loop.
+ */
+#define FPI_SSM_MAX_INLINE_DEPTH 32
+
 /* for library and drivers */
 #define fpi_ssm_new(dev, handler, nr_states) \
         fpi_ssm_new_full (dev, handler, nr_states, nr_states, #nr_states)
@@ -95,6 +118,8 @@ FpDevice * fpi_ssm_get_device (FpiSsm *machine);
 GError * fpi_ssm_get_error (FpiSsm *machine);
 GError * fpi_ssm_dup_error (FpiSsm *machine);
 int fpi_ssm_get_cur_state (FpiSsm *machine);
+const FpiSsmStateStats *fpi_ssm_get_state_stats (FpiSsm *machine,
+                                                 int     state);
 
 void fpi_ssm_silence_debug (FpiSsm *machine);
 
@@ -0,0 +1,381 @@
+/*
+ * Low overhead performance tracing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "trace"
+
+#include "fpi-log.h"
+#include "fpi-trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * SECTION: fpi-trace
+ * @title: Performance tracing
+ * @short_description: Recording of timing events
+ *
+ * When the `FP_TRACE` environment variable is set to a file name, libfprint
+ * records timestamped events for e.g. USB transfers, state machine
+ * transitions, image processing and matching. The events are written to
+ * the file in the Chrome trace event format every second, when the
+ * process exits and when fpi_trace_flush() is called. The file is replaced
+ * atomically, so a process that is killed leaves the last complete trace.
+ * It can be opened using Perfetto or chrome://tracing.
+ *
+ * Every thread records into its own fixed size ring buffer, so recording
+ * an event does not take any locks. Only the most recent events of each
+ * thread are kept. Once a thread exits, its ring is reused by the next new
+ * thread, so one thread id in the trace may stand for several threads that
+ * did not run at the same time. If tracing is disabled, the cost is a
+ * single check of an integer.
+ */
+
+/* Must be a power of two */
+#define TRACE_RING_SIZE 8192
+#define TRACE_NAME_LEN 40
+#define TRACE_FLUSH_INTERVAL_US G_USEC_PER_SEC
+
+/* -1: disabled, 0: not yet initialized, 1: enabled */
+gint fpi_trace_state = 0;
+
+typedef struct
+{
+  /* 2 * n + 1 while the n-th event of the ring is written into the slot,
+   * 2 * n + 2 once it is complete */
+  gint         seq;
+  gint64       timestamp;
+  /* Duration for spans, the value for counters, the id for async events */
+  gint64       value;
+  const gchar *category;
+  gchar        phase;
+  gchar        name[TRACE_NAME_LEN];
+} TraceEvent;
+
+typedef struct
+{
+  guint      tid;
+  /* The owning thread exited, protected by the trace_rings lock */
+  gboolean   retired;
+  /* Number of recorded events, only written by the owning thread */
+  gint       head;
+  TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+static gchar *trace_path = NULL;
+
+G_LOCK_DEFINE_STATIC (trace_rings);
+static GPtrArray *trace_rings = NULL;
+
+/* Serializes writing the file */
+G_LOCK_DEFINE_STATIC (trace_flush);
+static gint trace_flushed_events = 0;
+static gboolean trace_finished = FALSE;
+
+static void
+trace_ring_retire (gpointer data)
+{
+  TraceRing *ring = data;
+
+  G_LOCK (trace_rings);
+  ring->retired = TRUE;
+  G_UNLOCK (trace_rings);
+}
+
+static GPrivate trace_ring_key = G_PRIVATE_INIT (trace_ring_retire);
+
+static gpointer
+trace_flush_thread (gpointer data)
+{
+  while (TRUE)
+    {
+      g_usleep (TRACE_FLUSH_INTERVAL_US);
+      fpi_trace_flush ();
+    }
+
+  return NULL;
+}
+
+static void
+trace_atexit (void)
+{
+  guint i = 0;
+
+  fpi_trace_flush ();
+
+  /* Keep the flusher thread from overwriting the final trace once rings
+   * are freed. Threads that are still running may record more events, so
+   * only the rings of exited threads can be freed. */
+  G_LOCK (trace_flush);
+  trace_finished = TRUE;
+
+  G_LOCK (trace_rings);
+  while (i < trace_rings->len)
+    {
+      TraceRing *ring = g_ptr_array_index (trace_rings, i);
+
+      if (ring->retired)
+        g_free (g_ptr_array_remove_index_fast (trace_rings, i));
+      else
+        i++;
+    }
+  G_UNLOCK (trace_rings);
+
+  G_UNLOCK (trace_flush);
+}
+
+gboolean
+fpi_trace_init (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const gchar *path = g_getenv ("FP_TRACE");
+
+      if (path && *path)
+        {
+          trace_path = g_strdup (path);
+          trace_rings = g_ptr_array_new ();
+          atexit (trace_atexit);
+          g_atomic_int_set (&fpi_trace_state, 1);
+
+          /* Without this, a process that is killed loses the trace */
+          g_thread_unref (g_thread_new ("fpi-trace", trace_flush_thread, NULL));
+        }
+      else
+        {
+          g_atomic_int_set (&fpi_trace_state, -1);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return g_atomic_int_get (&fpi_trace_state) > 0;
+}
+
+static TraceRing *
+trace_get_ring (void)
+{
+  TraceRing *ring = g_private_get (&trace_ring_key);
+  guint i;
+
+  if (G_LIKELY (ring))
+    return ring;
+
+  G_LOCK (trace_rings);
+  for (i = 0; i < trace_rings->len; i++)
+    {
+      TraceRing *retired = g_ptr_array_index (trace_rings, i);
+
+      if (retired->retired)
+        {
+          retired->retired = FALSE;
+          ring = retired;
+          break;
+        }
+    }
+
+  if (!ring)
+    {
+      ring = g_new0 (TraceRing, 1);
+      ring->tid = trace_rings->len + 1;
+      g_ptr_array_add (trace_rings, ring);
+    }
+  G_UNLOCK (trace_rings);
+
+  g_private_set (&trace_ring_key, ring);
+
+  return ring;
+}
+
+/**
+ * fpi_trace_record:
+ * @phase: The Chrome trace event phase
+ * @category: The category of the event (a static string)
+ * @name: The name of the event, it is copied (and may be truncated)
+ * @timestamp: The monotonic time of the event in µs
+ * @value: The duration, counter value or id depending on @phase
+ *
+ * Records an event, use the inline helpers instead.
+ */
+void
+fpi_trace_record (gchar        phase,
+                  const gchar *category,
+                  const gchar *name,
+                  gint64       timestamp,
+                  gint64       value)
+{
+  TraceRing *ring = trace_get_ring ();
+  gint head = ring->head;
+  TraceEvent *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+
+  /* fpi_trace_flush() skips the slot while it is written */
+  g_atomic_int_set (&event->seq, (gint) ((guint) head * 2 + 1));
+
+  event->timestamp = timestamp;
+  event->value = value;
+  event->category = category;
+  event->phase = phase;
+  g_strlcpy (event->name, name ? name : "(null)", sizeof (event->name));
+
+  g_atomic_int_set (&event->seq, (gint) ((guint) head * 2 + 2));
+  g_atomic_int_set (&ring->head, head + 1);
+}
+
+/* Copies the n-th event of a ring, fails if it was overwritten */
+static gboolean
+trace_ring_read (TraceRing *ring, gint n, TraceEvent *copy)
+{
+  TraceEvent *event = &ring->events[n & (TRACE_RING_SIZE - 1)];
+  gint seq = (gint) ((guint) n * 2 + 2);
+
+  if (g_atomic_int_get (&event->seq) != seq)
+    return FALSE;
+
+  memcpy (copy, event, sizeof (*copy));
+
+  /* The atomic access is a full barrier, the copy is only valid if the
+   * owner did not start writing the slot again while it was taken. */
+  if (g_atomic_int_get (&event->seq) != seq)
+    return FALSE;
+
+  copy->name[TRACE_NAME_LEN - 1] = '\0';
+
+  return TRUE;
+}
+
+static void
+append_json_string (GString *out, const gchar *str)
+{
+  g_string_append_c (out, '"');
+  for (; *str; str++)
+    {
+      if (*str == '"' || *str == '\\')
+        g_string_append_printf (out, "\\%c", *str);
+      else if ((guchar) str[0] < 0x20)
+        g_string_append_printf (out, "\\u%04x", (guchar) str[0]);
+      else
+        g_string_append_c (out, *str);
+    }
+  g_string_append_c (out, '"');
+}
+
+static void
+append_event (GString *out, guint pid, guint tid, const TraceEvent *event)
+{
+  g_string_append (out, ",\n{\"name\":");
+  append_json_string (out, event->name);
+  g_string_append (out, ",\"cat\":");
+  append_json_string (out, event->category);
+  g_string_append_printf (out,
+                          ",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%u,\"tid\":%u",
+                          event->phase, event->timestamp, pid, tid);
+
+  switch (event->phase)
+    {
+    case 'X':
+      g_string_append_printf (out, ",\"dur\":%" G_GINT64_FORMAT, event->value);
+      break;
+
+    case 'C':
+      g_string_append_printf (out, ",\"args\":{\"value\":%" G_GINT64_FORMAT "}", event->value);
+      break;
+
+    case 'b':
+    case 'e':
+      g_string_append_printf (out, ",\"id\":\"0x%" G_GINT64_MODIFIER "x\"", event->value);
+      break;
+    }
+
+  g_string_append_c (out, '}');
+}
+
+/**
+ * fpi_trace_flush:
+ *
+ * Writes all recorded events to the file given by the `FP_TRACE`
+ * environment variable. This happens automatically every second and when
+ * the process exits. Events that are recorded by other threads while
+ * flushing may be missing from the file.
+ */
+void
+fpi_trace_flush (void)
+{
+  g_autoptr(GString) out = NULL;
+  g_autoptr(GError) error = NULL;
+  guint pid = getpid ();
+  gint n_events = 0;
+  guint i;
+
+  if (!fpi_trace_enabled ())
+    return;
+
+  G_LOCK (trace_flush);
+  if (trace_finished)
+    {
+      G_UNLOCK (trace_flush);
+      return;
+    }
+
+  G_LOCK (trace_rings);
+
+  for (i = 0; i < trace_rings->len; i++)
+    n_events += g_atomic_int_get (&((TraceRing *) g_ptr_array_index (trace_rings, i))->head);
+
+  /* Nothing new since the last time */
+  if (n_events == trace_flushed_events)
+    {
+      G_UNLOCK (trace_rings);
+      G_UNLOCK (trace_flush);
+      return;
+    }
+
+  out = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  g_string_append_printf (out,
+                          "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                          "\"args\":{\"name\":", pid);
+  append_json_string (out, g_get_prgname () ? g_get_prgname () : "libfprint");
+  g_string_append (out, "}}");
+
+  for (i = 0; i < trace_rings->len; i++)
+    {
+      TraceRing *ring = g_ptr_array_index (trace_rings, i);
+      gint head = g_atomic_int_get (&ring->head);
+      gint first = MAX (head - TRACE_RING_SIZE, 0);
+      gint j;
+
+      for (j = first; j < head; j++)
+        {
+          TraceEvent event;
+
+          if (trace_ring_read (ring, j, &event))
+            append_event (out, pid, ring->tid, &event);
+        }
+    }
+  G_UNLOCK (trace_rings);
+
+  g_string_append (out, "\n]}\n");
+
+  if (!g_file_set_contents (trace_path, out->str, out->len, &error))
+    fp_warn ("Could not write trace to %s: %s", trace_path, error->message);
+  else
+    trace_flushed_events = n_events;
+
+  G_UNLOCK (trace_flush);
+}
@@ -0,0 +1,134 @@
+/*
+ * Low overhead performance tracing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#ifndef __GTK_DOC_IGNORE__
+/* Internal, use fpi_trace_enabled() */
+extern gint fpi_trace_state;
+
+gboolean fpi_trace_init (void);
+void     fpi_trace_record (gchar       phase,
+                           const gchar *category,
+                           const gchar *name,
+                           gint64       timestamp,
+                           gint64       value);
+#endif
+
+void fpi_trace_flush (void);
+
+/**
+ * fpi_trace_enabled:
+ *
+ * Checks whether tracing was enabled using the `FP_TRACE` environment
+ * variable. This is cheap, so there is no need to cache the result.
+ *
+ * Returns: %TRUE if events are recorded
+ */
+static inline gboolean
+fpi_trace_enabled (void)
+{
+  gint state = g_atomic_int_get (&fpi_trace_state);
+
+  if (G_LIKELY (state < 0))
+    return FALSE;
+  if (state > 0)
+    return TRUE;
+
+  return fpi_trace_init ();
+}
+
+/**
+ * fpi_trace_begin:
+ *
+ * Starts a span, pass the returned value to fpi_trace_end().
+ *
+ * Returns: The current time, or 0 if tracing is disabled
+ */
+static inline gint64
+fpi_trace_begin (void)
+{
+  return fpi_trace_enabled () ? g_get_monotonic_time () : 0;
+}
+
+/**
+ * fpi_trace_end:
+ * @category: The category of the event (a static string)
+ * @name: The name of the span
+ * @start: The value returned by fpi_trace_begin()
+ *
+ * Records a span that started at @start and ends now.
+ */
+static inline void
+fpi_trace_end (const gchar *category, const gchar *name, gint64 start)
+{
+  if (G_UNLIKELY (start != 0))
+    fpi_trace_record ('X', category, name, start, g_get_monotonic_time () - start);
+}
+
+/**
+ * fpi_trace_counter:
+ * @category: The category of the event (a static string)
+ * @name: The name of the counter
+ * @value: The new value of the counter
+ *
+ * Records a change of a counter, e.g. the state of a state machine.
+ */
+static inline void
+fpi_trace_counter (const gchar *category, const gchar *name, gint64 value)
+{
+  if (fpi_trace_enabled ())
+    fpi_trace_record ('C', category, name, g_get_monotonic_time (), value);
+}
+
+/**
+ * fpi_trace_async_begin:
+ * @category: The category of the event (a static string)
+ * @name: The name of the operation
+ * @id: A pointer identifying the operation, e.g. a transfer
+ *
+ * Records the start of an asynchronous operation which may finish in a
+ * different thread or after other operations have started.
+ */
+static inline void
+fpi_trace_async_begin (const gchar *category, const gchar *name, gconstpointer id)
+{
+  if (fpi_trace_enabled ())
+    fpi_trace_record ('b', category, name, g_get_monotonic_time (), GPOINTER_TO_SIZE (id));
+}
+
+/**
+ * fpi_trace_async_end:
+ * @category: The category passed to fpi_trace_async_begin()
+ * @name: The name passed to fpi_trace_async_begin()
+ * @id: The id passed to fpi_trace_async_begin()
+ *
+ * Records the end of an asynchronous operation.
+ */
+static inline void
+fpi_trace_async_end (const gchar *category, const gchar *name, gconstpointer id)
+{
+  if (fpi_trace_enabled ())
+    fpi_trace_record ('e', category, name, g_get_monotonic_time (), GPOINTER_TO_SIZE (id));
+}
+
+G_END_DECLS
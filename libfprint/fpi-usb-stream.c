@@ -0,0 +1,391 @@
+/*
+ * Streaming USB bulk reads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "usb-stream"
+
+#include "fpi-log.h"
+#include "fpi-usb-stream.h"
+
+/**
+ * SECTION: fpi-usb-stream
+ * @title: USB streaming
+ * @short_description: Continuous bulk reads
+ *
+ * Sensors that send a continuous stream of data (e.g. swipe sensors) need
+ * a read to be pending at all times, otherwise data may be lost between
+ * the completion of one read and the submission of the next one.
+ *
+ * A #FpiUsbStream owns a ring of bulk reads that are all queued on an
+ * endpoint while the stream runs. Completed reads are passed to the driver
+ * in the order they were queued, even if the host controller returns them
+ * out of order, and are then submitted again with the same buffer. The
+ * queue depth and the read size are chosen by the driver.
+ *
+ * Once the stream is stopped, cancelled or a read failed, the remaining
+ * reads are cancelled and the stream waits for all of them to be returned
+ * before calling the callback a last time. At that point no transfer is in
+ * flight anymore, so the stream can be started again or freed.
+ */
+
+typedef struct
+{
+  FpiUsbStream   *stream;
+  FpiUsbTransfer *transfer;
+  GError         *error;
+  gboolean        done;
+} StreamRead;
+
+struct _FpiUsbStream
+{
+  gint                   ref_count;
+
+  FpDevice              *device;
+  guint8                 endpoint;
+  guint                  n_reads;
+  guint                  timeout_ms;
+  FpiUsbStreamSubmitFunc submit;
+
+  /* Set while started, i.e. until the final callback */
+  gboolean               active;
+  /* Whether completed reads are delivered and resubmitted */
+  gboolean               running;
+  gboolean               stopped;
+  gboolean               processing;
+
+  FpiUsbStreamCallback   callback;
+  gpointer               user_data;
+  GError                *error;
+
+  GCancellable          *cancellable;
+  GCancellable          *external_cancellable;
+  gulong                 external_cancellable_id;
+
+  /* Ring of reads, the n_outstanding reads starting at head were submitted
+   * in this order and were not processed yet. While the stream is running
+   * all of them are outstanding. */
+  StreamRead            *reads;
+  guint                  head;
+  guint                  n_outstanding;
+};
+
+static void stream_process (FpiUsbStream *stream);
+
+static void
+stream_read_cb (FpiUsbTransfer *transfer, FpDevice *dev,
+                gpointer user_data, GError *error)
+{
+  StreamRead *read = user_data;
+
+  read->done = TRUE;
+  read->error = error;
+
+  stream_process (read->stream);
+}
+
+static void
+stream_submit_read (FpiUsbStream *stream, StreamRead *read)
+{
+  read->done = FALSE;
+  stream->n_outstanding++;
+
+  stream->submit (fpi_usb_transfer_ref (read->transfer), stream->timeout_ms,
+                  stream->cancellable, stream_read_cb, read);
+}
+
+static void
+stream_halt (FpiUsbStream *stream)
+{
+  if (!stream->running)
+    return;
+
+  stream->running = FALSE;
+  g_cancellable_cancel (stream->cancellable);
+}
+
+static void
+stream_finish (FpiUsbStream *stream)
+{
+  FpiUsbStreamCallback callback = stream->callback;
+  gpointer user_data = stream->user_data;
+  GError *error = g_steal_pointer (&stream->error);
+
+  if (stream->external_cancellable)
+    g_cancellable_disconnect (stream->external_cancellable,
+                              stream->external_cancellable_id);
+  stream->external_cancellable_id = 0;
+  g_clear_object (&stream->external_cancellable);
+  g_clear_object (&stream->cancellable);
+
+  stream->active = FALSE;
+  stream->callback = NULL;
+  stream->user_data = NULL;
+
+  fp_dbg ("Stream on endpoint 0x%02x finished", stream->endpoint);
+  callback (stream, stream->device, NULL, user_data, error);
+
+  /* Drop the reference taken in fpi_usb_stream_start() */
+  fpi_usb_stream_unref (stream);
+}
+
+static void
+stream_process (FpiUsbStream *stream)
+{
+  /* A callback might cause a transfer to complete right away */
+  if (stream->processing)
+    return;
+  stream->processing = TRUE;
+
+  while (stream->n_outstanding > 0)
+    {
+      StreamRead *read = &stream->reads[stream->head];
+
+      /* Later reads wait for the oldest one */
+      if (!read->done)
+        break;
+
+      stream->head = (stream->head + 1) % stream->n_reads;
+      stream->n_outstanding--;
+
+      if (read->error)
+        {
+          /* The reads that are cancelled because the stream stopped are
+           * not errors, and only the first error is reported. */
+          if (!stream->error &&
+              !(stream->stopped &&
+                g_error_matches (read->error, G_IO_ERROR, G_IO_ERROR_CANCELLED)))
+            stream->error = g_steal_pointer (&read->error);
+
+          g_clear_error (&read->error);
+          stream_halt (stream);
+        }
+      else if (stream->running)
+        {
+          stream->callback (stream, stream->device, read->transfer,
+                            stream->user_data, NULL);
+        }
+
+      /* Queue it again as the newest read, it is at the end of the ring */
+      if (stream->running)
+        stream_submit_read (stream, read);
+    }
+
+  stream->processing = FALSE;
+
+  if (stream->active && stream->n_outstanding == 0)
+    stream_finish (stream);
+}
+
+static void
+stream_external_cancelled_cb (GCancellable *cancellable, gpointer user_data)
+{
+  FpiUsbStream *stream = user_data;
+
+  /* This may be called from a different thread, so only cancel here */
+  g_cancellable_cancel (stream->cancellable);
+}
+
+/**
+ * fpi_usb_stream_new:
+ * @device: The #FpDevice to read from
+ * @endpoint: The bulk IN endpoint
+ * @buffer_size: The length of every read
+ * @n_transfers: The number of reads that are kept queued
+ * @timeout_ms: The timeout for each read, 0 for no timeout
+ *
+ * Creates a stream of bulk reads, it is started using
+ * fpi_usb_stream_start(). The buffers are allocated once and reused for
+ * every read. The stream must not be used after @device was closed.
+ *
+ * Returns: (transfer full): A new #FpiUsbStream
+ */
+FpiUsbStream *
+fpi_usb_stream_new (FpDevice *device,
+                    guint8    endpoint,
+                    gsize     buffer_size,
+                    guint     n_transfers,
+                    guint     timeout_ms)
+{
+  FpiUsbStream *stream;
+  guint i;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+  g_return_val_if_fail (endpoint & FPI_USB_ENDPOINT_IN, NULL);
+  g_return_val_if_fail (buffer_size > 0, NULL);
+  g_return_val_if_fail (n_transfers > 0, NULL);
+
+  stream = g_new0 (FpiUsbStream, 1);
+  stream->ref_count = 1;
+  stream->device = device;
+  stream->endpoint = endpoint;
+  stream->n_reads = n_transfers;
+  stream->timeout_ms = timeout_ms;
+  stream->submit = fpi_usb_transfer_submit;
+  stream->reads = g_new0 (StreamRead, n_transfers);
+
+  for (i = 0; i < n_transfers; i++)
+    {
+      StreamRead *read = &stream->reads[i];
+
+      read->stream = stream;
+      read->transfer = fpi_usb_transfer_new (device);
+      fpi_usb_transfer_fill_bulk (read->transfer, endpoint, buffer_size);
+    }
+
+  return stream;
+}
+
+/**
+ * fpi_usb_stream_ref:
+ * @stream: A #FpiUsbStream
+ *
+ * Returns: (transfer full): @stream
+ */
+FpiUsbStream *
+fpi_usb_stream_ref (FpiUsbStream *stream)
+{
+  g_return_val_if_fail (stream, NULL);
+  g_return_val_if_fail (stream->ref_count, NULL);
+
+  g_atomic_int_inc (&stream->ref_count);
+
+  return stream;
+}
+
+/**
+ * fpi_usb_stream_unref:
+ * @stream: A #FpiUsbStream
+ *
+ * Drops a reference. An active stream holds a reference to itself, use
+ * fpi_usb_stream_stop() to stop it.
+ */
+void
+fpi_usb_stream_unref (FpiUsbStream *stream)
+{
+  guint i;
+
+  g_return_if_fail (stream);
+  g_return_if_fail (stream->ref_count);
+
+  if (!g_atomic_int_dec_and_test (&stream->ref_count))
+    return;
+
+  g_assert (!stream->active);
+  g_assert (stream->n_outstanding == 0);
+
+  for (i = 0; i < stream->n_reads; i++)
+    fpi_usb_transfer_unref (stream->reads[i].transfer);
+  g_free (stream->reads);
+  g_free (stream);
+}
+
+/**
+ * fpi_usb_stream_start:
+ * @stream: A #FpiUsbStream
+ * @cancellable: (nullable): Cancellable to use, e.g. fpi_device_get_cancellable()
+ * @callback: Called for every completed read, see #FpiUsbStreamCallback
+ * @user_data: Data to pass to @callback
+ *
+ * Queues all reads and resubmits each of them after @callback ran, until
+ * the stream is stopped. The stream stops if a read fails (including
+ * timeouts) or @cancellable is cancelled.
+ */
+void
+fpi_usb_stream_start (FpiUsbStream        *stream,
+                      GCancellable        *cancellable,
+                      FpiUsbStreamCallback callback,
+                      gpointer             user_data)
+{
+  guint i;
+
+  g_return_if_fail (stream);
+  g_return_if_fail (callback);
+  g_return_if_fail (!stream->active);
+
+  fp_dbg ("Starting stream on endpoint 0x%02x with %u reads of %" G_GSIZE_FORMAT " bytes",
+          stream->endpoint, stream->n_reads, stream->reads[0].transfer->length);
+
+  fpi_usb_stream_ref (stream);
+  stream->active = TRUE;
+  stream->running = TRUE;
+  stream->stopped = FALSE;
+  stream->callback = callback;
+  stream->user_data = user_data;
+  stream->cancellable = g_cancellable_new ();
+
+  if (cancellable)
+    {
+      stream->external_cancellable = g_object_ref (cancellable);
+      stream->external_cancellable_id =
+        g_cancellable_connect (cancellable,
+                               G_CALLBACK (stream_external_cancelled_cb),
+                               stream, NULL);
+    }
+
+  for (i = 0; i < stream->n_reads; i++)
+    stream_submit_read (stream, &stream->reads[(stream->head + i) % stream->n_reads]);
+}
+
+/**
+ * fpi_usb_stream_stop:
+ * @stream: A #FpiUsbStream
+ *
+ * Stops the stream by cancelling the queued reads, data that arrives
+ * afterwards is dropped. The callback is called with a %NULL transfer
+ * once all reads have been returned.
+ *
+ * This may be called from the stream callback, the reads that completed
+ * after the current one are not delivered then.
+ */
+void
+fpi_usb_stream_stop (FpiUsbStream *stream)
+{
+  g_return_if_fail (stream);
+
+  if (!stream->running)
+    return;
+
+  fp_dbg ("Stopping stream on endpoint 0x%02x", stream->endpoint);
+  stream->stopped = TRUE;
+  stream_halt (stream);
+}
+
+/**
+ * fpi_usb_stream_is_active:
+ * @stream: A #FpiUsbStream
+ *
+ * Returns: %TRUE if the stream was started and the final callback did not
+ *   happen yet
+ */
+gboolean
+fpi_usb_stream_is_active (FpiUsbStream *stream)
+{
+  g_return_val_if_fail (stream, FALSE);
+
+  return stream->active;
+}
+
+/* Replaces fpi_usb_transfer_submit() for the unit tests */
+void
+fpi_usb_stream_set_submit_func (FpiUsbStream          *stream,
+                                FpiUsbStreamSubmitFunc submit)
+{
+  g_return_if_fail (stream);
+  g_return_if_fail (!stream->active);
+
+  stream->submit = submit ? submit : fpi_usb_transfer_submit;
+}
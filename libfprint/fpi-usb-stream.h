@@ -0,0 +1,84 @@
+/*
+ * Streaming USB bulk reads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include "fpi-usb-transfer.h"
+
+G_BEGIN_DECLS
+
+/**
+ * FpiUsbStream:
+ *
+ * Keeps a number of bulk reads queued on an endpoint, see fpi_usb_stream_new().
+ */
+typedef struct _FpiUsbStream FpiUsbStream;
+
+/**
+ * FpiUsbStreamCallback:
+ * @stream: The #FpiUsbStream
+ * @dev: The #FpDevice the stream belongs to
+ * @transfer: (nullable): The completed transfer, or %NULL once the stream ended
+ * @user_data: The user data passed to fpi_usb_stream_start()
+ * @error: (transfer full) (nullable): The error that ended the stream
+ *
+ * Called for every completed read in the order the reads were queued. The
+ * data is in @transfer->buffer and @transfer->actual_length. @transfer is
+ * submitted again once the callback returns, so the data must be copied if
+ * needed.
+ *
+ * After the stream stopped, the callback is called a last time with
+ * @transfer set to %NULL. @error is %NULL if fpi_usb_stream_stop() was
+ * called, otherwise it is the error that ended the stream.
+ */
+typedef void (*FpiUsbStreamCallback)(FpiUsbStream   *stream,
+                                     FpDevice       *dev,
+                                     FpiUsbTransfer *transfer,
+                                     gpointer        user_data,
+                                     GError         *error);
+
+FpiUsbStream *fpi_usb_stream_new (FpDevice *device,
+                                  guint8    endpoint,
+                                  gsize     buffer_size,
+                                  guint     n_transfers,
+                                  guint     timeout_ms);
+FpiUsbStream *fpi_usb_stream_ref (FpiUsbStream *stream);
+void          fpi_usb_stream_unref (FpiUsbStream *stream);
+
+void          fpi_usb_stream_start (FpiUsbStream        *stream,
+                                    GCancellable        *cancellable,
+                                    FpiUsbStreamCallback callback,
+                                    gpointer             user_data);
+void          fpi_usb_stream_stop (FpiUsbStream *stream);
+gboolean      fpi_usb_stream_is_active (FpiUsbStream *stream);
+
+#ifndef __GTK_DOC_IGNORE__
+/* Internal, lets the unit tests complete the reads */
+typedef void (*FpiUsbStreamSubmitFunc)(FpiUsbTransfer        *transfer,
+                                       guint                  timeout_ms,
+                                       GCancellable          *cancellable,
+                                       FpiUsbTransferCallback callback,
+                                       gpointer               user_data);
+
+void fpi_usb_stream_set_submit_func (FpiUsbStream          *stream,
+                                     FpiUsbStreamSubmitFunc submit);
+#endif
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiUsbStream, fpi_usb_stream_unref)
+
+G_END_DECLS
@@ -18,6 +18,11 @@
  */
 
 #include "fpi-usb-transfer.h"
+#include "fpi-trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 /**
  * SECTION:fpi-usb-transfer
@@ -30,14 +35,106 @@
  *
  * Drivers should use this API only rather than accessing the GUsbDevice
  * directly in most cases.
+ *
+ * Drivers that continuously stream data can use a #FpiUsbTransferPool to
+ * avoid allocating a new transfer and buffer for every read.
+ *
+ * Long sequences of small writes (e.g. register initialization using
+ * control transfers) can be queued in a #FpiUsbTransferBatch. It keeps
+ * several transfers in flight, rather than waiting for the completion of
+ * each one before the next is submitted.
  */
 
+/**
+ * FpiUsbTransferPool:
+ *
+ * A cache of #FpiUsbTransfer structures with buffers of a fixed size.
+ * Transfers acquired from the pool are used like any other transfer, once
+ * the last reference is dropped (usually after the callback ran), they
+ * are returned to the pool and reused including their buffer.
+ */
+struct _FpiUsbTransferPool
+{
+  gint      ref_count;
+
+  FpDevice *device;
+  gsize     buffer_size;
+  gboolean  page_aligned;
+  guint     max_free;
+
+  GMutex    mutex;
+  GQueue    free_transfers;
+};
+
+/**
+ * FpiUsbTransferBatch:
+ *
+ * An ordered list of #FpiUsbTransfer structures that are submitted with a
+ * limited number of them in flight at the same time. Transfers are
+ * submitted in order, but a transfer is not held back until the previous
+ * one has completed, so it must not depend on its result.
+ */
+struct _FpiUsbTransferBatch
+{
+  FpDevice                   *device;
+  guint                       max_in_flight;
+
+  GQueue                      pending;
+  guint                       n_transfers;
+  guint                       n_submitted;
+  guint                       in_flight;
+
+  /* The error of the earliest failed transfer */
+  GError                     *error;
+  guint                       error_index;
+  gboolean                    error_is_abort;
+
+  guint                       timeout_ms;
+  GCancellable               *cancellable;
+  gulong                      cancellable_id;
+  /* Cancels the transfers in flight once one of them failed */
+  GCancellable               *abort;
+  FpiUsbTransferBatchCallback callback;
+  gpointer                    user_data;
+};
+
+typedef struct
+{
+  FpiUsbTransferBatch *batch;
+  guint                index;
+} TransferBatchEntry;
+
 
 G_DEFINE_BOXED_TYPE (FpiUsbTransfer, fpi_usb_transfer, fpi_usb_transfer_ref, fpi_usb_transfer_unref)
 
+static const gchar *
+transfer_trace_name (FpiUsbTransfer *transfer)
+{
+  switch (transfer->type)
+    {
+    case FP_TRANSFER_BULK:
+      return "bulk transfer";
+
+    case FP_TRANSFER_CONTROL:
+      return "control transfer";
+
+    case FP_TRANSFER_INTERRUPT:
+      return "interrupt transfer";
+
+    case FP_TRANSFER_NONE:
+    default:
+      return "transfer";
+    }
+}
+
 static void
 log_transfer (FpiUsbTransfer *transfer, gboolean submit, GError *error)
 {
+  if (submit)
+    fpi_trace_async_begin ("usb", transfer_trace_name (transfer), transfer);
+  else
+    fpi_trace_async_end ("usb", transfer_trace_name (transfer), transfer);
+
   if (g_getenv ("FP_DEBUG_TRANSFER"))
     {
       if (!submit)
@@ -112,17 +209,54 @@ fpi_usb_transfer_new (FpDevice * device)
   return self;
 }
 
+static gboolean
+transfer_pool_recycle (FpiUsbTransferPool *pool, FpiUsbTransfer *transfer)
+{
+  guchar *buffer = transfer->buffer;
+  GDestroyNotify free_buffer = transfer->free_buffer;
+  gboolean recycled = FALSE;
+
+  g_mutex_lock (&pool->mutex);
+  if (pool->free_transfers.length < pool->max_free)
+    {
+      /* Keep only the buffer, the pool does not hold a reference */
+      memset (transfer, 0, sizeof (*transfer));
+      transfer->device = pool->device;
+      transfer->type = FP_TRANSFER_NONE;
+      transfer->buffer = buffer;
+      transfer->free_buffer = free_buffer;
+
+      g_queue_push_head (&pool->free_transfers, transfer);
+      recycled = TRUE;
+    }
+  g_mutex_unlock (&pool->mutex);
+
+  if (recycled)
+    fpi_usb_transfer_pool_unref (pool);
+
+  return recycled;
+}
+
 static void
 fpi_usb_transfer_free (FpiUsbTransfer *self)
 {
+  FpiUsbTransferPool *pool;
+
   g_assert (self);
   g_assert_cmpint (self->ref_count, ==, 0);
 
+  pool = self->pool;
+  if (pool && transfer_pool_recycle (pool, self))
+    return;
+
   if (self->free_buffer && self->buffer)
     self->free_buffer (self->buffer);
   self->buffer = NULL;
 
   g_slice_free (FpiUsbTransfer, self);
+
+  if (pool)
+    fpi_usb_transfer_pool_unref (pool);
 }
 
 /**
@@ -367,6 +501,7 @@ transfer_cancel_cb (FpDevice *device, gpointer user_data)
   callback = transfer->callback;
   transfer->callback = NULL;
   transfer->actual_length = -1;
+  log_transfer (transfer, FALSE, error);
   callback (transfer, transfer->device, transfer->user_data, error);
 
   fpi_usb_transfer_unref (transfer);
@@ -548,3 +683,398 @@ fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
 
   return res;
 }
+
+/**
+ * fpi_usb_transfer_pool_new:
+ * @device: The #FpDevice the transfers are for
+ * @buffer_size: The size of the buffer of every transfer
+ * @max_free: The maximum number of unused transfers that are kept
+ * @page_aligned: Whether the buffers should be aligned to the page size
+ *
+ * Creates a pool of transfers with reusable buffers. The pool must not
+ * be used after @device was closed, so it is usually created when opening
+ * the device and dropped when closing it.
+ *
+ * Returns: (transfer full): A new #FpiUsbTransferPool
+ */
+FpiUsbTransferPool *
+fpi_usb_transfer_pool_new (FpDevice *device,
+                           gsize     buffer_size,
+                           guint     max_free,
+                           gboolean  page_aligned)
+{
+  FpiUsbTransferPool *pool;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+  g_return_val_if_fail (buffer_size > 0, NULL);
+
+  pool = g_new0 (FpiUsbTransferPool, 1);
+  pool->ref_count = 1;
+  pool->device = device;
+  pool->buffer_size = buffer_size;
+  pool->max_free = max_free;
+  pool->page_aligned = page_aligned;
+  g_mutex_init (&pool->mutex);
+  g_queue_init (&pool->free_transfers);
+
+  return pool;
+}
+
+/**
+ * fpi_usb_transfer_pool_ref:
+ * @pool: A #FpiUsbTransferPool
+ *
+ * Returns: (transfer full): @pool
+ */
+FpiUsbTransferPool *
+fpi_usb_transfer_pool_ref (FpiUsbTransferPool *pool)
+{
+  g_return_val_if_fail (pool, NULL);
+  g_return_val_if_fail (pool->ref_count, NULL);
+
+  g_atomic_int_inc (&pool->ref_count);
+
+  return pool;
+}
+
+/**
+ * fpi_usb_transfer_pool_unref:
+ * @pool: A #FpiUsbTransferPool
+ *
+ * Drops a reference. Every acquired transfer holds a reference, so the
+ * pool is only freed once all of them were returned.
+ */
+void
+fpi_usb_transfer_pool_unref (FpiUsbTransferPool *pool)
+{
+  FpiUsbTransfer *transfer;
+
+  g_return_if_fail (pool);
+  g_return_if_fail (pool->ref_count);
+
+  if (!g_atomic_int_dec_and_test (&pool->ref_count))
+    return;
+
+  while ((transfer = g_queue_pop_head (&pool->free_transfers)))
+    fpi_usb_transfer_free (transfer);
+
+  g_mutex_clear (&pool->mutex);
+  g_free (pool);
+}
+
+/**
+ * fpi_usb_transfer_pool_get_buffer_size:
+ * @pool: A #FpiUsbTransferPool
+ *
+ * Returns: The size of the buffers, i.e. the maximum transfer length
+ */
+gsize
+fpi_usb_transfer_pool_get_buffer_size (FpiUsbTransferPool *pool)
+{
+  g_return_val_if_fail (pool, 0);
+
+  return pool->buffer_size;
+}
+
+static FpiUsbTransfer *
+transfer_pool_acquire (FpiUsbTransferPool *pool,
+                       FpiTransferType     type,
+                       guint8              endpoint,
+                       gsize               length)
+{
+  FpiUsbTransfer *transfer;
+
+  g_mutex_lock (&pool->mutex);
+  transfer = g_queue_pop_head (&pool->free_transfers);
+  g_mutex_unlock (&pool->mutex);
+
+  if (transfer)
+    {
+      transfer->ref_count = 1;
+    }
+  else if (pool->page_aligned)
+    {
+      gpointer buffer;
+
+      if (posix_memalign (&buffer, sysconf (_SC_PAGESIZE), pool->buffer_size) != 0)
+        g_error ("Failed to allocate %" G_GSIZE_FORMAT " bytes", pool->buffer_size);
+      memset (buffer, 0, pool->buffer_size);
+
+      transfer = fpi_usb_transfer_new (pool->device);
+      transfer->buffer = buffer;
+      transfer->free_buffer = free;
+    }
+  else
+    {
+      transfer = fpi_usb_transfer_new (pool->device);
+      transfer->buffer = g_malloc0 (pool->buffer_size);
+      transfer->free_buffer = g_free;
+    }
+
+  transfer->pool = fpi_usb_transfer_pool_ref (pool);
+  transfer->type = type;
+  transfer->endpoint = endpoint;
+  transfer->length = length;
+
+  return transfer;
+}
+
+/**
+ * fpi_usb_transfer_pool_acquire_bulk:
+ * @pool: A #FpiUsbTransferPool
+ * @endpoint: The endpoint to send the transfer to
+ * @length: The length of the transfer, at most the buffer size of @pool
+ *
+ * Gets a bulk transfer from the pool, a new one is created if there is no
+ * unused transfer. This is the equivalent of calling fpi_usb_transfer_new()
+ * and fpi_usb_transfer_fill_bulk(), except that the buffer content is not
+ * cleared if the transfer was used before.
+ *
+ * Returns: (transfer full): A filled #FpiUsbTransfer
+ */
+FpiUsbTransfer *
+fpi_usb_transfer_pool_acquire_bulk (FpiUsbTransferPool *pool,
+                                    guint8              endpoint,
+                                    gsize               length)
+{
+  g_return_val_if_fail (pool, NULL);
+  g_return_val_if_fail (length <= pool->buffer_size, NULL);
+
+  return transfer_pool_acquire (pool, FP_TRANSFER_BULK, endpoint, length);
+}
+
+/**
+ * fpi_usb_transfer_pool_acquire_interrupt:
+ * @pool: A #FpiUsbTransferPool
+ * @endpoint: The endpoint to send the transfer to
+ * @length: The length of the transfer, at most the buffer size of @pool
+ *
+ * Gets an interrupt transfer from the pool, see
+ * fpi_usb_transfer_pool_acquire_bulk().
+ *
+ * Returns: (transfer full): A filled #FpiUsbTransfer
+ */
+FpiUsbTransfer *
+fpi_usb_transfer_pool_acquire_interrupt (FpiUsbTransferPool *pool,
+                                         guint8              endpoint,
+                                         gsize               length)
+{
+  g_return_val_if_fail (pool, NULL);
+  g_return_val_if_fail (length <= pool->buffer_size, NULL);
+
+  return transfer_pool_acquire (pool, FP_TRANSFER_INTERRUPT, endpoint, length);
+}
+
+/**
+ * fpi_usb_transfer_batch_new:
+ * @device: The #FpDevice the transfers are for
+ * @max_in_flight: The maximum number of transfers that are submitted at
+ *   the same time
+ *
+ * Creates an empty batch, add transfers using fpi_usb_transfer_batch_add()
+ * and start it using fpi_usb_transfer_batch_submit().
+ *
+ * Returns: (transfer full): A new #FpiUsbTransferBatch
+ */
+FpiUsbTransferBatch *
+fpi_usb_transfer_batch_new (FpDevice *device,
+                            guint     max_in_flight)
+{
+  FpiUsbTransferBatch *batch;
+
+  g_return_val_if_fail (FP_IS_DEVICE (device), NULL);
+  g_return_val_if_fail (max_in_flight > 0, NULL);
+
+  batch = g_new0 (FpiUsbTransferBatch, 1);
+  batch->device = device;
+  batch->max_in_flight = max_in_flight;
+  g_queue_init (&batch->pending);
+
+  return batch;
+}
+
+/**
+ * fpi_usb_transfer_batch_add:
+ * @batch: A #FpiUsbTransferBatch
+ * @transfer: (transfer full): A filled #FpiUsbTransfer
+ *
+ * Appends a transfer to the batch. The callback of the transfer is not
+ * used, the batch reports the result once all transfers have completed.
+ */
+void
+fpi_usb_transfer_batch_add (FpiUsbTransferBatch *batch,
+                            FpiUsbTransfer      *transfer)
+{
+  g_return_if_fail (batch);
+  g_return_if_fail (transfer);
+  g_return_if_fail (transfer->device == batch->device);
+  g_return_if_fail (!batch->callback);
+
+  g_queue_push_tail (&batch->pending, transfer);
+  batch->n_transfers++;
+}
+
+static void
+transfer_batch_free (FpiUsbTransferBatch *batch)
+{
+  FpiUsbTransfer *transfer;
+
+  while ((transfer = g_queue_pop_head (&batch->pending)))
+    fpi_usb_transfer_unref (transfer);
+
+  if (batch->cancellable_id)
+    g_cancellable_disconnect (batch->cancellable, batch->cancellable_id);
+  g_clear_object (&batch->cancellable);
+  g_clear_object (&batch->abort);
+  g_clear_error (&batch->error);
+  g_free (batch);
+}
+
+/**
+ * fpi_usb_transfer_batch_free:
+ * @batch: A #FpiUsbTransferBatch that was not submitted
+ *
+ * Frees a batch and the transfers in it without submitting them.
+ */
+void
+fpi_usb_transfer_batch_free (FpiUsbTransferBatch *batch)
+{
+  g_return_if_fail (batch);
+  g_return_if_fail (!batch->callback);
+
+  transfer_batch_free (batch);
+}
+
+static void transfer_batch_submit_next (FpiUsbTransferBatch *batch);
+
+static void
+transfer_batch_cb (FpiUsbTransfer *transfer, FpDevice *device,
+                   gpointer user_data, GError *error)
+{
+  TransferBatchEntry *entry = user_data;
+  FpiUsbTransferBatch *batch = entry->batch;
+  guint index = entry->index;
+  gboolean is_abort;
+
+  g_free (entry);
+  batch->in_flight--;
+
+  if (!error)
+    {
+      transfer_batch_submit_next (batch);
+      return;
+    }
+
+  /* Transfers that we cancelled ourselves only report if nothing else
+   * failed. Otherwise, keep the error of the earliest transfer, later
+   * ones may complete first if e.g. one of them timed out. */
+  is_abort = g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+             g_cancellable_is_cancelled (batch->abort) &&
+             !(batch->cancellable && g_cancellable_is_cancelled (batch->cancellable));
+
+  if (!batch->error ||
+      (batch->error_is_abort && !is_abort) ||
+      (batch->error_is_abort == is_abort && index < batch->error_index))
+    {
+      g_clear_error (&batch->error);
+      batch->error = error;
+      batch->error_index = index;
+      batch->error_is_abort = is_abort;
+    }
+  else
+    {
+      g_error_free (error);
+    }
+
+  /* Do not write anything else to the device */
+  g_cancellable_cancel (batch->abort);
+
+  transfer_batch_submit_next (batch);
+}
+
+static void
+transfer_batch_submit_next (FpiUsbTransferBatch *batch)
+{
+  /* Nothing new is submitted after an error */
+  while (!batch->error && batch->in_flight < batch->max_in_flight &&
+         !g_queue_is_empty (&batch->pending))
+    {
+      TransferBatchEntry *entry = g_new0 (TransferBatchEntry, 1);
+
+      entry->batch = batch;
+      entry->index = batch->n_submitted++;
+      batch->in_flight++;
+
+      /* The time waiting for the earlier transfers counts as well */
+      fpi_usb_transfer_submit (g_queue_pop_head (&batch->pending),
+                               batch->timeout_ms * batch->in_flight,
+                               batch->abort,
+                               transfer_batch_cb,
+                               entry);
+    }
+
+  /* Only report once no transfer refers to the batch anymore */
+  if (batch->in_flight == 0)
+    {
+      if (batch->error)
+        g_prefix_error (&batch->error, "Transfer %u of %u: ",
+                        batch->error_index + 1, batch->n_transfers);
+
+      batch->callback (batch->device, batch->user_data,
+                       g_steal_pointer (&batch->error));
+      transfer_batch_free (batch);
+    }
+}
+
+static void
+transfer_batch_cancelled_cb (GCancellable *cancellable, GCancellable *abort)
+{
+  g_cancellable_cancel (abort);
+}
+
+/**
+ * fpi_usb_transfer_batch_submit:
+ * @batch: (transfer full): A #FpiUsbTransferBatch
+ * @timeout_ms: Timeout for each transfer in ms, not including the time it
+ *   waits for the transfers submitted before it
+ * @cancellable: (nullable): Cancellable to use, e.g. fpi_device_get_cancellable()
+ * @callback: Callback once all transfers have completed
+ * @user_data: User data for @callback
+ *
+ * Submits the transfers of @batch in order, with at most the number of
+ * transfers given to fpi_usb_transfer_batch_new() in flight at the same
+ * time.
+ *
+ * If a transfer fails, no further transfers are submitted and the ones in
+ * flight are cancelled. Note that these may have reached the device
+ * already. Once all of them have completed, @callback is called with the
+ * error of the earliest failed transfer. The batch is freed after
+ * @callback returns. An empty batch calls @callback right away.
+ */
+void
+fpi_usb_transfer_batch_submit (FpiUsbTransferBatch        *batch,
+                               guint                       timeout_ms,
+                               GCancellable               *cancellable,
+                               FpiUsbTransferBatchCallback callback,
+                               gpointer                    user_data)
+{
+  g_return_if_fail (batch);
+  g_return_if_fail (callback);
+  g_return_if_fail (!batch->callback);
+
+  batch->timeout_ms = timeout_ms;
+  batch->callback = callback;
+  batch->user_data = user_data;
+  batch->abort = g_cancellable_new ();
+
+  if (cancellable)
+    {
+      batch->cancellable = g_object_ref (cancellable);
+      batch->cancellable_id = g_cancellable_connect (cancellable,
+                                                     G_CALLBACK (transfer_batch_cancelled_cb),
+                                                     batch->abort,
+                                                     NULL);
+    }
+
+  transfer_batch_submit_next (batch);
+}
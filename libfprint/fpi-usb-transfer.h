@@ -30,14 +30,28 @@ G_BEGIN_DECLS
 #define FPI_USB_ENDPOINT_IN 0x80
 #define FPI_USB_ENDPOINT_OUT 0x00
 
-typedef struct _FpiUsbTransfer FpiUsbTransfer;
-typedef struct _FpiSsm         FpiSsm;
+typedef struct _FpiUsbTransfer      FpiUsbTransfer;
+typedef struct _FpiUsbTransferPool  FpiUsbTransferPool;
+typedef struct _FpiUsbTransferBatch FpiUsbTransferBatch;
+typedef struct _FpiSsm              FpiSsm;
 
 typedef void (*FpiUsbTransferCallback)(FpiUsbTransfer *transfer,
                                        FpDevice       *dev,
                                        gpointer        user_data,
                                        GError         *error);
 
+/**
+ * FpiUsbTransferBatchCallback:
+ * @dev: The #FpDevice the batch belongs to
+ * @user_data: User data passed to fpi_usb_transfer_batch_submit()
+ * @error: (transfer full): The error of the first failed transfer, or %NULL
+ *
+ * Called once all transfers of a #FpiUsbTransferBatch have completed.
+ */
+typedef void (*FpiUsbTransferBatchCallback)(FpDevice *dev,
+                                            gpointer  user_data,
+                                            GError   *error);
+
 /**
  * FpiTransferType:
  * @FP_TRANSFER_NONE: Type not set
@@ -102,6 +116,9 @@ struct _FpiUsbTransfer
 
   /* Data free function */
   GDestroyNotify free_buffer;
+
+  /* The pool the transfer is returned to, if any */
+  FpiUsbTransferPool *pool;
 };
 
 GType              fpi_usb_transfer_get_type (void) G_GNUC_CONST;
@@ -153,7 +170,35 @@ gboolean           fpi_usb_transfer_submit_sync (FpiUsbTransfer *transfer,
                                                  guint           timeout_ms,
                                                  GError        **error);
 
+FpiUsbTransferPool *fpi_usb_transfer_pool_new (FpDevice *device,
+                                               gsize     buffer_size,
+                                               guint     max_free,
+                                               gboolean  page_aligned);
+FpiUsbTransferPool *fpi_usb_transfer_pool_ref (FpiUsbTransferPool *pool);
+void               fpi_usb_transfer_pool_unref (FpiUsbTransferPool *pool);
+gsize              fpi_usb_transfer_pool_get_buffer_size (FpiUsbTransferPool *pool);
+
+FpiUsbTransfer     *fpi_usb_transfer_pool_acquire_bulk (FpiUsbTransferPool *pool,
+                                                        guint8              endpoint,
+                                                        gsize               length);
+FpiUsbTransfer     *fpi_usb_transfer_pool_acquire_interrupt (FpiUsbTransferPool *pool,
+                                                             guint8              endpoint,
+                                                             gsize               length);
+
+FpiUsbTransferBatch *fpi_usb_transfer_batch_new (FpDevice *device,
+                                                 guint     max_in_flight);
+void               fpi_usb_transfer_batch_add (FpiUsbTransferBatch *batch,
+                                               FpiUsbTransfer      *transfer);
+void               fpi_usb_transfer_batch_free (FpiUsbTransferBatch *batch);
+void               fpi_usb_transfer_batch_submit (FpiUsbTransferBatch        *batch,
+                                                  guint                       timeout_ms,
+                                                  GCancellable               *cancellable,
+                                                  FpiUsbTransferBatchCallback callback,
+                                                  gpointer                    user_data);
+
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiUsbTransfer, fpi_usb_transfer_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiUsbTransferPool, fpi_usb_transfer_pool_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiUsbTransferBatch, fpi_usb_transfer_batch_free)
 
 G_END_DECLS
@@ -0,0 +1,428 @@
+/*
+ * Shared processing worker threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "worker"
+
+#include "fpi-log.h"
+#include "fpi-worker.h"
+
+/**
+ * SECTION: fpi-worker
+ * @title: Processing worker threads
+ * @short_description: Bounded thread pool for image processing
+ *
+ * Image processing is CPU heavy and is therefore done in separate threads.
+ * Rather than using the generic GIO thread pool (which is unbounded and
+ * shared with I/O jobs), jobs are run by a #FpiWorker with a limited
+ * number of threads. Jobs are started by priority, so that e.g. a verify
+ * operation does not need to wait for a pending enrollment. Additionally,
+ * the number of running jobs per owner (usually the #FpDevice) is limited
+ * so that a single device cannot starve all others.
+ *
+ * The default worker is shared and configured by all #FpContext instances.
+ */
+
+struct _FpiWorker
+{
+  gint         ref_count;
+
+  GThreadPool *pool;
+  GMutex       mutex;
+  guint        queue_depth;
+  guint64      next_seq;
+
+  /* owner -> OwnerQueue */
+  GHashTable *owners;
+};
+
+typedef struct
+{
+  guint  running;
+  GQueue held_back;
+} OwnerQueue;
+
+typedef struct
+{
+  FpiWorker        *worker;
+  GTask            *task;
+  GTaskThreadFunc   func;
+  FpiWorkerPriority priority;
+  guint64           seq;
+  gconstpointer     owner;
+} WorkerJob;
+
+G_LOCK_DEFINE_STATIC (default_worker);
+static FpiWorker *default_worker = NULL;
+
+static gint
+job_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const WorkerJob *job_a = a;
+  const WorkerJob *job_b = b;
+
+  if (job_a->priority != job_b->priority)
+    return job_a->priority < job_b->priority ? -1 : 1;
+
+  return job_a->seq < job_b->seq ? -1 : job_a->seq > job_b->seq;
+}
+
+static void
+owner_queue_free (OwnerQueue *queue)
+{
+  g_assert (queue->running == 0 && g_queue_is_empty (&queue->held_back));
+  g_free (queue);
+}
+
+static void
+job_free (WorkerJob *job)
+{
+  g_object_unref (job->task);
+  fpi_worker_unref (job->worker);
+  g_free (job);
+}
+
+/* Must be called with the mutex held */
+static void
+worker_push_locked (FpiWorker *worker, WorkerJob *job)
+{
+  g_autoptr(GError) error = NULL;
+
+  /* The job is queued even if no new thread could be started */
+  if (!g_thread_pool_push (worker->pool, job, &error))
+    g_warning ("Could not start processing thread: %s", error->message);
+}
+
+static void
+worker_job_done (FpiWorker *worker, gconstpointer owner)
+{
+  OwnerQueue *queue;
+
+  if (!owner)
+    return;
+
+  g_mutex_lock (&worker->mutex);
+
+  queue = g_hash_table_lookup (worker->owners, owner);
+  g_assert (queue && queue->running > 0);
+  queue->running--;
+
+  if (!g_queue_is_empty (&queue->held_back))
+    {
+      queue->running++;
+      worker_push_locked (worker, g_queue_pop_head (&queue->held_back));
+    }
+  else if (queue->running == 0)
+    {
+      g_hash_table_remove (worker->owners, owner);
+    }
+
+  g_mutex_unlock (&worker->mutex);
+}
+
+static void
+worker_thread_func (gpointer data, gpointer user_data)
+{
+  WorkerJob *job = data;
+  FpiWorker *worker = job->worker;
+  gconstpointer owner = job->owner;
+
+  /* Do not even start jobs that were cancelled while waiting */
+  if (!g_task_return_error_if_cancelled (job->task))
+    job->func (job->task,
+               g_task_get_source_object (job->task),
+               g_task_get_task_data (job->task),
+               g_task_get_cancellable (job->task));
+
+  fpi_worker_ref (worker);
+  job_free (job);
+  worker_job_done (worker, owner);
+  fpi_worker_unref (worker);
+}
+
+/**
+ * fpi_worker_get_default_max_threads:
+ *
+ * Returns: The number of threads of a worker if none was given, this
+ *   depends on the number of processors
+ */
+guint
+fpi_worker_get_default_max_threads (void)
+{
+  return CLAMP (g_get_num_processors (), 1, 4);
+}
+
+/**
+ * fpi_worker_new:
+ * @max_threads: The maximum number of threads, or 0 to pick a default
+ * @queue_depth: The maximum number of running jobs per owner, or 0 for
+ *   #FPI_WORKER_DEFAULT_QUEUE_DEPTH
+ *
+ * Returns: (transfer full): A new #FpiWorker
+ */
+FpiWorker *
+fpi_worker_new (guint max_threads, guint queue_depth)
+{
+  FpiWorker *worker = g_new0 (FpiWorker, 1);
+
+  if (max_threads == 0)
+    max_threads = fpi_worker_get_default_max_threads ();
+
+  worker->ref_count = 1;
+  worker->queue_depth = queue_depth ? queue_depth : FPI_WORKER_DEFAULT_QUEUE_DEPTH;
+  worker->owners = g_hash_table_new_full (NULL, NULL, NULL,
+                                          (GDestroyNotify) owner_queue_free);
+  g_mutex_init (&worker->mutex);
+
+  worker->pool = g_thread_pool_new (worker_thread_func, worker,
+                                    max_threads, FALSE, NULL);
+  g_thread_pool_set_sort_function (worker->pool, job_compare, NULL);
+
+  return worker;
+}
+
+/**
+ * fpi_worker_ref:
+ * @worker: A #FpiWorker
+ *
+ * Returns: (transfer full): @worker
+ */
+FpiWorker *
+fpi_worker_ref (FpiWorker *worker)
+{
+  g_return_val_if_fail (worker, NULL);
+
+  g_atomic_int_inc (&worker->ref_count);
+
+  return worker;
+}
+
+/**
+ * fpi_worker_unref:
+ * @worker: A #FpiWorker
+ *
+ * Drops a reference. Every queued job holds a reference, so the threads
+ * are stopped only once all jobs have finished.
+ */
+void
+fpi_worker_unref (FpiWorker *worker)
+{
+  g_return_if_fail (worker);
+
+  if (!g_atomic_int_dec_and_test (&worker->ref_count))
+    return;
+
+  /* This may run in one of the pool threads, so do not wait */
+  g_thread_pool_free (worker->pool, FALSE, FALSE);
+  g_hash_table_unref (worker->owners);
+  g_mutex_clear (&worker->mutex);
+  g_free (worker);
+}
+
+/**
+ * fpi_worker_get_default:
+ *
+ * Gets the worker that is used for image processing, it is shared by
+ * all #FpContext instances. A worker with default settings is created if
+ * there is none.
+ *
+ * Returns: (transfer full): The default #FpiWorker
+ */
+FpiWorker *
+fpi_worker_get_default (void)
+{
+  FpiWorker *worker;
+
+  G_LOCK (default_worker);
+  if (!default_worker)
+    default_worker = fpi_worker_new (0, 0);
+  worker = fpi_worker_ref (default_worker);
+  G_UNLOCK (default_worker);
+
+  return worker;
+}
+
+/**
+ * fpi_worker_set_default:
+ * @worker: (nullable): A #FpiWorker
+ *
+ * Replaces the default worker, jobs that were already queued are still
+ * run by the previous one.
+ */
+void
+fpi_worker_set_default (FpiWorker *worker)
+{
+  FpiWorker *old;
+
+  G_LOCK (default_worker);
+  old = g_steal_pointer (&default_worker);
+  if (worker)
+    default_worker = fpi_worker_ref (worker);
+  G_UNLOCK (default_worker);
+
+  if (old)
+    fpi_worker_unref (old);
+}
+
+/**
+ * fpi_worker_set_max_threads:
+ * @worker: A #FpiWorker
+ * @max_threads: The maximum number of threads
+ *
+ * Changes the number of threads that may run jobs at the same time.
+ */
+void
+fpi_worker_set_max_threads (FpiWorker *worker, guint max_threads)
+{
+  g_return_if_fail (worker);
+  g_return_if_fail (max_threads > 0);
+
+  g_thread_pool_set_max_threads (worker->pool, max_threads, NULL);
+}
+
+/**
+ * fpi_worker_get_max_threads:
+ * @worker: A #FpiWorker
+ *
+ * Returns: The maximum number of threads
+ */
+guint
+fpi_worker_get_max_threads (FpiWorker *worker)
+{
+  g_return_val_if_fail (worker, 0);
+
+  return g_thread_pool_get_max_threads (worker->pool);
+}
+
+/**
+ * fpi_worker_set_queue_depth:
+ * @worker: A #FpiWorker
+ * @queue_depth: The maximum number of running jobs per owner
+ *
+ * Changes how many jobs of a single owner may be queued in or run by
+ * the thread pool at the same time. Further jobs are held back until
+ * one of them finished.
+ */
+void
+fpi_worker_set_queue_depth (FpiWorker *worker, guint queue_depth)
+{
+  g_return_if_fail (worker);
+  g_return_if_fail (queue_depth > 0);
+
+  g_mutex_lock (&worker->mutex);
+  worker->queue_depth = queue_depth;
+  g_mutex_unlock (&worker->mutex);
+}
+
+/**
+ * fpi_worker_get_queue_depth:
+ * @worker: A #FpiWorker
+ *
+ * Returns: The maximum number of running jobs per owner
+ */
+guint
+fpi_worker_get_queue_depth (FpiWorker *worker)
+{
+  guint res;
+
+  g_return_val_if_fail (worker, 0);
+
+  g_mutex_lock (&worker->mutex);
+  res = worker->queue_depth;
+  g_mutex_unlock (&worker->mutex);
+
+  return res;
+}
+
+/**
+ * fpi_worker_run_task:
+ * @worker: A #FpiWorker
+ * @task: The #GTask to run
+ * @func: The function to run in a worker thread
+ * @priority: The #FpiWorkerPriority of the job
+ * @owner: (nullable): The owner of the job (usually a #FpDevice), or %NULL
+ *   to not limit the number of jobs
+ *
+ * This is the equivalent of g_task_run_in_thread(), the worker holds its
+ * own reference to @task until @func has returned. If the cancellable of
+ * @task is cancelled before @func is started, the task returns
+ * %G_IO_ERROR_CANCELLED without calling @func. If #FPI_WORKER_MAX_HELD_BACK
+ * jobs of @owner are waiting already, the task returns %G_IO_ERROR_BUSY.
+ */
+void
+fpi_worker_run_task (FpiWorker        *worker,
+                     GTask            *task,
+                     GTaskThreadFunc   func,
+                     FpiWorkerPriority priority,
+                     gconstpointer     owner)
+{
+  WorkerJob *job;
+  OwnerQueue *queue = NULL;
+
+  g_return_if_fail (worker);
+  g_return_if_fail (G_IS_TASK (task));
+  g_return_if_fail (func);
+
+  job = g_new0 (WorkerJob, 1);
+  job->worker = fpi_worker_ref (worker);
+  job->task = g_object_ref (task);
+  job->func = func;
+  job->priority = priority;
+  job->owner = owner;
+
+  g_mutex_lock (&worker->mutex);
+
+  job->seq = worker->next_seq++;
+
+  if (owner)
+    {
+      queue = g_hash_table_lookup (worker->owners, owner);
+      if (!queue)
+        {
+          queue = g_new0 (OwnerQueue, 1);
+          g_queue_init (&queue->held_back);
+          g_hash_table_insert (worker->owners, (gpointer) owner, queue);
+        }
+    }
+
+  if (queue && queue->running >= worker->queue_depth &&
+      g_queue_get_length (&queue->held_back) >= FPI_WORKER_MAX_HELD_BACK)
+    {
+      g_mutex_unlock (&worker->mutex);
+
+      fp_warn ("Dropping job for %p, %u jobs are held back already",
+               owner, FPI_WORKER_MAX_HELD_BACK);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_BUSY,
+                               "Too many queued processing jobs");
+      job_free (job);
+      return;
+    }
+
+  if (queue && queue->running >= worker->queue_depth)
+    {
+      fp_dbg ("Holding back job for %p, %u jobs are running", owner, queue->running);
+      g_queue_insert_sorted (&queue->held_back, job, job_compare, NULL);
+    }
+  else
+    {
+      if (queue)
+        queue->running++;
+      worker_push_locked (worker, job);
+    }
+
+  g_mutex_unlock (&worker->mutex);
+}
@@ -0,0 +1,90 @@
+/*
+ * Shared processing worker threads
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * FpiWorker:
+ *
+ * A bounded pool of threads for CPU heavy processing (e.g. minutiae
+ * detection) with job priorities and a per owner limit on the number of
+ * running jobs.
+ */
+typedef struct _FpiWorker FpiWorker;
+
+/**
+ * FpiWorkerPriority:
+ * @FPI_WORKER_PRIORITY_HIGH: Jobs a user is waiting for, e.g. verify and identify
+ * @FPI_WORKER_PRIORITY_DEFAULT: Default priority
+ * @FPI_WORKER_PRIORITY_LOW: Jobs that may be delayed, e.g. enrollment or
+ *   loading prints from storage
+ *
+ * Priority of a job, jobs with a higher priority are started first.
+ */
+typedef enum {
+  FPI_WORKER_PRIORITY_HIGH,
+  FPI_WORKER_PRIORITY_DEFAULT,
+  FPI_WORKER_PRIORITY_LOW,
+} FpiWorkerPriority;
+
+/**
+ * FPI_WORKER_DEFAULT_QUEUE_DEPTH:
+ *
+ * The default number of jobs of a single owner that may run at the same
+ * time, further jobs are held back.
+ */
+#define FPI_WORKER_DEFAULT_QUEUE_DEPTH 2
+
+/**
+ * FPI_WORKER_MAX_HELD_BACK:
+ *
+ * The number of jobs of a single owner that may wait for one of its
+ * running jobs to finish. Jobs beyond that fail with %G_IO_ERROR_BUSY.
+ */
+#define FPI_WORKER_MAX_HELD_BACK 32
+
+FpiWorker *fpi_worker_new (guint max_threads,
+                           guint queue_depth);
+FpiWorker *fpi_worker_ref (FpiWorker *worker);
+void       fpi_worker_unref (FpiWorker *worker);
+
+guint      fpi_worker_get_default_max_threads (void);
+
+FpiWorker *fpi_worker_get_default (void);
+void       fpi_worker_set_default (FpiWorker *worker);
+
+void  fpi_worker_set_max_threads (FpiWorker *worker,
+                                  guint      max_threads);
+guint fpi_worker_get_max_threads (FpiWorker *worker);
+void  fpi_worker_set_queue_depth (FpiWorker *worker,
+                                  guint      queue_depth);
+guint fpi_worker_get_queue_depth (FpiWorker *worker);
+
+void fpi_worker_run_task (FpiWorker        *worker,
+                          GTask            *task,
+                          GTaskThreadFunc   func,
+                          FpiWorkerPriority priority,
+                          gconstpointer     owner);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiWorker, fpi_worker_unref)
+
+G_END_DECLS
@@ -10,6 +10,7 @@
 #pragma once
 
 #include "opencv2/core/mat.hpp"
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <stdexcept>
@@ -44,6 +45,10 @@ public:
     {
     }
 
+    // Reads from the given memory without copying it, it must outlive the
+    // stream. Such a stream cannot be written to.
+    stream(const byte* data, std::size_t len) : view_{data}, view_len_{len} {}
+
     template<typename T, std::enable_if_t<serializer<T>::value, bool> = true>
     constexpr stream& operator<<(T v)
     {
@@ -66,11 +71,16 @@ public:
                          bool> = true>
     constexpr stream& write(Iter&& begin, Iter&& end)
     {
-        std::copy(std::forward<Iter>(begin), std::forward<Iter>(end),
-                  std::back_inserter(store_));
+        if (view_) {
+            throw std::logic_error{"trying to write to a read only stream"};
+        }
+        store_.insert(store_.end(), std::forward<Iter>(begin),
+                      std::forward<Iter>(end));
         return *this;
     }
 
+    void reserve(std::size_t n) { store_.reserve(n); }
+
     template<typename T, std::enable_if_t<serializer<T>::value, bool> = true>
     stream& serialize(const T& m, stream& out)
     {
@@ -98,23 +108,34 @@ public:
                          bool> = true>
     constexpr stream& read(Iter&& begin, std::size_t dist)
     {
-        if (dist > store_.size()) {
-            throw std::runtime_error{"trying to read too much from a stream. wanted: " + std::to_string(dist) + " available: " + std::to_string(store_.size())};
+        if (dist > size()) {
+            throw std::runtime_error{"trying to read too much from a stream. wanted: " + std::to_string(dist) + " available: " + std::to_string(size())};
         }
-        std::copy(store_.begin(), store_.begin() + dist, begin);
-        store_.erase(store_.begin(), store_.begin() + dist);
+        std::copy(data() + pos_, data() + pos_ + dist, begin);
+        pos_ += dist;
         return *this;
     }
     byte* copy_buffer() const
     {
-        byte* raw = static_cast<byte*>(malloc(store_.size()));
-        std::copy(store_.begin(), store_.end(), raw);
+        byte* raw = static_cast<byte*>(malloc(size()));
+        std::copy(data() + pos_, data() + pos_ + size(), raw);
         return raw;
     }
-    std::size_t size() const { return store_.size(); }
+    // Number of bytes that are left to be read
+    std::size_t size() const
+    {
+        return (view_ ? view_len_ : store_.size()) - pos_;
+    }
 
 private:
+    const byte* data() const { return view_ ? view_ : store_.data(); }
+
     std::vector<byte> store_;
+    const byte* view_ = nullptr;
+    std::size_t view_len_ = 0;
+    // Reading advances a cursor, erasing from the front of store_ would make
+    // deserialization quadratic in the size of the data.
+    std::size_t pos_ = 0;
 };
 
 template<typename T>
@@ -217,7 +238,8 @@ struct deserializer<std::vector<T>, std::enable_if_t<deserializer<T>::value>> :
         std::size_t size;
         in >> size;
         std::vector<T> vs;
-        vs.reserve(size);
+        // Every element takes at least one byte, do not trust the size blindly
+        vs.reserve(std::min(size, in.size()));
         for (std::size_t n = 0; n != size; ++n) {
             T v;
             in >> v;
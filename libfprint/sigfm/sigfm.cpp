@@ -11,6 +11,7 @@
 #include "binary.hpp"
 #include "img-info.hpp"
 
+#include "opencv2/calib3d.hpp"
 #include "opencv2/core/persistence.hpp"
 #include "opencv2/core/types.hpp"
 #include "opencv2/features2d.hpp"
@@ -52,6 +53,9 @@ constexpr auto distance_match = 0.75;
 constexpr auto length_match = 0.05;
 constexpr auto angle_match = 0.05;
 constexpr auto min_match = 5;
+// Registering infos for fusion needs a more reliable transformation
+constexpr auto fuse_min_inliers = 12;
+constexpr auto fuse_ransac_threshold = 3.0;
 struct match {
     cv::Point2i p1;
     cv::Point2i p2;
@@ -84,6 +88,11 @@ int sigfm_keypoints_count(SigfmImgInfo* info) { return info->keypoints.size(); }
 unsigned char* sigfm_serialize_binary(SigfmImgInfo* info, int* outlen)
 {
     bin::stream s;
+    // Avoid growing the buffer step by step for every serialized field
+    s.reserve(sizeof(std::size_t) +
+              info->keypoints.size() * sizeof(cv::KeyPoint) +
+              3 * sizeof(int) +
+              info->descriptors.total() * info->descriptors.elemSize());
     s << *info;
     *outlen = s.size();
     return s.copy_buffer();
@@ -92,7 +101,7 @@ unsigned char* sigfm_serialize_binary(SigfmImgInfo* info, int* outlen)
 SigfmImgInfo* sigfm_deserialize_binary(const unsigned char* bytes, int len)
 {
     try {
-        bin::stream s{bytes, bytes + len};
+        bin::stream s{bytes, static_cast<std::size_t>(len)};
         auto info = std::make_unique<SigfmImgInfo>();
         s >> *info;
         return info.release();
@@ -121,6 +130,103 @@ SigfmImgInfo* sigfm_extract(const SigfmPix* pix, int width, int height)
     }
 }
 
+namespace {
+// Registers info against the mosaic and adds all keypoints that are not
+// present in the mosaic yet, returns false if it cannot be registered
+bool fuse_into(SigfmImgInfo& mosaic, const SigfmImgInfo& info)
+{
+    if (info.keypoints.empty() || mosaic.keypoints.empty()) {
+        return false;
+    }
+
+    std::vector<std::vector<cv::DMatch>> points;
+    cv::BFMatcher::create()->knnMatch(info.descriptors, mosaic.descriptors,
+                                      points, 2);
+
+    std::vector<cv::Point2f> src;
+    std::vector<cv::Point2f> dst;
+    std::vector<int> src_idx;
+    for (const auto& pts : points) {
+        if (pts.size() < 2) {
+            continue;
+        }
+        const cv::DMatch& match_1 = pts.at(0);
+        if (match_1.distance < distance_match * pts.at(1).distance) {
+            src.push_back(info.keypoints.at(match_1.queryIdx).pt);
+            dst.push_back(mosaic.keypoints.at(match_1.trainIdx).pt);
+            src_idx.push_back(match_1.queryIdx);
+        }
+    }
+    if (src.size() < fuse_min_inliers) {
+        return false;
+    }
+
+    std::vector<uchar> inliers;
+    const cv::Mat transform = cv::estimateAffinePartial2D(
+        src, dst, inliers, cv::RANSAC, fuse_ransac_threshold);
+    if (transform.empty() || cv::countNonZero(inliers) < fuse_min_inliers) {
+        return false;
+    }
+
+    // Keypoints with a consistent match are already in the mosaic
+    std::vector<bool> duplicate(info.keypoints.size(), false);
+    for (std::size_t j = 0; j < inliers.size(); j++) {
+        if (inliers[j]) {
+            duplicate[src_idx[j]] = true;
+        }
+    }
+
+    std::vector<cv::Point2f> pts_in;
+    std::vector<cv::Point2f> pts_out;
+    cv::KeyPoint::convert(info.keypoints, pts_in);
+    cv::transform(pts_in, pts_out, transform);
+    const double rotation = std::atan2(transform.at<double>(1, 0),
+                                       transform.at<double>(0, 0)) *
+                            180 / M_PI;
+
+    for (std::size_t j = 0; j < info.keypoints.size(); j++) {
+        if (duplicate[j]) {
+            continue;
+        }
+        cv::KeyPoint kp = info.keypoints[j];
+        kp.pt = pts_out[j];
+        if (kp.angle >= 0) {
+            kp.angle = std::fmod(kp.angle + rotation + 360, 360);
+        }
+        mosaic.keypoints.push_back(kp);
+        mosaic.descriptors.push_back(info.descriptors.row(j));
+    }
+    return true;
+}
+} // namespace
+
+SigfmImgInfo* sigfm_fuse_info(SigfmImgInfo** infos, int count, int* merged)
+{
+    try {
+        // Copies share the descriptor data, the mosaic must not modify it
+        auto mosaic = std::make_unique<SigfmImgInfo>(
+            SigfmImgInfo{infos[0]->keypoints, infos[0]->descriptors.clone()});
+        std::fill(merged, merged + count, 0);
+        merged[0] = 1;
+
+        // Infos might only overlap with parts that are added later on
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            for (int i = 1; i < count; i++) {
+                if (!merged[i] && fuse_into(*mosaic, *infos[i])) {
+                    merged[i] = 1;
+                    progress = true;
+                }
+            }
+        }
+        return mosaic.release();
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
 int sigfm_match_score(SigfmImgInfo* frame, SigfmImgInfo* enrolled)
 {
     try {
@@ -49,6 +49,24 @@ void sigfm_free_info (SigfmImgInfo * info);
 int sigfm_match_score (SigfmImgInfo * frame,
                        SigfmImgInfo * enrolled);
 
+/**
+ * @brief Fuse several infos of the same finger into a single mosaic
+ * @details Every info is registered against the mosaic built so far using
+ * the descriptor matches between them. Keypoints that correspond to one
+ * already present in the mosaic are dropped, the others are transformed
+ * into the coordinate system of the first info and added.
+ *
+ * @param infos Infos to fuse, the first one is used as the reference
+ * @param count Number of infos, must be at least 1
+ * @param merged output: Array of count values, set to non-zero for every
+ * info that is part of the mosaic. Infos that could not be registered
+ * should be kept separately.
+ * @return SigfmImgInfo* Newly allocated mosaic, or NULL on error
+ */
+SigfmImgInfo * sigfm_fuse_info (SigfmImgInfo ** infos,
+                                int             count,
+                                int           * merged);
+
 /**
  * @brief Serialize an image info for storage
  *
@@ -158,3 +158,61 @@ TEST_SUITE("binary")
         free(bin_data2);
     }
 }
+
+TEST_SUITE("fusion")
+{
+    SigfmImgInfo* extract_crop(int x, int y, int w, int h)
+    {
+        cv::Mat img(256, 256, CV_8UC1,
+                    const_cast<unsigned char*>(embedded::capture_aes3500));
+        cv::Mat crop = img(cv::Rect{x, y, w, h}).clone();
+        return sigfm_extract(crop.data, w, h);
+    }
+
+    TEST_CASE("overlapping infos are fused without duplicates")
+    {
+        SigfmImgInfo* infos[2] = {extract_crop(0, 0, 192, 192),
+                                  extract_crop(48, 32, 192, 192)};
+        REQUIRE(infos[0] != nullptr);
+        REQUIRE(infos[1] != nullptr);
+        const auto n_0 = infos[0]->keypoints.size();
+        const auto n_1 = infos[1]->keypoints.size();
+        const auto desc_0 = infos[0]->descriptors.clone();
+
+        int merged[2];
+        SigfmImgInfo* fused = sigfm_fuse_info(infos, 2, merged);
+        REQUIRE(fused != nullptr);
+        CHECK(merged[0]);
+        CHECK(merged[1]);
+        CHECK(fused->keypoints.size() > n_0);
+        CHECK(fused->keypoints.size() < n_0 + n_1);
+        CHECK(fused->keypoints.size() ==
+              static_cast<std::size_t>(fused->descriptors.rows));
+        // The fused infos are not modified
+        CHECK(comp_mats(infos[0]->descriptors, desc_0));
+
+        // A frame from the second crop still matches the mosaic
+        CHECK(sigfm_match_score(fused, infos[1]) > 0);
+
+        sigfm_free_info(fused);
+        sigfm_free_info(infos[0]);
+        sigfm_free_info(infos[1]);
+    }
+
+    TEST_CASE("an info fused with itself does not grow")
+    {
+        SigfmImgInfo* info = extract_crop(0, 0, 256, 256);
+        REQUIRE(info != nullptr);
+        SigfmImgInfo* infos[2] = {info, info};
+
+        int merged[2];
+        SigfmImgInfo* fused = sigfm_fuse_info(infos, 2, merged);
+        REQUIRE(fused != nullptr);
+        CHECK(merged[1]);
+        CHECK(fused->keypoints.size() <
+              info->keypoints.size() + info->keypoints.size() / 10);
+
+        sigfm_free_info(fused);
+        sigfm_free_info(info);
+    }
+}
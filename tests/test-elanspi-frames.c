@@ -0,0 +1,312 @@
+/*
+ * Frame processing kernels on recorded elanspi frames
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fpi-image.h"
+#include "drivers/elanspi_level.h"
+
+/* The recorded sensor is read line by line, two bytes (big endian) per pixel */
+#define SENSOR_WIDTH 96
+#define SENSOR_HEIGHT 96
+#define FRAME_PIXELS (SENSOR_WIDTH * SENSOR_HEIGHT)
+
+#define BENCHMARK_ROUNDS 200
+#define RANDOM_FRAMES 2000
+
+/* Original scalar implementations of the driver, used as the reference */
+static gint
+reference_correct_with_bg (guint16 *raw_image, const guint16 *bg_image)
+{
+  gint count = 0;
+
+  for (int i = 0; i < FRAME_PIXELS; i += 1)
+    {
+      if (raw_image[i] < bg_image[i])
+        {
+          count += 1;
+          raw_image[i] = 0;
+        }
+      else
+        {
+          raw_image[i] -= bg_image[i];
+        }
+    }
+
+  return count;
+}
+
+static int
+reference_mean_image (const guint16 *img)
+{
+  int total = 0;
+
+  for (int i = 0; i < FRAME_PIXELS; i += 1)
+    total += img[i];
+  return total / FRAME_PIXELS;
+}
+
+static int
+cmp_u16 (const void *a, const void *b)
+{
+  return (int) (*(guint16 *) a - *(guint16 *) b);
+}
+
+/* Original qsort based leveling of elanspi_process_frame() */
+static void
+reference_level_frame (const guint16 *frame, size_t frame_size, guint8 *data_out)
+{
+  g_autofree guint16 *data_in_sorted = g_memdup2 (frame, frame_size * sizeof (guint16));
+
+  qsort (data_in_sorted, frame_size, 2, cmp_u16);
+  guint16 lvl0 = data_in_sorted[0];
+  guint16 lvl1 = data_in_sorted[frame_size * 3 / 10];
+  guint16 lvl2 = data_in_sorted[frame_size * 65 / 100];
+  guint16 lvl3 = data_in_sorted[frame_size - 1];
+
+  lvl1 = MAX (lvl1, lvl0 + 1);
+  lvl2 = MAX (lvl2, lvl1 + 1);
+  lvl3 = MAX (lvl3, lvl2 + 1);
+
+  for (size_t i = 0; i < frame_size; i += 1)
+    {
+      guint16 px = frame[i];
+      if (px < lvl0)
+        {
+          px = 0;
+        }
+      else if (px > lvl3)
+        {
+          px = 255;
+        }
+      else
+        {
+          if (lvl0 <= px && px < lvl1)
+            px = (px - lvl0) * 99 / (lvl1 - lvl0);
+          else if (lvl1 <= px && px < lvl2)
+            px = 99 + ((px - lvl1) * 56 / (lvl2 - lvl1));
+          else /* (lvl2 <= px && px <= lvl3) */
+            px = 155 + ((px - lvl2) * 100 / (lvl3 - lvl2));
+        }
+      data_out[i] = px;
+    }
+}
+
+static void
+check_level_frame (const guint16 *frame, size_t frame_size)
+{
+  g_autofree guint32 *index = g_new (guint32, frame_size);
+  g_autofree guint16 *reversed = g_new (guint16, frame_size);
+  g_autofree guint8 *fast = g_malloc (frame_size);
+  g_autofree guint8 *reference = g_malloc (frame_size);
+
+  /* Read the frame backwards to also exercise the index */
+  for (size_t i = 0; i < frame_size; i++)
+    {
+      index[i] = frame_size - i - 1;
+      reversed[i] = frame[frame_size - i - 1];
+    }
+
+  elanspi_level_frame (frame, index, frame_size, fast);
+  reference_level_frame (reversed, frame_size, reference);
+
+  g_assert_cmpmem (fast, frame_size, reference, frame_size);
+}
+
+/* Collects all complete frames from the line reads in the ioctl recording */
+static GArray *
+load_frames (void)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GError) error = NULL;
+  GArray *frames = g_array_new (FALSE, FALSE, sizeof (guint16));
+  g_autofree guint16 *frame = g_new (guint16, FRAME_PIXELS);
+  guint line_ptr = 0;
+  guint i;
+
+  path = g_test_build_filename (G_TEST_DIST, "elanspi", "capture.ioctl", NULL);
+  g_file_get_contents (path, &contents, NULL, &error);
+  g_assert_no_error (error);
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      const char *hex = lines[i] + 3;
+      guint col;
+
+      /* Only the line reads have the size of a sensor line */
+      if (!g_str_has_prefix (lines[i], "CR ") || strlen (hex) != SENSOR_WIDTH * 4)
+        continue;
+
+      for (col = 0; col < SENSOR_WIDTH; col++)
+        {
+          guint8 high = g_ascii_xdigit_value (hex[col * 4]) << 4 |
+                        g_ascii_xdigit_value (hex[col * 4 + 1]);
+          guint8 low = g_ascii_xdigit_value (hex[col * 4 + 2]) << 4 |
+                       g_ascii_xdigit_value (hex[col * 4 + 3]);
+
+          frame[line_ptr * SENSOR_WIDTH + col] = low + high * 0x100;
+        }
+
+      if (++line_ptr == SENSOR_HEIGHT)
+        {
+          g_array_append_vals (frames, frame, FRAME_PIXELS);
+          line_ptr = 0;
+        }
+    }
+
+  g_assert_cmpuint (frames->len / FRAME_PIXELS, >, 2);
+
+  return frames;
+}
+
+static void
+test_frames_correct_with_bg (void)
+{
+  g_autoptr(GArray) frames = load_frames ();
+  const guint16 *bg = &g_array_index (frames, guint16, 0);
+  guint n_frames = frames->len / FRAME_PIXELS;
+  guint f;
+
+  for (f = 0; f < n_frames; f++)
+    {
+      const guint16 *raw = &g_array_index (frames, guint16, f * FRAME_PIXELS);
+      g_autofree guint16 *fast = g_memdup2 (raw, FRAME_PIXELS * sizeof (guint16));
+      g_autofree guint16 *reference = g_memdup2 (raw, FRAME_PIXELS * sizeof (guint16));
+      FpiFrameStats stats = { 0 };
+
+      fpi_frame_stats_add_u16 (&stats, raw, SENSOR_WIDTH, SENSOR_HEIGHT, SENSOR_WIDTH, 1);
+      g_assert_cmpint (fpi_frame_stats_get_mean (&stats), ==, reference_mean_image (raw));
+
+      g_assert_cmpint (fpi_frame_subtract_u16 (fast, bg, FRAME_PIXELS), ==,
+                       reference_correct_with_bg (reference, bg));
+      g_assert_cmpmem (fast, FRAME_PIXELS * sizeof (guint16),
+                       reference, FRAME_PIXELS * sizeof (guint16));
+    }
+}
+
+static void
+test_frames_level (void)
+{
+  g_autoptr(GArray) frames = load_frames ();
+  const guint16 *bg = &g_array_index (frames, guint16, 0);
+  g_autofree guint16 *work = g_new (guint16, FRAME_PIXELS);
+  guint n_frames = frames->len / FRAME_PIXELS;
+  guint f;
+
+  for (f = 0; f < n_frames; f++)
+    {
+      memcpy (work, &g_array_index (frames, guint16, f * FRAME_PIXELS),
+              FRAME_PIXELS * sizeof (guint16));
+      check_level_frame (work, FRAME_PIXELS);
+
+      /* As processed by the driver */
+      fpi_frame_subtract_u16 (work, bg, FRAME_PIXELS);
+      check_level_frame (work, FRAME_PIXELS);
+    }
+}
+
+static void
+test_frames_level_random (void)
+{
+  g_autofree guint16 *frame = g_new (guint16, FRAME_PIXELS);
+  guint f;
+
+  for (f = 0; f < RANDOM_FRAMES; f++)
+    {
+      size_t frame_size = g_test_rand_int_range (1, FRAME_PIXELS + 1);
+      /* Narrow and wide ranges, also close to the top where levels wrap */
+      guint32 range = 1 << g_test_rand_int_range (0, 17);
+      guint32 base = g_test_rand_bit () ? 0x10000 - range : g_test_rand_int_range (0, 0x10000 - range + 1);
+
+      for (size_t i = 0; i < frame_size; i++)
+        frame[i] = base + g_test_rand_int_range (0, range);
+
+      check_level_frame (frame, frame_size);
+    }
+}
+
+static void
+test_frames_benchmark (void)
+{
+  g_autoptr(GArray) frames = NULL;
+  g_autofree guint16 *work = g_new (guint16, FRAME_PIXELS);
+  const guint16 *bg;
+  guint n_frames, f, r;
+  volatile gint64 sink = 0;
+  gdouble reference_time, fast_time;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Only run in performance mode (-m perf)");
+      return;
+    }
+
+  frames = load_frames ();
+  bg = &g_array_index (frames, guint16, 0);
+  n_frames = frames->len / FRAME_PIXELS;
+
+  /* Background correction followed by the mean, as during calibration
+   * and finger detection */
+  g_test_timer_start ();
+  for (r = 0; r < BENCHMARK_ROUNDS; r++)
+    for (f = 0; f < n_frames; f++)
+      {
+        memcpy (work, &g_array_index (frames, guint16, f * FRAME_PIXELS),
+                FRAME_PIXELS * sizeof (guint16));
+        sink += reference_correct_with_bg (work, bg);
+        sink += reference_mean_image (work);
+      }
+  reference_time = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (r = 0; r < BENCHMARK_ROUNDS; r++)
+    for (f = 0; f < n_frames; f++)
+      {
+        FpiFrameStats stats = { 0 };
+
+        memcpy (work, &g_array_index (frames, guint16, f * FRAME_PIXELS),
+                FRAME_PIXELS * sizeof (guint16));
+        sink += fpi_frame_subtract_u16 (work, bg, FRAME_PIXELS);
+        fpi_frame_stats_add_u16 (&stats, work, SENSOR_WIDTH, SENSOR_HEIGHT, SENSOR_WIDTH, 1);
+        sink += fpi_frame_stats_get_mean (&stats);
+      }
+  fast_time = g_test_timer_elapsed ();
+
+  g_test_minimized_result (reference_time, "scalar: %u frames in %.3f s",
+                           n_frames * BENCHMARK_ROUNDS, reference_time);
+  g_test_minimized_result (fast_time, "kernels: %u frames in %.3f s (%.1fx)",
+                           n_frames * BENCHMARK_ROUNDS, fast_time,
+                           reference_time / fast_time);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/elanspi/frames/correct_with_bg", test_frames_correct_with_bg);
+  g_test_add_func ("/elanspi/frames/level", test_frames_level);
+  g_test_add_func ("/elanspi/frames/level_random", test_frames_level_random);
+  g_test_add_func ("/elanspi/frames/benchmark", test_frames_benchmark);
+
+  return g_test_run ();
+}
@@ -383,6 +383,55 @@ test_context_remove_device_active (void)
   fpt_teardown_virtual_device_environment ();
 }
 
+static void
+test_context_open_all_no_devices (void)
+{
+  g_autoptr(FpContext) context = fp_context_new ();
+  g_autoptr(GError) error = NULL;
+
+  g_assert_true (fp_context_open_all_sync (context, NULL, &error));
+  g_assert_no_error (error);
+}
+
+static void
+test_context_open_all (void)
+{
+  g_autoptr(FptContext) tctx = fpt_context_new_with_virtual_device (FPT_VIRTUAL_DEVICE_IMAGE);
+  g_autoptr(GError) error = NULL;
+
+  g_assert_false (fp_device_is_open (tctx->device));
+
+  g_assert_true (fp_context_open_all_sync (tctx->fp_context, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (fp_device_is_open (tctx->device));
+
+  /* Devices that are open already are skipped */
+  g_assert_true (fp_context_open_all_sync (tctx->fp_context, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (fp_device_is_open (tctx->device));
+
+  fp_device_close_sync (tctx->device, NULL, &error);
+  g_assert_no_error (error);
+
+  fpt_teardown_virtual_device_environment ();
+}
+
+static void
+test_context_open_all_cancelled (void)
+{
+  g_autoptr(FptContext) tctx = fpt_context_new_with_virtual_device (FPT_VIRTUAL_DEVICE_IMAGE);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GError) error = NULL;
+
+  g_cancellable_cancel (cancellable);
+
+  g_assert_false (fp_context_open_all_sync (tctx->fp_context, cancellable, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_false (fp_device_is_open (tctx->device));
+
+  fpt_teardown_virtual_device_environment ();
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -397,6 +446,9 @@ main (int argc, char *argv[])
   g_test_add_func ("/context/remove-device-open", test_context_remove_device_open);
   g_test_add_func ("/context/remove-device-opening", test_context_remove_device_opening);
   g_test_add_func ("/context/remove-device-active", test_context_remove_device_active);
+  g_test_add_func ("/context/open-all-no-devices", test_context_open_all_no_devices);
+  g_test_add_func ("/context/open-all", test_context_open_all);
+  g_test_add_func ("/context/open-all-cancelled", test_context_open_all_cancelled);
 
   return g_test_run ();
 }
@@ -0,0 +1,296 @@
+/*
+ * FpPrintStore Unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fp-print-private.h"
+
+#define DRIVER "test-driver"
+#define DEVICE_ID "test-device"
+
+typedef struct
+{
+  gchar *dir;
+  gchar *path;
+} StoreFixture;
+
+static void
+store_fixture_setup (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->dir = g_dir_make_tmp ("libfprint-store-XXXXXX", &error);
+  g_assert_no_error (error);
+  fixture->path = g_build_filename (fixture->dir, "prints.fpstore", NULL);
+}
+
+static void
+store_fixture_teardown (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_unlink (fixture->path);
+  g_rmdir (fixture->dir);
+  g_free (fixture->path);
+  g_free (fixture->dir);
+}
+
+static FpPrint *
+make_print (guint n)
+{
+  FpPrint *print = g_object_new (FP_TYPE_PRINT,
+                                 "driver", DRIVER,
+                                 "device-id", DEVICE_ID,
+                                 NULL);
+
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, FPI_PRINT_RAW);
+  g_object_set (print, "fpi-data", g_variant_new ("(su)", "raw print", n), NULL);
+
+  return print;
+}
+
+static goffset
+file_size (const gchar *path)
+{
+  GStatBuf st;
+
+  g_assert_cmpint (g_stat (path, &st), ==, 0);
+
+  return st.st_size;
+}
+
+static FpPrintStore *
+open_store (const gchar *path)
+{
+  g_autoptr(GError) error = NULL;
+  FpPrintStore *store;
+
+  store = fp_print_store_new (path, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (store);
+
+  return store;
+}
+
+static void
+assert_stored (FpPrintStore *store, FpFinger finger, const gchar *username,
+               FpPrint *expected)
+{
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+
+  loaded = fp_print_store_load (store, DRIVER, DEVICE_ID, finger, username, &error);
+  g_assert_no_error (error);
+
+  if (!expected)
+    {
+      g_assert_null (loaded);
+      g_assert_false (fp_print_store_contains (store, DRIVER, DEVICE_ID, finger, username));
+      return;
+    }
+
+  g_assert_nonnull (loaded);
+  g_assert_true (fp_print_store_contains (store, DRIVER, DEVICE_ID, finger, username));
+  g_assert_true (fp_print_equal (loaded, expected));
+}
+
+static void
+test_store_save_load (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = make_print (1);
+  g_autoptr(FpPrint) print_b = make_print (2);
+  g_autoptr(FpPrint) print_c = make_print (3);
+  g_autoptr(GPtrArray) prints = NULL;
+  g_autoptr(GError) error = NULL;
+
+  store = open_store (fixture->path);
+  g_assert_true (fp_print_store_save (store, print_a, FP_FINGER_LEFT_THUMB, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_save (store, print_b, FP_FINGER_LEFT_THUMB, "user", &error));
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_save (store, print_c, FP_FINGER_RIGHT_INDEX, NULL, &error));
+  g_assert_no_error (error);
+
+  assert_stored (store, FP_FINGER_LEFT_THUMB, NULL, print_a);
+  assert_stored (store, FP_FINGER_LEFT_THUMB, "user", print_b);
+  assert_stored (store, FP_FINGER_RIGHT_INDEX, NULL, print_c);
+  assert_stored (store, FP_FINGER_RIGHT_THUMB, NULL, NULL);
+
+  /* Saving again replaces the print */
+  g_assert_true (fp_print_store_save (store, print_c, FP_FINGER_LEFT_THUMB, NULL, &error));
+  g_assert_no_error (error);
+  assert_stored (store, FP_FINGER_LEFT_THUMB, NULL, print_c);
+
+  g_assert_true (fp_print_store_delete (store, DRIVER, DEVICE_ID,
+                                        FP_FINGER_RIGHT_INDEX, NULL, &error));
+  g_assert_no_error (error);
+  assert_stored (store, FP_FINGER_RIGHT_INDEX, NULL, NULL);
+
+  prints = fp_print_store_list (store, DRIVER, DEVICE_ID);
+  g_assert_cmpuint (prints->len, ==, 2);
+  g_clear_pointer (&prints, g_ptr_array_unref);
+
+  prints = fp_print_store_list (store, DRIVER, "other-device");
+  g_assert_cmpuint (prints->len, ==, 0);
+  g_clear_pointer (&prints, g_ptr_array_unref);
+
+  /* Everything is found again after reopening */
+  g_clear_object (&store);
+  store = open_store (fixture->path);
+
+  assert_stored (store, FP_FINGER_LEFT_THUMB, NULL, print_c);
+  assert_stored (store, FP_FINGER_LEFT_THUMB, "user", print_b);
+  assert_stored (store, FP_FINGER_RIGHT_INDEX, NULL, NULL);
+}
+
+static void
+test_store_torn_record (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = make_print (1);
+  g_autoptr(FpPrint) print_b = make_print (2);
+  g_autoptr(FpPrint) print_c = make_print (3);
+  g_autoptr(GError) error = NULL;
+  goffset intact_size;
+  goffset full_size;
+  guint8 byte;
+  int fd;
+
+  store = open_store (fixture->path);
+  g_assert_true (fp_print_store_save (store, print_a, FP_FINGER_LEFT_THUMB, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_save (store, print_b, FP_FINGER_LEFT_INDEX, NULL, &error));
+  g_assert_no_error (error);
+  intact_size = file_size (fixture->path);
+
+  g_assert_true (fp_print_store_save (store, print_c, FP_FINGER_LEFT_MIDDLE, NULL, &error));
+  g_assert_no_error (error);
+  full_size = file_size (fixture->path);
+  g_clear_object (&store);
+
+  /* A record that was only partially written */
+  g_assert_cmpint (truncate (fixture->path, full_size - 5), ==, 0);
+
+  g_test_expect_message ("libfprint-print-store", G_LOG_LEVEL_WARNING,
+                         "Dropping * bytes of incomplete data at the end of *");
+  store = open_store (fixture->path);
+  g_test_assert_expected_messages ();
+
+  g_assert_cmpint (file_size (fixture->path), ==, intact_size);
+  assert_stored (store, FP_FINGER_LEFT_THUMB, NULL, print_a);
+  assert_stored (store, FP_FINGER_LEFT_INDEX, NULL, print_b);
+  assert_stored (store, FP_FINGER_LEFT_MIDDLE, NULL, NULL);
+
+  /* The store can be appended to again */
+  g_assert_true (fp_print_store_save (store, print_c, FP_FINGER_LEFT_MIDDLE, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (file_size (fixture->path), ==, full_size);
+  g_clear_object (&store);
+
+  /* A record of the full size, but with data that was not written */
+  fd = g_open (fixture->path, O_RDWR, 0);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (pread (fd, &byte, 1, full_size - 16), ==, 1);
+  byte ^= 0xff;
+  g_assert_cmpint (pwrite (fd, &byte, 1, full_size - 16), ==, 1);
+  close (fd);
+
+  g_test_expect_message ("libfprint-print-store", G_LOG_LEVEL_WARNING,
+                         "Dropping * bytes of incomplete data at the end of *");
+  store = open_store (fixture->path);
+  g_test_assert_expected_messages ();
+
+  g_assert_cmpint (file_size (fixture->path), ==, intact_size);
+  assert_stored (store, FP_FINGER_LEFT_THUMB, NULL, print_a);
+  assert_stored (store, FP_FINGER_LEFT_INDEX, NULL, print_b);
+  assert_stored (store, FP_FINGER_LEFT_MIDDLE, NULL, NULL);
+}
+
+static void
+test_store_compact (StoreFixture *fixture, gconstpointer user_data)
+{
+  g_autoptr(FpPrintStore) store = NULL;
+  g_autoptr(FpPrint) print_a = make_print (1);
+  g_autoptr(FpPrint) print_b = make_print (2);
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(GError) error = NULL;
+  goffset live_size;
+  guint i;
+
+  /* The size of the records that stay */
+  store = open_store (fixture->path);
+  g_assert_true (fp_print_store_save (store, print_a, FP_FINGER_LEFT_THUMB, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_save (store, print_b, FP_FINGER_LEFT_INDEX, "user", &error));
+  g_assert_no_error (error);
+  live_size = file_size (fixture->path);
+
+  for (i = 0; i < 10; i++)
+    {
+      g_autoptr(FpPrint) print = make_print (10 + i);
+
+      g_assert_true (fp_print_store_save (store, print, FP_FINGER_RIGHT_THUMB, NULL, &error));
+      g_assert_no_error (error);
+    }
+  g_assert_true (fp_print_store_save (store, print_b, FP_FINGER_LEFT_INDEX, "user", &error));
+  g_assert_no_error (error);
+  g_assert_true (fp_print_store_delete (store, DRIVER, DEVICE_ID,
+                                        FP_FINGER_RIGHT_THUMB, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (file_size (fixture->path), >, live_size);
+
+  /* Prints loaded before stay valid */
+  loaded = fp_print_store_load (store, DRIVER, DEVICE_ID, FP_FINGER_LEFT_THUMB, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (fp_print_store_compact (store, &error));
+  g_assert_no_error (error);
+
+  g_assert_cmpint (file_size (fixture->path), ==, live_size);
+  g_assert_true (fp_print_equal (loaded, print_a));
+  assert_stored (store, FP_FINGER_LEFT_THUMB, NULL, print_a);
+  assert_stored (store, FP_FINGER_LEFT_INDEX, "user", print_b);
+  assert_stored (store, FP_FINGER_RIGHT_THUMB, NULL, NULL);
+
+  /* The compacted file is complete and can be appended to */
+  g_assert_true (fp_print_store_save (store, print_b, FP_FINGER_RIGHT_THUMB, NULL, &error));
+  g_assert_no_error (error);
+  g_clear_object (&store);
+
+  store = open_store (fixture->path);
+  assert_stored (store, FP_FINGER_LEFT_THUMB, NULL, print_a);
+  assert_stored (store, FP_FINGER_LEFT_INDEX, "user", print_b);
+  assert_stored (store, FP_FINGER_RIGHT_THUMB, NULL, print_b);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/print-store/save-load", StoreFixture, NULL,
+              store_fixture_setup, test_store_save_load, store_fixture_teardown);
+  g_test_add ("/print-store/torn-record", StoreFixture, NULL,
+              store_fixture_setup, test_store_torn_record, store_fixture_teardown);
+  g_test_add ("/print-store/compact", StoreFixture, NULL,
+              store_fixture_setup, test_store_compact, store_fixture_teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,382 @@
+/*
+ * FpPrint Unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libfprint/fprint.h>
+#include "fp-print-private.h"
+#include "fpi-compat.h"
+
+static FpPrint *
+make_raw_print (guint n)
+{
+  FpPrint *print = g_object_new (FP_TYPE_PRINT,
+                                 "driver", "test-driver",
+                                 "device-id", "test-device",
+                                 "finger", FP_FINGER_LEFT_THUMB + n % 10,
+                                 "username", "user",
+                                 NULL);
+
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, FPI_PRINT_RAW);
+  g_object_set (print, "fpi-data", g_variant_new ("(su)", "raw print", n), NULL);
+
+  return print;
+}
+
+static FpPrint *
+make_nbis_print (guint n)
+{
+  FpPrint *print = g_object_new (FP_TYPE_PRINT,
+                                 "driver", "test-driver",
+                                 "device-id", "test-device",
+                                 NULL);
+  guint i, j;
+
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, FPI_PRINT_NBIS);
+
+  for (i = 0; i < 3; i++)
+    {
+      FpiXyt *xyt = fpi_xyt_new (10 + n + i);
+
+      for (j = 0; j < xyt->nrows; j++)
+        {
+          FPI_XYT_X (xyt)[j] = g_test_rand_int_range (0, 256);
+          FPI_XYT_Y (xyt)[j] = g_test_rand_int_range (0, 256);
+          FPI_XYT_THETA (xyt)[j] = g_test_rand_int_range (-179, 181);
+        }
+
+      g_ptr_array_add (print->prints, xyt);
+    }
+
+  return print;
+}
+
+static void
+assert_prints_equal (FpPrint *a, FpPrint *b)
+{
+  g_assert_true (fp_print_equal (a, b));
+  g_assert_cmpint (fp_print_get_finger (a), ==, fp_print_get_finger (b));
+  g_assert_cmpstr (fp_print_get_username (a), ==, fp_print_get_username (b));
+}
+
+static void
+test_print_deserialize_bytes (void)
+{
+  guint trusted;
+
+  for (trusted = 0; trusted < 2; trusted++)
+    {
+      g_autoptr(FpPrint) raw = make_raw_print (1);
+      g_autoptr(FpPrint) nbis = make_nbis_print (2);
+      FpPrint *prints[] = { raw, nbis };
+      guint i;
+
+      for (i = 0; i < G_N_ELEMENTS (prints); i++)
+        {
+          g_autoptr(FpPrint) loaded = NULL;
+          g_autoptr(FpPrint) loaded_aligned = NULL;
+          g_autoptr(GBytes) bytes = NULL;
+          g_autoptr(GError) error = NULL;
+          g_autofree guchar *data = NULL;
+          g_autofree guchar *aligned = NULL;
+          gsize length;
+
+          g_assert_true (fp_print_serialize (prints[i], &data, &length, &error));
+          g_assert_no_error (error);
+
+          bytes = g_bytes_new (data, length);
+          loaded = fp_print_deserialize_bytes (bytes, trusted, &error);
+          g_assert_no_error (error);
+          assert_prints_equal (prints[i], loaded);
+
+          /* Place the data after the header at an aligned location */
+          aligned = g_malloc (length + 5);
+          memcpy (aligned + 5, data, length);
+          g_clear_pointer (&bytes, g_bytes_unref);
+          bytes = g_bytes_new_static (aligned + 5, length);
+          loaded_aligned = fp_print_deserialize_bytes (bytes, trusted, &error);
+          g_assert_no_error (error);
+          assert_prints_equal (prints[i], loaded_aligned);
+          g_clear_pointer (&bytes, g_bytes_unref);
+
+          /* The print must stay valid (with or without referencing the data) */
+          g_clear_object (&loaded);
+          loaded = fp_print_deserialize (data, length, &error);
+          g_assert_no_error (error);
+          assert_prints_equal (loaded_aligned, loaded);
+        }
+    }
+}
+
+static void
+test_print_deserialize_many (void)
+{
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) loaded = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *data = NULL;
+  gsize length;
+  guint i;
+
+  for (i = 0; i < 20; i++)
+    g_ptr_array_add (prints, i % 2 ? make_raw_print (i) : make_nbis_print (i));
+
+  g_assert_true (fp_print_serialize_many (prints, &data, &length, &error));
+  g_assert_no_error (error);
+
+  bytes = g_bytes_new_take (g_steal_pointer (&data), length);
+  loaded = fp_print_deserialize_many (bytes, FALSE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded->len, ==, prints->len);
+
+  for (i = 0; i < prints->len; i++)
+    assert_prints_equal (g_ptr_array_index (prints, i),
+                         g_ptr_array_index (loaded, i));
+
+  /* A single print is not a gallery */
+  g_clear_pointer (&loaded, g_ptr_array_unref);
+  g_clear_pointer (&bytes, g_bytes_unref);
+  g_assert_true (fp_print_serialize (g_ptr_array_index (prints, 0), &data, &length, NULL));
+  bytes = g_bytes_new_take (g_steal_pointer (&data), length);
+  loaded = fp_print_deserialize_many (bytes, FALSE, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert_null (loaded);
+}
+
+static void
+async_result_cb (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+  GAsyncResult **result = user_data;
+
+  *result = g_object_ref (res);
+}
+
+static GAsyncResult *
+wait_for_result (GAsyncResult **result)
+{
+  while (!*result)
+    g_main_context_iteration (NULL, TRUE);
+
+  return *result;
+}
+
+static void
+test_print_async (void)
+{
+  g_autoptr(GPtrArray) prints = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(FpPrint) loaded = NULL;
+  g_autoptr(GPtrArray) loaded_many = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  guchar *data = NULL;
+  gsize length;
+  guint i;
+
+  for (i = 0; i < 10; i++)
+    g_ptr_array_add (prints, i % 2 ? make_raw_print (i) : make_nbis_print (i));
+
+  fp_print_serialize_async (g_ptr_array_index (prints, 0), NULL,
+                            async_result_cb, &result);
+  g_assert_true (fp_print_serialize_finish (g_ptr_array_index (prints, 0),
+                                            wait_for_result (&result),
+                                            &data, &length, &error));
+  g_assert_no_error (error);
+  g_clear_object (&result);
+
+  bytes = g_bytes_new_take (data, length);
+  fp_print_deserialize_async (bytes, FALSE, NULL, async_result_cb, &result);
+  loaded = fp_print_deserialize_finish (wait_for_result (&result), &error);
+  g_assert_no_error (error);
+  assert_prints_equal (g_ptr_array_index (prints, 0), loaded);
+  g_clear_object (&result);
+  g_clear_pointer (&bytes, g_bytes_unref);
+
+  fp_print_serialize_many_async (prints, NULL, async_result_cb, &result);
+  g_assert_true (fp_print_serialize_many_finish (wait_for_result (&result),
+                                                 &data, &length, &error));
+  g_assert_no_error (error);
+  g_clear_object (&result);
+
+  bytes = g_bytes_new_take (data, length);
+  fp_print_deserialize_many_async (bytes, FALSE, NULL, async_result_cb, &result);
+  loaded_many = fp_print_deserialize_many_finish (wait_for_result (&result), &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (loaded_many->len, ==, prints->len);
+  for (i = 0; i < prints->len; i++)
+    assert_prints_equal (g_ptr_array_index (prints, i),
+                         g_ptr_array_index (loaded_many, i));
+
+  /* Results of other operations are rejected */
+  g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL,
+                         "*fp_print_serialize_many_async*");
+  g_assert_false (fp_print_serialize_many_finish (result, &data, &length, &error));
+  g_test_assert_expected_messages ();
+  g_assert_no_error (error);
+  g_clear_object (&result);
+  g_clear_pointer (&loaded_many, g_ptr_array_unref);
+
+  g_cancellable_cancel (cancellable);
+  fp_print_deserialize_many_async (bytes, FALSE, cancellable, async_result_cb, &result);
+  loaded_many = fp_print_deserialize_many_finish (wait_for_result (&result), &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (loaded_many);
+}
+
+static void
+test_print_xyt (void)
+{
+  g_autofree struct xyt_struct *expanded = g_new0 (struct xyt_struct, 1);
+  g_autoptr(FpPrint) print = make_nbis_print (0);
+  g_autoptr(FpPrint) other = make_nbis_print (0);
+  FpiXyt *xyt = g_ptr_array_index (print->prints, 0);
+  guint i;
+
+  g_assert_cmpuint (fpi_xyt_size (xyt), <, sizeof (struct xyt_struct));
+
+  fpi_xyt_to_struct (xyt, expanded);
+  g_assert_cmpint (expanded->nrows, ==, xyt->nrows);
+  for (i = 0; i < xyt->nrows; i++)
+    {
+      g_assert_cmpint (expanded->xcol[i], ==, FPI_XYT_X (xyt)[i]);
+      g_assert_cmpint (expanded->ycol[i], ==, FPI_XYT_Y (xyt)[i]);
+      g_assert_cmpint (expanded->thetacol[i], ==, FPI_XYT_THETA (xyt)[i]);
+    }
+
+  /* Prints with random minutiae differ */
+  g_assert_false (fp_print_equal (print, other));
+
+  /* Only the size of the template is copied */
+  g_ptr_array_set_size (print->prints, 1);
+  fpi_print_add_print (other, print);
+  g_assert_cmpuint (other->prints->len, ==, 4);
+  g_assert_cmpmem (g_ptr_array_index (other->prints, 3),
+                   fpi_xyt_size (xyt), xyt, fpi_xyt_size (xyt));
+}
+
+static void
+test_print_match_order (void)
+{
+  g_autoptr(FpPrint) template = make_nbis_print (30);
+  g_autoptr(FpPrint) probe = make_nbis_print (0);
+  g_autoptr(FpPrint) other = make_nbis_print (30);
+  g_autoptr(GError) error = NULL;
+  FpiXyt *last = g_ptr_array_index (template->prints, 2);
+  gint score, sub_print;
+  guint i;
+
+  /* The probe is identical to the last sub-print of the template */
+  g_ptr_array_set_size (probe->prints, 0);
+  g_ptr_array_add (probe->prints, g_memdup2 (last, fpi_xyt_size (last)));
+
+  for (i = 0; i < 3; i++)
+    {
+      g_assert_cmpint (fpi_print_bz3_match (template, probe, 40,
+                                            &score, &sub_print, &error),
+                       ==, FPI_MATCH_SUCCESS);
+      g_assert_no_error (error);
+      g_assert_cmpint (score, >=, 40);
+      g_assert_cmpint (sub_print, ==, 2);
+    }
+
+  /* The matching sub-print is remembered and tried first */
+  g_assert_cmpuint (template->n_sub_print_hits, ==, 3);
+  g_assert_cmpuint (template->sub_print_hits[2], ==, 3);
+  g_assert_cmpuint (template->sub_print_hits[0], ==, 0);
+
+  /* A failed match still reports the best score */
+  g_assert_cmpint (fpi_print_bz3_match (other, probe, 1000,
+                                        &score, &sub_print, &error),
+                   ==, FPI_MATCH_FAIL);
+  g_assert_no_error (error);
+  g_assert_cmpint (sub_print, >=, 0);
+  g_assert_cmpint (sub_print, <, 3);
+  g_assert_null (other->sub_print_hits);
+}
+
+static void
+test_print_hash (void)
+{
+  g_autoptr(FpPrint) raw = make_raw_print (1);
+  g_autoptr(FpPrint) raw_same = make_raw_print (1);
+  g_autoptr(FpPrint) raw_other = make_raw_print (2);
+  g_autoptr(FpPrint) print = make_nbis_print (0);
+  g_autoptr(FpPrint) copy = NULL;
+  g_autoptr(GHashTable) table = NULL;
+  g_autofree guchar *data = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize length;
+  guint hash;
+
+  g_assert_cmpuint (fpi_print_hash (raw), ==, fpi_print_hash (raw_same));
+  g_assert_cmpuint (fpi_print_hash (raw), !=, fpi_print_hash (raw_other));
+  g_assert_true (fp_print_equal (raw, raw_same));
+  g_assert_false (fp_print_equal (raw, raw_other));
+
+  g_assert_true (fp_print_serialize (print, &data, &length, &error));
+  g_assert_no_error (error);
+  copy = fp_print_deserialize (data, length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (fpi_print_hash (print), ==, fpi_print_hash (copy));
+
+  table = g_hash_table_new ((GHashFunc) fpi_print_hash, (GEqualFunc) fp_print_equal);
+  g_hash_table_add (table, raw);
+  g_hash_table_add (table, print);
+  g_assert_true (g_hash_table_contains (table, raw_same));
+  g_assert_true (g_hash_table_contains (table, copy));
+  g_assert_false (g_hash_table_contains (table, raw_other));
+  g_hash_table_remove_all (table);
+
+  /* Modifying the print data updates the hash */
+  hash = fpi_print_hash (copy);
+  g_ptr_array_set_size (print->prints, 1);
+  fpi_print_add_print (copy, print);
+  g_assert_cmpuint (fpi_print_hash (copy), !=, hash);
+  g_assert_false (fp_print_equal (print, copy));
+
+  g_object_set (raw_other, "fpi-data", g_variant_new ("(su)", "raw print", 1), NULL);
+  g_assert_cmpuint (fpi_print_hash (raw_other), ==, fpi_print_hash (raw));
+  g_assert_true (fp_print_equal (raw, raw_other));
+
+  /* Reading properties keeps the cached hash, setting them resets it */
+  hash = fpi_print_hash (raw_other);
+  g_assert_nonnull (fp_print_get_driver (raw_other));
+  g_assert_cmpuint (fpi_print_hash (raw_other), ==, hash);
+  g_object_set (raw_other, "fpi-data", g_variant_new ("(su)", "raw print", 3), NULL);
+  g_assert_cmpuint (fpi_print_hash (raw_other), !=, hash);
+  g_assert_false (fp_print_equal (raw, raw_other));
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/print/xyt", test_print_xyt);
+  g_test_add_func ("/print/deserialize-bytes", test_print_deserialize_bytes);
+  g_test_add_func ("/print/deserialize-many", test_print_deserialize_many);
+  g_test_add_func ("/print/async", test_print_async);
+  g_test_add_func ("/print/match-order", test_print_match_order);
+  g_test_add_func ("/print/hash", test_print_hash);
+
+  return g_test_run ();
+}
@@ -20,12 +20,18 @@
 #include "fp-device.h"
 #include "fp-enums.h"
 #include <libfprint/fprint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/spi/spidev.h>
 
 #define FP_COMPONENT "device"
 
 #include "fpi-device.h"
 #include "fpi-compat.h"
 #include "fpi-log.h"
+#include "fpi-spi-transfer.h"
+#include "fpi-usb-stream.h"
+#include "fpi-usb-transfer.h"
 #include "test-device-fake.h"
 #include "fp-print-private.h"
 
@@ -1816,6 +1822,110 @@ test_driver_identify (void)
   g_assert (expected_matched == matched_print);
 }
 
+static void
+test_driver_identify_chunked_cb (FpDevice *device,
+                                 FpPrint  *match,
+                                 FpPrint  *print,
+                                 gpointer  user_data,
+                                 GError   *error)
+{
+  GPtrArray **chunk = user_data;
+
+  /* The result is only reported once */
+  g_assert_null (*chunk);
+  *chunk = g_ptr_array_ref (FPI_DEVICE_FAKE (device)->action_data);
+}
+
+static void (*identify_chunk_orig) (FpDevice *device);
+static GArray *identify_chunk_status;
+
+static void
+test_driver_identify_chunk_status (FpDevice *device)
+{
+  FpFingerStatusFlags status = fp_device_get_finger_status (device);
+
+  g_array_append_val (identify_chunk_status, status);
+  identify_chunk_orig (device);
+}
+
+static void
+assert_identify_chunk_status (guint n_chunks)
+{
+  guint i;
+
+  g_assert_cmpuint (identify_chunk_status->len, ==, n_chunks);
+  g_assert_cmpuint (g_array_index (identify_chunk_status, FpFingerStatusFlags, 0),
+                    ==, FP_FINGER_STATUS_NONE);
+
+  /* The user is asked for the finger again before every further chunk */
+  for (i = 1; i < n_chunks; i++)
+    g_assert_cmpuint (g_array_index (identify_chunk_status, FpFingerStatusFlags, i),
+                      ==, FP_FINGER_STATUS_NEEDED);
+
+  g_array_set_size (identify_chunk_status, 0);
+}
+
+static void
+test_driver_identify_chunked (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FpPrint) print = NULL;
+  g_autoptr(FpPrint) matched_print = NULL;
+  g_autoptr(FpAutoResetClass) dev_class = auto_reset_device_class ();
+  g_autoptr(FpAutoCloseDevice) device = auto_close_fake_device_new ();
+  g_autoptr(GPtrArray) prints = make_fake_prints_gallery (device, 500);
+  g_autoptr(GPtrArray) chunk = NULL;
+  g_autoptr(GArray) status = g_array_new (FALSE, FALSE, sizeof (FpFingerStatusFlags));
+  g_autoptr(FpPrint) ret_print = NULL;
+  FpiDeviceFake *fake_dev = FPI_DEVICE_FAKE (device);
+  FpPrint *expected_matched;
+
+  dev_class->identify_max_prints = 64;
+  identify_chunk_orig = dev_class->identify;
+  dev_class->identify = test_driver_identify_chunk_status;
+  identify_chunk_status = status;
+
+  /* The driver reports the same print for every chunk, so keep a reference */
+  ret_print = g_object_ref_sink (make_fake_print (device, NULL));
+  fake_dev->ret_print = ret_print;
+
+  /* The match is in the fourth chunk */
+  expected_matched = g_ptr_array_index (prints, 200);
+  fp_print_set_description (expected_matched, "fake-verified");
+
+  g_assert_true (fp_device_identify_sync (device, prints, NULL,
+                                          test_driver_identify_chunked_cb, &chunk,
+                                          &matched_print, &print, &error));
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (chunk->len, ==, 64);
+  g_assert_true (g_ptr_array_index (chunk, 0) == g_ptr_array_index (prints, 192));
+  g_assert_true (matched_print == expected_matched);
+  g_assert_true (print == ret_print);
+  assert_identify_chunk_status (4);
+  g_assert_cmpuint (fp_device_get_finger_status (device), ==, FP_FINGER_STATUS_NONE);
+
+  /* Without a match, all chunks are tried */
+  fp_print_set_description (expected_matched, NULL);
+  g_clear_pointer (&chunk, g_ptr_array_unref);
+  g_clear_object (&matched_print);
+  g_clear_object (&print);
+
+  g_assert_true (fp_device_identify_sync (device, prints, NULL,
+                                          test_driver_identify_chunked_cb, &chunk,
+                                          &matched_print, &print, &error));
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (chunk->len, ==, 500 % 64);
+  g_assert_true (g_ptr_array_index (chunk, chunk->len - 1) == g_ptr_array_index (prints, 499));
+  g_assert_null (matched_print);
+  g_assert_true (print == ret_print);
+  assert_identify_chunk_status (8);
+  g_assert_cmpuint (fp_device_get_finger_status (device), ==, FP_FINGER_STATUS_NONE);
+
+  identify_chunk_status = NULL;
+}
+
 static void
 test_driver_identify_fail (void)
 {
@@ -3387,6 +3497,611 @@ test_driver_retry_error_types (void)
   g_test_assert_expected_messages ();
 }
 
+static void
+test_driver_usb_transfer_pool (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(FpiUsbTransferPool) pool = NULL;
+  FpiUsbTransfer *transfer;
+  FpiUsbTransfer *other;
+  guchar *buffer;
+
+  pool = fpi_usb_transfer_pool_new (device, 512, 1, TRUE);
+  g_assert_cmpuint (fpi_usb_transfer_pool_get_buffer_size (pool), ==, 512);
+
+  transfer = fpi_usb_transfer_pool_acquire_bulk (pool, 0x81, 64);
+  g_assert_true (transfer->device == device);
+  g_assert_cmpint (transfer->length, ==, 64);
+  g_assert_nonnull (transfer->buffer);
+  g_assert_cmpuint (GPOINTER_TO_SIZE (transfer->buffer) % sysconf (_SC_PAGESIZE), ==, 0);
+  buffer = transfer->buffer;
+  transfer->short_is_error = TRUE;
+
+  /* Both are in use, so a second transfer is created */
+  other = fpi_usb_transfer_pool_acquire_bulk (pool, 0x81, 512);
+  g_assert_true (other != transfer);
+  g_assert_true (other->buffer != buffer);
+
+  /* Only one unused transfer is kept */
+  fpi_usb_transfer_unref (transfer);
+  fpi_usb_transfer_unref (other);
+
+  transfer = fpi_usb_transfer_pool_acquire_interrupt (pool, 0x82, 128);
+  g_assert_true (transfer->buffer == buffer);
+  g_assert_cmpint (transfer->length, ==, 128);
+  g_assert_false (transfer->short_is_error);
+  g_assert_null (transfer->ssm);
+
+  /* The transfer keeps the pool alive */
+  g_clear_pointer (&pool, fpi_usb_transfer_pool_unref);
+  fpi_usb_transfer_unref (transfer);
+}
+
+static FpiUsbTransfer *
+batch_write_transfer (FpDevice *device, guint8 reg)
+{
+  FpiUsbTransfer *transfer = fpi_usb_transfer_new (device);
+
+  fpi_usb_transfer_fill_control (transfer,
+                                 G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
+                                 G_USB_DEVICE_REQUEST_TYPE_VENDOR,
+                                 G_USB_DEVICE_RECIPIENT_DEVICE,
+                                 0x0c, 0, reg, 1);
+
+  return transfer;
+}
+
+typedef struct
+{
+  gint    called;
+  GError *error;
+} BatchResult;
+
+static void
+test_driver_usb_transfer_batch_cb (FpDevice *device, gpointer user_data, GError *error)
+{
+  BatchResult *result = user_data;
+
+  result->called++;
+  g_assert_null (result->error);
+  result->error = error;
+}
+
+static void
+test_driver_usb_transfer_batch_empty (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  BatchResult result = { 0 };
+  FpiUsbTransferBatch *batch;
+
+  batch = fpi_usb_transfer_batch_new (device, 4);
+  fpi_usb_transfer_batch_submit (batch, 100, NULL,
+                                 test_driver_usb_transfer_batch_cb, &result);
+
+  /* Reported right away and without an error */
+  g_assert_cmpint (result.called, ==, 1);
+  g_assert_no_error (result.error);
+}
+
+static void
+test_driver_usb_transfer_batch_free (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(FpiUsbTransferBatch) batch = NULL;
+  FpiUsbTransfer *transfer;
+
+  batch = fpi_usb_transfer_batch_new (device, 4);
+  transfer = batch_write_transfer (device, 0);
+  fpi_usb_transfer_batch_add (batch, fpi_usb_transfer_ref (transfer));
+  fpi_usb_transfer_batch_add (batch, batch_write_transfer (device, 1));
+
+  /* The batch holds a reference to the transfers that were not submitted */
+  g_assert_cmpuint (transfer->ref_count, ==, 2);
+  g_clear_pointer (&batch, fpi_usb_transfer_batch_free);
+  g_assert_cmpuint (transfer->ref_count, ==, 1);
+  fpi_usb_transfer_unref (transfer);
+}
+
+static void
+test_driver_usb_transfer_batch_failure (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  BatchResult result = { 0 };
+  FpiUsbTransfer *transfers[10];
+  FpiUsbTransferBatch *batch;
+  guint i;
+
+  batch = fpi_usb_transfer_batch_new (device, 3);
+  for (i = 0; i < G_N_ELEMENTS (transfers); i++)
+    {
+      transfers[i] = batch_write_transfer (device, i);
+      fpi_usb_transfer_batch_add (batch, fpi_usb_transfer_ref (transfers[i]));
+    }
+
+  /* Every submitted transfer fails */
+  g_cancellable_cancel (cancellable);
+  fpi_usb_transfer_batch_submit (batch, 100, cancellable,
+                                 test_driver_usb_transfer_batch_cb, &result);
+
+  /* Only the first three are in flight */
+  for (i = 0; i < G_N_ELEMENTS (transfers); i++)
+    {
+      if (i < 3)
+        g_assert_nonnull (transfers[i]->callback);
+      else
+        g_assert_null (transfers[i]->callback);
+    }
+
+  while (!result.called)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The error of the first transfer is reported */
+  g_assert_cmpint (result.called, ==, 1);
+  g_assert_error (result.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_true (g_str_has_prefix (result.error->message, "Transfer 1 of 10: "));
+  g_clear_error (&result.error);
+
+  /* Nothing was submitted after the failure, and the batch is gone */
+  for (i = 0; i < G_N_ELEMENTS (transfers); i++)
+    {
+      g_assert_null (transfers[i]->callback);
+      g_assert_cmpuint (transfers[i]->ref_count, ==, 1);
+      g_assert_cmpint (transfers[i]->actual_length, ==, i < 3 ? -1 : 0);
+      fpi_usb_transfer_unref (transfers[i]);
+    }
+}
+
+typedef struct
+{
+  FpiUsbTransfer        *transfer;
+  /* The submitted transfer, also after it completed */
+  FpiUsbTransfer        *submitted;
+  GCancellable          *cancellable;
+  FpiUsbTransferCallback callback;
+  gpointer               user_data;
+} FakeStreamRead;
+
+/* FakeStreamRead in submission order */
+static GPtrArray *fake_stream_reads = NULL;
+
+static void
+fake_stream_read_free (FakeStreamRead *read)
+{
+  g_assert_null (read->transfer);
+  g_clear_object (&read->cancellable);
+  g_free (read);
+}
+
+static void
+fake_stream_submit (FpiUsbTransfer        *transfer,
+                    guint                  timeout_ms,
+                    GCancellable          *cancellable,
+                    FpiUsbTransferCallback callback,
+                    gpointer               user_data)
+{
+  FakeStreamRead *read = g_new0 (FakeStreamRead, 1);
+
+  read->transfer = transfer;
+  read->submitted = transfer;
+  read->cancellable = g_object_ref (cancellable);
+  read->callback = callback;
+  read->user_data = user_data;
+  g_ptr_array_add (fake_stream_reads, read);
+}
+
+static FakeStreamRead *
+fake_stream_read (guint n)
+{
+  g_assert_cmpuint (n, <, fake_stream_reads->len);
+
+  return g_ptr_array_index (fake_stream_reads, n);
+}
+
+/* Completes the n-th submitted read with one byte of data or an error */
+static void
+fake_stream_complete (guint n, guint8 data, GError *error)
+{
+  FakeStreamRead *read = fake_stream_read (n);
+  FpiUsbTransfer *transfer = g_steal_pointer (&read->transfer);
+
+  g_assert_nonnull (transfer);
+
+  if (error)
+    {
+      transfer->actual_length = -1;
+    }
+  else
+    {
+      transfer->buffer[0] = data;
+      transfer->actual_length = 1;
+    }
+
+  read->callback (transfer, transfer->device, read->user_data, error);
+  fpi_usb_transfer_unref (transfer);
+}
+
+/* Returns all pending reads like the host controller does once cancelled */
+static void
+fake_stream_complete_cancelled (void)
+{
+  guint i;
+
+  for (i = 0; i < fake_stream_reads->len; i++)
+    {
+      FakeStreamRead *read = fake_stream_read (i);
+
+      if (!read->transfer)
+        continue;
+
+      g_assert_true (g_cancellable_is_cancelled (read->cancellable));
+      fake_stream_complete (i, 0,
+                            g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                                 "Transfer cancelled"));
+    }
+}
+
+typedef struct
+{
+  GString *data;
+  gint     finished;
+  GError  *error;
+  /* Stop the stream from the callback when receiving this */
+  guint8   stop_at;
+} StreamResult;
+
+static void
+test_driver_usb_stream_cb (FpiUsbStream   *stream,
+                           FpDevice       *dev,
+                           FpiUsbTransfer *transfer,
+                           gpointer        user_data,
+                           GError         *error)
+{
+  StreamResult *result = user_data;
+
+  g_assert_cmpint (result->finished, ==, 0);
+
+  if (!transfer)
+    {
+      g_assert_false (fpi_usb_stream_is_active (stream));
+      result->finished++;
+      result->error = error;
+      return;
+    }
+
+  g_assert_no_error (error);
+  g_assert_cmpint (transfer->actual_length, ==, 1);
+  g_string_append_c (result->data, transfer->buffer[0]);
+
+  if (result->stop_at && transfer->buffer[0] == result->stop_at)
+    fpi_usb_stream_stop (stream);
+}
+
+static FpiUsbStream *
+fake_stream_new (FpDevice *device, guint n_transfers)
+{
+  FpiUsbStream *stream = fpi_usb_stream_new (device, 0x81, 64, n_transfers, 0);
+
+  fpi_usb_stream_set_submit_func (stream, fake_stream_submit);
+  fake_stream_reads = g_ptr_array_new_with_free_func ((GDestroyNotify) fake_stream_read_free);
+
+  return stream;
+}
+
+static void
+fake_stream_free (FpiUsbStream *stream)
+{
+  fpi_usb_stream_unref (stream);
+  g_clear_pointer (&fake_stream_reads, g_ptr_array_unref);
+}
+
+static void
+test_driver_usb_stream_order (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  StreamResult result = { g_string_new (NULL) };
+  FpiUsbStream *stream;
+  guint i;
+
+  stream = fake_stream_new (device, 3);
+  fpi_usb_stream_start (stream, NULL, test_driver_usb_stream_cb, &result);
+
+  /* All reads are queued up front */
+  g_assert_true (fpi_usb_stream_is_active (stream));
+  g_assert_cmpuint (fake_stream_reads->len, ==, 3);
+
+  /* Reads that complete early wait for the older ones */
+  fake_stream_complete (2, 'c', NULL);
+  fake_stream_complete (1, 'b', NULL);
+  g_assert_cmpstr (result.data->str, ==, "");
+  g_assert_cmpuint (fake_stream_reads->len, ==, 3);
+
+  fake_stream_complete (0, 'a', NULL);
+  g_assert_cmpstr (result.data->str, ==, "abc");
+
+  /* Each read was queued again in order, reusing its transfer */
+  g_assert_cmpuint (fake_stream_reads->len, ==, 6);
+  for (i = 0; i < 3; i++)
+    g_assert_true (fake_stream_read (i + 3)->submitted == fake_stream_read (i)->submitted);
+
+  fake_stream_complete (3, 'd', NULL);
+  fake_stream_complete (4, 'e', NULL);
+  g_assert_cmpstr (result.data->str, ==, "abcde");
+  g_assert_cmpuint (fake_stream_reads->len, ==, 8);
+
+  /* Data that arrives after stopping is dropped and nothing is resubmitted */
+  fpi_usb_stream_stop (stream);
+  g_assert_true (fpi_usb_stream_is_active (stream));
+  fake_stream_complete (6, 'f', NULL);
+  fake_stream_complete_cancelled ();
+
+  g_assert_cmpint (result.finished, ==, 1);
+  g_assert_no_error (result.error);
+  g_assert_cmpstr (result.data->str, ==, "abcde");
+  g_assert_cmpuint (fake_stream_reads->len, ==, 8);
+
+  /* The stream can be started again and continues around the ring */
+  result.finished = 0;
+  result.stop_at = 'h';
+  fpi_usb_stream_start (stream, NULL, test_driver_usb_stream_cb, &result);
+  g_assert_cmpuint (fake_stream_reads->len, ==, 11);
+  for (i = 8; i < 11; i++)
+    g_assert_true (fake_stream_read (i)->submitted == fake_stream_read (i - 3)->submitted);
+
+  /* Stopping from the callback drops the reads that completed after it */
+  fake_stream_complete (10, 'i', NULL);
+  fake_stream_complete (8, 'g', NULL);
+  fake_stream_complete (9, 'h', NULL);
+  g_assert_cmpint (result.finished, ==, 1);
+  g_assert_no_error (result.error);
+  g_assert_cmpstr (result.data->str, ==, "abcdegh");
+  g_assert_cmpuint (fake_stream_reads->len, ==, 11);
+
+  g_string_free (result.data, TRUE);
+  fake_stream_free (stream);
+}
+
+static void
+test_driver_usb_stream_cancel (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  StreamResult result = { g_string_new (NULL) };
+  FpiUsbStream *stream;
+
+  stream = fake_stream_new (device, 2);
+  fpi_usb_stream_start (stream, cancellable, test_driver_usb_stream_cb, &result);
+
+  fake_stream_complete (0, 'a', NULL);
+  g_assert_cmpuint (fake_stream_reads->len, ==, 3);
+
+  /* Cancelling the external cancellable cancels all reads */
+  g_cancellable_cancel (cancellable);
+  g_assert_true (fpi_usb_stream_is_active (stream));
+  fake_stream_complete_cancelled ();
+
+  g_assert_cmpint (result.finished, ==, 1);
+  g_assert_error (result.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpstr (result.data->str, ==, "a");
+  g_assert_cmpuint (fake_stream_reads->len, ==, 3);
+
+  g_clear_error (&result.error);
+  g_string_free (result.data, TRUE);
+  fake_stream_free (stream);
+}
+
+static void
+test_driver_usb_stream_cancelled (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(FpiUsbStream) stream = NULL;
+  StreamResult result = { g_string_new (NULL) };
+
+  /* Real transfers, which fail as they are cancelled before starting */
+  g_cancellable_cancel (cancellable);
+  stream = fpi_usb_stream_new (device, 0x81, 64, 4, 0);
+  fpi_usb_stream_start (stream, cancellable, test_driver_usb_stream_cb, &result);
+
+  while (!result.finished)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (fpi_usb_stream_is_active (stream));
+  g_assert_error (result.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpstr (result.data->str, ==, "");
+
+  g_clear_error (&result.error);
+  g_string_free (result.data, TRUE);
+}
+
+static void
+test_driver_usb_stream_error (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  StreamResult result = { g_string_new (NULL) };
+  FpiUsbStream *stream;
+
+  stream = fake_stream_new (device, 3);
+  fpi_usb_stream_start (stream, NULL, test_driver_usb_stream_cb, &result);
+
+  fake_stream_complete (0, 'a', NULL);
+  fake_stream_complete (2, 'c', NULL);
+  g_assert_cmpuint (fake_stream_reads->len, ==, 4);
+
+  /* The stream ends with the first error, later data is not delivered */
+  fake_stream_complete (1, 0, g_error_new_literal (G_USB_DEVICE_ERROR,
+                                                   G_USB_DEVICE_ERROR_IO,
+                                                   "Read failed"));
+  g_assert_cmpint (result.finished, ==, 0);
+  fake_stream_complete_cancelled ();
+
+  g_assert_cmpint (result.finished, ==, 1);
+  g_assert_error (result.error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_IO);
+  g_assert_cmpstr (result.data->str, ==, "a");
+  g_assert_cmpuint (fake_stream_reads->len, ==, 4);
+
+  g_clear_error (&result.error);
+  g_string_free (result.data, TRUE);
+  fake_stream_free (stream);
+}
+
+typedef struct
+{
+  GMutex     mutex;
+  GCond      cond;
+  gboolean   blocked;
+  gboolean   waiting;
+  /* Segments of each ioctl, "|" marks a deselect of the chip */
+  GPtrArray *ioctls;
+  guint      fail_ioctl;
+} FakeSpidev;
+
+static FakeSpidev fake_spidev;
+
+static int
+fake_spidev_ioctl (int spidev_fd, struct spi_ioc_transfer *xfer, guint n_xfer)
+{
+  GString *segments = g_string_new (NULL);
+  gsize length = 0;
+  guint call;
+  guint i;
+
+  g_mutex_lock (&fake_spidev.mutex);
+
+  fake_spidev.waiting = TRUE;
+  g_cond_broadcast (&fake_spidev.cond);
+  while (fake_spidev.blocked)
+    g_cond_wait (&fake_spidev.cond, &fake_spidev.mutex);
+
+  call = fake_spidev.ioctls->len;
+
+  for (i = 0; i < n_xfer; i++)
+    {
+      if (xfer[i].tx_buf)
+        g_string_append_c (segments, 'w');
+      if (xfer[i].rx_buf)
+        {
+          g_string_append_c (segments, 'r');
+          memset ((guint8 *) (gsize) xfer[i].rx_buf, call, xfer[i].len);
+        }
+
+      /* On the last segment it would keep the chip selected */
+      g_assert_false (xfer[i].cs_change && i + 1 == n_xfer);
+      if (xfer[i].cs_change)
+        g_string_append_c (segments, '|');
+
+      length += xfer[i].len;
+    }
+
+  g_ptr_array_add (fake_spidev.ioctls, g_string_free (segments, FALSE));
+
+  g_mutex_unlock (&fake_spidev.mutex);
+
+  if (call == fake_spidev.fail_ioctl)
+    {
+      errno = EIO;
+      return -1;
+    }
+
+  return length;
+}
+
+typedef struct
+{
+  FpiSpiTransfer *transfers[6];
+  GError         *errors[6];
+  GString        *order;
+} SpiResult;
+
+static void
+test_driver_spi_transfer_cb (FpiSpiTransfer *transfer, FpDevice *device,
+                             gpointer user_data, GError *error)
+{
+  SpiResult *result = user_data;
+  gint index = 0;
+
+  while (result->transfers[index] != transfer)
+    index++;
+
+  g_string_append_c (result->order, '0' + index);
+  result->errors[index] = error;
+
+  if (index == 1)
+    {
+      g_assert_no_error (error);
+      g_assert_cmpint (transfer->buffer_rd[0], ==, 1);
+    }
+}
+
+static void
+test_driver_spi_transfer_merge (void)
+{
+  g_autoptr(FpDevice) device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  SpiResult result = { { NULL } };
+  FpiSpiTransfer **transfers = result.transfers;
+  guint i;
+
+  fake_spidev.blocked = TRUE;
+  fake_spidev.waiting = FALSE;
+  fake_spidev.ioctls = g_ptr_array_new_with_free_func (g_free);
+  fake_spidev.fail_ioctl = 2;
+  result.order = g_string_new (NULL);
+  fpi_spi_transfer_set_ioctl_func (fake_spidev_ioctl);
+
+  for (i = 0; i < G_N_ELEMENTS (result.transfers); i++)
+    transfers[i] = fpi_spi_transfer_new (device, 1000);
+
+  fpi_spi_transfer_write (transfers[0], 1);
+  fpi_spi_transfer_write (transfers[1], 2);
+  fpi_spi_transfer_read (transfers[1], 1);
+  fpi_spi_transfer_write (transfers[2], 1);
+  /* transfers[3] has neither write nor read, so it fails on its own */
+  fpi_spi_transfer_read (transfers[4], 2);
+  fpi_spi_transfer_write (transfers[5], 1);
+
+  /* Queue the others while the first one runs */
+  fpi_spi_transfer_submit (transfers[0], NULL, test_driver_spi_transfer_cb, &result);
+
+  g_mutex_lock (&fake_spidev.mutex);
+  while (!fake_spidev.waiting)
+    g_cond_wait (&fake_spidev.cond, &fake_spidev.mutex);
+  g_mutex_unlock (&fake_spidev.mutex);
+
+  for (i = 1; i < G_N_ELEMENTS (result.transfers); i++)
+    fpi_spi_transfer_submit (transfers[i], NULL, test_driver_spi_transfer_cb, &result);
+
+  g_mutex_lock (&fake_spidev.mutex);
+  fake_spidev.blocked = FALSE;
+  g_cond_broadcast (&fake_spidev.cond);
+  g_mutex_unlock (&fake_spidev.mutex);
+
+  while (result.order->len < G_N_ELEMENTS (result.transfers))
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Transfers complete in order, each with its own result */
+  g_assert_cmpstr (result.order->str, ==, "012345");
+  g_assert_no_error (result.errors[0]);
+  g_assert_no_error (result.errors[1]);
+  g_assert_no_error (result.errors[2]);
+  g_assert_error (result.errors[3], G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_assert_nonnull (result.errors[4]);
+  g_assert_true (result.errors[4]->domain == G_IO_ERROR);
+  g_assert_nonnull (result.errors[5]);
+  g_assert_true (result.errors[5]->domain == G_IO_ERROR);
+
+  /* The waiting transfers were merged, up to the one that cannot be */
+  g_assert_cmpuint (fake_spidev.ioctls->len, ==, 3);
+  g_assert_cmpstr (g_ptr_array_index (fake_spidev.ioctls, 0), ==, "w");
+  g_assert_cmpstr (g_ptr_array_index (fake_spidev.ioctls, 1), ==, "wr|w");
+  g_assert_cmpstr (g_ptr_array_index (fake_spidev.ioctls, 2), ==, "r|w");
+
+  fpi_spi_transfer_set_ioctl_func (NULL);
+  for (i = 0; i < G_N_ELEMENTS (result.errors); i++)
+    g_clear_error (&result.errors[i]);
+  g_clear_pointer (&fake_spidev.ioctls, g_ptr_array_unref);
+  g_string_free (result.order, TRUE);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -3455,6 +4170,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/driver/verify/complete_retry", test_driver_verify_complete_retry);
   g_test_add_func ("/driver/identify", test_driver_identify);
   g_test_add_func ("/driver/identify/fail", test_driver_identify_fail);
+  g_test_add_func ("/driver/identify/chunked", test_driver_identify_chunked);
   g_test_add_func ("/driver/identify/retry", test_driver_identify_retry);
   g_test_add_func ("/driver/identify/error", test_driver_identify_error);
   g_test_add_func ("/driver/identify/not_reported", test_driver_identify_not_reported);
@@ -3502,5 +4218,15 @@ main (int argc, char *argv[])
   g_test_add_func ("/driver/error_types", test_driver_error_types);
   g_test_add_func ("/driver/retry_error_types", test_driver_retry_error_types);
 
+  g_test_add_func ("/driver/usb_transfer_pool", test_driver_usb_transfer_pool);
+  g_test_add_func ("/driver/usb_transfer_batch/empty", test_driver_usb_transfer_batch_empty);
+  g_test_add_func ("/driver/usb_transfer_batch/free", test_driver_usb_transfer_batch_free);
+  g_test_add_func ("/driver/usb_transfer_batch/failure", test_driver_usb_transfer_batch_failure);
+  g_test_add_func ("/driver/usb_stream/order", test_driver_usb_stream_order);
+  g_test_add_func ("/driver/usb_stream/cancel", test_driver_usb_stream_cancel);
+  g_test_add_func ("/driver/usb_stream/cancelled", test_driver_usb_stream_cancelled);
+  g_test_add_func ("/driver/usb_stream/error", test_driver_usb_stream_error);
+  g_test_add_func ("/driver/spi_transfer/merge", test_driver_spi_transfer_merge);
+
   return g_test_run ();
 }
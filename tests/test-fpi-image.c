@@ -0,0 +1,250 @@
+/*
+ * FpImage Unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include "fpi-image.h"
+
+static FpImage *
+random_image (guint width, guint height)
+{
+  FpImage *img = fp_image_new (width, height);
+  guint i;
+
+  for (i = 0; i < width * height; i++)
+    img->data[i] = g_test_rand_int_range (0, 256);
+
+  return img;
+}
+
+static guint
+image_pixel (FpImage *img, gint x, gint y)
+{
+  if (x < 0 || y < 0 || x >= (gint) img->width || y >= (gint) img->height)
+    return 0;
+
+  return img->data[x + y * img->width];
+}
+
+/* Straight per pixel implementation of pixman's bilinear sampling */
+static guint8
+reference_bilinear (FpImage *img, guint w_factor, guint h_factor, gint x, gint y)
+{
+  gint32 x_step = (1 << 16) / w_factor;
+  gint32 y_step = (1 << 16) / h_factor;
+  gint32 fx = (((gint64) x_step * 0x8000 + 0x8000) >> 16) + x * x_step - 0x8000;
+  gint32 fy = (((gint64) y_step * 0x8000 + 0x8000) >> 16) + y * y_step - 0x8000;
+  gint x1 = fx >> 16;
+  gint y1 = fy >> 16;
+  guint64 dx = ((fx >> 9) & 0x7f) << 1;
+  guint64 dy = ((fy >> 9) & 0x7f) << 1;
+  guint64 res;
+
+  res = image_pixel (img, x1, y1) * (256 - dx) * (256 - dy) +
+        image_pixel (img, x1 + 1, y1) * dx * (256 - dy) +
+        image_pixel (img, x1, y1 + 1) * (256 - dx) * dy +
+        image_pixel (img, x1 + 1, y1 + 1) * dx * dy;
+
+  return res >> 16;
+}
+
+static void
+test_image_resize (void)
+{
+  const guint sizes[][2] = { { 1, 1 }, { 7, 5 }, { 16, 12 }, { 33, 17 }, { 96, 96 } };
+  guint s, f;
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+    {
+      for (f = 1; f <= 4; f++)
+        {
+          g_autoptr(FpImage) img = random_image (sizes[s][0], sizes[s][1]);
+          g_autoptr(FpImage) resized = NULL;
+          guint x, y;
+
+          img->flags = FPI_IMAGE_COLORS_INVERTED;
+          resized = fpi_image_resize (img, f, f + 1);
+
+          g_assert_cmpuint (resized->width, ==, img->width * f);
+          g_assert_cmpuint (resized->height, ==, img->height * (f + 1));
+          g_assert_cmpuint (resized->flags, ==, img->flags);
+
+          for (y = 0; y < resized->height; y++)
+            for (x = 0; x < resized->width; x++)
+              g_assert_cmpuint (resized->data[x + y * resized->width], ==,
+                                reference_bilinear (img, f, f + 1, x, y));
+        }
+    }
+}
+
+static void
+test_image_normalize (void)
+{
+  const guint sizes[][2] = { { 1, 1 }, { 15, 3 }, { 16, 4 }, { 37, 21 } };
+  guint s, flags;
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+    {
+      for (flags = 0; flags <= FPI_IMAGE_NORMALIZATION_FLAGS; flags++)
+        {
+          g_autoptr(FpImage) img = random_image (sizes[s][0], sizes[s][1]);
+          g_autofree guint8 *data = NULL;
+          guint x, y;
+
+          img->flags = flags;
+          data = fpi_image_dup_normalized_data (img);
+
+          for (y = 0; y < img->height; y++)
+            {
+              for (x = 0; x < img->width; x++)
+                {
+                  guint src_x = flags & FPI_IMAGE_H_FLIPPED ? img->width - x - 1 : x;
+                  guint src_y = flags & FPI_IMAGE_V_FLIPPED ? img->height - y - 1 : y;
+                  guint8 expected = img->data[src_x + src_y * img->width];
+
+                  if (flags & FPI_IMAGE_COLORS_INVERTED)
+                    expected = 0xff - expected;
+
+                  g_assert_cmpuint (data[x + y * img->width], ==, expected);
+                }
+            }
+        }
+    }
+}
+
+static void
+test_frame_stats (void)
+{
+  const guint sizes[][2] = { { 1, 1 }, { 7, 5 }, { 16, 12 }, { 33, 17 }, { 120, 96 } };
+  guint s, step;
+
+  for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+    {
+      guint width = sizes[s][0];
+      guint height = sizes[s][1];
+      g_autofree guint8 *buf8 = g_malloc (width * height);
+      g_autofree guint16 *buf16 = g_new (guint16, width * height);
+      g_autofree guint16 *ref16 = g_new (guint16, width * height);
+      guint i;
+
+      for (i = 0; i < width * height; i++)
+        {
+          buf8[i] = g_test_rand_int_range (0, 256);
+          buf16[i] = g_test_rand_int_range (0, 65536);
+          ref16[i] = g_test_rand_int_range (0, 65536);
+        }
+
+      for (step = 1; step <= 3; step++)
+        {
+          /* Skip the last column to also cover a stride larger than the width */
+          guint area_width = MAX (width - 1, 1);
+          FpiFrameStats stats8 = { 0 }, stats16 = { 0 }, stats_diff = { 0 };
+          guint64 count = 0, sum8 = 0, sum16 = 0, sum_diff = 0;
+          guint64 mean8, mean16, mean_diff;
+          guint64 sq8 = 0, sq16 = 0, sq_diff = 0;
+          guint x, y;
+
+          fpi_frame_stats_add_u8 (&stats8, buf8, area_width, height, width, step);
+          fpi_frame_stats_add_u16 (&stats16, buf16, area_width, height, width, step);
+          fpi_frame_stats_add_diff_u16 (&stats_diff, buf16, ref16, area_width, height, width, step);
+
+          /* Two pass reference */
+          for (y = 0; y < height; y += step)
+            for (x = 0; x < area_width; x += step)
+              {
+                i = x + y * width;
+                count++;
+                sum8 += buf8[i];
+                sum16 += buf16[i];
+                sum_diff += ABS ((gint) buf16[i] - (gint) ref16[i]);
+              }
+
+          mean8 = sum8 / count;
+          mean16 = sum16 / count;
+          mean_diff = sum_diff / count;
+
+          for (y = 0; y < height; y += step)
+            for (x = 0; x < area_width; x += step)
+              {
+                gint64 d8, d16, d_diff;
+
+                i = x + y * width;
+                d8 = (gint64) buf8[i] - mean8;
+                d16 = (gint64) buf16[i] - mean16;
+                d_diff = (gint64) ABS ((gint) buf16[i] - (gint) ref16[i]) - mean_diff;
+                sq8 += d8 * d8;
+                sq16 += d16 * d16;
+                sq_diff += d_diff * d_diff;
+              }
+
+          g_assert_cmpuint (stats8.count, ==, count);
+          g_assert_cmpuint (fpi_frame_stats_get_mean (&stats8), ==, mean8);
+          g_assert_cmpuint (fpi_frame_stats_get_sq_dev (&stats8), ==, sq8 / count);
+          g_assert_cmpuint (fpi_frame_stats_get_mean (&stats16), ==, mean16);
+          g_assert_cmpuint (fpi_frame_stats_get_sq_dev (&stats16), ==, sq16 / count);
+          g_assert_cmpuint (fpi_frame_stats_get_mean (&stats_diff), ==, mean_diff);
+          g_assert_cmpuint (fpi_frame_stats_get_sq_dev (&stats_diff), ==, sq_diff / count);
+        }
+
+      {
+        guint64 sum = 0, mean, sq = 0;
+
+        for (i = 0; i < width * height; i++)
+          sum += buf8[i];
+        mean = sum / (width * height);
+        for (i = 0; i < width * height; i++)
+          sq += ((gint64) buf8[i] - mean) * ((gint64) buf8[i] - mean);
+
+        g_assert_cmpint (fpi_std_sq_dev (buf8, width * height), ==, sq / (width * height));
+      }
+    }
+}
+
+static void
+test_finger_detector (void)
+{
+  FpiFingerDetector detector;
+
+  fpi_finger_detector_init (&detector, 100, 50, 2);
+
+  /* A single frame above the threshold is not enough */
+  g_assert_false (fpi_finger_detector_update (&detector, 200));
+  g_assert_false (fpi_finger_detector_update (&detector, 10));
+  g_assert_false (fpi_finger_detector_update (&detector, 200));
+  g_assert_true (fpi_finger_detector_update (&detector, 200));
+
+  /* Values between the thresholds keep the state */
+  g_assert_true (fpi_finger_detector_update (&detector, 75));
+  g_assert_true (fpi_finger_detector_update (&detector, 10));
+  g_assert_true (fpi_finger_detector_update (&detector, 75));
+  g_assert_true (fpi_finger_detector_update (&detector, 10));
+  g_assert_false (fpi_finger_detector_update (&detector, 10));
+  g_assert_false (fpi_finger_detector_update (&detector, 75));
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/image/resize", test_image_resize);
+  g_test_add_func ("/image/normalize", test_image_normalize);
+  g_test_add_func ("/image/frame_stats", test_frame_stats);
+  g_test_add_func ("/image/finger_detector", test_finger_detector);
+
+  return g_test_run ();
+}
@@ -1311,6 +1311,134 @@ test_ssm_cleanup_fail (void)
   g_assert_true (data->ssm_destroyed);
 }
 
+static void
+test_ssm_loop_handler (FpiSsm   *ssm,
+                       FpDevice *dev)
+{
+  FpiSsmTestData *data = fpi_ssm_get_data (ssm);
+
+  test_ssm_handler (ssm, dev);
+
+  if (g_slist_length (data->handlers_chain) < 200)
+    fpi_ssm_jump_to_state (ssm, FPI_TEST_SSM_STATE_0);
+  else
+    fpi_ssm_mark_completed (ssm);
+}
+
+static void
+test_ssm_inline_depth (void)
+{
+  g_autoptr(FpiSsmTestData) data = NULL;
+  FpiSsm *ssm;
+
+  ssm = fpi_ssm_new_full (fake_device, test_ssm_loop_handler, 1, 1, "FPI_TEST_SSM_LOOP");
+  data = fpi_ssm_test_data_new ();
+  fpi_ssm_set_data (ssm, fpi_ssm_test_data_ref (data),
+                    (GDestroyNotify) fpi_ssm_test_data_unref_by_ssm);
+  data->expected_last_state = FPI_TEST_SSM_STATE_0;
+
+  /* The nested handlers are run synchronously up to the maximum depth */
+  fpi_ssm_start (ssm, test_ssm_completed_callback);
+  g_assert_cmpuint (g_slist_length (data->handlers_chain), ==, FPI_SSM_MAX_INLINE_DEPTH);
+  g_assert_cmpuint (fpi_ssm_get_state_stats (ssm, FPI_TEST_SSM_STATE_0)->entries, ==,
+                    FPI_SSM_MAX_INLINE_DEPTH);
+  g_assert_false (data->completed);
+
+  while (!data->completed)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* 200 handler calls plus the completion callback */
+  g_assert_cmpuint (g_slist_length (data->handlers_chain), ==, 201);
+  g_assert_no_error (data->error);
+  g_assert_true (data->ssm_destroyed);
+}
+
+static void
+test_ssm_recurse_handler (FpiSsm   *ssm,
+                          FpDevice *dev)
+{
+  test_ssm_handler (ssm, dev);
+
+  fpi_ssm_jump_to_state (ssm, fpi_ssm_get_cur_state (ssm));
+}
+
+static void
+test_ssm_inline_depth_mark_failed (void)
+{
+  g_autoptr(FpiSsmTestData) data = NULL;
+  FpiSsm *ssm;
+
+  ssm = fpi_ssm_new_full (fake_device, test_ssm_recurse_handler, 1, 1, "FPI_TEST_SSM_RECURSE");
+  data = fpi_ssm_test_data_new ();
+  fpi_ssm_set_data (ssm, fpi_ssm_test_data_ref (data),
+                    (GDestroyNotify) fpi_ssm_test_data_unref_by_ssm);
+  data->expected_last_state = FPI_TEST_SSM_STATE_0;
+
+  fpi_ssm_start (ssm, test_ssm_completed_callback);
+  g_assert_cmpuint (g_slist_length (data->handlers_chain), ==, FPI_SSM_MAX_INLINE_DEPTH);
+
+  /* The deferred handler does not prevent completing the machine */
+  fpi_ssm_mark_failed (ssm, g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED, "failed"));
+  g_assert_true (data->completed);
+  g_assert_error (data->error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert_true (data->ssm_destroyed);
+
+  /* And it is not called anymore */
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+  g_assert_cmpuint (g_slist_length (data->handlers_chain), ==, FPI_SSM_MAX_INLINE_DEPTH + 1);
+}
+
+static void
+test_ssm_noop_handler (FpiSsm   *ssm,
+                       FpDevice *dev)
+{
+}
+
+static void
+test_ssm_free_after_device (void)
+{
+  FpDevice *device = g_object_new (FPI_TYPE_DEVICE_FAKE, NULL);
+  FpiSsm *ssm;
+
+  ssm = fpi_ssm_new (device, test_ssm_noop_handler, FPI_TEST_SSM_STATE_NUM);
+  fpi_ssm_start (ssm, NULL);
+  fpi_ssm_next_state_delayed (ssm, 1000);
+  fpi_ssm_cancel_delayed_state_change (ssm);
+
+  /* The timer of the machine is not destroyed with the device */
+  g_object_unref (device);
+  fpi_ssm_free (ssm);
+}
+
+static void
+test_ssm_state_stats (void)
+{
+  g_autoptr(FpiSsm) ssm = ssm_test_new ();
+  const FpiSsmStateStats *stats;
+
+  g_assert_cmpuint (fpi_ssm_get_state_stats (ssm, FPI_TEST_SSM_STATE_0)->entries, ==, 0);
+
+  fpi_ssm_start (ssm, test_ssm_completed_callback);
+  g_usleep (1000);
+  fpi_ssm_next_state (ssm);
+  fpi_ssm_jump_to_state (ssm, FPI_TEST_SSM_STATE_0);
+  fpi_ssm_next_state (ssm);
+
+  stats = fpi_ssm_get_state_stats (ssm, FPI_TEST_SSM_STATE_0);
+  g_assert_cmpuint (stats->entries, ==, 2);
+  g_assert_cmpint (stats->total_time, >=, 1000);
+  g_assert_cmpint (stats->max_time, >=, 1000);
+  g_assert_cmpint (stats->max_time, <=, stats->total_time);
+
+  stats = fpi_ssm_get_state_stats (ssm, FPI_TEST_SSM_STATE_1);
+  g_assert_cmpuint (stats->entries, ==, 2);
+
+  stats = fpi_ssm_get_state_stats (ssm, FPI_TEST_SSM_STATE_2);
+  g_assert_cmpuint (stats->entries, ==, 0);
+  g_assert_cmpint (stats->total_time, ==, 0);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -1364,6 +1492,10 @@ main (int argc, char *argv[])
   g_test_add_func ("/ssm/subssm/mark_failed", test_ssm_subssm_mark_failed);
   g_test_add_func ("/ssm/cleanup/complete", test_ssm_cleanup_complete);
   g_test_add_func ("/ssm/cleanup/fail", test_ssm_cleanup_fail);
+  g_test_add_func ("/ssm/inline_depth", test_ssm_inline_depth);
+  g_test_add_func ("/ssm/inline_depth/mark_failed", test_ssm_inline_depth_mark_failed);
+  g_test_add_func ("/ssm/free_after_device", test_ssm_free_after_device);
+  g_test_add_func ("/ssm/state_stats", test_ssm_state_stats);
 
   return g_test_run ();
 }
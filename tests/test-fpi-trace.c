@@ -0,0 +1,214 @@
+/*
+ * Unit tests for the performance tracing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include "fpi-trace.h"
+
+#define N_THREADS 4
+#define N_EVENTS 1000
+
+static gchar *trace_dir = NULL;
+static gchar *trace_file = NULL;
+
+typedef struct
+{
+  guint n_concurrent;
+  guint n_sequential;
+  guint n_main;
+  guint n_other;
+  /* Bitmask of the thread ids of the recorded events */
+  guint tids;
+} TraceContents;
+
+static gpointer
+record_concurrent (gpointer data)
+{
+  gint i;
+
+  for (i = 0; i < N_EVENTS; i++)
+    {
+      gint64 start = fpi_trace_begin ();
+
+      fpi_trace_counter ("test", "concurrent-counter", i);
+      fpi_trace_end ("test", "concurrent-span", start);
+    }
+
+  return NULL;
+}
+
+static gpointer
+record_sequential (gpointer data)
+{
+  fpi_trace_async_begin ("test", "sequential", data);
+  fpi_trace_async_end ("test", "sequential", data);
+
+  return NULL;
+}
+
+static void
+parse_trace (TraceContents *contents)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GRegex) regex = NULL;
+  g_autofree gchar *data = NULL;
+  g_auto(GStrv) lines = NULL;
+  gsize len;
+  guint i;
+
+  g_assert_true (g_file_get_contents (trace_file, &data, &len, &error));
+  g_assert_no_error (error);
+
+  g_assert_true (g_str_has_prefix (data, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+  g_assert_true (g_str_has_suffix (data, "\n]}\n"));
+
+  regex = g_regex_new ("^,{\"name\":\"((?:[^\"\\\\]|\\\\.)*)\",\"cat\":\"test\","
+                       "\"ph\":\"(.)\",\"ts\":[0-9]+,\"pid\":[0-9]+,\"tid\":([0-9]+)",
+                       0, 0, &error);
+  g_assert_no_error (error);
+
+  memset (contents, 0, sizeof (*contents));
+
+  lines = g_strsplit (data, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      g_autoptr(GMatchInfo) match = NULL;
+      g_autofree gchar *name = NULL;
+      g_autofree gchar *phase = NULL;
+      g_autofree gchar *tid = NULL;
+
+      /* Framing and the process name */
+      if (!g_str_has_prefix (lines[i], ",{"))
+        continue;
+
+      g_assert_true (g_str_has_suffix (lines[i], "}"));
+      if (!g_regex_match (regex, lines[i], 0, &match))
+        g_error ("Unexpected trace event: %s", lines[i]);
+
+      name = g_match_info_fetch (match, 1);
+      phase = g_match_info_fetch (match, 2);
+      tid = g_match_info_fetch (match, 3);
+
+      g_assert_cmpuint (atoi (tid), >, 0);
+      g_assert_cmpuint (atoi (tid), <, 32);
+      contents->tids |= 1 << atoi (tid);
+
+      if (g_str_equal (name, "concurrent-counter"))
+        {
+          g_assert_cmpstr (phase, ==, "C");
+          g_assert_nonnull (strstr (lines[i], ",\"args\":{\"value\":"));
+          contents->n_concurrent++;
+        }
+      else if (g_str_equal (name, "concurrent-span"))
+        {
+          g_assert_cmpstr (phase, ==, "X");
+          g_assert_nonnull (strstr (lines[i], ",\"dur\":"));
+          contents->n_concurrent++;
+        }
+      else if (g_str_equal (name, "sequential"))
+        {
+          g_assert_true (g_str_equal (phase, "b") || g_str_equal (phase, "e"));
+          g_assert_nonnull (strstr (lines[i], ",\"id\":\"0x"));
+          contents->n_sequential++;
+        }
+      else if (g_str_equal (name, "main \\\"quoted\\\""))
+        {
+          contents->n_main++;
+        }
+      else
+        {
+          contents->n_other++;
+        }
+    }
+}
+
+static void
+test_trace_threads (void)
+{
+  GThread *threads[N_THREADS];
+  TraceContents contents;
+  guint concurrent_tids;
+  guint i;
+
+  g_assert_true (fpi_trace_enabled ());
+
+  fpi_trace_counter ("test", "main \"quoted\"", 1);
+
+  for (i = 0; i < N_THREADS; i++)
+    threads[i] = g_thread_new ("trace-test", record_concurrent, NULL);
+
+  /* Flushing must not see partially written events */
+  for (i = 0; i < 20; i++)
+    {
+      fpi_trace_flush ();
+      parse_trace (&contents);
+      g_assert_cmpuint (contents.n_other, ==, 0);
+    }
+
+  for (i = 0; i < N_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  fpi_trace_flush ();
+  parse_trace (&contents);
+
+  g_assert_cmpuint (contents.n_concurrent, ==, N_THREADS * N_EVENTS * 2);
+  g_assert_cmpuint (contents.n_main, ==, 1);
+  g_assert_cmpuint (contents.n_sequential, ==, 0);
+  g_assert_cmpuint (contents.n_other, ==, 0);
+  g_assert_cmpuint (g_bit_nth_msf (contents.tids, -1) + 1, <=, N_THREADS + 2);
+  concurrent_tids = contents.tids;
+
+  /* Threads that ran after the others exited reuse their rings */
+  for (i = 0; i < N_THREADS * 4; i++)
+    g_thread_join (g_thread_new ("trace-test", record_sequential, GUINT_TO_POINTER (i + 1)));
+
+  fpi_trace_flush ();
+  parse_trace (&contents);
+
+  g_assert_cmpuint (contents.n_concurrent, ==, N_THREADS * N_EVENTS * 2);
+  g_assert_cmpuint (contents.n_sequential, ==, N_THREADS * 4 * 2);
+  g_assert_cmpuint (contents.n_main, ==, 1);
+  g_assert_cmpuint (contents.tids, ==, concurrent_tids);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  /* Must be set before anything is traced */
+  trace_dir = g_dir_make_tmp ("libfprint-trace-XXXXXX", &error);
+  g_assert_no_error (error);
+  trace_file = g_build_filename (trace_dir, "trace.json", NULL);
+  g_setenv ("FP_TRACE", trace_file, TRUE);
+
+  g_test_add_func ("/trace/threads", test_trace_threads);
+
+  ret = g_test_run ();
+
+  g_unlink (trace_file);
+  g_rmdir (trace_dir);
+  g_free (trace_file);
+  g_free (trace_dir);
+
+  return ret;
+}
@@ -0,0 +1,206 @@
+/*
+ * Unit tests for the image processing worker
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gio/gio.h>
+#include "fpi-worker.h"
+
+typedef struct
+{
+  GMutex   mutex;
+  GCond    cond;
+  gboolean released;
+} Blocker;
+
+typedef struct
+{
+  gint     func_calls;
+  gint     finished;
+  gint     freed;
+  gint     cancelled;
+  gint     busy;
+  Blocker *blocker;
+} TestData;
+
+static void
+blocker_release (Blocker *blocker)
+{
+  g_mutex_lock (&blocker->mutex);
+  blocker->released = TRUE;
+  g_cond_broadcast (&blocker->cond);
+  g_mutex_unlock (&blocker->mutex);
+}
+
+static void
+test_job_func (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  TestData *data = task_data;
+
+  g_atomic_int_inc (&data->func_calls);
+
+  if (data->blocker)
+    {
+      g_mutex_lock (&data->blocker->mutex);
+      while (!data->blocker->released)
+        g_cond_wait (&data->blocker->cond, &data->blocker->mutex);
+      g_mutex_unlock (&data->blocker->mutex);
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+test_job_done (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr(GError) error = NULL;
+  TestData *data = user_data;
+
+  if (!g_task_propagate_boolean (G_TASK (res), &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        data->cancelled++;
+      else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_BUSY))
+        data->busy++;
+      else
+        g_assert_no_error (error);
+    }
+
+  data->finished++;
+}
+
+static void
+test_data_freed (gpointer user_data)
+{
+  TestData *data = user_data;
+
+  g_atomic_int_inc (&data->freed);
+}
+
+static void
+run_job (FpiWorker    *worker,
+         TestData     *data,
+         GCancellable *cancellable,
+         gconstpointer owner)
+{
+  g_autoptr(GObject) source = g_object_new (G_TYPE_OBJECT, NULL);
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (source, cancellable, test_job_done, data);
+  g_task_set_task_data (task, data, test_data_freed);
+  fpi_worker_run_task (worker, task, test_job_func,
+                       FPI_WORKER_PRIORITY_DEFAULT, owner);
+}
+
+static void
+wait_for_freed (TestData *data, gint count)
+{
+  while (g_atomic_int_get (&data->freed) < count)
+    g_main_context_iteration (NULL, FALSE);
+}
+
+static void
+test_worker_cancelled_before_start (void)
+{
+  g_autoptr(FpiWorker) worker = fpi_worker_new (1, 0);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  Blocker blocker = { 0 };
+  TestData blocking = { .blocker = &blocker };
+  TestData cancelled = { 0 };
+
+  g_mutex_init (&blocker.mutex);
+  g_cond_init (&blocker.cond);
+
+  /* The only thread is busy, so the second job is not started */
+  run_job (worker, &blocking, NULL, NULL);
+  run_job (worker, &cancelled, cancellable, NULL);
+
+  g_cancellable_cancel (cancellable);
+  blocker_release (&blocker);
+
+  /* The task (and its source object) must be freed without running it */
+  wait_for_freed (&blocking, 1);
+  wait_for_freed (&cancelled, 1);
+  while (cancelled.finished == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (blocking.func_calls, ==, 1);
+  g_assert_cmpint (blocking.finished, ==, 1);
+  g_assert_cmpint (cancelled.func_calls, ==, 0);
+  g_assert_cmpint (cancelled.cancelled, ==, 1);
+
+  g_mutex_clear (&blocker.mutex);
+  g_cond_clear (&blocker.cond);
+}
+
+static void
+test_worker_held_back_limit (void)
+{
+  g_autoptr(FpiWorker) worker = fpi_worker_new (2, 1);
+  Blocker blocker = { 0 };
+  TestData blocking = { .blocker = &blocker };
+  TestData held_back = { 0 };
+  TestData other = { 0 };
+  gint owner;
+  gint i;
+
+  g_mutex_init (&blocker.mutex);
+  g_cond_init (&blocker.cond);
+
+  run_job (worker, &blocking, NULL, &owner);
+  for (i = 0; i < FPI_WORKER_MAX_HELD_BACK + 1; i++)
+    run_job (worker, &held_back, NULL, &owner);
+
+  /* The last job exceeded the limit and was dropped right away */
+  wait_for_freed (&held_back, 1);
+  while (held_back.finished == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (held_back.busy, ==, 1);
+
+  /* Jobs of other owners are not affected */
+  run_job (worker, &other, NULL, NULL);
+  while (other.finished == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (other.func_calls, ==, 1);
+  g_assert_cmpint (held_back.func_calls, ==, 0);
+
+  blocker_release (&blocker);
+
+  while (held_back.finished < FPI_WORKER_MAX_HELD_BACK + 1)
+    g_main_context_iteration (NULL, TRUE);
+  wait_for_freed (&held_back, FPI_WORKER_MAX_HELD_BACK + 1);
+  wait_for_freed (&blocking, 1);
+
+  g_assert_cmpint (held_back.func_calls, ==, FPI_WORKER_MAX_HELD_BACK);
+  g_assert_cmpint (held_back.busy, ==, 1);
+
+  g_mutex_clear (&blocker.mutex);
+  g_cond_clear (&blocker.cond);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/worker/cancelled-before-start", test_worker_cancelled_before_start);
+  g_test_add_func ("/worker/held-back-limit", test_worker_held_back_limit);
+
+  return g_test_run ();
+}
@@ -0,0 +1,204 @@
+/*
+ * URU4000 image decryption unit tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include "fpi-byte-utils.h"
+#include "drivers/uru4000_decode.h"
+
+#define IMAGE_WIDTH 384
+#define IMAGE_HEADER_SIZE 64
+
+#define PCAPNG_ENHANCED_PACKET_BLOCK 6
+#define USBMON_HEADER_SIZE 64
+
+/* Original byte-by-byte implementation, used as the reference */
+static uint32_t
+reference_decode (uint8_t *data, int num_bytes, uint32_t key)
+{
+  uint8_t xorbyte;
+  int i;
+
+  for (i = 0; i < num_bytes - 1; i++)
+    {
+      xorbyte  = ((key >>  4) & 1) << 0;
+      xorbyte |= ((key >>  8) & 1) << 1;
+      xorbyte |= ((key >> 11) & 1) << 2;
+      xorbyte |= ((key >> 14) & 1) << 3;
+      xorbyte |= ((key >> 18) & 1) << 4;
+      xorbyte |= ((key >> 21) & 1) << 5;
+      xorbyte |= ((key >> 24) & 1) << 6;
+      xorbyte |= ((key >> 29) & 1) << 7;
+      key = uru4000_update_key (key);
+
+      data[i] = data[i + 1] ^ xorbyte;
+    }
+
+  data[i] = 0;
+  return uru4000_update_key (key);
+}
+
+typedef struct
+{
+  GBytes  *image;
+  guint32  key;
+} CaptureData;
+
+/* Finds the image transfer and the scramble key register read in a usbmon
+ * capture (LINKTYPE_USB_LINUX_MMAPPED). */
+static void
+load_capture (const char *name, CaptureData *capture)
+{
+  g_autofree char *path = NULL;
+  g_autofree guint8 *contents = NULL;
+  g_autoptr(GError) error = NULL;
+  guint64 key_urb_id = 0;
+  gsize len, pos;
+
+  path = g_test_build_filename (G_TEST_DIST, name, "capture.pcapng", NULL);
+  g_file_get_contents (path, (char **) &contents, &len, &error);
+  g_assert_no_error (error);
+
+  capture->image = NULL;
+  capture->key = 0;
+
+  for (pos = 0; pos + 12 <= len;)
+    {
+      guint32 block_type = FP_READ_UINT32_LE (contents + pos);
+      guint32 block_len = FP_READ_UINT32_LE (contents + pos + 4);
+      const guint8 *pkt, *pkt_data;
+      guint32 cap_len;
+      guint64 urb_id;
+
+      g_assert_cmpuint (block_len, >=, 12);
+      g_assert_cmpuint (pos + block_len, <=, len);
+
+      if (block_type != PCAPNG_ENHANCED_PACKET_BLOCK)
+        {
+          pos += block_len;
+          continue;
+        }
+
+      /* The block header, packet header and trailing length */
+      g_assert_cmpuint (block_len, >=, 32);
+      cap_len = FP_READ_UINT32_LE (contents + pos + 20);
+      g_assert_cmpuint (cap_len, <=, block_len - 32);
+      pkt = contents + pos + 28;
+      pkt_data = pkt + USBMON_HEADER_SIZE;
+      pos += block_len;
+
+      if (cap_len < USBMON_HEADER_SIZE)
+        continue;
+
+      urb_id = FP_READ_UINT64_LE (pkt);
+
+      /* Submission of a vendor control read of REG_SCRAMBLE_DATA_KEY */
+      if (pkt[8] == 'S' && pkt[9] == 2 && pkt[14] == 0 &&
+          pkt[40] == 0xc0 && pkt[41] == 0x04 && pkt[42] == 0x34)
+        key_urb_id = urb_id;
+
+      if (pkt[8] == 'C' && pkt[9] == 2 && urb_id == key_urb_id &&
+          cap_len >= USBMON_HEADER_SIZE + 4)
+        capture->key = FP_READ_UINT32_LE (pkt_data);
+
+      /* The image is by far the largest bulk transfer */
+      if (pkt[8] == 'C' && pkt[9] == 3 &&
+          cap_len - USBMON_HEADER_SIZE > IMAGE_HEADER_SIZE + IMAGE_WIDTH &&
+          (!capture->image ||
+           cap_len - USBMON_HEADER_SIZE > g_bytes_get_size (capture->image)))
+        {
+          g_clear_pointer (&capture->image, g_bytes_unref);
+          capture->image = g_bytes_new (pkt_data, cap_len - USBMON_HEADER_SIZE);
+        }
+    }
+
+  g_assert_nonnull (capture->image);
+  g_assert_cmpuint (key_urb_id, !=, 0);
+}
+
+static void
+test_decode_capture (gconstpointer user_data)
+{
+  const char *name = user_data;
+  const guint32 extra_keys[] = { 0x00000001, 0x80000000, 0xdeadbeef, 0xffffffff };
+  CaptureData capture;
+  const guint8 *image;
+  gsize image_len;
+  guint k;
+
+  load_capture (name, &capture);
+  image = g_bytes_get_data (capture.image, &image_len);
+
+  for (k = 0; k <= G_N_ELEMENTS (extra_keys); k++)
+    {
+      g_autofree guint8 *fast = g_memdup2 (image, image_len);
+      g_autofree guint8 *reference = g_memdup2 (image, image_len);
+      guint32 start_key = k == 0 ? capture.key : extra_keys[k - 1];
+      guint32 fast_key = start_key;
+      guint32 reference_key = start_key;
+      gsize offset = IMAGE_HEADER_SIZE;
+      gint block;
+
+      /* Walk the blocks like the driver does, alternating between
+       * decoding and skipping to also cover the key chaining. */
+      for (block = 0; offset + IMAGE_WIDTH <= image_len; block++)
+        {
+          gint lines = MIN (block % 5 + 1, (image_len - offset) / IMAGE_WIDTH);
+          gint num_bytes = lines * IMAGE_WIDTH;
+          gint r;
+
+          if (block % 3 == 2)
+            {
+              fast_key = uru4000_skip_key (fast_key, num_bytes);
+              for (r = 0; r < num_bytes; r++)
+                reference_key = uru4000_update_key (reference_key);
+            }
+          else
+            {
+              fast_key = uru4000_decode (fast + offset, num_bytes, fast_key);
+              reference_key = reference_decode (reference + offset, num_bytes, reference_key);
+            }
+
+          g_assert_cmpuint (fast_key, ==, reference_key);
+          g_assert_cmpmem (fast, image_len, reference, image_len);
+          offset += num_bytes;
+        }
+
+      /* Block sizes that are not a multiple of the chunk size */
+      for (offset = 1; offset < 100; offset += 7)
+        {
+          fast_key = uru4000_decode (fast + IMAGE_HEADER_SIZE, offset, start_key);
+          reference_key = reference_decode (reference + IMAGE_HEADER_SIZE, offset, start_key);
+
+          g_assert_cmpuint (fast_key, ==, reference_key);
+          g_assert_cmpmem (fast, image_len, reference, image_len);
+        }
+    }
+
+  g_bytes_unref (capture.image);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_data_func ("/uru4000/decode/msv2", "uru4000-msv2", test_decode_capture);
+  g_test_add_data_func ("/uru4000/decode/4500", "uru4000-4500", test_decode_capture);
+
+  return g_test_run ();
+}
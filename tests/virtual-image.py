@@ -248,6 +248,64 @@ class VirtualImage(unittest.TestCase):
 
         return self._enrolled
 
+    def test_enroll_pipelined(self):
+        self._step = 0
+        self._enrolled = None
+        self._sent = 0
+        self._captured = 0
+        self._present = False
+        self._pipelined = False
+
+        def progress_cb(dev, step, fp, user_data):
+            self._step = step
+
+        def done_cb(dev, res):
+            self._enrolled = dev.enroll_finish(res)
+
+        def finger_status_cb(dev, pspec):
+            status = dev.get_finger_status()
+            present = bool(status & FPrint.FingerStatusFlags.PRESENT)
+            if present and not self._present:
+                self._captured += 1
+            self._present = present
+
+            # A finger is requested before the last image was processed
+            if status & FPrint.FingerStatusFlags.NEEDED and self._step < self._captured:
+                self._pipelined = True
+
+        handler = self.dev.connect('notify::finger-status', finger_status_cb)
+
+        template = FPrint.Print.new(self.dev)
+        self.dev.enroll(template, None, progress_cb, tuple(), done_cb)
+
+        # Note: Assumes 5 enroll steps for this device!
+        for i in range(5):
+            while (self._captured < self._sent or
+                   not self.dev.get_finger_status() & FPrint.FingerStatusFlags.NEEDED):
+                ctx.iteration(True)
+            self._sent += 1
+            self.send_image('whorl')
+
+        while self._enrolled is None:
+            ctx.iteration(True)
+
+        self.dev.disconnect(handler)
+
+        self.assertTrue(self._pipelined)
+        self.assertEqual(self._step, 5)
+        self.assertEqual(self.dev.get_finger_status(), FPrint.FingerStatusFlags.NONE)
+
+        # The pipelined print verifies like any other
+        self._verify_match = None
+        def verify_cb(dev, res):
+            self._verify_match, self._verify_fp = dev.verify_finish(res)
+
+        self.dev.verify(self._enrolled, callback=verify_cb)
+        self.send_image('whorl')
+        while self._verify_match is None:
+            ctx.iteration(True)
+        assert(self._verify_match)
+
     def test_enroll_verify(self):
         done = False
 
@@ -365,6 +423,70 @@ class VirtualImage(unittest.TestCase):
         assert(self._identify_error is not None)
         assert(self._identify_error.matches(FPrint.device_error_quark(), FPrint.DeviceError.GENERAL))
 
+    def check_match_info(self, fp, matched):
+        info = fp.get_match_info()
+        self.assertIsNotNone(info)
+        self.assertGreater(info.score_threshold, 0)
+        if matched:
+            self.assertGreaterEqual(info.score, info.score_threshold)
+        else:
+            self.assertLess(info.score, info.score_threshold)
+        self.assertGreaterEqual(info.sub_print, 0)
+        self.assertLess(info.sub_print, self.dev.get_nr_enroll_stages())
+        self.assertGreaterEqual(info.capture_time, 0)
+        self.assertGreater(info.extraction_time, 0)
+        self.assertGreater(info.match_time, 0)
+        return info
+
+    def test_match_info(self):
+        fp_whorl = self.enroll_print('whorl')
+        fp_tented_arch = self.enroll_print('tented_arch')
+        fp_arch = self.enroll_print('arch')
+
+        def verify_cb(dev, res):
+            self._verify_match, self._verify_fp = dev.verify_finish(res)
+
+        def identify_cb(dev, res):
+            self._identify_match, self._identify_fp = dev.identify_finish(res)
+
+        def verify(template, image):
+            self._verify_match = None
+            self.dev.verify(template, callback=verify_cb)
+            self.send_image(image)
+            while self._verify_match is None:
+                ctx.iteration(True)
+            return self.check_match_info(self._verify_fp, self._verify_match)
+
+        def identify(templates, image):
+            self._identify_fp = None
+            self.dev.identify(templates, callback=identify_cb)
+            self.send_image(image)
+            while self._identify_fp is None:
+                ctx.iteration(True)
+            return self.check_match_info(self._identify_fp,
+                                         self._identify_match is not None)
+
+        match = verify(fp_whorl, 'whorl')
+        self.assertTrue(self._verify_match)
+        no_match_tented_arch = verify(fp_tented_arch, 'whorl')
+        self.assertFalse(self._verify_match)
+        no_match_arch = verify(fp_arch, 'whorl')
+        self.assertFalse(self._verify_match)
+
+        # The same images give the same scores
+        info = identify([fp_tented_arch, fp_whorl], 'whorl')
+        self.assertIs(self._identify_match, fp_whorl)
+        self.assertEqual(info.score, match.score)
+
+        # Without a match, the closest template is reported
+        info = identify([fp_tented_arch, fp_arch], 'whorl')
+        self.assertIsNone(self._identify_match)
+        self.assertEqual(info.score, max(no_match_tented_arch.score, no_match_arch.score))
+
+        info = identify([fp_arch, fp_tented_arch], 'whorl')
+        self.assertIsNone(self._identify_match)
+        self.assertEqual(info.score, max(no_match_tented_arch.score, no_match_arch.score))
+
     def test_verify_serialized(self):
         done = False
 